@@ -164,6 +164,49 @@ int readloop(int filedes, void *buffer, size_t size)
     return 0;
 }
 
+int preadloop(int filedes, void *buffer, size_t size, off64_t offset)
+{
+    size_t readden = 0;
+    while (readden < size) {
+	ssize_t result = pread(filedes, buffer + readden, size - readden,
+			       offset + readden);
+
+	if (result == 0 /* EOF */ ) {
+	    warn("end-of-file detected while reading after %i bytes",
+		 readden);
+	    errno = EIO;
+	    return -1;
+	}
+
+	if (result == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;		// failure
+	}
+	readden += result;
+    }
+    return 0;
+}
+
+int pwriteloop(int filedes, const void *buffer, size_t size,
+	       off64_t offset)
+{
+    size_t written = 0;
+    while (written < size) {
+	ssize_t result = pwrite(filedes, buffer + written, size - written,
+				offset + written);
+	if (result == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return -1;		// failure
+	}
+	written += result;
+    }
+    return 0;
+}
+
 int sendfileloop(int out_fd, int in_fd, off64_t * offset, size_t count)
 {
     size_t sent = 0;
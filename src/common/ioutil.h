@@ -32,6 +32,19 @@ int writeloop(int filedes, const void *buffer, size_t size);
   */
 int readloop(int filedes, void *buffer, size_t size);
 
+/** Repeat a pread() operation that succeeds partially until ''size'' bytes
+  * are read from ''offset'' onwards, or an error is returned, when it returns
+  * -1 as usual.  Reading past the end of the file is an error.
+  */
+int preadloop(int filedes, void *buffer, size_t size, off64_t offset);
+
+/** Repeat a pwrite() operation that succeeds partially until ''size'' bytes
+  * are written at ''offset'' onwards, or an error is returned, when it
+  * returns -1 as usual.
+  */
+int pwriteloop(int filedes, const void *buffer, size_t size,
+	       off64_t offset);
+
 /** Repeat a sendfile() operation that succeeds partially until ''size'' bytes
   * are written, or an error is returned, when it returns -1 as usual.
   */
@@ -26,6 +26,13 @@ void mode(char *mode, int argc, char **argv);
 #define OPT_CONNECT_PORT "conn-port"
 #define OPT_KILLSWITCH "killswitch"
 #define OPT_MAX_SPEED "max-speed"
+#define OPT_QUEUE_DEPTH "queue-depth"
+#define OPT_MAX_CLIENTS "max-clients"
+#define OPT_STREAM_SIZE "stream-size"
+#define OPT_ALWAYS_SYNC "always-sync"
+#define OPT_BACKEND "backend"
+#define OPT_NEWSTYLE "newstyle"
+#define OPT_EXPORT "export"
 
 #define CMD_SERVE  "serve"
 #define CMD_LISTEN "listen"
@@ -60,6 +67,13 @@ void mode(char *mode, int argc, char **argv);
 #define GETOPT_CONNECT_PORT GETOPT_ARG( OPT_CONNECT_PORT, 'P' )
 #define GETOPT_KILLSWITCH   GETOPT_ARG( OPT_KILLSWITCH,   'k' )
 #define GETOPT_MAX_SPEED    GETOPT_ARG( OPT_MAX_SPEED, 'm' )
+#define GETOPT_QUEUE_DEPTH  GETOPT_ARG( OPT_QUEUE_DEPTH, 'Q' )
+#define GETOPT_MAX_CLIENTS  GETOPT_ARG( OPT_MAX_CLIENTS, 'M' )
+#define GETOPT_STREAM_SIZE  GETOPT_ARG( OPT_STREAM_SIZE, 'z' )
+#define GETOPT_ALWAYS_SYNC  GETOPT_FLAG( OPT_ALWAYS_SYNC, 'y' )
+#define GETOPT_BACKEND      GETOPT_ARG( OPT_BACKEND, 'B' )
+#define GETOPT_NEWSTYLE     GETOPT_FLAG( OPT_NEWSTYLE, 'n' )
+#define GETOPT_EXPORT       GETOPT_ARG( OPT_EXPORT, 'e' )
 
 #define OPT_VERBOSE "verbose"
 #define SOPT_VERBOSE "v"
@@ -90,6 +104,8 @@ void mode(char *mode, int argc, char **argv);
 	 "\t--" OPT_BIND ",-b <BIND-ADDR>\tBind the local socket to a particular IP address.\n"
 #define MAX_SPEED_LINE \
 	 "\t--" OPT_MAX_SPEED ",-m <bps>\tMaximum speed of the migration, in bytes/sec.\n"
+#define EXPORT_LINE \
+	 "\t--" OPT_EXPORT ",-e <NAME>\tAct on the export NAME, not the --file one.\n"
 
 char *help_help_text;
 
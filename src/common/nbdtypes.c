@@ -59,3 +59,121 @@ void nbd_h2r_reply(struct nbd_reply *from, struct nbd_reply_raw *to)
     to->error = htobe32(from->error);
     to->handle.w = from->handle.w;
 }
+
+
+void nbd_r2h_handshake(struct nbd_handshake_raw *from,
+		       struct nbd_handshake *to)
+{
+    memcpy(to->passwd, from->passwd, 8);
+    to->magic = be64toh(from->magic);
+    to->flags = be16toh(from->flags);
+}
+
+void nbd_h2r_handshake(struct nbd_handshake *from,
+		       struct nbd_handshake_raw *to)
+{
+    memcpy(to->passwd, from->passwd, 8);
+    to->magic = htobe64(from->magic);
+    to->flags = htobe16(from->flags);
+}
+
+
+void nbd_r2h_option(struct nbd_option_raw *from, struct nbd_option *to)
+{
+    to->magic = be64toh(from->magic);
+    to->option = be32toh(from->option);
+    to->length = be32toh(from->length);
+}
+
+void nbd_h2r_option(struct nbd_option *from, struct nbd_option_raw *to)
+{
+    to->magic = htobe64(from->magic);
+    to->option = htobe32(from->option);
+    to->length = htobe32(from->length);
+}
+
+
+void nbd_r2h_option_reply(struct nbd_option_reply_raw *from,
+			  struct nbd_option_reply *to)
+{
+    to->magic = be64toh(from->magic);
+    to->option = be32toh(from->option);
+    to->type = be32toh(from->type);
+    to->length = be32toh(from->length);
+}
+
+void nbd_h2r_option_reply(struct nbd_option_reply *from,
+			  struct nbd_option_reply_raw *to)
+{
+    to->magic = htobe64(from->magic);
+    to->option = htobe32(from->option);
+    to->type = htobe32(from->type);
+    to->length = htobe32(from->length);
+}
+
+
+void nbd_r2h_structured_reply(struct nbd_structured_reply_raw *from,
+			      struct nbd_structured_reply *to)
+{
+    to->magic = be32toh(from->magic);
+    to->flags = be16toh(from->flags);
+    to->type = be16toh(from->type);
+    to->handle.w = from->handle.w;
+    to->length = be32toh(from->length);
+}
+
+void nbd_h2r_structured_reply(struct nbd_structured_reply *from,
+			      struct nbd_structured_reply_raw *to)
+{
+    to->magic = htobe32(from->magic);
+    to->flags = htobe16(from->flags);
+    to->type = htobe16(from->type);
+    to->handle.w = from->handle.w;
+    to->length = htobe32(from->length);
+}
+
+
+void nbd_r2h_extended_request(struct nbd_extended_request_raw *from,
+			      struct nbd_request *to)
+{
+    to->magic = be32toh(from->magic);
+    to->flags = be16toh(from->flags);
+    to->type = be16toh(from->type);
+    to->handle.w = from->handle.w;
+    to->from = be64toh(from->from);
+    to->len = be64toh(from->len);
+}
+
+void nbd_h2r_extended_request(struct nbd_request *from,
+			      struct nbd_extended_request_raw *to)
+{
+    to->magic = htobe32(from->magic);
+    to->flags = htobe16(from->flags);
+    to->type = htobe16(from->type);
+    to->handle.w = from->handle.w;
+    to->from = htobe64(from->from);
+    to->len = htobe64(from->len);
+}
+
+
+void nbd_r2h_extended_reply(struct nbd_extended_reply_raw *from,
+			    struct nbd_extended_reply *to)
+{
+    to->magic = be32toh(from->magic);
+    to->flags = be16toh(from->flags);
+    to->type = be16toh(from->type);
+    to->handle.w = from->handle.w;
+    to->offset = be64toh(from->offset);
+    to->length = be64toh(from->length);
+}
+
+void nbd_h2r_extended_reply(struct nbd_extended_reply *from,
+			    struct nbd_extended_reply_raw *to)
+{
+    to->magic = htobe32(from->magic);
+    to->flags = htobe16(from->flags);
+    to->type = htobe16(from->type);
+    to->handle.w = from->handle.w;
+    to->offset = htobe64(from->offset);
+    to->length = htobe64(from->length);
+}
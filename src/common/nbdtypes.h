@@ -8,31 +8,94 @@
 #define REQUEST_MAGIC 0x25609513
 #define REPLY_MAGIC 0x67446698
 
+/* Once extended headers are negotiated, requests and replies carry 64-bit
+ * lengths, and use these instead.
+ */
+#define EXTENDED_REQUEST_MAGIC 0x21e41c71
+#define EXTENDED_REPLY_MAGIC 0x6e8a278c
+
 #define REQUEST_READ 0
 #define REQUEST_WRITE 1
 #define REQUEST_DISCONNECT 2
 #define REQUEST_FLUSH 3
+#define REQUEST_TRIM 4
+#define REQUEST_CACHE 5
+#define REQUEST_WRITE_ZEROES 6
+#define REQUEST_BLOCK_STATUS 7
 
 /* values for transmission flag field */
 #define FLAG_HAS_FLAGS	(1 << 0)	/* Flags are there */
 #define FLAG_SEND_FLUSH	(1 << 2)	/* Send FLUSH */
 #define FLAG_SEND_FUA	(1 << 3)	/* Send FUA (Force Unit Access) */
+#define FLAG_SEND_TRIM	(1 << 5)	/* Send TRIM (discard) */
+#define FLAG_SEND_WRITE_ZEROES (1 << 6)	/* Send NBD_CMD_WRITE_ZEROES */
+#define FLAG_SEND_CACHE (1 << 10)	/* Send NBD_CMD_CACHE */
 
 /* values for command flag field */
 #define CMD_FLAG_FUA     (1 << 0)
+#define CMD_FLAG_NO_HOLE (1 << 1)
+#define CMD_FLAG_REQ_ONE (1 << 3)
+
+/* The fixed newstyle handshake, which lets the client negotiate options
+ * before it starts making requests.
+ */
+#define OPTS_MAGIC 0x49484156454F5054ULL	/* "IHAVEOPT" */
+#define OPTION_REPLY_MAGIC 0x0003e889045565a9ULL
+
+/* values for the handshake flag field, and the client's reply to it */
+#define HANDSHAKE_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define HANDSHAKE_FLAG_NO_ZEROES (1 << 1)
+
+#define OPTION_EXPORT_NAME 1
+#define OPTION_ABORT 2
+#define OPTION_LIST 3
+#define OPTION_INFO 6
+#define OPTION_GO 7
+#define OPTION_STRUCTURED_REPLY 8
+#define OPTION_LIST_META_CONTEXT 9
+#define OPTION_SET_META_CONTEXT 10
+#define OPTION_EXTENDED_HEADERS 11
+
+#define OPTION_REPLY_ACK 1
+#define OPTION_REPLY_SERVER 2
+#define OPTION_REPLY_INFO 3
+#define OPTION_REPLY_META_CONTEXT 4
+#define OPTION_REPLY_ERR_UNSUP 0x80000001
+#define OPTION_REPLY_ERR_POLICY 0x80000002
+#define OPTION_REPLY_ERR_INVALID 0x80000003
+#define OPTION_REPLY_ERR_UNKNOWN 0x80000006
+#define OPTION_REPLY_ERR_SHUTDOWN 0x80000007
+#define OPTION_REPLY_ERR_EXT_HEADER_REQD 0x8000000a
+
+/* What we'll tell the client about in an OPTION_REPLY_INFO */
+#define INFO_EXPORT 0
+#define INFO_BLOCK_SIZE 3
+
+/* The one metadata context we offer, and the flags it uses in block
+ * status replies.  Anything not flagged is allocated.
+ */
+#define META_CONTEXT_BASE_ALLOCATION "base:allocation"
+#define STATE_HOLE (1 << 0)
+#define STATE_ZERO (1 << 1)
+
+/* Structured replies, once the client has asked for them */
+#define STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define REPLY_FLAG_DONE (1 << 0)
+
+#define REPLY_TYPE_NONE 0
+#define REPLY_TYPE_OFFSET_DATA 1
+#define REPLY_TYPE_OFFSET_HOLE 2
+#define REPLY_TYPE_BLOCK_STATUS 5
+#define REPLY_TYPE_BLOCK_STATUS_EXT 6
+#define REPLY_TYPE_ERROR 32769
+
+#define FLAG_CAN_MULTI_CONN    (1 << 8)	/* multiple connections are okay */
 
 #if 0
 /* Not yet implemented by flexnbd */
-#define REQUEST_TRIM 4
-#define REQUEST_WRITE_ZEROES 6
-
 #define FLAG_READ_ONLY	(1 << 1)	/* Device is read-only */
 #define FLAG_ROTATIONAL	(1 << 4)	/* Use elevator algorithm - rotational media */
-#define FLAG_SEND_TRIM	(1 << 5)	/* Send TRIM (discard) */
-#define FLAG_SEND_WRITE_ZEROES (1 << 6)	/* Send NBD_CMD_WRITE_ZEROES */
-#define FLAG_CAN_MULTI_CONN    (1 << 8)	/* multiple connections are okay */
-
-#define CMD_FLAG_NO_HOLE (1 << 1)
 #endif
 
 
@@ -43,6 +106,9 @@
 
 #define NBD_REQUEST_SIZE ( sizeof( struct nbd_request_raw ) )
 #define NBD_REPLY_SIZE   ( sizeof( struct nbd_reply_raw ) )
+#define NBD_STRUCTURED_REPLY_SIZE ( sizeof( struct nbd_structured_reply_raw ) )
+#define NBD_EXTENDED_REQUEST_SIZE ( sizeof( struct nbd_extended_request_raw ) )
+#define NBD_EXTENDED_REPLY_SIZE ( sizeof( struct nbd_extended_reply_raw ) )
 
 #include <linux/types.h>
 #include <inttypes.h>
@@ -80,6 +146,57 @@ struct nbd_reply_raw {
     nbd_handle_t handle;	/* handle you got from request  */
 };
 
+/* The newstyle replacement for nbd_init_raw.  The size and transmission
+ * flags come once the client has picked an export.
+ */
+struct nbd_handshake_raw {
+    char passwd[8];
+    __be64 magic;
+    __be16 flags;
+} __attribute__ ((packed));
+
+struct nbd_option_raw {
+    __be64 magic;
+    __be32 option;
+    __be32 length;		/* of the data following */
+} __attribute__ ((packed));
+
+struct nbd_option_reply_raw {
+    __be64 magic;
+    __be32 option;		/* the option we're replying to */
+    __be32 type;
+    __be32 length;		/* of the data following */
+} __attribute__ ((packed));
+
+struct nbd_structured_reply_raw {
+    __be32 magic;
+    __be16 flags;
+    __be16 type;
+    nbd_handle_t handle;
+    __be32 length;		/* of the data following */
+} __attribute__ ((packed));
+
+/* The extended header versions of nbd_request_raw and
+ * nbd_structured_reply_raw.  Every reply is structured once they're in use.
+ */
+struct nbd_extended_request_raw {
+    __be32 magic;
+    __be16 flags;
+    __be16 type;
+    nbd_handle_t handle;
+    __be64 from;
+    __be64 len;
+} __attribute__ ((packed));
+
+struct nbd_extended_reply_raw {
+    __be32 magic;
+    __be16 flags;
+    __be16 type;
+    nbd_handle_t handle;
+    __be64 offset;		/* of the request we're replying to */
+    __be64 length;		/* of the data following */
+} __attribute__ ((packed));
+
 struct nbd_init {
     char passwd[8];
     uint64_t magic;
@@ -94,7 +211,8 @@ struct nbd_request {
     uint16_t type;		/* == READ || == WRITE || == DISCONNECT || == FLUSH */
     nbd_handle_t handle;
     uint64_t from;
-    uint32_t len;
+    /* Only extended requests can have more than 32 bits of this */
+    uint64_t len;
 } __attribute__ ((packed));
 
 struct nbd_reply {
@@ -103,12 +221,70 @@ struct nbd_reply {
     nbd_handle_t handle;	/* handle you got from request  */
 };
 
+struct nbd_handshake {
+    char passwd[8];
+    uint64_t magic;
+    uint16_t flags;
+};
+
+struct nbd_option {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t length;
+};
+
+struct nbd_option_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t length;
+};
+
+struct nbd_structured_reply {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    nbd_handle_t handle;
+    uint32_t length;
+};
+
+struct nbd_extended_reply {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    nbd_handle_t handle;
+    uint64_t offset;
+    uint64_t length;
+};
+
 void nbd_r2h_init(struct nbd_init_raw *from, struct nbd_init *to);
 void nbd_r2h_request(struct nbd_request_raw *from, struct nbd_request *to);
 void nbd_r2h_reply(struct nbd_reply_raw *from, struct nbd_reply *to);
+void nbd_r2h_handshake(struct nbd_handshake_raw *from,
+		       struct nbd_handshake *to);
+void nbd_r2h_option(struct nbd_option_raw *from, struct nbd_option *to);
+void nbd_r2h_option_reply(struct nbd_option_reply_raw *from,
+			  struct nbd_option_reply *to);
+void nbd_r2h_structured_reply(struct nbd_structured_reply_raw *from,
+			      struct nbd_structured_reply *to);
+void nbd_r2h_extended_request(struct nbd_extended_request_raw *from,
+			      struct nbd_request *to);
+void nbd_r2h_extended_reply(struct nbd_extended_reply_raw *from,
+			    struct nbd_extended_reply *to);
 
 void nbd_h2r_init(struct nbd_init *from, struct nbd_init_raw *to);
 void nbd_h2r_request(struct nbd_request *from, struct nbd_request_raw *to);
 void nbd_h2r_reply(struct nbd_reply *from, struct nbd_reply_raw *to);
+void nbd_h2r_handshake(struct nbd_handshake *from,
+		       struct nbd_handshake_raw *to);
+void nbd_h2r_option(struct nbd_option *from, struct nbd_option_raw *to);
+void nbd_h2r_option_reply(struct nbd_option_reply *from,
+			  struct nbd_option_reply_raw *to);
+void nbd_h2r_structured_reply(struct nbd_structured_reply *from,
+			      struct nbd_structured_reply_raw *to);
+void nbd_h2r_extended_request(struct nbd_request *from,
+			      struct nbd_extended_request_raw *to);
+void nbd_h2r_extended_reply(struct nbd_extended_reply *from,
+			    struct nbd_extended_reply_raw *to);
 
 #endif
@@ -240,26 +240,50 @@ int socket_nbd_disconnect(int fd)
 	}\
 }
 
+/* The server won't take more than NBD_MAX_SIZE in one request, so longer
+ * reads and writes are split up.
+ */
+static uint32_t readwrite_chunk(struct mode_readwrite_params *params,
+				uint32_t done)
+{
+    uint32_t left = params->len - done;
+    return left < NBD_MAX_SIZE ? left : NBD_MAX_SIZE;
+}
+
 void do_read(struct mode_readwrite_params *params)
 {
+    uint32_t done = 0;
+    uint32_t len;
+
     params->client =
 	socket_connect(&params->connect_to.generic,
 		       &params->connect_from.generic);
     FATAL_IF_NEGATIVE(params->client, "Couldn't connect.");
     CHECK_RANGE("read");
-    socket_nbd_read(params->client, params->from, params->len,
-		    params->data_fd, NULL, 10);
+    do {
+	len = readwrite_chunk(params, done);
+	socket_nbd_read(params->client, params->from + done, len,
+			params->data_fd, NULL, 10);
+	done += len;
+    } while (done < params->len);
     close(params->client);
 }
 
 void do_write(struct mode_readwrite_params *params)
 {
+    uint32_t done = 0;
+    uint32_t len;
+
     params->client =
 	socket_connect(&params->connect_to.generic,
 		       &params->connect_from.generic);
     FATAL_IF_NEGATIVE(params->client, "Couldn't connect.");
     CHECK_RANGE("write");
-    socket_nbd_write(params->client, params->from, params->len,
-		     params->data_fd, NULL, 10);
+    do {
+	len = readwrite_chunk(params, done);
+	socket_nbd_write(params->client, params->from + done, len,
+			 params->data_fd, NULL, 10);
+	done += len;
+    } while (done < params->len);
     close(params->client);
 }
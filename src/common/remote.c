@@ -24,8 +24,12 @@ void print_response(const char *response)
     fprintf(out, "%s\n", response_text + 2);
 }
 
-void do_remote_command(char *command, char *socket_name, int argc,
-		       char **argv)
+/* Send a command to the control socket at socket_name, and exit with the
+ * server's response.  If export is set, the command is for that export
+ * rather than the default one.
+ */
+void do_remote_command(char *command, char *export, char *socket_name,
+		       int argc, char **argv)
 {
     char newline = 10;
     int i;
@@ -46,6 +50,12 @@ void do_remote_command(char *command, char *socket_name, int argc,
 		       sizeof(address)), "Couldn't connect to %s",
 		      socket_name);
 
+    if (NULL != export) {
+	write(remote, "export", 6);
+	write(remote, &newline, 1);
+	write(remote, export, strlen(export));
+	write(remote, &newline, 1);
+    }
     write(remote, command, strlen(command));
     write(remote, &newline, 1);
     for (i = 0; i < argc; i++) {
@@ -0,0 +1,161 @@
+#include "zeroes.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_VECTORS 1
+#endif
+
+
+/* Handles the ends of the buffer, and anything too short to be worth
+ * vectorising.  We OR everything together rather than stopping at the
+ * first non-zero byte: data being written is usually either all zeroes or
+ * not zero near the start, and the branch costs more than it saves.
+ */
+int is_all_zeroes_generic(const char *buf, size_t len)
+{
+    uint64_t acc = 0;
+    uint64_t word;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+	memcpy(&word, buf + i, sizeof(word));
+	acc |= word;
+    }
+    for (; i < len; i++) {
+	acc |= (unsigned char) buf[i];
+    }
+
+    return acc == 0;
+}
+
+
+#ifdef HAVE_X86_VECTORS
+
+__attribute__ ((target("sse2")))
+int is_all_zeroes_sse2(const char *buf, size_t len)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    /* Four vectors at a time, checking after each 64 bytes so that we
+     * don't read the rest of a buffer that obviously isn't zero.
+     */
+    for (; i + 64 <= len; i += 64) {
+	acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (buf + i)));
+	acc = _mm_or_si128(acc,
+			   _mm_loadu_si128((const __m128i *) (buf + i + 16)));
+	acc = _mm_or_si128(acc,
+			   _mm_loadu_si128((const __m128i *) (buf + i + 32)));
+	acc = _mm_or_si128(acc,
+			   _mm_loadu_si128((const __m128i *) (buf + i + 48)));
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+	    0xFFFF) {
+	    return 0;
+	}
+    }
+
+    return is_all_zeroes_generic(buf + i, len - i);
+}
+
+__attribute__ ((target("avx2")))
+int is_all_zeroes_avx2(const char *buf, size_t len)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+	acc = _mm256_or_si256(acc,
+			      _mm256_loadu_si256((const __m256i *) (buf +
+								    i)));
+	acc = _mm256_or_si256(acc,
+			      _mm256_loadu_si256((const __m256i *) (buf + i +
+								    32)));
+	acc = _mm256_or_si256(acc,
+			      _mm256_loadu_si256((const __m256i *) (buf + i +
+								    64)));
+	acc = _mm256_or_si256(acc,
+			      _mm256_loadu_si256((const __m256i *) (buf + i +
+								    96)));
+	if (!_mm256_testz_si256(acc, acc)) {
+	    return 0;
+	}
+    }
+
+    return is_all_zeroes_sse2(buf + i, len - i);
+}
+
+int zeroes_have_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+int zeroes_have_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+int is_all_zeroes_sse2(const char *buf, size_t len)
+{
+    return is_all_zeroes_generic(buf, len);
+}
+
+int is_all_zeroes_avx2(const char *buf, size_t len)
+{
+    return is_all_zeroes_generic(buf, len);
+}
+
+int zeroes_have_sse2(void)
+{
+    return 0;
+}
+
+int zeroes_have_avx2(void)
+{
+    return 0;
+}
+
+#endif
+
+
+typedef int (zeroes_fn) (const char *buf, size_t len);
+
+/* Every thread that gets here first will pick the same function, so
+ * there's no harm in them racing to set it.
+ */
+static zeroes_fn *zeroes_impl = NULL;
+
+int is_all_zeroes(const char *buf, size_t len)
+{
+    zeroes_fn *impl = __atomic_load_n(&zeroes_impl, __ATOMIC_RELAXED);
+
+    if (NULL == impl) {
+	if (zeroes_have_avx2()) {
+	    impl = is_all_zeroes_avx2;
+	} else if (zeroes_have_sse2()) {
+	    impl = is_all_zeroes_sse2;
+	} else {
+	    impl = is_all_zeroes_generic;
+	}
+	__atomic_store_n(&zeroes_impl, impl, __ATOMIC_RELAXED);
+    }
+
+    return impl(buf, len);
+}
+
+
+/* Deliberately not const, which would put it in the binary rather than in
+ * the bss.
+ */
+static char zeroes_buffer_data[ZEROES_BUFFER_SIZE];
+
+const char *zeroes_buffer(void)
+{
+    return zeroes_buffer_data;
+}
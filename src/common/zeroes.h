@@ -0,0 +1,36 @@
+#ifndef ZEROES_H
+#define ZEROES_H
+
+#include <stddef.h>
+
+/* Returns 1 if all ''len'' bytes at ''buf'' are zero, 0 otherwise.  The
+ * first time it's called, this picks the fastest implementation the CPU
+ * we're running on supports.
+ */
+int is_all_zeroes(const char *buf, size_t len);
+
+/* The implementations is_all_zeroes chooses between, for testing.
+ * zeroes_have_sse2 and zeroes_have_avx2 say whether the corresponding
+ * function can be called on this machine.
+ */
+int is_all_zeroes_generic(const char *buf, size_t len);
+int is_all_zeroes_sse2(const char *buf, size_t len);
+int is_all_zeroes_avx2(const char *buf, size_t len);
+
+int zeroes_have_sse2(void);
+int zeroes_have_avx2(void);
+
+/** ZEROES_BUFFER_SIZE
+ * The size of the buffer zeroes_buffer returns.  Anything wanting to send
+ * more zeroes than this has to point at it more than once.
+ */
+#define ZEROES_BUFFER_SIZE (1024 * 1024)
+
+/* Returns ZEROES_BUFFER_SIZE bytes of zeroes, shared by everyone, for
+ * sending zeroes without having to make any.  Nothing is ever written to
+ * it, so all of its pages are the kernel's zero page, and it costs no
+ * memory.
+ */
+const char *zeroes_buffer(void);
+
+#endif
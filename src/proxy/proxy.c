@@ -392,7 +392,7 @@ int proxy_prefetch_for_request(struct proxier *proxy, int state)
 
 	req->len *= 2;
 
-	debug("Prefetching additional %" PRIu32 " bytes",
+	debug("Prefetching additional %" PRIu64 " bytes",
 	      req->len - proxy->prefetch_req_orig_len);
 	nbd_h2r_request(req, req_raw);
     }
@@ -467,14 +467,14 @@ int proxy_read_from_downstream(struct proxier *proxy, int state)
 	 */
 	if (request->type == REQUEST_READ) {
 	    if (request->len > NBD_MAX_SIZE) {
-		warn("NBD read request size %" PRIu32 " too large",
+		warn("NBD read request size %" PRIu64 " too large",
 		     request->len);
 		return EXIT;
 	    }
 	}
 	if (request->type == REQUEST_WRITE) {
 	    if (request->len > NBD_MAX_SIZE) {
-		warn("NBD write request size %" PRIu32 " too large",
+		warn("NBD write request size %" PRIu64 " too large",
 		     request->len);
 		return EXIT;
 	    }
@@ -485,7 +485,7 @@ int proxy_read_from_downstream(struct proxier *proxy, int state)
 
     if (proxy->req.needle == proxy->req.size) {
 	debug("Received NBD request from downstream. type=%" PRIu16
-	      " flags=%" PRIu16 " from=%" PRIu64 " len=%" PRIu32,
+	      " flags=%" PRIu16 " from=%" PRIu64 " len=%" PRIu64,
 	      request->type, request->flags, request->from, request->len);
 
 	/* Finished reading, so advance state. Leave size untouched so the next
@@ -717,9 +717,12 @@ void proxy_session(struct proxier *proxy)
     int connect_to_upstream_cooldown = 0;
 
 
-    /* First action: Write hello to downstream */
+    /* First action: Write hello to downstream.  We only serve one client
+     * at a time, so it mustn't think it can open more connections.
+     */
     nbd_hello_to_buf((struct nbd_init_raw *) proxy->rsp.buf,
-		     proxy->upstream_size, proxy->upstream_flags);
+		     proxy->upstream_size,
+		     proxy->upstream_flags & ~FLAG_CAN_MULTI_CONN);
     proxy->rsp.size = sizeof(struct nbd_init_raw);
     proxy->rsp.needle = 0;
     state = WRITE_TO_DOWNSTREAM;
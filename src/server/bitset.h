@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 
 /*
  * Make the bitfield words 'opaque' to prevent code
@@ -29,10 +30,19 @@ typedef bitfield_word_t *bitfield_p;
 #define BIT_WORDS_FOR_SIZE(_bytes) \
 			((_bytes + (BITFIELD_WORD_SIZE-1)) / BITFIELD_WORD_SIZE)
 
+/** Return the word holding bit ''idx'' in array ''b''.  Other threads may
+ * be changing it with the _atomic functions below, so we read it exactly
+ * once, and work from that.
+ */
+static inline bitfield_word_t bit_word_load(bitfield_p b, uint64_t idx)
+{
+    return __atomic_load_n(&BIT_WORD(b, idx), __ATOMIC_RELAXED);
+}
+
 /** Return the bit value ''idx'' in array ''b'' */
 static inline int bit_get(bitfield_p b, uint64_t idx)
 {
-    return (BIT_WORD(b, idx) >> (idx & (BITS_PER_WORD - 1))) & 1;
+    return (bit_word_load(b, idx) >> (idx & (BITS_PER_WORD - 1))) & 1;
 }
 
 /** Return 1 if the bit at ''idx'' in array ''b'' is set */
@@ -104,41 +114,106 @@ static inline void bit_clear_range(bitfield_p b, uint64_t from,
     }
 }
 
+/** The bits of a word covered by ''len'' bits starting at ''from'', which
+  * mustn't run on into the next word.
+  */
+static inline bitfield_word_t bit_word_mask(uint64_t from, uint64_t len)
+{
+    bitfield_word_t mask =
+	len >= BITS_PER_WORD ? ~(bitfield_word_t) 0 :
+	((bitfield_word_t) 1 << len) - 1;
+
+    return mask << (from % BITS_PER_WORD);
+}
+
+/** As bit_set_range, but changing each word with a single atomic operation,
+  * so that threads setting and clearing bits in the same word at once don't
+  * undo each other's changes.  Words which are already set are only read,
+  * so the cache lines they're on aren't taken away from other threads.
+  * Returns the number of bits which weren't already set.
+  */
+static inline uint64_t bit_set_range_atomic(bitfield_p b, uint64_t from,
+					    uint64_t len)
+{
+    uint64_t n, changed = 0;
+    bitfield_word_t mask, old;
+
+    for (; len > 0; from += n, len -= n) {
+	n = BITS_PER_WORD - (from % BITS_PER_WORD);
+	if (n > len) {
+	    n = len;
+	}
+	mask = bit_word_mask(from, n);
+	if ((bit_word_load(b, from) & mask) != mask) {
+	    old = __sync_fetch_and_or(&BIT_WORD(b, from), mask);
+	    changed += __builtin_popcountll(mask & ~old);
+	}
+    }
+
+    return changed;
+}
+
+/** As bit_clear_range, but atomically, in the same way as
+  * bit_set_range_atomic.  Returns the number of bits which were set.
+  */
+static inline uint64_t bit_clear_range_atomic(bitfield_p b, uint64_t from,
+					      uint64_t len)
+{
+    uint64_t n, changed = 0;
+    bitfield_word_t mask, old;
+
+    for (; len > 0; from += n, len -= n) {
+	n = BITS_PER_WORD - (from % BITS_PER_WORD);
+	if (n > len) {
+	    n = len;
+	}
+	mask = bit_word_mask(from, n);
+	if ((bit_word_load(b, from) & mask) != 0) {
+	    old = __sync_fetch_and_and(&BIT_WORD(b, from), ~mask);
+	    changed += __builtin_popcountll(mask & old);
+	}
+    }
+
+    return changed;
+}
+
 /** Counts the number of contiguous bits in array ''b'', starting at ''from''
   * up to a maximum number of bits ''len''.  Returns the number of contiguous
   * bits that are the same as the first one specified. If ''run_is_set'' is
   * non-NULL, the value of that bit is placed into it.
+  *
+  * Each word is read just once, so the run is one the bits really had, even
+  * if other threads are changing them as we go.
   */
 static inline uint64_t bit_run_count(bitfield_p b, uint64_t from,
 				     uint64_t len, int *run_is_set)
 {
-    uint64_t count = 0;
-    int first_value = bit_get(b, from);
+    uint64_t count = 0, n;
+    bitfield_word_t word = bit_word_load(b, from);
+    int first_value = (word >> (from % BITS_PER_WORD)) & 1;
     bitfield_word_t word_match = first_value ? -1 : 0;
+    bitfield_word_t differ;
 
     if (run_is_set != NULL) {
 	*run_is_set = first_value;
     }
 
-    for (; ((from + count) % BITS_PER_WORD) != 0 && len > 0; len--) {
-	if (bit_has_value(b, from + count, first_value)) {
-	    count++;
-	} else {
-	    return count;
+    while (len > 0) {
+	n = BITS_PER_WORD - ((from + count) % BITS_PER_WORD);
+	if (n > len) {
+	    n = len;
 	}
-    }
 
-    for (; len >= BITS_PER_WORD; len -= BITS_PER_WORD) {
-	if (BIT_WORD(b, from + count) == word_match) {
-	    count += BITS_PER_WORD;
-	} else {
-	    break;
+	differ = (word ^ word_match) & bit_word_mask(from + count, n);
+	if (differ) {
+	    return count + __builtin_ctzll(differ) -
+		(from + count) % BITS_PER_WORD;
 	}
-    }
 
-    for (; len > 0; len--) {
-	if (bit_has_value(b, from + count, first_value)) {
-	    count++;
+	count += n;
+	len -= n;
+	if (len > 0) {
+	    word = bit_word_load(b, from + count);
 	}
     }
 
@@ -159,29 +234,113 @@ struct bitset_stream_entry {
     uint64_t len;
 };
 
-/** Limit the stream size to 1MB for now.
+/** The default number of events the stream holds, which is 1MB of them.
  *
- *  If this is too small, it'll cause requests to stall as the migration lags
- *  behind the changes made by those requests.
+ *  If this is too small, changes which don't fit go into the overflow map,
+ *  and the mirror has to go looking for them there.
  */
 #define BITSET_STREAM_SIZE ( ( 1024 * 1024 ) / sizeof( struct bitset_stream_entry ) )
 
+/* A slot in the stream.  A slot's sequence is its position in the stream
+ * while it's free for a producer to fill, one more than that once it's
+ * been filled, and its next position once the consumer has emptied it.
+ */
+struct bitset_stream_slot {
+    uint64_t sequence;
+    struct bitset_stream_entry entry;
+};
+
+/** The stream is a ring which any number of threads can add to at once,
+ *  without a lock, and one thread takes events out of.  Adding to it never
+ *  waits: if the ring is full, the blocks a SET or UNSET covers are marked
+ *  in the overflow map instead, and the consumer turns them back into
+ *  events once it's emptied the ring.  By then they may be out of date, so
+ *  it looks at the bitset to see whether they're SET or UNSET now.
+ *
+ *  An UNSET can end up behind a SET of the same blocks that was made after
+ *  it, so it's only taken to mean the blocks may have been cleared.  When
+ *  the consumer takes one, it looks at the bitset, and any blocks which
+ *  are set again come out as a SET instead.
+ *
+ *  A block which is already covered by a SET waiting in the stream doesn't
+ *  need another, so the queued map marks those, and a SET which would only
+ *  repeat them is dropped.  The consumer also merges runs of SETs, or of
+ *  UNSETs, which touch each other.  Between them, a block that's written
+ *  over and over is only sent once each time the mirror catches up.
+ *
+ *  The mutex and condition variable are only used by the consumer to sleep
+ *  on when there's nothing to take, and are only touched when it is.
+ */
 struct bitset_stream {
-    struct bitset_stream_entry entries[BITSET_STREAM_SIZE];
-    int in;
-    int out;
-    int size;
+    struct bitset_stream_slot *slots;
+    uint64_t capacity;
+    /* The next position for a producer to claim, and the next for the
+     * consumer to empty.  These only ever go up; the slot for a position
+     * is the position modulo capacity.  They're kept apart so producers
+     * and the consumer aren't fighting over the cache line.
+     */
+    uint64_t in __attribute__ ((aligned(64)));
+    uint64_t out __attribute__ ((aligned(64)));
+    /* Updated atomically */
+    uint64_t queued_bytes[BITSET_STREAM_EVENTS_ENUM_SIZE];
+
+    /* One bit per block of the bitset, set atomically by producers, and
+     * cleared by the consumer.  overflow_blocks counts the bits that are
+     * set, though while a producer is marking some, it may count them a
+     * moment early.  The consumer carries on looking from overflow_next.
+     */
+    bitfield_word_t *overflow;
+    uint64_t overflow_blocks;
+    uint64_t overflow_next;
+
+    /* One bit per block, set while a SET covering it is waiting in the
+     * ring or the overflow map.  Set by producers as they add a SET, and
+     * cleared by the consumer as it takes one, before the mirror reads the
+     * blocks.  An UNSET clears it too, so that a SET after it isn't lost.
+     */
+    bitfield_word_t *queued;
+
     pthread_mutex_t mutex;
-    pthread_cond_t cond_not_full;
     pthread_cond_t cond_not_empty;
-    uint64_t queued_bytes[BITSET_STREAM_EVENTS_ENUM_SIZE];
+    /* Set while the consumer is sleeping.  Updated atomically, with the
+     * mutex held.
+     */
+    int consumer_waiting;
+
+    /* How many threads are adding events right now.  Updated atomically,
+     * and waited on when the stream's enabled, before the maps are reset.
+     */
+    int producers;
 };
 
 
+/** The most levels a bitset's summary can have, which is enough for 2^64
+ *  bits.
+ */
+#define BITSET_SUMMARY_LEVELS 11
+
 /** An application of a bitset - a bitset mapping represents a file of ''size''
   * broken down into ''resolution''-sized chunks.  The bit set is assumed to
-  * represent one bit per chunk.  We also bundle a lock so that the set can be
-  * written reliably by multiple threads.
+  * represent one bit per chunk.
+  *
+  * The bits are changed with atomic operations, so any number of threads
+  * can change and read them at once without a lock.  The lock is only
+  * taken to enable or disable the stream.  Each thread adds its events
+  * after changing the bits, and events come out in the order their slots
+  * in the stream were claimed, so two threads changing the same bits at
+  * once may add their events the other way round.  That's safe, as a SET
+  * has the mirror read the blocks as they are when it gets to them, and
+  * an UNSET is checked against the bits as it's taken.
+  *
+  * So that finding the end of a run doesn't mean reading every word of
+  * it, the bits are summarised in levels.  Level 0 is the bits
+  * themselves.  Above that, each bit of any[k] says whether the word
+  * under it in any[k-1] has any bits set, and each bit of all[k] whether
+  * every bit of the word under it in all[k-1] is set.  Each level has a
+  * 64th of the words of the one below, up to one with a single word.
+  * A summary is brought up to date straight after the word under it
+  * changes, so while a word is changing, a reader may see a summary
+  * that's a moment out of date.
   */
 struct bitset {
     pthread_mutex_t lock;
@@ -189,144 +348,433 @@ struct bitset {
     int resolution;
     struct bitset_stream *stream;
     int stream_enabled;
+
+    int levels;
+    uint64_t words[BITSET_SUMMARY_LEVELS];
+    bitfield_p any[BITSET_SUMMARY_LEVELS];
+    bitfield_p all[BITSET_SUMMARY_LEVELS];
+
     bitfield_word_t bits[];
 };
 
 /** Allocate a bitset for a file of the given size, and chunks of the
-  * given resolution.
+  * given resolution, with room for ''stream_size'' events in its stream.
   */
-static inline struct bitset *bitset_alloc(uint64_t size, int resolution)
+static inline struct bitset *bitset_alloc_with_stream(uint64_t size,
+						      int resolution,
+						      uint64_t stream_size)
 {
     // calculate a size to allocate that is a multiple of the size of the
-    // bitfield word
+    // bitfield word, since we change the bits a word at a time
+    uint64_t bits = (size + resolution - 1) / resolution;
     size_t bitfield_size =
-	BIT_WORDS_FOR_SIZE(((size + resolution -
-			     1) / resolution)) * sizeof(bitfield_word_t);
-    struct bitset *bitset =
-	xmalloc(sizeof(struct bitset) + (bitfield_size / 8));
+	((bits + BITS_PER_WORD - 1) / BITS_PER_WORD) *
+	sizeof(bitfield_word_t);
+    struct bitset *bitset = xmalloc(sizeof(struct bitset) + bitfield_size);
+    uint64_t i;
 
     bitset->size = size;
     bitset->resolution = resolution;
+
+    bitset->words[0] = bitfield_size / sizeof(bitfield_word_t);
+    bitset->any[0] = bitset->all[0] = bitset->bits;
+    for (bitset->levels = 1; bitset->words[bitset->levels - 1] > 1;
+	 bitset->levels++) {
+	i = (bitset->words[bitset->levels - 1] + BITS_PER_WORD - 1) /
+	    BITS_PER_WORD;
+	bitset->words[bitset->levels] = i;
+	bitset->any[bitset->levels] = xmalloc(i * sizeof(bitfield_word_t));
+	bitset->all[bitset->levels] = xmalloc(i * sizeof(bitfield_word_t));
+    }
+
     /* don't actually need to call pthread_mutex_destroy ' */
     pthread_mutex_init(&bitset->lock, NULL);
     bitset->stream = xmalloc(sizeof(struct bitset_stream));
+    bitset->stream->capacity = stream_size;
+    bitset->stream->slots =
+	xmalloc(stream_size * sizeof(struct bitset_stream_slot));
+    for (i = 0; i < stream_size; i++) {
+	bitset->stream->slots[i].sequence = i;
+    }
+    bitset->stream->overflow = xmalloc(bitfield_size);
+    bitset->stream->queued = xmalloc(bitfield_size);
     pthread_mutex_init(&bitset->stream->mutex, NULL);
 
     /* Technically don't need to call pthread_cond_destroy either */
-    pthread_cond_init(&bitset->stream->cond_not_full, NULL);
     pthread_cond_init(&bitset->stream->cond_not_empty, NULL);
 
     return bitset;
 }
 
+/** As bitset_alloc_with_stream, with a stream of the default size. */
+static inline struct bitset *bitset_alloc(uint64_t size, int resolution)
+{
+    return bitset_alloc_with_stream(size, resolution, BITSET_STREAM_SIZE);
+}
+
 static inline void bitset_free(struct bitset *set)
 {
+    int level;
+
     /* TODO: free our mutex... */
 
+    for (level = 1; level < set->levels; level++) {
+	free(set->any[level]);
+	free(set->all[level]);
+    }
+
+    free(set->stream->queued);
+    free(set->stream->overflow);
+    free(set->stream->slots);
     free(set->stream);
     set->stream = NULL;
 
     free(set);
 }
 
+#define BITSET_LOCK \
+  FATAL_IF_NEGATIVE(pthread_mutex_lock(&set->lock), "Error locking bitset")
+
+#define BITSET_UNLOCK \
+  FATAL_IF_NEGATIVE(pthread_mutex_unlock(&set->lock), "Error unlocking bitset")
+
+
+/* Has anything gone into the overflow map? */
+static inline int bitset_stream_overflowed(struct bitset_stream *stream)
+{
+    return __atomic_load_n(&stream->overflow_blocks, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Is there an event in ''slot'' for the consumer at position ''pos''? */
+static inline int bitset_stream_ready(struct bitset_stream_slot *slot,
+				      uint64_t pos)
+{
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* Sleep until there's an event in ''slot'', or something in the overflow
+ * map.
+ */
+static inline void bitset_stream_wait(struct bitset_stream *stream,
+				      struct bitset_stream_slot *slot,
+				      uint64_t pos)
+{
+    pthread_mutex_lock(&stream->mutex);
+    /* This is a full barrier, so either we see the event below, or
+     * whoever adds it sees us waiting.
+     */
+    __sync_add_and_fetch(&stream->consumer_waiting, 1);
+    while (!bitset_stream_ready(slot, pos) &&
+	   !bitset_stream_overflowed(stream)) {
+	pthread_cond_wait(&stream->cond_not_empty, &stream->mutex);
+    }
+    __sync_sub_and_fetch(&stream->consumer_waiting, 1);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+/* Having added something, wake the consumer if it's sleeping. */
+static inline void bitset_stream_wake(struct bitset_stream *stream)
+{
+    __sync_synchronize();
+    if (__atomic_load_n(&stream->consumer_waiting, __ATOMIC_RELAXED)) {
+	pthread_mutex_lock(&stream->mutex);
+	pthread_cond_signal(&stream->cond_not_empty);
+	pthread_mutex_unlock(&stream->mutex);
+    }
+}
+
 #define INT_FIRST_AND_LAST \
   uint64_t first = from/set->resolution, \
       last = ((from+len)-1)/set->resolution, \
       bitlen = (last-first)+1
 
-#define BITSET_LOCK \
-  FATAL_IF_NEGATIVE(pthread_mutex_lock(&set->lock), "Error locking bitset")
+/* Mark the blocks covering the given bytes in the overflow map.  The
+ * consumer may clear the bits as soon as they're set, and take them off
+ * overflow_blocks, so they're counted first.  Any which turn out to have
+ * been marked already are taken off again afterwards, so overflow_blocks
+ * is never less than the number of bits set.
+ */
+static inline void bitset_stream_overflow(struct bitset *set,
+					  uint64_t from, uint64_t len)
+{
+    struct bitset_stream *stream = set->stream;
+    uint64_t marked;
 
-#define BITSET_UNLOCK \
-  FATAL_IF_NEGATIVE(pthread_mutex_unlock(&set->lock), "Error unlocking bitset")
+    if (len == 0) {
+	return;
+    }
 
+    INT_FIRST_AND_LAST;
+    __sync_add_and_fetch(&stream->overflow_blocks, bitlen);
+    marked = bit_set_range_atomic(stream->overflow, first, bitlen);
+    if (marked < bitlen) {
+	__sync_sub_and_fetch(&stream->overflow_blocks, bitlen - marked);
+    }
+    if (marked) {
+	bitset_stream_wake(stream);
+    }
+}
+
+/* Mark the blocks covering the given bytes as having a SET waiting for
+ * them, returning how many didn't already.
+ */
+static inline uint64_t bitset_stream_queue_blocks(struct bitset *set,
+						  uint64_t from, uint64_t len)
+{
+    if (len == 0) {
+	return 0;
+    }
+
+    INT_FIRST_AND_LAST;
+    return bit_set_range_atomic(set->stream->queued, first, bitlen);
+}
 
+/* The blocks covering the given bytes no longer have a SET waiting. */
+static inline void bitset_stream_unqueue_blocks(struct bitset *set,
+						uint64_t from, uint64_t len)
+{
+    if (len == 0) {
+	return;
+    }
+
+    INT_FIRST_AND_LAST;
+    bit_clear_range_atomic(set->stream->queued, first, bitlen);
+}
+
+/** Add an event to the stream.  Safe to call from any number of threads at
+ *  once, and never waits.  If the ring is full, SET and UNSET events go
+ *  into the overflow map; ON and OFF are only markers, so they're dropped.
+ *  A SET is dropped if every block it covers already has one waiting.
+ */
 static inline void bitset_stream_enqueue(struct bitset *set,
 					 enum bitset_stream_events event,
 					 uint64_t from, uint64_t len)
 {
     struct bitset_stream *stream = set->stream;
+    struct bitset_stream_slot *slot;
+    uint64_t pos;
+    int64_t diff;
 
-    pthread_mutex_lock(&stream->mutex);
+    if (event == BITSET_STREAM_SET) {
+	if (len > 0 && bitset_stream_queue_blocks(set, from, len) == 0) {
+	    return;
+	}
+    } else if (event == BITSET_STREAM_UNSET) {
+	bitset_stream_unqueue_blocks(set, from, len);
+    }
 
-    while (stream->size == BITSET_STREAM_SIZE) {
-	pthread_cond_wait(&stream->cond_not_full, &stream->mutex);
+    pos = __atomic_load_n(&stream->in, __ATOMIC_RELAXED);
+    while (1) {
+	slot = &stream->slots[pos % stream->capacity];
+	diff = (int64_t) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE)
+			  - pos);
+
+	if (diff == 0) {
+	    /* The slot is free; claim it, unless someone beat us to it, in
+	     * which case pos is updated to where they left in.
+	     */
+	    if (__atomic_compare_exchange_n(&stream->in, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (diff < 0) {
+	    /* The consumer hasn't emptied it yet, so the ring is full */
+	    if (event == BITSET_STREAM_SET || event == BITSET_STREAM_UNSET) {
+		bitset_stream_overflow(set, from, len);
+	    }
+	    return;
+	} else {
+	    /* Someone else has filled it since we looked at in */
+	    pos = __atomic_load_n(&stream->in, __ATOMIC_RELAXED);
+	}
     }
 
-    stream->entries[stream->in].event = event;
-    stream->entries[stream->in].from = from;
-    stream->entries[stream->in].len = len;
-    stream->queued_bytes[event] += len;
+    slot->entry.event = event;
+    slot->entry.from = from;
+    slot->entry.len = len;
+    __sync_add_and_fetch(&stream->queued_bytes[event], len);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
 
-    stream->size++;
-    stream->in++;
-    stream->in %= BITSET_STREAM_SIZE;
+    bitset_stream_wake(stream);
+}
 
-    pthread_mutex_unlock(&stream->mutex);
-    pthread_cond_signal(&stream->cond_not_empty);
+static inline int bitset_stream_sweep(struct bitset *set,
+				      struct bitset_stream_entry *out);
+static inline uint64_t bitset_run_count_ex(struct bitset *set,
+					   uint64_t from,
+					   uint64_t len, int *run_is_set);
+
+/* Take the event at ''pos'', which has to be ready, out of the ring. */
+static inline void bitset_stream_take(struct bitset *set, uint64_t pos,
+				      struct bitset_stream_entry *out)
+{
+    struct bitset_stream *stream = set->stream;
+    struct bitset_stream_slot *slot = &stream->slots[pos % stream->capacity];
 
-    return;
+    *out = slot->entry;
+    __sync_sub_and_fetch(&stream->queued_bytes[out->event], out->len);
+    if (out->event == BITSET_STREAM_SET) {
+	bitset_stream_unqueue_blocks(set, out->from, out->len);
+    }
+
+    __atomic_store_n(&stream->out, pos + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, pos + stream->capacity,
+		     __ATOMIC_RELEASE);
+}
+
+/* Describe the blocks an UNSET covers as they are now, as the sweep does.
+ * If the first of them are set, it becomes a SET of those.  Whatever's
+ * left after the first run goes into the overflow map, to be looked at
+ * again once the ring's empty.
+ */
+static inline void bitset_stream_recheck(struct bitset *set,
+					 struct bitset_stream_entry *entry)
+{
+    uint64_t len;
+    int is_set;
+
+    len = bitset_run_count_ex(set, entry->from, entry->len, &is_set);
+    if (len == 0) {
+	return;
+    }
+    if (len < entry->len) {
+	bitset_stream_overflow(set, entry->from + len, entry->len - len);
+	entry->len = len;
+    }
+    if (is_set) {
+	entry->event = BITSET_STREAM_SET;
+    }
 }
 
+/** Take the oldest event off the stream, or one from the overflow map once
+ *  the ring is empty, waiting for one if there are none.  Any SETs or
+ *  UNSETs straight after it in the ring which overlap or touch it are
+ *  taken too, and merged into it.  An UNSET is checked against the bitset
+ *  before it's handed out.  Only one thread may do this at a time.
+ */
 static inline void bitset_stream_dequeue(struct bitset *set,
 					 struct bitset_stream_entry *out)
 {
     struct bitset_stream *stream = set->stream;
-    struct bitset_stream_entry *dequeued;
+    uint64_t pos = __atomic_load_n(&stream->out, __ATOMIC_RELAXED);
+    struct bitset_stream_slot *slot = &stream->slots[pos % stream->capacity];
+    struct bitset_stream_entry entry, next;
+    uint64_t end;
+
+    while (!bitset_stream_ready(slot, pos)) {
+	if (bitset_stream_overflowed(stream)) {
+	    if (bitset_stream_sweep(set, out ? out : &entry)) {
+		return;
+	    }
+	} else {
+	    bitset_stream_wait(stream, slot, pos);
+	}
+    }
 
-    pthread_mutex_lock(&stream->mutex);
+    bitset_stream_take(set, pos, &entry);
 
-    while (stream->size == 0) {
-	pthread_cond_wait(&stream->cond_not_empty, &stream->mutex);
+    while (entry.event == BITSET_STREAM_SET ||
+	   entry.event == BITSET_STREAM_UNSET) {
+	slot = &stream->slots[++pos % stream->capacity];
+	if (!bitset_stream_ready(slot, pos)) {
+	    break;
+	}
+	next = slot->entry;
+	if (next.event != entry.event ||
+	    next.from > entry.from + entry.len ||
+	    next.from + next.len < entry.from) {
+	    break;
+	}
+	bitset_stream_take(set, pos, &next);
+
+	end = entry.from + entry.len;
+	if (next.from + next.len > end) {
+	    end = next.from + next.len;
+	}
+	if (next.from < entry.from) {
+	    entry.from = next.from;
+	}
+	entry.len = end - entry.from;
     }
 
-    dequeued = &stream->entries[stream->out];
+    if (entry.event == BITSET_STREAM_UNSET) {
+	bitset_stream_recheck(set, &entry);
+    }
 
     if (out != NULL) {
-	out->event = dequeued->event;
-	out->from = dequeued->from;
-	out->len = dequeued->len;
+	*out = entry;
     }
-
-    stream->queued_bytes[dequeued->event] -= dequeued->len;
-    stream->size--;
-    stream->out++;
-    stream->out %= BITSET_STREAM_SIZE;
-
-    pthread_mutex_unlock(&stream->mutex);
-    pthread_cond_signal(&stream->cond_not_full);
-
-    return;
 }
 
+/** How many events are in the stream.  This includes any that producers
+ *  have claimed slots for, but not finished adding yet, and counts each
+ *  block in the overflow map as one.
+ */
 static inline size_t bitset_stream_size(struct bitset *set)
 {
-    size_t size;
+    /* out first, so in can't be behind it */
+    uint64_t out = __atomic_load_n(&set->stream->out, __ATOMIC_ACQUIRE);
+    uint64_t in = __atomic_load_n(&set->stream->in, __ATOMIC_ACQUIRE);
 
-    pthread_mutex_lock(&set->stream->mutex);
-    size = set->stream->size;
-    pthread_mutex_unlock(&set->stream->mutex);
+    return (in - out) +
+	__atomic_load_n(&set->stream->overflow_blocks, __ATOMIC_RELAXED);
+}
 
-    return size;
+/** How many events the ring can hold before it overflows */
+static inline size_t bitset_stream_capacity(struct bitset *set)
+{
+    return set->stream->capacity;
 }
 
+/** The bytes covered by events of type ''event''.  Everything in the
+ *  overflow map counts as SET, since that's what it'll mostly turn out to
+ *  be.
+ */
 static inline uint64_t bitset_stream_queued_bytes(struct bitset *set,
 						  enum bitset_stream_events
 						  event)
 {
-    uint64_t total;
+    uint64_t total = __atomic_load_n(&set->stream->queued_bytes[event],
+				     __ATOMIC_RELAXED);
 
-    pthread_mutex_lock(&set->stream->mutex);
-    total = set->stream->queued_bytes[event];
-    pthread_mutex_unlock(&set->stream->mutex);
+    if (event == BITSET_STREAM_SET) {
+	total += __atomic_load_n(&set->stream->overflow_blocks,
+				 __ATOMIC_RELAXED) * set->resolution;
+    }
 
     return total;
 }
 
 static inline void bitset_enable_stream(struct bitset *set)
 {
+    struct bitset_stream *stream = set->stream;
+    uint64_t blocks = (set->size + set->resolution - 1) / set->resolution;
+
     BITSET_LOCK;
+    /* The ON event means starting again from scratch, so anything left
+     * over from the last time the stream was enabled can go.  Only the
+     * consumer enables it, and once anyone who saw it enabled last time
+     * has finished, no-one else will look at the overflow or queued maps
+     * until it's enabled again.
+     */
+    while (__atomic_load_n(&stream->producers, __ATOMIC_ACQUIRE) > 0) {
+	sched_yield();
+    }
+    memset(stream->overflow, 0,
+	   ((blocks + BITS_PER_WORD - 1) / BITS_PER_WORD) *
+	   sizeof(bitfield_word_t));
+    memset(stream->queued, 0,
+	   ((blocks + BITS_PER_WORD - 1) / BITS_PER_WORD) *
+	   sizeof(bitfield_word_t));
+    __atomic_store_n(&stream->overflow_blocks, 0, __ATOMIC_RELAXED);
+    stream->overflow_next = 0;
     set->stream_enabled = 1;
+    /* Anyone changing bits from here on will see the stream is enabled,
+     * and anyone who didn't see it has finished changing them.  Pairs with
+     * the barrier in bitset_stream_start.
+     */
+    __sync_synchronize();
     bitset_stream_enqueue(set, BITSET_STREAM_ON, 0, set->size);
     BITSET_UNLOCK;
 }
@@ -339,6 +787,160 @@ static inline void bitset_disable_stream(struct bitset *set)
     BITSET_UNLOCK;
 }
 
+static inline int bitset_stream_is_enabled(struct bitset *set)
+{
+    return __atomic_load_n(&set->stream_enabled, __ATOMIC_RELAXED);
+}
+
+/* Having changed word ''w'' on ''level'' of the any (if ''full'' is 0) or
+ * all summaries, bring the levels above it up to date.  We stop once a
+ * level doesn't change.  If someone else changes the word while we're
+ * looking at it, we look again, so whoever changes it last leaves the
+ * summary right.
+ */
+static inline void bitset_summarise(struct bitset *set, bitfield_p * table,
+				    int full, uint64_t w)
+{
+    int level, changed, summary;
+    bitfield_word_t word, mask, old;
+
+    for (level = 0; level + 1 < set->levels;
+	 level++, w /= BITS_PER_WORD) {
+	mask = (bitfield_word_t) 1 << (w % BITS_PER_WORD);
+	changed = 0;
+	do {
+	    word = bit_word_load(table[level], w * BITS_PER_WORD);
+	    summary = full ? word == ~(bitfield_word_t) 0 : word != 0;
+	    old = bit_word_load(table[level + 1], w);
+	    if (summary && !(old & mask)) {
+		old = __sync_fetch_and_or(&BIT_WORD(table[level + 1], w),
+					  mask);
+		changed |= !(old & mask);
+	    } else if (!summary && (old & mask)) {
+		old = __sync_fetch_and_and(&BIT_WORD(table[level + 1], w),
+					   ~mask);
+		changed |= !!(old & mask);
+	    }
+	} while (bit_word_load(table[level], w * BITS_PER_WORD) != word);
+
+	if (!changed) {
+	    return;
+	}
+    }
+}
+
+/* Set (or clear, if ''value'' is 0) ''len'' bits from bit ''from'', as
+ * bit_set_range_atomic does, and update the summaries of any words that
+ * changed.
+ */
+static inline void bitset_change_bits(struct bitset *set, uint64_t from,
+				      uint64_t len, int value)
+{
+    uint64_t n;
+    bitfield_word_t mask, old;
+
+    for (; len > 0; from += n, len -= n) {
+	n = BITS_PER_WORD - (from % BITS_PER_WORD);
+	if (n > len) {
+	    n = len;
+	}
+	mask = bit_word_mask(from, n);
+	old = bit_word_load(set->bits, from);
+	if (value) {
+	    if ((old & mask) == mask) {
+		continue;
+	    }
+	    __sync_fetch_and_or(&BIT_WORD(set->bits, from), mask);
+	} else {
+	    if ((old & mask) == 0) {
+		continue;
+	    }
+	    __sync_fetch_and_and(&BIT_WORD(set->bits, from), ~mask);
+	}
+	bitset_summarise(set, set->any, 0, from / BITS_PER_WORD);
+	bitset_summarise(set, set->all, 1, from / BITS_PER_WORD);
+    }
+}
+
+/* The first bit at or after ''from'' on ''level'' of ''table'' which is
+ * ''want'', or UINT64_MAX if there isn't one.  ''table'' has to be any if
+ * we want a set bit, and all if we want a clear one, so that the level
+ * above tells us which words have one in.  If a summary turns out to be
+ * out of date, we just carry on looking past the word it led us to.
+ */
+static inline uint64_t bitset_find_level(struct bitset *set,
+					 bitfield_p * table, int level,
+					 int want, uint64_t from)
+{
+    uint64_t w = from / BITS_PER_WORD;
+    bitfield_word_t word;
+
+    while (w < set->words[level]) {
+	word = bit_word_load(table[level], w * BITS_PER_WORD);
+	if (!want) {
+	    word = ~word;
+	}
+	if (from > w * BITS_PER_WORD) {
+	    word &= ~(bitfield_word_t) 0 << (from % BITS_PER_WORD);
+	}
+	if (word) {
+	    return w * BITS_PER_WORD + __builtin_ctzll(word);
+	}
+
+	if (level + 1 == set->levels) {
+	    w++;
+	} else {
+	    w = bitset_find_level(set, table, level + 1, want, w + 1);
+	}
+    }
+
+    return UINT64_MAX;
+}
+
+/** The first bit at or after ''from'' which is ''want'', or UINT64_MAX if
+  * there isn't one.  Bits past the end of the bitset are clear.
+  */
+static inline uint64_t bitset_find_bit(struct bitset *set, int want,
+				       uint64_t from)
+{
+    return bitset_find_level(set, want ? set->any : set->all, 0, want,
+			     from);
+}
+
+/** Having changed some bits, see whether the stream needs to hear about
+  * it.  If it returns 1, the caller adds its events, and then calls
+  * bitset_stream_finish.  No lock is taken.  If the stream was enabled
+  * after the bits changed, the events may come after others for later
+  * changes, but nothing can have read the stream past them yet, so
+  * whoever's reading it will still see the change.
+  */
+static inline int bitset_stream_start(struct bitset *set)
+{
+    /* Either we see the stream's enabled, or we changed the bits before it
+     * was.  Pairs with the barrier in bitset_enable_stream.
+     */
+    __sync_synchronize();
+    if (!bitset_stream_is_enabled(set)) {
+	return 0;
+    }
+
+    /* If it was enabled again since we looked, the maps may have been
+     * reset under us, so we count ourselves in, and look again.
+     */
+    __sync_add_and_fetch(&set->stream->producers, 1);
+    if (__atomic_load_n(&set->stream_enabled, __ATOMIC_ACQUIRE)) {
+	return 1;
+    }
+    __sync_sub_and_fetch(&set->stream->producers, 1);
+    return 0;
+}
+
+/** Done adding the events bitset_stream_start said were needed. */
+static inline void bitset_stream_finish(struct bitset *set)
+{
+    __sync_sub_and_fetch(&set->stream->producers, 1);
+}
+
 /** Set the bits in a bitset which correspond to the given bytes in the larger
   * file.
   */
@@ -346,14 +948,44 @@ static inline void bitset_set_range(struct bitset *set,
 				    uint64_t from, uint64_t len)
 {
     INT_FIRST_AND_LAST;
-    BITSET_LOCK;
-    bit_set_range(set->bits, first, bitlen);
 
-    if (set->stream_enabled) {
+    bitset_change_bits(set, first, bitlen, 1);
+    if (bitset_stream_start(set)) {
 	bitset_stream_enqueue(set, BITSET_STREAM_SET, from, len);
+	bitset_stream_finish(set);
     }
+}
 
-    BITSET_UNLOCK;
+
+/** A byte range of the file, for bitset_set_ranges. */
+struct bitset_range {
+    uint64_t from;
+    uint64_t len;
+};
+
+/** As bitset_set_range, for several ranges at once, looking to see whether
+  * the stream is enabled only once.
+  */
+static inline void bitset_set_ranges(struct bitset *set,
+				     const struct bitset_range *ranges,
+				     int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	uint64_t from = ranges[i].from, len = ranges[i].len;
+	INT_FIRST_AND_LAST;
+
+	bitset_change_bits(set, first, bitlen, 1);
+    }
+
+    if (bitset_stream_start(set)) {
+	for (i = 0; i < count; i++) {
+	    bitset_stream_enqueue(set, BITSET_STREAM_SET, ranges[i].from,
+				  ranges[i].len);
+	}
+	bitset_stream_finish(set);
+    }
 }
 
 
@@ -370,14 +1002,12 @@ static inline void bitset_clear_range(struct bitset *set,
 				      uint64_t from, uint64_t len)
 {
     INT_FIRST_AND_LAST;
-    BITSET_LOCK;
-    bit_clear_range(set->bits, first, bitlen);
 
-    if (set->stream_enabled) {
+    bitset_change_bits(set, first, bitlen, 0);
+    if (bitset_stream_start(set)) {
 	bitset_stream_enqueue(set, BITSET_STREAM_UNSET, from, len);
+	bitset_stream_finish(set);
     }
-
-    BITSET_UNLOCK;
 }
 
 
@@ -388,13 +1018,16 @@ static inline void bitset_clear(struct bitset *set)
 }
 
 /** As per bitset_run_count but also tells you whether the run it found was set
-  * or unset, atomically.
+  * or unset.  This doesn't take the lock, and goes by the summaries to find
+  * where the run ends, so it takes about as long for a long run as a short
+  * one.  Other threads may be changing the bits as we go.
   */
 static inline uint64_t bitset_run_count_ex(struct bitset *set,
 					   uint64_t from,
 					   uint64_t len, int *run_is_set)
 {
-    uint64_t run;
+    uint64_t run, end;
+    int is_set;
 
     /* Clip our requests to the end of the bitset,  avoiding uint underflow. */
     if (from > set->size) {
@@ -404,12 +1037,18 @@ static inline uint64_t bitset_run_count_ex(struct bitset *set,
 
     INT_FIRST_AND_LAST;
 
-    BITSET_LOCK;
-    run =
-	bit_run_count(set->bits, first, bitlen,
-		      run_is_set) * set->resolution;
+    is_set = bit_get(set->bits, first);
+    if (run_is_set != NULL) {
+	*run_is_set = is_set;
+    }
+
+    end = bitset_find_bit(set, !is_set, first + 1);
+    if (end > first + bitlen) {
+	end = first + bitlen;
+    }
+
+    run = (end - first) * set->resolution;
     run -= (from % set->resolution);
-    BITSET_UNLOCK;
 
     return run;
 }
@@ -423,6 +1062,62 @@ static inline uint64_t bitset_run_count(struct bitset *set,
     return bitset_run_count_ex(set, from, len, NULL);
 }
 
+/* Take the next run of blocks out of the overflow map, from where the last
+ * one ended, and describe it as an event.  The run stops where the bitset
+ * changes between set and clear, so it can be a SET or an UNSET of the
+ * blocks as they are now.  Only called by the consumer, which is the only
+ * thread that clears bits in the overflow map.  Returns 0 if there was
+ * nothing there after all.
+ */
+static inline int bitset_stream_sweep(struct bitset *set,
+				      struct bitset_stream_entry *out)
+{
+    struct bitset_stream *stream = set->stream;
+    uint64_t blocks = (set->size + set->resolution - 1) / set->resolution;
+    uint64_t block = stream->overflow_next, end = blocks, pass;
+    uint64_t from, len, run;
+    bitfield_word_t word;
+    int is_set = 0;
+
+    /* Look from the cursor to the end, then from the start to the cursor */
+    for (pass = 0; pass < 2; pass++) {
+	while (block < end) {
+	    word = bit_word_load(stream->overflow, block) &
+		bit_word_mask(block, BITS_PER_WORD - block % BITS_PER_WORD);
+	    if (word) {
+		block = (block & ~(uint64_t) (BITS_PER_WORD - 1)) +
+		    __builtin_ctzll(word);
+		break;
+	    }
+	    block = (block | (BITS_PER_WORD - 1)) + 1;
+	}
+	if (block < end) {
+	    break;
+	}
+	end = stream->overflow_next < blocks ? stream->overflow_next : blocks;
+	block = 0;
+    }
+    if (pass == 2) {
+	return 0;
+    }
+
+    run = bit_run_count(stream->overflow, block, blocks - block, NULL);
+    from = block * set->resolution;
+    len = bitset_run_count_ex(set, from, run * set->resolution, &is_set);
+    run = (len + set->resolution - 1) / set->resolution;
+
+    bit_clear_range_atomic(stream->queued, block, run);
+    __sync_sub_and_fetch(&stream->overflow_blocks,
+			 bit_clear_range_atomic(stream->overflow, block, run));
+    stream->overflow_next = block + run;
+
+    out->event = is_set ? BITSET_STREAM_SET : BITSET_STREAM_UNSET;
+    out->from = from;
+    out->len = len;
+
+    return 1;
+}
+
 /** Tests whether the bit field is clear for the given file offset.
   */
 static inline int bitset_is_clear_at(struct bitset *set, uint64_t at)
@@ -0,0 +1,474 @@
+#include "block_cache.h"
+#include "ioutil.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* If anyone has set aside huge pages, we'll use them for the cache.  They
+ * come in 2MB pieces, so we round the cache up to fit.
+ */
+#define BLOCK_CACHE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+
+static inline uint64_t block_cache_hash(uint64_t block)
+{
+    return block * 0x9E3779B97F4A7C15ULL;
+}
+
+static inline struct block_cache_shard *block_cache_shard(struct block_cache
+							  *cache,
+							  uint64_t block)
+{
+    return &cache->shards[(block_cache_hash(block) >> 32) %
+			  BLOCK_CACHE_SHARDS];
+}
+
+static inline int *block_cache_bucket(struct block_cache_shard *shard,
+				      uint64_t block)
+{
+    return &shard->buckets[block_cache_hash(block) &
+			   (shard->buckets_count - 1)];
+}
+
+/* How much of the block is inside the file. */
+static inline uint64_t block_cache_block_len(struct block_cache *cache,
+					     uint64_t block)
+{
+    uint64_t from = block * BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t left = cache->size - from;
+
+    return left < BLOCK_CACHE_BLOCK_SIZE ? left : BLOCK_CACHE_BLOCK_SIZE;
+}
+
+
+static int block_cache_disc_read(struct block_cache *cache, uint64_t block,
+				 char *data)
+{
+    uint64_t from = block * BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t len = block_cache_block_len(cache, block);
+
+    if (preadloop(cache->direct_fd, data, len, from) == -1) {
+	if (errno != EINVAL ||
+	    preadloop(cache->buffered_fd, data, len, from) == -1) {
+	    return -1;
+	}
+    }
+    memset(data + len, 0, BLOCK_CACHE_BLOCK_SIZE - len);
+
+    return 0;
+}
+
+static int block_cache_disc_write(struct block_cache *cache,
+				  uint64_t block, const char *data)
+{
+    uint64_t from = block * BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t len = block_cache_block_len(cache, block);
+
+    if (pwriteloop(cache->direct_fd, data, len, from) == -1) {
+	if (errno != EINVAL ||
+	    pwriteloop(cache->buffered_fd, data, len, from) == -1) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+static int block_cache_lookup(struct block_cache_shard *shard,
+			      uint64_t block)
+{
+    int i;
+
+    for (i = *block_cache_bucket(shard, block); i != -1;
+	 i = shard->slots[i].next) {
+	if (shard->slots[i].block == block) {
+	    return i;
+	}
+    }
+
+    return -1;
+}
+
+static void block_cache_unlink(struct block_cache_shard *shard, int index)
+{
+    struct block_cache_slot *slot = &shard->slots[index];
+    int *link = block_cache_bucket(shard, slot->block);
+
+    while (*link != index) {
+	link = &shard->slots[*link].next;
+    }
+    *link = slot->next;
+
+    slot->next = -1;
+    slot->valid = 0;
+}
+
+/* Go round the slots until we find one that's free, or hasn't been used
+ * since we last passed it, and take it.
+ */
+static int block_cache_evict(struct block_cache_shard *shard)
+{
+    struct block_cache_slot *slot;
+    int index;
+
+    while (1) {
+	index = shard->hand;
+	slot = &shard->slots[index];
+	shard->hand = (shard->hand + 1) % shard->slots_count;
+
+	if (!slot->valid) {
+	    return index;
+	}
+	if (slot->referenced) {
+	    slot->referenced = 0;
+	    continue;
+	}
+
+	block_cache_unlink(shard, index);
+	return index;
+    }
+}
+
+
+/* Find ''block'' in the shard, which must be locked, bringing it in from
+ * disc if it isn't there and ''fill'' is set.  Returns the slot, or -1 if
+ * the read failed.
+ */
+static int block_cache_find(struct block_cache *cache,
+			    struct block_cache_shard *shard, uint64_t block,
+			    int fill)
+{
+    struct block_cache_slot *slot;
+    int *bucket;
+    int index = block_cache_lookup(shard, block);
+
+    if (index != -1) {
+	__sync_add_and_fetch(&cache->hits, 1);
+	shard->slots[index].referenced = 1;
+	return index;
+    }
+
+    __sync_add_and_fetch(&cache->misses, 1);
+    index = block_cache_evict(shard);
+    slot = &shard->slots[index];
+
+    if (fill) {
+	if (block_cache_disc_read(cache, block, slot->data) == -1) {
+	    return -1;
+	}
+    } else {
+	memset(slot->data, 0, BLOCK_CACHE_BLOCK_SIZE);
+    }
+
+    bucket = block_cache_bucket(shard, block);
+    slot->block = block;
+    slot->valid = 1;
+    slot->referenced = 1;
+    slot->next = *bucket;
+    *bucket = index;
+
+    return index;
+}
+
+
+struct block_cache *block_cache_create(const char *filename, uint64_t size,
+				       uint64_t capacity)
+{
+    struct block_cache *cache = xmalloc(sizeof(struct block_cache));
+    struct block_cache_shard *shard;
+    uint64_t blocks;
+    int slots_per_shard;
+    int i, j;
+
+    cache->size = size;
+    cache->buffered_fd = -1;
+    cache->direct_fd = open(filename, O_RDWR | O_DIRECT | O_NOATIME);
+    if (cache->direct_fd == -1) {
+	warn(SHOW_ERRNO("Couldn't open %s for direct I/O", filename));
+	free(cache);
+	return NULL;
+    }
+    cache->buffered_fd = open(filename, O_RDWR | O_NOATIME);
+    if (cache->buffered_fd == -1) {
+	warn(SHOW_ERRNO("Couldn't open %s", filename));
+	close(cache->direct_fd);
+	free(cache);
+	return NULL;
+    }
+
+    /* There's no point in having room for more than the whole file */
+    blocks = capacity / BLOCK_CACHE_BLOCK_SIZE;
+    if (blocks > (size + BLOCK_CACHE_BLOCK_SIZE - 1) / BLOCK_CACHE_BLOCK_SIZE) {
+	blocks = (size + BLOCK_CACHE_BLOCK_SIZE - 1) / BLOCK_CACHE_BLOCK_SIZE;
+    }
+    slots_per_shard = (blocks + BLOCK_CACHE_SHARDS - 1) / BLOCK_CACHE_SHARDS;
+    if (slots_per_shard < 1) {
+	slots_per_shard = 1;
+    }
+
+    cache->memory_size = (uint64_t) slots_per_shard * BLOCK_CACHE_SHARDS *
+	BLOCK_CACHE_BLOCK_SIZE;
+    cache->memory_size = (cache->memory_size +
+			  BLOCK_CACHE_HUGE_PAGE_SIZE - 1) &
+	~((size_t) BLOCK_CACHE_HUGE_PAGE_SIZE - 1);
+
+    cache->memory = mmap(NULL, cache->memory_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (cache->memory == MAP_FAILED) {
+	cache->memory = mmap(NULL, cache->memory_size,
+			     PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	FATAL_IF(cache->memory == MAP_FAILED,
+		 SHOW_ERRNO("Couldn't allocate %zu bytes of cache",
+			    cache->memory_size));
+	/* Transparent huge pages will do if we can't have real ones */
+	madvise(cache->memory, cache->memory_size, MADV_HUGEPAGE);
+    }
+
+    for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+	shard = &cache->shards[i];
+
+	FATAL_UNLESS(0 == pthread_mutex_init(&shard->lock, NULL),
+		     "Failed to initialise a mutex");
+
+	shard->slots_count = slots_per_shard;
+	shard->slots =
+	    xmalloc(slots_per_shard * sizeof(struct block_cache_slot));
+	for (j = 0; j < slots_per_shard; j++) {
+	    shard->slots[j].next = -1;
+	    shard->slots[j].data = cache->memory +
+		((uint64_t) i * slots_per_shard + j) * BLOCK_CACHE_BLOCK_SIZE;
+	}
+
+	shard->buckets_count = 1;
+	while (shard->buckets_count < slots_per_shard) {
+	    shard->buckets_count <<= 1;
+	}
+	shard->buckets = xmalloc(shard->buckets_count * sizeof(int));
+	for (j = 0; j < shard->buckets_count; j++) {
+	    shard->buckets[j] = -1;
+	}
+    }
+
+    debug("block cache for %s: %d blocks in %d shards", filename,
+	  slots_per_shard * BLOCK_CACHE_SHARDS, BLOCK_CACHE_SHARDS);
+    return cache;
+}
+
+
+int block_cache_read(struct block_cache *cache, uint64_t from,
+		     uint64_t len, char *out)
+{
+    struct block_cache_shard *shard;
+    uint64_t block, offset, run;
+    int index;
+    int err = 0;
+
+    while (len > 0) {
+	block = from / BLOCK_CACHE_BLOCK_SIZE;
+	offset = from % BLOCK_CACHE_BLOCK_SIZE;
+	run = BLOCK_CACHE_BLOCK_SIZE - offset;
+	if (run > len) {
+	    run = len;
+	}
+
+	shard = block_cache_shard(cache, block);
+	pthread_mutex_lock(&shard->lock);
+	{
+	    index = block_cache_find(cache, shard, block, 1);
+	    if (index != -1) {
+		memcpy(out, shard->slots[index].data + offset, run);
+	    } else {
+		err = errno;
+	    }
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (index == -1) {
+	    errno = err;
+	    return -1;
+	}
+
+	from += run;
+	out += run;
+	len -= run;
+    }
+
+    return 0;
+}
+
+
+int block_cache_prefetch(struct block_cache *cache, uint64_t from,
+			 uint64_t len)
+{
+    struct block_cache_shard *shard;
+    uint64_t block = from / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t end;
+    int index;
+    int err = 0;
+
+    if (len == 0) {
+	return 0;
+    }
+    end = (from + len - 1) / BLOCK_CACHE_BLOCK_SIZE;
+
+    for (; block <= end; block++) {
+	shard = block_cache_shard(cache, block);
+	pthread_mutex_lock(&shard->lock);
+	{
+	    index = block_cache_find(cache, shard, block, 1);
+	    if (index == -1) {
+		err = errno;
+	    }
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (index == -1) {
+	    errno = err;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
+int block_cache_write(struct block_cache *cache, uint64_t from,
+		      uint64_t len, const char *data)
+{
+    struct block_cache_shard *shard;
+    uint64_t block, offset, run;
+    int index;
+    int err = 0;
+
+    while (len > 0) {
+	block = from / BLOCK_CACHE_BLOCK_SIZE;
+	offset = from % BLOCK_CACHE_BLOCK_SIZE;
+	run = BLOCK_CACHE_BLOCK_SIZE - offset;
+	if (run > len) {
+	    run = len;
+	}
+
+	shard = block_cache_shard(cache, block);
+	pthread_mutex_lock(&shard->lock);
+	{
+	    /* No need to read the block in if we're about to replace all
+	     * of it.
+	     */
+	    index = block_cache_find(cache, shard, block, offset > 0 ||
+				     run < block_cache_block_len(cache,
+								 block));
+	    if (index != -1) {
+		memcpy(shard->slots[index].data + offset, data, run);
+		if (block_cache_disc_write(cache, block,
+					   shard->slots[index].data) == -1) {
+		    /* We don't know what's on disc now */
+		    err = errno;
+		    block_cache_unlink(shard, index);
+		    index = -1;
+		}
+	    } else {
+		err = errno;
+	    }
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (index == -1) {
+	    errno = err;
+	    return -1;
+	}
+
+	from += run;
+	data += run;
+	len -= run;
+    }
+
+    return 0;
+}
+
+
+void block_cache_forget(struct block_cache *cache, uint64_t from,
+			uint64_t len)
+{
+    struct block_cache_shard *shard;
+    uint64_t first = from / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t last = (from + len + BLOCK_CACHE_BLOCK_SIZE - 1) /
+	BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t block;
+    int index, i;
+
+    if (last - first > (uint64_t) cache->shards[0].slots_count *
+	BLOCK_CACHE_SHARDS) {
+	/* Quicker to look at everything we have than everything we don't */
+	for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+	    shard = &cache->shards[i];
+	    pthread_mutex_lock(&shard->lock);
+	    {
+		for (index = 0; index < shard->slots_count; index++) {
+		    block = shard->slots[index].block;
+		    if (shard->slots[index].valid && block >= first &&
+			block < last) {
+			block_cache_unlink(shard, index);
+		    }
+		}
+	    }
+	    pthread_mutex_unlock(&shard->lock);
+	}
+	return;
+    }
+
+    for (block = first; block < last; block++) {
+	shard = block_cache_shard(cache, block);
+	pthread_mutex_lock(&shard->lock);
+	{
+	    index = block_cache_lookup(shard, block);
+	    if (index != -1) {
+		block_cache_unlink(shard, index);
+	    }
+	}
+	pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+
+int block_cache_sync(struct block_cache *cache)
+{
+    /* Both descriptors are for the same file, so this covers anything
+     * that went via buffered_fd too.
+     */
+    return fdatasync(cache->direct_fd);
+}
+
+
+void block_cache_stats(struct block_cache *cache, uint64_t * hits,
+		       uint64_t * misses)
+{
+    *hits = __sync_add_and_fetch(&cache->hits, 0);
+    *misses = __sync_add_and_fetch(&cache->misses, 0);
+}
+
+
+void block_cache_destroy(struct block_cache *cache)
+{
+    int i;
+
+    if (NULL == cache) {
+	return;
+    }
+
+    for (i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+	pthread_mutex_destroy(&cache->shards[i].lock);
+	free(cache->shards[i].slots);
+	free(cache->shards[i].buckets);
+    }
+
+    munmap(cache->memory, cache->memory_size);
+    close(cache->buffered_fd);
+    close(cache->direct_fd);
+    free(cache);
+}
@@ -0,0 +1,109 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+/** block_cache
+ * A fixed-size cache of the blocks of a file, which does its own I/O with
+ * O_DIRECT so that the file's data isn't also sitting in the page cache.
+ * Writes go straight through to the file; the cache only ever holds what's
+ * on disc.
+ *
+ * The cache is split into shards, each with its own lock, hash table and
+ * CLOCK hand, so that threads working on different parts of the file don't
+ * contend.  A shard's lock is held while it reads a missing block in, so a
+ * block is never read twice.
+ *
+ * All of these are safe to call from any thread.  None of them call
+ * error().
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The unit we cache and do I/O in.  This has to be a multiple of the
+ * underlying device's sector size for O_DIRECT, and matches
+ * block_allocation_resolution so writes don't allocate more than they
+ * need to.
+ */
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+#define BLOCK_CACHE_SHARDS 16
+
+struct block_cache_slot {
+    uint64_t block;
+    int valid;
+    /* Set on every access, cleared as the CLOCK hand passes */
+    int referenced;
+    /* Next slot in the same hash bucket, or -1 */
+    int next;
+    char *data;
+};
+
+struct block_cache_shard {
+    pthread_mutex_t lock;
+
+    int slots_count;
+    struct block_cache_slot *slots;
+
+    /* Heads of the hash chains; buckets_count is a power of two */
+    int buckets_count;
+    int *buckets;
+
+    int hand;
+};
+
+struct block_cache {
+    /* All reads and writes go through direct_fd, unless the kernel
+     * refuses one (usually at an oddly-sized end of the file), in which
+     * case we use buffered_fd for it instead.
+     */
+    int direct_fd;
+    int buffered_fd;
+    uint64_t size;
+
+    struct block_cache_shard shards[BLOCK_CACHE_SHARDS];
+
+    /* Backing store for every slot's data */
+    char *memory;
+    size_t memory_size;
+
+    /* Updated atomically */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* Open ''filename'', which is ''size'' bytes long, for direct I/O and
+ * set up a cache of up to ''capacity'' bytes for it.  Returns NULL (with
+ * a warning) if the file can't be opened with O_DIRECT.
+ */
+struct block_cache *block_cache_create(const char *filename, uint64_t size,
+				       uint64_t capacity);
+
+/* These return 0 on success, or -1 with errno set. */
+int block_cache_read(struct block_cache *cache, uint64_t from,
+		     uint64_t len, char *out);
+int block_cache_write(struct block_cache *cache, uint64_t from,
+		      uint64_t len, const char *data);
+
+/* Read any blocks touching [from, from+len) that we don't have into the
+ * cache, without copying them anywhere.  Returns 0 on success, or -1 with
+ * errno set.
+ */
+int block_cache_prefetch(struct block_cache *cache, uint64_t from,
+			 uint64_t len);
+
+/* Drop any blocks touching [from, from+len) from the cache.  Call this
+ * after changing the file behind the cache's back, e.g. by punching a hole
+ * in it.
+ */
+void block_cache_forget(struct block_cache *cache, uint64_t from,
+			uint64_t len);
+
+/* Make everything written so far durable. */
+int block_cache_sync(struct block_cache *cache);
+
+void block_cache_stats(struct block_cache *cache, uint64_t * hits,
+		       uint64_t * misses);
+
+void block_cache_destroy(struct block_cache *cache);
+
+#endif
@@ -6,8 +6,15 @@
 #include "bitset.h"
 #include "nbdtypes.h"
 #include "self_pipe.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "block_cache.h"
+#include "zeroes.h"
 
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <endian.h>
 #include <errno.h>
 #include <stdlib.h>
 
@@ -16,49 +23,40 @@
 #include <fcntl.h>
 
 
-// When this signal is invoked, we call shutdown() on the client fd, which
-// results in the thread being wound up
-void client_killswitch_hit(int signal
-			   __attribute__ ((unused)), siginfo_t * info,
-			   void *ptr __attribute__ ((unused)))
-{
-    int fd = info->si_value.sival_int;
-    warn("Killswitch for fd %i activated, calling shutdown on socket", fd);
-
-    FATAL_IF(-1 == shutdown(fd, SHUT_RDWR),
-	     SHOW_ERRNO
-	     ("Failed to shutdown() the socket, killing the server")
-	);
-}
+/* Clients are served by a single reactor thread, which does all of the
+ * socket I/O without blocking, and a pool of worker threads which do all of
+ * the disc I/O.  The reactor reads each request (and the data for a write),
+ * hands it to the workers, and sends the reply once they've finished with
+ * it.  A client only occupies a worker while it has a request being
+ * serviced; idle clients cost nothing but their socket.
+ */
 
 struct client *client_create(struct server *serve, int socket)
 {
     NULLCHECK(serve);
 
     struct client *c;
-    struct sigevent evp = {
-	.sigev_notify = SIGEV_SIGNAL,
-	.sigev_signo = CLIENT_KILLSWITCH_SIGNAL
-    };
-
-    /*
-     * Our killswitch closes this socket, forcing read() and write() calls
-     * blocked on it to return with an error. The thread then close()s the
-     * socket itself, avoiding races.
-     */
-    evp.sigev_value.sival_int = socket;
 
     c = xmalloc(sizeof(struct client));
     c->stopped = 0;
     c->socket = socket;
     c->serve = serve;
+    c->slot = -1;
 
     c->stop_signal = self_pipe_create();
 
-    FATAL_IF_NEGATIVE(timer_create
-		      (CLOCK_MONOTONIC, &evp, &(c->killswitch)),
-		      SHOW_ERRNO("Failed to create killswitch timer")
-	);
+    c->max_in_flight = serve->max_requests_in_flight;
+    if (c->max_in_flight < 1) {
+	c->max_in_flight = CLIENT_MAX_REQUESTS_IN_FLIGHT;
+    }
+    /* So the first read doesn't look like it follows on from anything */
+    c->stream.next = UINT64_MAX;
+    c->stream.window = CLIENT_READAHEAD_MIN;
+
+    FATAL_UNLESS(0 == pthread_mutex_init(&c->stop_lock, NULL),
+		 "Failed to initialise a mutex");
+    FATAL_UNLESS(0 == pthread_cond_init(&c->stopped_cond, NULL),
+		 "Failed to initialise a condition variable");
 
     debug("Alloced client %p with socket %d", c, socket);
     return c;
@@ -74,13 +72,44 @@ void client_signal_stop(struct client *c)
     self_pipe_signal(c->stop_signal);
 }
 
+
+int client_is_stopped(struct client *client)
+{
+    int stopped;
+
+    NULLCHECK(client);
+
+    pthread_mutex_lock(&client->stop_lock);
+    {
+	stopped = client->stopped;
+    }
+    pthread_mutex_unlock(&client->stop_lock);
+
+    return stopped;
+}
+
+
+/* Block until the reactor has finished with the client. */
+void client_wait_for_stop(struct client *client)
+{
+    NULLCHECK(client);
+
+    pthread_mutex_lock(&client->stop_lock);
+    {
+	while (!client->stopped) {
+	    pthread_cond_wait(&client->stopped_cond, &client->stop_lock);
+	}
+    }
+    pthread_mutex_unlock(&client->stop_lock);
+}
+
+
 void client_destroy(struct client *client)
 {
     NULLCHECK(client);
 
-    FATAL_IF_NEGATIVE(timer_delete(client->killswitch),
-		      SHOW_ERRNO("Couldn't delete killswitch")
-	);
+    pthread_cond_destroy(&client->stopped_cond);
+    pthread_mutex_destroy(&client->stop_lock);
 
     debug("Destroying stop signal for client %p", client);
     self_pipe_destroy(client->stop_signal);
@@ -90,27 +119,97 @@ void client_destroy(struct client *client)
 
 
 
+/* Put len bytes of data into the file at from, either with pwrite() or
+ * through the server's block cache.  Copying into the mapping would fault
+ * in any page that wasn't already in memory, reading it from disc only to
+ * overwrite it; pwrite() doesn't have to read the pages it fills
+ * completely.  Returns 0 on success, -1 on failure.
+ */
+int client_store(struct client *client, uint64_t from, uint64_t len,
+		 const char *data)
+{
+    if (client->serve->cache) {
+	return block_cache_write(client->serve->cache, from, len, data);
+    }
+
+    return pwriteloop(client->fileno, data, len, from);
+}
+
+
+/* How many ranges write_not_zeroes collects before it updates the
+ * allocation map.  Adjacent ranges are merged, so this is only reached by
+ * writes which alternate between zero and non-zero blocks.
+ */
+#define WRITE_NOT_ZEROES_BATCH 64
+
+struct write_not_zeroes_batch {
+    struct bitset_range ranges[WRITE_NOT_ZEROES_BATCH];
+    int count;
+};
+
+static void write_not_zeroes_commit(struct bitset *map,
+				    struct write_not_zeroes_batch *batch)
+{
+    if (batch->count > 0) {
+	bitset_set_ranges(map, batch->ranges, batch->count);
+	batch->count = 0;
+    }
+}
+
+/* Note that [from, from+len) has been written to. */
+static void write_not_zeroes_mark(struct bitset *map,
+				  struct write_not_zeroes_batch *batch,
+				  uint64_t from, uint64_t len)
+{
+    struct bitset_range *last;
+
+    if (batch->count > 0) {
+	last = &batch->ranges[batch->count - 1];
+	if (last->from + last->len == from) {
+	    last->len += len;
+	    return;
+	}
+    }
+
+    if (batch->count == WRITE_NOT_ZEROES_BATCH) {
+	write_not_zeroes_commit(map, batch);
+    }
+    batch->ranges[batch->count].from = from;
+    batch->ranges[batch->count].len = len;
+    batch->count++;
+}
+
+
 /**
- * So waiting on client->socket is len bytes of data, and we must write it all
- * to client->mapped.  However while doing do we must consult the bitmap
+ * So waiting in data is len bytes, and we must write it all to the file.
+ * However while doing do we must consult the bitmap
  * client->serve->allocation_map, which is a bitmap where one bit represents
  * block_allocation_resolution bytes.  Where a bit isn't set, there are no
  * disc blocks allocated for that portion of the file, and we'd like to keep
  * it that way.
  *
  * If the bitmap shows that every block in our prospective write is already
- * allocated, we can proceed as normal and make one call to writeloop.
+ * allocated, we can proceed as normal and make one call to memcpy.
  *
+ * Otherwise we check each unallocated block for zeroes, and store the
+ * non-zero blocks in as few pieces as we can.  The allocation map is only
+ * updated once everything has been stored, so its lock is taken once per
+ * write rather than once per block.
  */
-void write_not_zeroes(struct client *client, uint64_t from, uint64_t len)
+int write_not_zeroes(struct client *client, uint64_t from, uint64_t len,
+		     char *data)
 {
     NULLCHECK(client);
     NULLCHECK(client->serve);
     NULLCHECK(client->serve->allocation_map);
 
     struct bitset *map = client->serve->allocation_map;
+    struct write_not_zeroes_batch batch;
+    int result = 0;
 
-    while (len > 0) {
+    batch.count = 0;
+
+    while (len > 0 && result == 0) {
 	/* so we have to calculate how much of our input to consider
 	 * next based on the bitmap of allocated blocks.  This will be
 	 * at a coarser resolution than the actual write, which may
@@ -129,74 +228,51 @@ void write_not_zeroes(struct client *client, uint64_t from, uint64_t len)
 	    debug("(run adjusted to %d)", run);
 	}
 
-	/* 
-	   // Useful but expensive
-	   if (0) 
-	   {
-	   uint64_t i;
-	   fprintf(stderr, "full map resolution=%d: ", map->resolution);
-	   for (i=0; i<client->serve->size; i+=map->resolution) {
-	   int here = (from >= i && from < i+map->resolution);
-
-	   if (here) { fprintf(stderr, ">"); }
-	   fprintf(stderr, bitset_is_set_at(map, i) ? "1" : "0");
-	   if (here) { fprintf(stderr, "<"); }
-	   }
-	   fprintf(stderr, "\n");
-	   }
-	 */
-
-#define DO_READ(dst, len) ERROR_IF_NEGATIVE( \
-			readloop( \
-				client->socket, \
-				(dst), \
-				(len) \
-			), \
-			"read failed %ld+%d", from, (len) \
-		)
-
 	if (bitset_is_set_at(map, from)) {
 	    debug("writing the lot: from=%ld, run=%d", from, run);
 	    /* already allocated, just write it all */
-	    DO_READ(client->mapped + from, run);
+	    if (client_store(client, from, run, data) == -1) {
+		result = -1;
+		break;
+	    }
 	    /* We know from our earlier call to  bitset_run_count that the
 	     * bitset is all-1s at this point, but we need to dirty it for the
 	     * sake of the event stream - the actual bytes have changed, and we
 	     * are interested in that fact.
 	     */
-	    bitset_set_range(map, from, run);
+	    write_not_zeroes_mark(map, &batch, from, run);
 	    len -= run;
 	    from += run;
+	    data += run;
 	} else {
-	    char zerobuffer[block_allocation_resolution];
-	    /* not allocated, read in block_allocation_resoution */
+	    /* not allocated, so look at it in block_allocation_resolution
+	     * pieces, and only store the ones that aren't all zeroes.
+	     * Neighbouring non-zero blocks are stored together.
+	     */
+	    uint64_t store_from = from;
+	    char *store_data = data;
+	    uint64_t store_len = 0;
+
 	    while (run > 0) {
 		uint64_t blockrun = block_allocation_resolution -
 		    (from % block_allocation_resolution);
 		if (blockrun > run)
 		    blockrun = run;
 
-		DO_READ(zerobuffer, blockrun);
-
-		/* This reads the buffer twice in the worst case
-		 * but we're leaning on memcmp failing early
-		 * and memcpy being fast, rather than try to
-		 * hand-optimized something specific.
-		 */
-
-		int all_zeros = (zerobuffer[0] == 0) &&
-		    (0 ==
-		     memcmp(zerobuffer, zerobuffer + 1, blockrun - 1));
-
-		if (!all_zeros) {
-		    memcpy(client->mapped + from, zerobuffer, blockrun);
-		    bitset_set_range(map, from, blockrun);
-		    /* at this point we could choose to
-		     * short-cut the rest of the write for
-		     * faster I/O but by continuing to do it
-		     * the slow way we preserve as much
-		     * sparseness as possible.
-		     */
+		if (!is_all_zeroes(data, blockrun)) {
+		    if (store_len == 0) {
+			store_from = from;
+			store_data = data;
+		    }
+		    store_len += blockrun;
+		} else if (store_len > 0) {
+		    if (client_store(client, store_from, store_len,
+				     store_data) == -1) {
+			result = -1;
+			break;
+		    }
+		    write_not_zeroes_mark(map, &batch, store_from, store_len);
+		    store_len = 0;
 		}
 		/* When the block is all_zeroes, no bytes have changed, so we
 		 * don't need to put an event into the bitset stream. This may
@@ -206,56 +282,37 @@ void write_not_zeroes(struct client *client, uint64_t from, uint64_t len)
 		len -= blockrun;
 		run -= blockrun;
 		from += blockrun;
+		data += blockrun;
+	    }
+
+	    if (result == 0 && store_len > 0) {
+		if (client_store(client, store_from, store_len,
+				 store_data) == -1) {
+		    result = -1;
+		} else {
+		    write_not_zeroes_mark(map, &batch, store_from,
+					  store_len);
+		}
 	    }
 	}
     }
+
+    /* Whatever we managed to store has changed, even if we failed later */
+    write_not_zeroes_commit(map, &batch);
+
+    return result;
 }
 
 
+/* Blocking versions of the request and reply handling, for anything
+ * that wants to talk NBD over a plain file descriptor.
+ */
 int fd_read_request(int fd, struct nbd_request_raw *out_request)
 {
     return readloop(fd, out_request, sizeof(struct nbd_request_raw));
 }
 
 
-/* Returns 1 if *request was filled with a valid request which we should
- * try to honour. 0 otherwise. */
-int client_read_request(struct client *client,
-			struct nbd_request *out_request, int *disconnected)
-{
-    NULLCHECK(client);
-    NULLCHECK(out_request);
-
-    struct nbd_request_raw request_raw;
-
-    if (fd_read_request(client->socket, &request_raw) == -1) {
-	*disconnected = 1;
-	switch (errno) {
-	case 0:
-	    warn("EOF while reading request");
-	    return 0;
-	case ECONNRESET:
-	    warn("Connection reset while" " reading request");
-	    return 0;
-	case ETIMEDOUT:
-	    warn("Connection timed out while" " reading request");
-	    return 0;
-	default:
-	    /* FIXME: I've seen this happen, but I
-	     * couldn't reproduce it so I'm leaving
-	     * it here with a better debug output in
-	     * the hope it'll spontaneously happen
-	     * again.  It should *probably* be an
-	     * error() call, but I want to be sure.
-	     * */
-	    fatal("Error reading request: %d, %s", errno, strerror(errno));
-	}
-    }
-
-    nbd_r2h_request(&request_raw, out_request);
-    return 1;
-}
-
 int fd_write_reply(int fd, uint64_t handle, int error)
 {
     struct nbd_reply reply;
@@ -288,19 +345,12 @@ int fd_write_reply(int fd, uint64_t handle, int error)
 }
 
 
-/* Writes a reply to request *request, with error, to the client's
- * socket.
- * Returns 1; we don't check for errors on the write.
- * TODO: Check for errors on the write.
- */
-int client_write_reply(struct client *client, struct nbd_request *request,
-		       int error)
-{
-    return fd_write_reply(client->socket, request->handle.w, error);
-}
-
 
-void client_write_init(struct client *client, uint64_t size)
+/* Sends the hello.  This happens before the socket is made non-blocking,
+ * but it's small enough to go straight into an empty send buffer.
+ * Returns 0 on success, -1 on failure.
+ */
+int client_write_init(struct client *client, uint64_t size)
 {
     struct nbd_init init = { {0} };
     struct nbd_init_raw init_raw = { {0} };
@@ -308,419 +358,2157 @@ void client_write_init(struct client *client, uint64_t size)
     memcpy(init.passwd, INIT_PASSWD, sizeof(init.passwd));
     init.magic = INIT_MAGIC;
     init.size = size;
-    /* As more features are implemented, this is the place to advertise
-     * them.
-     */
-    init.flags = FLAG_HAS_FLAGS | FLAG_SEND_FLUSH | FLAG_SEND_FUA;
+    init.flags = CLIENT_TRANSMISSION_FLAGS;
     memset(init.reserved, 0, 124);
 
     nbd_h2r_init(&init, &init_raw);
 
-    ERROR_IF_NEGATIVE(writeloop
-		      (client->socket, &init_raw, sizeof(init_raw)),
-		      "Couldn't send hello");
+    return writeloop(client->socket, &init_raw, sizeof(init_raw));
 }
 
 
-/* Remove len bytes from the client socket. This is needed when the
- * client sends a write we can't honour - we need to get rid of the
- * bytes they've already written before we can look for another request.
+/*
+ * Worker side.  These run on the worker threads, and mustn't touch any of
+ * the client's reactor state; they just do the disc I/O for a job, and
+ * record the outcome in it.
  */
-void client_flush(struct client *client, size_t len)
-{
-    int devnull = open("/dev/null", O_WRONLY);
-    FATAL_IF_NEGATIVE(devnull,
-		      "Couldn't open /dev/null: %s", strerror(errno));
-    int pipes[2];
-    pipe(pipes);
-
-    const unsigned int flags = SPLICE_F_MORE | SPLICE_F_MOVE;
-    size_t spliced = 0;
 
-    while (spliced < len) {
-	ssize_t received = splice(client->socket, NULL,
-				  pipes[1], NULL,
-				  len - spliced, flags);
-	FATAL_IF_NEGATIVE(received, "splice error: %s", strerror(errno));
-	ssize_t junked = 0;
-	while (junked < received) {
-	    ssize_t junk;
-	    junk = splice(pipes[0], NULL, devnull, NULL, received, flags);
-	    FATAL_IF_NEGATIVE(junk, "splice error: %s", strerror(errno));
-	    junked += junk;
+void client_job_read(struct client *client, struct client_job *job)
+{
+    struct nbd_request *request = &job->request;
+    struct client_run *run;
+    uint64_t offset = 0;
+    char *buffer;
+    int result = 0;
+    int i;
+
+    debug("request read %" PRIu64 "+%" PRIu64, request->from, request->len);
+
+    /* No need to zero it, we're about to fill it, or as much of it as
+     * we'll send.  We might be finishing off a read io_uring couldn't
+     * manage, in which case we have one.
+     */
+    buffer = realloc(job->buffer, request->len > 0 ? request->len : 1);
+    if (NULL == buffer) {
+	warn("couldn't allocate %" PRIu64 " bytes to read into",
+	     request->len);
+	free(job->buffer);
+	job->buffer = NULL;
+	job->error = ENOMEM;
+	return;
+    }
+    job->buffer = buffer;
+
+    for (i = 0; i < job->runs_count && result != -1; i++) {
+	run = &job->runs[i];
+	if (!run->allocated) {
+	    /* Nothing but zeroes, so there's no need to go to the file */
+	} else if (client->serve->cache) {
+	    result = block_cache_read(client->serve->cache,
+				      request->from + offset, run->len,
+				      job->buffer + offset);
+	} else {
+	    result = preadloop(client->fileno, job->buffer + offset,
+			       run->len, request->from + offset);
 	}
-	spliced += received;
+	offset += run->len;
     }
-    debug("Flushed %d bytes", len);
 
+    if (result == -1) {
+	warn(SHOW_ERRNO("read failed from=%" PRIu64 ", len=%" PRIu64,
+			request->from, request->len));
+	free(job->buffer);
+	job->buffer = NULL;
+	job->error = EIO;
+    }
 
-    close(devnull);
+    /* Readahead is only advice, so the client needn't hear if it fails */
+    if (job->readahead_len > 0) {
+	int err = posix_fadvise(client->fileno, job->readahead_from,
+				job->readahead_len, POSIX_FADV_WILLNEED);
+	if (err != 0) {
+	    debug("readahead failed from=%" PRIu64 ", len=%" PRIu64 ": %s",
+		  job->readahead_from, job->readahead_len, strerror(err));
+	}
+	job->readahead_len = 0;
+    }
 }
 
 
-/* Check to see if the client's request needs a reply constructing.
- * Returns 1 if we do, 0 otherwise.
- * request_err is set to 0 if the client sent a bad request, in which
- * case we drop the connection.
+/* Remember that [from, to) has been written to since the last flush.
+ * Ranges which touch are merged, so a client writing sequentially only
+ * ever uses one slot.  The list belongs to the export, so a flush from
+ * any of its clients will sync it.
  */
-int client_request_needs_reply(struct client *client,
-			       struct nbd_request request)
+void client_dirty_add(struct client *client, uint64_t from, uint64_t to)
 {
-    /* The client is stupid, but don't take down the whole server as a result.
-     * We send a reply before disconnecting so that at least some indication of
-     * the problem is visible, and so proxies don't retry the same (bad) request
-     * forever.
-     */
-    if (request.magic != REQUEST_MAGIC) {
-	warn("Bad magic 0x%08X from client", request.magic);
-	client_write_reply(client, &request, EBADMSG);
-	client->disconnect = 1;	// no need to flush
-	return 0;
-    }
+    struct server_dirty *dirty = &client->serve->dirty;
+    struct server_dirty_range *range;
+    int i;
 
-    debug("request type=%" PRIu16 ", flags=%" PRIu16 ", from=%" PRIu64
-	  ", len=%" PRIu32 ", handle=0x%08X", request.type, request.flags,
-	  request.from, request.len, request.handle);
+    pthread_mutex_lock(&dirty->lock);
+    {
+	if (!dirty->overflowed) {
+	    /* Merging can make the new range touch one we've already
+	     * checked, so go round again whenever we swallow one.
+	     */
+	    for (i = 0; i < dirty->ranges_count; i++) {
+		range = &dirty->ranges[i];
+		if (range->from > to || range->to < from) {
+		    continue;
+		}
+		from = range->from < from ? range->from : from;
+		to = range->to > to ? range->to : to;
+		*range = dirty->ranges[--dirty->ranges_count];
+		i = -1;
+	    }
 
-    /* check it's not out of range. NBD protocol requires ENOSPC to be
-     * returned in this instance 
-     */
-    if (request.from + request.len > client->serve->size) {
-	warn("write request %" PRIu64 "+%" PRIu32 " out of range",
-	     request.from, request.len);
-	if (request.type == REQUEST_WRITE) {
-	    client_flush(client, request.len);
+	    if (dirty->ranges_count < SERVER_MAX_DIRTY_RANGES) {
+		range = &dirty->ranges[dirty->ranges_count++];
+		range->from = from;
+		range->to = to;
+	    } else {
+		debug("Too many dirty ranges, will sync the whole file");
+		dirty->overflowed = 1;
+		dirty->ranges_count = 0;
+	    }
 	}
-	client_write_reply(client, &request, ENOSPC);
-	client->disconnect = 0;
-	return 0;
     }
+    pthread_mutex_unlock(&dirty->lock);
+}
 
 
-    switch (request.type) {
-    case REQUEST_READ:
-	break;
-    case REQUEST_WRITE:
-	break;
-    case REQUEST_DISCONNECT:
-	debug("request disconnect");
-	client->disconnect = 1;
-	return 0;
-    case REQUEST_FLUSH:
-	break;
-    default:
-	/* NBD prototcol says servers SHOULD return EINVAL to unknown
-	 * commands */
-	warn("Unknown request 0x%08X", request.type);
-	client_write_reply(client, &request, EINVAL);
-	client->disconnect = 0;
-	return 0;
+/* Called when a sync which took the dirty list has finished.  If it failed,
+ * we no longer know what made it to disc, so sync the whole file next time.
+ */
+void client_dirty_synced(struct client *client, int result)
+{
+    struct server_dirty *dirty = &client->serve->dirty;
+
+    pthread_mutex_lock(&dirty->lock);
+    {
+	dirty->syncing--;
+	if (result == -1) {
+	    dirty->overflowed = 1;
+	    dirty->ranges_count = 0;
+	}
     }
-    return 1;
+    pthread_mutex_unlock(&dirty->lock);
 }
 
 
-void client_reply_to_read(struct client *client,
-			  struct nbd_request request)
+/* Sync everything written since the last call, by this client or any other
+ * of the export's.  We take the list before syncing it, so anything written
+ * meanwhile waits for the next flush.  If another flush has taken some
+ * ranges and not yet finished syncing them, we can't reply before it does,
+ * so sync the whole file instead, as we do if the file isn't mapped.  The
+ * page cache is shared, so syncing through the mapping covers what every
+ * client wrote.  Returns 0 on success, -1 on failure, in which case we
+ * fall back to syncing the whole file next time.
+ */
+int client_dirty_sync(struct client *client)
 {
-    off64_t offset;
+    struct server_dirty *dirty = &client->serve->dirty;
+    struct server_dirty_range ranges[SERVER_MAX_DIRTY_RANGES];
+    int ranges_count;
+    int overflowed;
+    int result = 0;
+    int i;
+
+    pthread_mutex_lock(&dirty->lock);
+    {
+	overflowed = dirty->overflowed || dirty->syncing > 0;
+	ranges_count = dirty->ranges_count;
+	memcpy(ranges, dirty->ranges, ranges_count * sizeof(ranges[0]));
+	dirty->overflowed = 0;
+	dirty->ranges_count = 0;
+	dirty->syncing++;
+    }
+    pthread_mutex_unlock(&dirty->lock);
 
-    debug("request read %ld+%d", request.from, request.len);
-    sock_set_tcp_cork(client->socket, 1);
-    client_write_reply(client, &request, 0);
+    if (overflowed || NULL == client->mapped) {
+	debug("Calling fdatasync");
+	if (fdatasync(client->fileno) == -1) {
+	    warn(SHOW_ERRNO("fdatasync failed"));
+	    result = -1;
+	}
+    } else {
+	for (i = 0; i < ranges_count; i++) {
+	    debug("Calling msync from=%" PRIu64 ", len=%" PRIu64,
+		  ranges[i].from, ranges[i].to - ranges[i].from);
+	    if (msync(client->mapped + ranges[i].from,
+		      ranges[i].to - ranges[i].from,
+		      MS_SYNC | MS_INVALIDATE) == -1) {
+		warn(SHOW_ERRNO("msync failed"));
+		result = -1;
+		break;
+	    }
+	}
+    }
 
-    offset = request.from;
+    client_dirty_synced(client, result);
+
+    return result;
+}
 
-    /* If we get cut off partway through this sendfile, we don't
-     * want to kill the server.  This should be an error.
-     */
-    ERROR_IF_NEGATIVE(sendfileloop(client->socket,
-				   client->fileno,
-				   &offset,
-				   request.len),
-		      "sendfile failed from=%ld, len=%d",
-		      offset, request.len);
 
-    sock_set_tcp_cork(client->socket, 0);
+/* Make everything the client has written durable. */
+int client_sync(struct client *client)
+{
+    if (client->serve->cache) {
+	return block_cache_sync(client->serve->cache);
+    }
+
+    return client_dirty_sync(client);
 }
 
 
-void client_reply_to_write(struct client *client,
-			   struct nbd_request request)
+void client_job_write(struct client *client, struct client_job *job)
 {
-    debug("request write from=%" PRIu64 ", len=%" PRIu32 ", handle=0x%08X",
-	  request.from, request.len, request.handle);
+    struct nbd_request *request = &job->request;
+    int result;
+
+    debug("request write from=%" PRIu64 ", len=%" PRIu64 ", handle=0x%08X",
+	  request->from, request->len, request->handle);
+
     if (client->serve->allocation_map_built) {
-	write_not_zeroes(client, request.from, request.len);
+	result = write_not_zeroes(client, request->from, request->len,
+				  job->buffer);
     } else {
 	debug("No allocation map, writing directly.");
-	/* If we get cut off partway through reading this data:
-	 * */
-	ERROR_IF_NEGATIVE(readloop(client->socket,
-				   client->mapped + request.from,
-				   request.len),
-			  "reading write data failed from=%ld, len=%d",
-			  request.from, request.len);
+	result = client_store(client, request->from, request->len,
+			      job->buffer);
 
 	/* the allocation_map is shared between client threads, and may be
 	 * being built. We need to reflect the write in it, as it may be in
 	 * a position the builder has already gone over.
 	 */
-	bitset_set_range(client->serve->allocation_map, request.from,
-			 request.len);
-    }
-
-    // Only flush if FUA is set -- overridden for now to force flush after each
-    // write.
-    // if (request.flags & CMD_FLAG_FUA) {
-    if (1) {
-	/* multiple of page size */
-	uint64_t from_rounded =
-	    request.from & (~(sysconf(_SC_PAGE_SIZE) - 1));
-	uint64_t len_rounded = request.len + (request.from - from_rounded);
+	bitset_set_range(client->serve->allocation_map, request->from,
+			 request->len);
+    }
+
+    free(job->buffer);
+    job->buffer = NULL;
+
+    if (result == -1) {
+	warn(SHOW_ERRNO("write failed from=%" PRIu64 ", len=%" PRIu64,
+			request->from, request->len));
+	job->error = EIO;
+	return;
+    }
+
+    if (client->serve->cache) {
+	/* The data's already gone to the device, but may be sitting in its
+	 * write cache.
+	 */
+	if (((request->flags & CMD_FLAG_FUA) || client->serve->always_sync)
+	    && block_cache_sync(client->serve->cache) == -1) {
+	    warn(SHOW_ERRNO("sync failed"));
+	    job->error = EIO;
+	}
+	return;
+    }
+
+    /* multiple of page size */
+    uint64_t from_rounded = request->from & (~(sysconf(_SC_PAGE_SIZE) - 1));
+    uint64_t len_rounded = request->len + (request->from - from_rounded);
+
+    /* Otherwise the write sits in the page cache until the client asks
+     * for a flush, or the kernel gets round to it.
+     */
+    if ((request->flags & CMD_FLAG_FUA) || client->serve->always_sync) {
 	debug("Calling msync from=%" PRIu64 ", len=%" PRIu64 "",
 	      from_rounded, len_rounded);
 
 	FATAL_IF_NEGATIVE(msync(client->mapped + from_rounded,
 				len_rounded,
 				MS_SYNC | MS_INVALIDATE),
-			  "msync failed %ld %ld", request.from,
-			  request.len);
+			  "msync failed %ld %ld", request->from,
+			  request->len);
+    } else {
+	client_dirty_add(client, from_rounded, from_rounded + len_rounded);
     }
-    client_write_reply(client, &request, 0);
 }
 
-void client_reply_to_flush(struct client *client,
-			   struct nbd_request request)
-{
-    debug("request flush from=%" PRIu64 ", len=%" PRIu32 ", handle=0x%08X",
-	  request.from, request.len, request.handle);
-
-    ERROR_IF_NEGATIVE(msync
-		      (client->mapped, client->mapped_size,
-		       MS_SYNC | MS_INVALIDATE), "flush failed");
-
-    client_write_reply(client, &request, 0);
-}
 
-void client_reply(struct client *client, struct nbd_request request)
+void client_job_flush(struct client *client, struct client_job *job)
 {
-    switch (request.type) {
-    case REQUEST_READ:
-	client_reply_to_read(client, request);
-	break;
-    case REQUEST_WRITE:
-	client_reply_to_write(client, request);
-	break;
-    case REQUEST_FLUSH:
-	client_reply_to_flush(client, request);
-	break;
+    debug("request flush from=%" PRIu64 ", len=%" PRIu64 ", handle=0x%08X",
+	  job->request.from, job->request.len, job->request.handle);
+
+    if (client_sync(client) == -1) {
+	warn("flush failed");
+	job->error = EIO;
     }
 }
 
 
-/* Starts a timer that will kill the whole process if disarm is not called
- * within a timeout (see CLIENT_HANDLE_TIMEOUT).
+/* Zero [from, from+len), which must be whole blocks, by punching a hole
+ * there if ''punch'' is set, or with FALLOC_FL_ZERO_RANGE, which keeps the
+ * blocks allocated, if not.  If the filesystem can't do either, we write
+ * the zeroes ourselves, so the range always reads back as zeroes
+ * afterwards; the mirror depends on that to pass a TRIM on as a TRIM.
+ * Returns 0 if the filesystem did it, 1 if we wrote zeroes, and -1 on
+ * failure.
  */
-void client_arm_killswitch(struct client *client)
+int client_zero_blocks(struct client *client, uint64_t from, uint64_t len,
+		       int punch)
 {
-    struct itimerspec its = {
-	.it_value = {.tv_nsec = 0,.tv_sec = CLIENT_HANDLER_TIMEOUT},
-	.it_interval = {.tv_nsec = 0,.tv_sec = 0}
-    };
-
-    if (!client->serve->use_killswitch) {
-	return;
+    uint64_t chunk;
+    int mode = (punch ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE) |
+	FALLOC_FL_KEEP_SIZE;
+    uint64_t done;
+
+    if (fallocate(client->fileno, mode, from, len) == 0) {
+	if (client->serve->cache) {
+	    block_cache_forget(client->serve->cache, from, len);
+	} else {
+	    /* The hole or zeroes aren't on disc until the next flush syncs
+	     * the range.
+	     */
+	    client_dirty_add(client, from, from + len);
+	}
+	return 0;
     }
 
-    debug("Arming killswitch");
+    if (errno != EOPNOTSUPP) {
+	return -1;
+    }
 
-    FATAL_IF_NEGATIVE(timer_settime(client->killswitch, 0, &its, NULL),
-		      SHOW_ERRNO("Failed to arm killswitch")
-	);
+    debug("Can't %s, writing zeroes instead",
+	  punch ? "punch holes" : "zero ranges");
+    for (done = 0; done < len; done += chunk) {
+	chunk = len - done < ZEROES_BUFFER_SIZE ?
+	    len - done : ZEROES_BUFFER_SIZE;
+	if (client_store(client, from + done, chunk, zeroes_buffer()) == -1) {
+	    return -1;
+	}
+    }
+    if (!client->serve->cache) {
+	client_dirty_add(client, from, from + len);
+    }
 
-    return;
+    return 1;
 }
 
-void client_disarm_killswitch(struct client *client)
+
+/* Zero the whole blocks in [from, to), and bring the allocation map up to
+ * date.  Returns 0 on success, -1 on failure.
+ */
+int client_zero_range(struct client *client, uint64_t from, uint64_t to,
+		      int punch)
 {
-    struct itimerspec its = {
-	.it_value = {.tv_nsec = 0,.tv_sec = 0},
-	.it_interval = {.tv_nsec = 0,.tv_sec = 0}
-    };
+    int result;
 
-    if (!client->serve->use_killswitch) {
-	return;
+    if (from >= to) {
+	return 0;
     }
 
-    debug("Disarming killswitch");
+    result = client_zero_blocks(client, from, to - from, punch);
+    if (result == -1) {
+	return -1;
+    }
 
-    FATAL_IF_NEGATIVE(timer_settime(client->killswitch, 0, &its, NULL),
-		      SHOW_ERRNO("Failed to disarm killswitch")
-	);
+    if (punch && result == 0) {
+	bitset_clear_range(client->serve->allocation_map, from, to - from);
+    } else {
+	/* Still allocated, but the bytes have changed */
+	bitset_set_range(client->serve->allocation_map, from, to - from);
+    }
 
-    return;
+    return 0;
 }
 
-/* Returns 0 if we should continue trying to serve requests */
-int client_serve_request(struct client *client)
-{
-    struct nbd_request request = { 0 };
-    int stop = 1;
-    int disconnected = 0;
-    fd_set rfds, efds;
-    int fd_count;
-
-    /* wait until there are some bytes on the fd before committing to reads
-     * FIXME: this whole scheme is broken because we're using blocking reads.
-     * read() can block directly after a select anyway, and it's possible that,
-     * without the killswitch, we'd hang forever. With the killswitch, we just
-     * hang for "a while". The Right Thing to do is to rewrite client.c to be
-     * non-blocking.
-     */
-
-    FD_ZERO(&rfds);
-    FD_SET(client->socket, &rfds);
-    self_pipe_fd_set(client->stop_signal, &rfds);
-
-    FD_ZERO(&efds);
-    FD_SET(client->socket, &efds);
 
-    fd_count = sock_try_select(FD_SETSIZE, &rfds, NULL, &efds, NULL);
+/* Write zeroes over a piece of a block, for the ragged ends of a
+ * WRITE_ZEROES.  There's nothing to do if the block isn't allocated.
+ */
+int client_zero_bytes(struct client *client, uint64_t from, uint64_t len)
+{
+    char *zeroes = (char *) zeroes_buffer();
+    uint64_t from_rounded;
+    uint64_t done, chunk;
 
-    if (fd_count == 0) {
-	/* This "can't ever happen" */
-	fatal("No FDs selected, and no timeout!");
-    } else if (fd_count < 0) {
-	fatal("Select failed");
+    if (len == 0) {
+	return 0;
     }
 
-    if (self_pipe_fd_isset(client->stop_signal, &rfds)) {
-	debug("Client received stop signal.");
-	return 1;		// Don't try to serve more requests
+    for (done = 0; done < len; done += chunk) {
+	chunk = len - done < ZEROES_BUFFER_SIZE ?
+	    len - done : ZEROES_BUFFER_SIZE;
+	if (client->serve->allocation_map_built) {
+	    if (write_not_zeroes(client, from + done, chunk, zeroes) == -1) {
+		return -1;
+	    }
+	} else {
+	    if (client_store(client, from + done, chunk, zeroes) == -1) {
+		return -1;
+	    }
+	    bitset_set_range(client->serve->allocation_map, from + done,
+			     chunk);
+	}
     }
 
-    if (FD_ISSET(client->socket, &efds)) {
-	debug("Client connection closed");
-	return 1;
+    if (!client->serve->cache) {
+	from_rounded = from & (~(sysconf(_SC_PAGE_SIZE) - 1));
+	client_dirty_add(client, from_rounded, from + len);
     }
 
+    return 0;
+}
 
-    /* We arm / disarm around the whole request cycle. The reason for this is
-     * that the remote peer could uncleanly die at any point; if we're stuck on
-     * a blocking read(), then that will hang for (almost) forever. This is bad
-     * in general, makes the server respond only to kill -9, and breaks
-     * outward mirroring in a most unpleasant way.
-     *
-     * Don't forget to disarm before exiting, no matter what!
-     *
-     * The replication is simple: open a connection to the flexnbd server, write
-     * a single byte, and then wait.
-     *
-     */
-    client_arm_killswitch(client);
 
-    if (!client_read_request(client, &request, &disconnected)) {
-	client_disarm_killswitch(client);
-	return stop;
+/* The whole blocks in the request, which can include a short one at the
+ * end of the file.
+ */
+void client_request_blocks(struct client *client,
+			   struct nbd_request *request, uint64_t * from,
+			   uint64_t * to)
+{
+    uint64_t resolution = block_allocation_resolution;
+
+    *from = (request->from + resolution - 1) & ~(resolution - 1);
+    *to = (request->from + request->len) & ~(resolution - 1);
+
+    if (request->from + request->len == client->serve->size) {
+	*to = client->serve->size;
     }
-    if (disconnected) {
-	client_disarm_killswitch(client);
-	return stop;
+    if (*to < *from) {
+	/* Inside a single block */
+	*to = *from;
     }
+}
 
-    if (!client_request_needs_reply(client, request)) {
-	client_disarm_killswitch(client);
-	return client->disconnect;
-    }
 
-    {
-	if (!server_is_closed(client->serve)) {
-	    client_reply(client, request);
-	    stop = 0;
+/* Make a TRIM or WRITE_ZEROES durable, if the client asked */
+void client_job_sync_if_needed(struct client *client,
+			       struct client_job *job)
+{
+    if ((job->request.flags & CMD_FLAG_FUA) || client->serve->always_sync) {
+	/* This covers holes and zeroed ranges as well as anything we
+	 * wrote.
+	 */
+	if (fdatasync(client->fileno) == -1) {
+	    warn(SHOW_ERRNO("sync failed"));
+	    job->error = EIO;
 	}
     }
-
-    client_disarm_killswitch(client);
-    return stop;
 }
 
 
-void client_send_hello(struct client *client)
+/* TRIM is only advice, so we discard the whole blocks it covers and leave
+ * the partial blocks at either end alone.
+ */
+void client_job_trim(struct client *client, struct client_job *job)
 {
-    client_write_init(client, client->serve->size);
-}
+    struct nbd_request *request = &job->request;
+    uint64_t from, to;
 
-void client_cleanup(struct client *client,
-		    int fatal __attribute__ ((unused)))
-{
-    info("client cleanup for client %p", client);
+    debug("request trim from=%" PRIu64 ", len=%" PRIu64 ", handle=0x%08X",
+	  request->from, request->len, request->handle);
 
-    /* If the thread hits an error, we need to ensure this is off */
-    client_disarm_killswitch(client);
+    client_request_blocks(client, request, &from, &to);
 
-    if (client->socket) {
-	FATAL_IF_NEGATIVE(close(client->socket),
-			  "Error closing client socket %d",
-			  client->socket);
-	debug("Closed client socket fd %d", client->socket);
-	client->socket = -1;
-    }
-    if (client->mapped) {
-	munmap(client->mapped, client->serve->size);
+    if (client_zero_range(client, from, to, 1) == -1) {
+	warn(SHOW_ERRNO("trim failed from=%" PRIu64 ", len=%" PRIu64, from,
+			to - from));
+	job->error = EIO;
+	return;
     }
-    if (client->fileno) {
-	FATAL_IF_NEGATIVE(close(client->fileno),
-			  "Error closing file %d", client->fileno);
-	debug("Closed client file fd %d", client->fileno);
-	client->fileno = -1;
+
+    client_job_sync_if_needed(client, job);
+}
+
+
+/* WRITE_ZEROES has to zero every byte, so we write zeroes to the partial
+ * blocks at either end ourselves, and have the filesystem do the rest.
+ * Unless the client said NO_HOLE, we punch holes rather than keeping the
+ * blocks allocated.
+ */
+void client_job_write_zeroes(struct client *client, struct client_job *job)
+{
+    struct nbd_request *request = &job->request;
+    uint64_t end = request->from + request->len;
+    uint64_t from, to;
+    int punch = !(request->flags & CMD_FLAG_NO_HOLE);
+
+    debug("request write_zeroes from=%" PRIu64 ", len=%" PRIu64
+	  ", flags=%" PRIu16 ", handle=0x%08X", request->from, request->len,
+	  request->flags, request->handle);
+
+    client_request_blocks(client, request, &from, &to);
+    if (from > end) {
+	/* Inside a single block, so it's all ragged */
+	from = to = end;
     }
 
-    if (server_acl_locked(client->serve)) {
-	server_unlock_acl(client->serve);
+    if (client_zero_bytes(client, request->from, from - request->from) ==
+	-1 || client_zero_range(client, from, to, punch) == -1
+	|| client_zero_bytes(client, to, end - to) == -1) {
+	warn(SHOW_ERRNO("write_zeroes failed from=%" PRIu64 ", len=%"
+			PRIu64, request->from, request->len));
+	job->error = EIO;
+	return;
     }
 
+    client_job_sync_if_needed(client, job);
 }
 
-void *client_serve(void *client_uncast)
+
+/* Take up to ''len'' bytes of the export's readahead for this second, and
+ * return how much we got.
+ */
+uint64_t client_readahead_allowance(struct client *client, uint64_t len)
 {
-    struct client *client = (struct client *) client_uncast;
+    struct server_readahead *readahead = &client->serve->readahead;
+    uint64_t second = monotonic_time_ms() / 1000;
+    uint64_t allowed;
 
-    error_set_handler((cleanup_handler *) client_cleanup, client);
+    pthread_mutex_lock(&readahead->lock);
+    {
+	if (readahead->second != second) {
+	    readahead->second = second;
+	    readahead->bytes = 0;
+	}
+	allowed = SERVER_READAHEAD_BYTES_PER_SECOND - readahead->bytes;
+	if (allowed > len) {
+	    allowed = len;
+	}
+	readahead->bytes += allowed;
+	readahead->total += allowed;
+    }
+    pthread_mutex_unlock(&readahead->lock);
 
-    info("client: mmaping file");
-    FATAL_IF_NEGATIVE(open_and_mmap(client->serve->filename,
-				    &client->fileno,
-				    &client->mapped_size,
-				    (void **) &client->mapped),
-		      "Couldn't open/mmap file %s: %s",
-		      client->serve->filename, strerror(errno)
-	);
+    return allowed;
+}
 
-    FATAL_IF_NEGATIVE(madvise
-		      (client->mapped, client->serve->size, MADV_RANDOM),
-		      SHOW_ERRNO("Failed to madvise() %s",
-				 client->serve->filename)
-	);
 
-    debug("Opened client file fd %d", client->fileno);
-    debug("client: sending hello");
-    client_send_hello(client);
+/* Called by the reactor for each read, in the order the client sent them.
+ * Once the client has read sequentially for long enough, we start asking
+ * for the file ahead of it, so the reads the workers make in parallel don't
+ * hide the pattern from the kernel's own readahead.  The direct backend
+ * would have to read the blocks in before replying, so we leave it be.
+ */
+void client_stream_read(struct client *client, struct client_job *job)
+{
+    struct client_stream *stream = &client->stream;
+    struct nbd_request *request = &job->request;
+    struct server *serve = client->serve;
+    uint64_t end = request->from + request->len;
+    uint64_t len;
+
+    if (request->len > 0 && request->from == stream->next) {
+	stream->run++;
+    } else {
+	stream->run = 0;
+	stream->ahead = end;
+	stream->window = CLIENT_READAHEAD_MIN;
+    }
+    stream->next = end;
+
+    if (stream->run < CLIENT_STREAM_TRIGGER) {
+	if (stream->sequential) {
+	    debug("client stopped reading sequentially at %" PRIu64,
+		  request->from);
+	    stream->sequential = 0;
+	    __sync_sub_and_fetch(&serve->sequential_clients, 1);
+	}
+	return;
+    }
+
+    if (!stream->sequential) {
+	debug("client reading sequentially from %" PRIu64, request->from);
+	stream->sequential = 1;
+	__sync_add_and_fetch(&serve->sequential_clients, 1);
+    }
+
+    if (serve->cache) {
+	return;
+    }
+
+    if (stream->ahead <= end) {
+	stream->ahead = end;
+    } else if (stream->ahead - end > stream->window / 2) {
+	return;
+    } else if (stream->window < CLIENT_READAHEAD_MAX) {
+	stream->window *= 2;
+    }
+    if (stream->ahead >= serve->size) {
+	return;
+    }
+
+    len = stream->window;
+    if (len > serve->size - stream->ahead) {
+	len = serve->size - stream->ahead;
+    }
+    len = client_readahead_allowance(client, len);
+    if (len == 0) {
+	return;
+    }
+
+    job->readahead_from = stream->ahead;
+    job->readahead_len = len;
+    stream->ahead += len;
+}
+
+
+/* CACHE is only advice, so we start reading in as much of the range as the
+ * export's readahead allows, and don't wait for it to arrive.  The direct
+ * backend keeps the file out of the page cache, so it reads the blocks into
+ * its own cache instead, which does mean waiting.
+ */
+void client_job_cache(struct client *client, struct client_job *job)
+{
+    struct nbd_request *request = &job->request;
+    uint64_t len = client_readahead_allowance(client, request->len);
+    int err;
+
+    debug("request cache from=%" PRIu64 ", len=%" PRIu64 ", handle=0x%08X",
+	  request->from, request->len, request->handle);
+
+    if (len < request->len) {
+	debug("Readahead used up, only caching %" PRIu64 " bytes", len);
+    }
+    if (len == 0) {
+	return;
+    }
+
+    if (client->serve->cache) {
+	if (block_cache_prefetch(client->serve->cache, request->from, len) ==
+	    -1) {
+	    warn(SHOW_ERRNO("cache failed from=%" PRIu64 ", len=%" PRIu64,
+			    request->from, len));
+	    job->error = EIO;
+	}
+    } else {
+	err = posix_fadvise(client->fileno, request->from, len,
+			    POSIX_FADV_WILLNEED);
+	if (err != 0) {
+	    warn("cache failed from=%" PRIu64 ", len=%" PRIu64 ": %s",
+		 request->from, len, strerror(err));
+	    job->error = EIO;
+	}
+    }
+}
+
+
+/* Fill in the i'th extent of a BLOCK_STATUS reply, in whichever format the
+ * client negotiated.
+ */
+static void client_extent_set(struct client *client, char *extents,
+			      uint32_t i, uint64_t length, uint32_t flags)
+{
+    if (client->handshake.extended_headers) {
+	struct client_extent_ext *extent =
+	    (struct client_extent_ext *) extents + i;
+	extent->length = htobe64(length);
+	extent->flags = htobe64(flags);
+    } else {
+	struct client_extent *extent = (struct client_extent *) extents + i;
+	extent->length = htobe32(length);
+	extent->flags = htobe32(flags);
+    }
+}
+
+
+/* Describe the allocation map over the request's range, one extent per
+ * run of allocated or unallocated blocks.  Until the map has been built,
+ * we have to say that everything is allocated.
+ */
+void client_job_block_status(struct client *client, struct client_job *job)
+{
+    struct nbd_request *request = &job->request;
+    struct bitset *map = client->serve->allocation_map;
+    char *extents;
+    uint32_t max_extents =
+	request->flags & CMD_FLAG_REQ_ONE ? 1 : CLIENT_MAX_EXTENTS;
+    uint64_t from = request->from;
+    uint64_t len = request->len;
+    uint64_t run;
+    int is_set;
+
+    debug("request block_status from=%" PRIu64 ", len=%" PRIu64
+	  ", handle=0x%08X", request->from, request->len, request->handle);
+
+    extents = xmalloc(max_extents *
+		      (client->handshake.extended_headers ?
+		       sizeof(struct client_extent_ext) :
+		       sizeof(struct client_extent)));
+    job->extents_count = 0;
+
+    while (len > 0 && job->extents_count < max_extents) {
+	if (client->serve->allocation_map_built) {
+	    run = bitset_run_count_ex(map, from, len, &is_set);
+	} else {
+	    run = len;
+	    is_set = 1;
+	}
+	if (run == 0) {
+	    break;
+	}
+	if (run > len) {
+	    run = len;
+	}
+
+	client_extent_set(client, extents, job->extents_count++, run,
+			  is_set ? 0 : STATE_HOLE | STATE_ZERO);
+
+	from += run;
+	len -= run;
+    }
+
+    job->buffer = extents;
+}
+
+
+void client_job_done(struct reactor *reactor, void *job_uncast);
+
+void client_job_run(void *job_uncast)
+{
+    struct client_job *job = (struct client_job *) job_uncast;
+    struct client *client = job->client;
+
+    switch (job->request.type) {
+    case REQUEST_READ:
+	client_job_read(client, job);
+	break;
+    case REQUEST_WRITE:
+	client_job_write(client, job);
+	break;
+    case REQUEST_FLUSH:
+	client_job_flush(client, job);
+	break;
+    case REQUEST_TRIM:
+	client_job_trim(client, job);
+	break;
+    case REQUEST_WRITE_ZEROES:
+	client_job_write_zeroes(client, job);
+	break;
+    case REQUEST_BLOCK_STATUS:
+	client_job_block_status(client, job);
+	break;
+    case REQUEST_CACHE:
+	client_job_cache(client, job);
+	break;
+    }
+
+    reactor_call(client->reactor, &job->done, client_job_done, job);
+}
+
+
+/*
+ * Reactor side.  Everything from here on runs on the reactor thread.
+ */
+
+void client_close(struct client *client);
+
+struct client_job *client_job_create(struct client *client,
+				     struct nbd_request *request)
+{
+    struct client_job *job = xmalloc(sizeof(struct client_job));
+
+    job->client = client;
+    job->request = *request;
+    client->in_flight++;
+
+    return job;
+}
+
+void client_job_free(struct client *client, struct client_job *job)
+{
+    free(job->buffer);
+    free(job->runs);
+    free(job->chunks);
+    if (job->reply_iov != job->reply_iov_simple) {
+	free(job->reply_iov);
+    }
+    free(job);
+    client->in_flight--;
+}
+
+void client_jobs_free(struct client *client, struct client_job *jobs)
+{
+    struct client_job *next;
+
+    while (jobs) {
+	next = jobs->next;
+	client_job_free(client, jobs);
+	jobs = next;
+    }
+}
+
+
+/* Reset the timeout whenever the client makes some progress.  This
+ * happens for every read and write, so it's just a store.
+ */
+void client_touch(struct client *client)
+{
+    if (client->watchdog_entry.armed) {
+	watchdog_touch(client->serve->watchdog, &client->watchdog_entry);
+    }
+}
+
+
+/* We only start on a new request if there's room for it; a request we've
+ * started on has to be read to the end regardless.
+ */
+int client_can_receive(struct client *client)
+{
+    if (client->closing || client->rx_state == CLIENT_RX_STOPPED) {
+	return 0;
+    }
+
+    return client->rx_state != CLIENT_RX_HEADER || client->rx_done > 0
+	|| client->in_flight < client->max_in_flight;
+}
+
+
+/* Start and stop the client's watchers to match what it's waiting for.
+ * The timeout runs whenever we're part-way through a request, or have any
+ * outstanding.  If the peer dies without closing the connection, that's
+ * the only way we'll ever notice.
+ */
+void client_update_watchers(struct client *client)
+{
+    struct ev_loop *loop = client->reactor->loop;
+    int timing;
+
+    if (client->closing) {
+	return;
+    }
+
+    if (client_can_receive(client)) {
+	ev_io_start(loop, &client->read_watcher);
+    } else {
+	ev_io_stop(loop, &client->read_watcher);
+    }
+
+    if (client->tx_head) {
+	ev_io_start(loop, &client->write_watcher);
+    } else {
+	ev_io_stop(loop, &client->write_watcher);
+    }
+
+    timing = client->serve->use_killswitch &&
+	(client->in_flight > 0 || client->rx_done > 0 ||
+	 client->rx_state == CLIENT_RX_DISCARD);
+
+    if (timing) {
+	watchdog_arm(client->serve->watchdog, &client->watchdog_entry);
+    } else {
+	watchdog_disarm(client->serve->watchdog, &client->watchdog_entry);
+    }
+}
+
+
+/* Once we've stopped reading requests, the client is finished with when
+ * everything outstanding has been replied to.
+ */
+void client_check_finished(struct client *client)
+{
+    if (!client->closing && client->rx_state == CLIENT_RX_STOPPED
+	&& client->in_flight == 0) {
+	client_close(client);
+    }
+}
+
+
+/* Send as many queued replies as the socket will take. */
+void client_send(struct client *client)
+{
+    struct iovec iov[CLIENT_MAX_SEND_IOVECS];
+    struct msghdr msg;
+    struct client_job *job;
+    ssize_t sent;
+
+    while (client->tx_head) {
+	int iovcnt = 0;
+
+	/* Gather up as many replies as we can */
+	for (job = client->tx_head;
+	     job && iovcnt < CLIENT_MAX_SEND_IOVECS; job = job->next) {
+	    size_t offset = job->sent;
+	    int i;
+
+	    for (i = 0; i < job->reply_iovcnt &&
+		 iovcnt < CLIENT_MAX_SEND_IOVECS; i++) {
+		if (offset >= job->reply_iov[i].iov_len) {
+		    offset -= job->reply_iov[i].iov_len;
+		    continue;
+		}
+		iov[iovcnt].iov_base =
+		    (char *) job->reply_iov[i].iov_base + offset;
+		iov[iovcnt].iov_len = job->reply_iov[i].iov_len - offset;
+		iovcnt++;
+		offset = 0;
+	    }
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	sent = sendmsg(client->socket, &msg, MSG_NOSIGNAL);
+	if (sent == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	    }
+	    warn(SHOW_ERRNO("Failed to send reply"));
+	    client_close(client);
+	    return;
+	}
+	client_touch(client);
+
+	/* Retire the replies that have gone completely */
+	while (sent > 0) {
+	    job = client->tx_head;
+
+	    if ((size_t) sent < job->reply_len - job->sent) {
+		job->sent += sent;
+		break;
+	    }
+
+	    sent -= job->reply_len - job->sent;
+	    client->tx_head = job->next;
+	    if (NULL == client->tx_head) {
+		client->tx_tail = NULL;
+	    }
+	    client_job_free(client, job);
+	}
+    }
+
+    client_check_finished(client);
+    client_update_watchers(client);
+}
+
+
+/* Add a part of the reply to the job's iovecs */
+static void client_reply_add(struct client_job *job, void *base, size_t len)
+{
+    job->reply_iov[job->reply_iovcnt].iov_base = base;
+    job->reply_iov[job->reply_iovcnt].iov_len = len;
+    job->reply_iovcnt++;
+    job->reply_len += len;
+}
+
+
+/* How many iovecs the data read for a job takes to send.  The unallocated
+ * runs come from the shared zero buffer, so a long one takes several.
+ */
+static int client_read_iovcnt(struct client_job *job)
+{
+    int count = 0;
+    int i;
+
+    for (i = 0; i < job->runs_count; i++) {
+	if (job->runs[i].allocated) {
+	    count++;
+	} else {
+	    count += (job->runs[i].len + ZEROES_BUFFER_SIZE - 1) /
+		ZEROES_BUFFER_SIZE;
+	}
+    }
+
+    return count;
+}
+
+
+/* Add the data read for a job to its reply */
+static void client_reply_read(struct client_job *job)
+{
+    char *zeroes = (char *) zeroes_buffer();
+    uint64_t offset = 0;
+    uint64_t left;
+    uint64_t len;
+    int i;
+
+    for (i = 0; i < job->runs_count; i++) {
+	if (job->runs[i].allocated) {
+	    client_reply_add(job, job->buffer + offset, job->runs[i].len);
+	} else {
+	    for (left = job->runs[i].len; left > 0; left -= len) {
+		len = left < ZEROES_BUFFER_SIZE ? left : ZEROES_BUFFER_SIZE;
+		client_reply_add(job, zeroes, len);
+	    }
+	}
+	offset += job->runs[i].len;
+    }
+}
+
+
+void client_reply_simple(struct client_job *job, int error)
+{
+    struct nbd_reply reply;
+    /* Only successful reads have any data to go with the reply */
+    int read = !error && job->request.type == REQUEST_READ;
+    int iovcnt = 1 + (read ? client_read_iovcnt(job) : 0);
+
+    reply.magic = REPLY_MAGIC;
+    reply.error = error;
+    reply.handle.w = job->request.handle.w;
+    nbd_h2r_reply(&reply, &job->reply_raw);
+
+    if (iovcnt <= 2) {
+	job->reply_iov = job->reply_iov_simple;
+    } else {
+	job->reply_iov = xmalloc(iovcnt * sizeof(struct iovec));
+    }
+    client_reply_add(job, &job->reply_raw, sizeof(job->reply_raw));
+
+    if (read) {
+	client_reply_read(job);
+    }
+}
+
+
+/* Fill in the next chunk's header, and return it.  Its payload is filled
+ * in by the caller.
+ */
+static struct client_chunk *client_chunk_add(struct client_job *job,
+					     int *count, int *size,
+					     uint16_t type, uint64_t length)
+{
+    struct nbd_structured_reply reply;
+    struct nbd_extended_reply reply_ext;
+    struct client_chunk *chunk;
+
+    if (*count == *size) {
+	*size *= 2;
+	job->chunks = xrealloc(job->chunks,
+			       *size * sizeof(struct client_chunk));
+    }
+    chunk = &job->chunks[(*count)++];
+    chunk->type = type;
+    chunk->length = length;
+
+    if (job->client->handshake.extended_headers) {
+	reply_ext.magic = EXTENDED_REPLY_MAGIC;
+	reply_ext.flags = 0;
+	reply_ext.type = type;
+	reply_ext.handle.w = job->request.handle.w;
+	reply_ext.offset = job->request.from;
+	reply_ext.length = length;
+	nbd_h2r_extended_reply(&reply_ext, &chunk->header.extended);
+    } else {
+	reply.magic = STRUCTURED_REPLY_MAGIC;
+	reply.flags = 0;
+	reply.type = type;
+	reply.handle.w = job->request.handle.w;
+	reply.length = length;
+	nbd_h2r_structured_reply(&reply, &chunk->header.structured);
+    }
+
+    return chunk;
+}
+
+
+/* Mark the chunk as the last one in the reply */
+static void client_chunk_done(struct client_job *job,
+			      struct client_chunk *chunk)
+{
+    if (job->client->handshake.extended_headers) {
+	chunk->header.extended.flags = htobe16(REPLY_FLAG_DONE);
+    } else {
+	chunk->header.structured.flags = htobe16(REPLY_FLAG_DONE);
+    }
+}
+
+
+/* A read is sent back as data chunks for the allocated parts of the range,
+ * and hole chunks for the rest, so the client doesn't have to be sent the
+ * zeroes.
+ */
+static int client_chunks_read(struct client_job *job, int *size)
+{
+    struct nbd_request *request = &job->request;
+    struct client_chunk *chunk;
+    uint64_t done = 0;
+    uint64_t run;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < job->runs_count; i++) {
+	run = job->runs[i].len;
+
+	if (job->runs[i].allocated) {
+	    chunk = client_chunk_add(job, &count, size,
+				     REPLY_TYPE_OFFSET_DATA,
+				     sizeof(chunk->payload.offset) + run);
+	    chunk->payload.offset = htobe64(request->from + done);
+	} else {
+	    chunk = client_chunk_add(job, &count, size,
+				     REPLY_TYPE_OFFSET_HOLE,
+				     sizeof(chunk->payload.hole));
+	    chunk->payload.hole.offset = htobe64(request->from + done);
+	    chunk->payload.hole.length = htobe32(run);
+	}
+	done += run;
+    }
+
+    return count;
+}
+
+
+/* Structured replies are used for reads and BLOCK_STATUS, once the client
+ * has asked for them, and for everything once it has extended headers.
+ */
+void client_reply_structured(struct client *client, struct client_job *job,
+			     int error)
+{
+    int extended = client->handshake.extended_headers;
+    struct client_chunk *chunk;
+    uint64_t fixed;
+    char *data;
+    int size = 4;
+    int count = 0;
+    int i;
+
+    job->chunks = xmalloc(size * sizeof(struct client_chunk));
+
+    if (error) {
+	chunk = client_chunk_add(job, &count, &size, REPLY_TYPE_ERROR,
+				 sizeof(chunk->payload.error));
+	chunk->payload.error.error = htobe32(error);
+	chunk->payload.error.message_length = 0;
+    } else if (job->request.type == REQUEST_BLOCK_STATUS && extended) {
+	chunk = client_chunk_add(job, &count, &size,
+				 REPLY_TYPE_BLOCK_STATUS_EXT,
+				 sizeof(chunk->payload.context_ext) +
+				 job->extents_count *
+				 sizeof(struct client_extent_ext));
+	chunk->payload.context_ext.context =
+	    htobe32(client->handshake.allocation_context);
+	chunk->payload.context_ext.count = htobe32(job->extents_count);
+    } else if (job->request.type == REQUEST_BLOCK_STATUS) {
+	chunk = client_chunk_add(job, &count, &size,
+				 REPLY_TYPE_BLOCK_STATUS,
+				 sizeof(chunk->payload.context) +
+				 job->extents_count *
+				 sizeof(struct client_extent));
+	chunk->payload.context =
+	    htobe32(client->handshake.allocation_context);
+    } else if (job->request.type == REQUEST_READ) {
+	count = client_chunks_read(job, &size);
+    }
+
+    if (count == 0) {
+	/* A zero-length read, or anything else that succeeded */
+	client_chunk_add(job, &count, &size, REPLY_TYPE_NONE, 0);
+    }
+    client_chunk_done(job, &job->chunks[count - 1]);
+
+    /* Each chunk is its header, its payload, then any data */
+    job->reply_iov = xmalloc(3 * count * sizeof(struct iovec));
+    data = job->buffer;
+    for (i = 0; i < count; i++) {
+	chunk = &job->chunks[i];
+
+	client_reply_add(job, &chunk->header,
+			 extended ? sizeof(chunk->header.extended) :
+			 sizeof(chunk->header.structured));
+
+	switch (chunk->type) {
+	case REPLY_TYPE_OFFSET_DATA:
+	    fixed = sizeof(chunk->payload.offset);
+	    break;
+	case REPLY_TYPE_OFFSET_HOLE:
+	    fixed = chunk->length;
+	    data += be32toh(chunk->payload.hole.length);
+	    break;
+	case REPLY_TYPE_BLOCK_STATUS:
+	    fixed = sizeof(chunk->payload.context);
+	    break;
+	case REPLY_TYPE_BLOCK_STATUS_EXT:
+	    fixed = sizeof(chunk->payload.context_ext);
+	    break;
+	default:
+	    /* Nothing follows the payload */
+	    fixed = chunk->length;
+	    break;
+	}
+
+	if (fixed > 0) {
+	    client_reply_add(job, &chunk->payload, fixed);
+	}
+	if (chunk->length > fixed) {
+	    client_reply_add(job, data, chunk->length - fixed);
+	    data += chunk->length - fixed;
+	}
+    }
+}
+
+
+/* Queue the reply to a job, and try to send it straight away. */
+void client_reply(struct client *client, struct client_job *job,
+		  int error)
+{
+    debug("Replying with handle=0x%08X, error=%" PRIu32,
+	  job->request.handle, error);
+
+    /* Only successful reads and BLOCK_STATUS have anything to go with the
+     * reply
+     */
+    if (error || (job->request.type != REQUEST_READ &&
+		  job->request.type != REQUEST_BLOCK_STATUS)) {
+	free(job->buffer);
+	job->buffer = NULL;
+    }
+
+    if (client->handshake.extended_headers ||
+	(client->handshake.structured_replies &&
+	 (job->request.type == REQUEST_READ ||
+	  job->request.type == REQUEST_BLOCK_STATUS))) {
+	client_reply_structured(client, job, error);
+    } else {
+	client_reply_simple(job, error);
+    }
+
+    job->sent = 0;
+    job->next = NULL;
+    if (client->tx_tail) {
+	client->tx_tail->next = job;
+    } else {
+	client->tx_head = job;
+    }
+    client->tx_tail = job;
+
+    client_send(client);
+}
+
+
+void client_reply_now(struct client *client, struct nbd_request *request,
+		      int error)
+{
+    client_reply(client, client_job_create(client, request), error);
+}
+
+
+/* Does the request change what's in the file? */
+int client_request_modifies(struct nbd_request *request)
+{
+    return request->type == REQUEST_WRITE || request->type == REQUEST_TRIM
+	|| request->type == REQUEST_WRITE_ZEROES;
+}
+
+
+int client_jobs_overlap(struct client_job *a, struct client_job *b)
+{
+    if (!client_request_modifies(&a->request)
+	&& !client_request_modifies(&b->request)) {
+	return 0;
+    }
+
+    return a->request.from < b->request.from + b->request.len &&
+	b->request.from < a->request.from + a->request.len;
+}
+
+
+/* Requests from one client are serviced concurrently, but we keep them in
+ * order where it matters: nothing that overlaps a write is started until the
+ * write has finished, and a write doesn't start until any overlapping reads
+ * have finished.  Anything that has to wait holds up the requests behind it.
+ */
+/*
+ * io_uring.  If the server has one, the reactor queues jobs to it directly,
+ * and the kernel tells us when it's done with them.  Anything we can't or
+ * won't do this way goes to the workers as usual.
+ */
+
+int client_job_wants_sync(struct client *client, struct client_job *job)
+{
+    return job->request.type == REQUEST_WRITE &&
+	((job->request.flags & CMD_FLAG_FUA) || client->serve->always_sync);
+}
+
+
+/* Writes which might need to leave holes in the file are left to
+ * write_not_zeroes, on the workers.
+ */
+int client_uring_can_write(struct client *client, struct nbd_request *request)
+{
+    struct bitset *map = client->serve->allocation_map;
+
+    if (!client->serve->allocation_map_built) {
+	return 1;
+    }
+
+    return bitset_is_set_at(map, request->from) &&
+	bitset_run_count(map, request->from, request->len) >= request->len;
+}
+
+
+void client_uring_transfer_done(struct uring_op *op, int result);
+void client_uring_sync_done(struct uring_op *op, int result);
+void client_uring_readahead_done(struct uring_op *op, int result);
+
+/* Queue the rest of a read or write, and the sync for a FUA write. */
+void client_uring_transfer(struct client *client, struct client_job *job)
+{
+    struct uring *ring = client->serve->uring;
+    struct nbd_request *request = &job->request;
+    uint64_t offset = request->from + job->transferred;
+    int sync = client_job_wants_sync(client, job);
+
+    job->iov.iov_base = job->buffer + job->transferred;
+    job->iov.iov_len = request->len - job->transferred;
+
+    job->transfer_op.done = client_uring_transfer_done;
+    job->transfer_op.data = job;
+    job->uring_pending++;
+
+    if (request->type == REQUEST_READ) {
+	uring_readv(ring, &job->transfer_op, client->fileno, &job->iov, 1,
+		    offset);
+    } else {
+	uring_writev(ring, &job->transfer_op, client->fileno, &job->iov, 1,
+		     offset, sync);
+    }
+
+    if (sync) {
+	job->sync_op.done = client_uring_sync_done;
+	job->sync_op.data = job;
+	job->uring_pending++;
+	uring_fdatasync(ring, &job->sync_op, client->fileno, request->from,
+			request->len);
+    }
+}
+
+
+/* Queue a sync of everything written to the export since the last flush,
+ * falling back to the whole file as client_dirty_sync does, or if a range
+ * is too long for one of io_uring's syncs.  Returns 0 if there was
+ * nothing to sync, or no room to do it.
+ */
+int client_uring_flush(struct client *client, struct client_job *job)
+{
+    struct uring *ring = client->serve->uring;
+    struct server_dirty *dirty = &client->serve->dirty;
+    int whole_file;
+    int count = 0;
+    int i;
+
+    job->sync_op.done = client_uring_sync_done;
+    job->sync_op.data = job;
+
+    pthread_mutex_lock(&dirty->lock);
+    {
+	whole_file = dirty->overflowed || dirty->syncing > 0;
+	for (i = 0; i < dirty->ranges_count; i++) {
+	    if (dirty->ranges[i].to - dirty->ranges[i].from > UINT32_MAX) {
+		whole_file = 1;
+	    }
+	}
+	count = whole_file ? 1 : dirty->ranges_count;
+
+	if (count > 0 && uring_has_room(ring, count)) {
+	    if (whole_file) {
+		uring_fdatasync(ring, &job->sync_op, client->fileno, 0, 0);
+	    } else {
+		for (i = 0; i < dirty->ranges_count; i++) {
+		    uring_fdatasync(ring, &job->sync_op, client->fileno,
+				    dirty->ranges[i].from,
+				    dirty->ranges[i].to -
+				    dirty->ranges[i].from);
+		}
+	    }
+	    job->uring_pending = count;
+	    dirty->overflowed = 0;
+	    dirty->ranges_count = 0;
+	    dirty->syncing++;
+	} else {
+	    count = 0;
+	}
+    }
+    pthread_mutex_unlock(&dirty->lock);
+
+    return count;
+}
+
+
+/* Returns 1 if the job was queued to io_uring, 0 if it needs the workers */
+int client_uring_start(struct client *client, struct client_job *job)
+{
+    struct nbd_request *request = &job->request;
+    struct server *serve = client->serve;
+
+    if (NULL == serve->uring) {
+	return 0;
+    }
+
+    switch (request->type) {
+    case REQUEST_READ:
+	/* Reads with holes in go to the workers, which read around them */
+	if (job->runs_count != 1 || !job->runs[0].allocated ||
+	    !uring_has_room(serve->uring, job->readahead_len > 0 ? 2 : 1)) {
+	    return 0;
+	}
+	/* If we can't have the memory, the workers will say so */
+	job->buffer = malloc(request->len);
+	if (NULL == job->buffer) {
+	    return 0;
+	}
+	break;
+    case REQUEST_WRITE:
+	if (request->len == 0 || !client_uring_can_write(client, request) ||
+	    !uring_has_room(serve->uring,
+			    client_job_wants_sync(client, job) ? 2 : 1)) {
+	    return 0;
+	}
+	break;
+    case REQUEST_FLUSH:
+	return client_uring_flush(client, job) > 0;
+    default:
+	return 0;
+    }
+
+    debug("request %s from=%" PRIu64 ", len=%" PRIu64 " via io_uring",
+	  request->type == REQUEST_READ ? "read" : "write",
+	  request->from, request->len);
+    client_uring_transfer(client, job);
+
+    if (job->readahead_len > 0) {
+	job->readahead_op.done = client_uring_readahead_done;
+	job->readahead_op.data = job;
+	job->uring_pending++;
+	uring_fadvise(serve->uring, &job->readahead_op, client->fileno,
+		      job->readahead_from, job->readahead_len,
+		      POSIX_FADV_WILLNEED);
+	job->readahead_len = 0;
+    }
+    return 1;
+}
+
+
+/* Called once each of a job's operations has completed. */
+void client_uring_finish(struct client_job *job)
+{
+    struct client *client = job->client;
+    struct nbd_request *request = &job->request;
+
+    if (job->uring_pending > 0) {
+	return;
+    }
+
+    if (request->type == REQUEST_FLUSH) {
+	client_dirty_synced(client, job->error ? -1 : 0);
+    } else if (!job->error && job->transferred < request->len) {
+	/* A short read or write, so carry on from where it stopped. */
+	int sync = client_job_wants_sync(client, job);
+	if (uring_has_room(client->serve->uring, sync ? 2 : 1)) {
+	    client_uring_transfer(client, job);
+	} else {
+	    worker_pool_submit(client->workers, &job->work, client_job_run,
+			       job);
+	}
+	return;
+    } else if (request->type == REQUEST_WRITE) {
+	if (!job->error) {
+	    /* Whether or not the map's built, a mirror has to hear about
+	     * the write, as write_not_zeroes would have told it.
+	     */
+	    bitset_set_range(client->serve->allocation_map, request->from,
+			     request->len);
+	}
+	if (!job->error && !client_job_wants_sync(client, job)) {
+	    uint64_t from_rounded =
+		request->from & (~(sysconf(_SC_PAGE_SIZE) - 1));
+	    client_dirty_add(client, from_rounded,
+			     request->from + request->len);
+	}
+	free(job->buffer);
+	job->buffer = NULL;
+    } else if (job->error) {
+	free(job->buffer);
+	job->buffer = NULL;
+    }
+
+    client_job_done(client->reactor, job);
+}
+
+
+void client_uring_transfer_done(struct uring_op *op, int result)
+{
+    struct client_job *job = (struct client_job *) op->data;
+
+    job->uring_pending--;
+
+    if (result <= 0) {
+	/* Running out of file counts as an error, as it does for the
+	 * workers.
+	 */
+	warn("%s failed from=%" PRIu64 ", len=%" PRIu64 ": %s",
+	     job->request.type == REQUEST_READ ? "read" : "write",
+	     job->request.from, job->request.len,
+	     result < 0 ? strerror(-result) : "end of file");
+	job->error = EIO;
+    } else {
+	job->transferred += result;
+    }
+
+    client_uring_finish(job);
+}
+
+
+void client_uring_sync_done(struct uring_op *op, int result)
+{
+    struct client_job *job = (struct client_job *) op->data;
+
+    job->uring_pending--;
+
+    /* ECANCELED means a short write broke the link to the sync; we'll be
+     * back with another once the rest is written.
+     */
+    if (result < 0 && result != -ECANCELED) {
+	warn("sync failed: %s", strerror(-result));
+	job->error = EIO;
+    }
+
+    client_uring_finish(job);
+}
+
+
+void client_uring_readahead_done(struct uring_op *op, int result)
+{
+    struct client_job *job = (struct client_job *) op->data;
+
+    job->uring_pending--;
+
+    /* As in client_job_read, the client needn't hear about this */
+    if (result < 0) {
+	debug("readahead failed: %s", strerror(-result));
+    }
+
+    client_uring_finish(job);
+}
+
+
+/* Split a read into runs of allocated and unallocated blocks.  This waits
+ * until any of the client's own writes to the range have finished, so it
+ * sees the blocks they allocated.  Returns 1 if any of the read is
+ * allocated, or 0 if it can be answered without going to the file.
+ */
+int client_read_runs(struct client *client, struct client_job *job)
+{
+    struct server *serve = client->serve;
+    struct nbd_request *request = &job->request;
+    struct client_run *run;
+    uint64_t done = 0;
+    int size = 4;
+    int allocated = 0;
+
+    job->runs = xmalloc(size * sizeof(struct client_run));
+    job->runs_count = 0;
+
+    while (done < request->len) {
+	if (job->runs_count == size) {
+	    size *= 2;
+	    job->runs = xrealloc(job->runs, size * sizeof(struct client_run));
+	}
+	run = &job->runs[job->runs_count++];
+	run->len = request->len - done;
+	run->allocated = 1;
+
+	/* Until the map is built, everything is presumed allocated */
+	if (serve->allocation_map_built &&
+	    job->runs_count < CLIENT_MAX_READ_RUNS) {
+	    run->len = bitset_run_count_ex(serve->allocation_map,
+					   request->from + done, run->len,
+					   &run->allocated);
+	    if (run->len == 0 || run->len > request->len - done) {
+		run->len = request->len - done;
+	    }
+	}
 
-    debug("client: serving requests");
-    while (client_serve_request(client) == 0);
-    debug("client: stopped serving requests");
-    client->stopped = 1;
+	allocated |= run->allocated;
+	done += run->len;
+    }
+
+    return allocated;
+}
+
+
+void client_dispatch_pending(struct client *client)
+{
+    struct client_job *job;
+    struct client_job *running;
+
+    while ((job = client->pending_head) != NULL) {
+	for (running = client->running; running; running = running->next) {
+	    if (client_jobs_overlap(job, running)) {
+		return;
+	    }
+	}
+
+	client->pending_head = job->next;
+	if (NULL == client->pending_head) {
+	    client->pending_tail = NULL;
+	}
+
+	job->next = client->running;
+	client->running = job;
+
+	if (job->request.type == REQUEST_READ &&
+	    !client_read_runs(client, job)) {
+	    /* There's nothing to read from the file */
+	    reactor_call(client->reactor, &job->done, client_job_done, job);
+	} else if (!client_uring_start(client, job)) {
+	    worker_pool_submit(client->workers, &job->work, client_job_run,
+			       job);
+	}
+    }
+}
+
+
+void client_dispatch(struct client *client, struct client_job *job)
+{
+    job->next = NULL;
+    if (client->pending_tail) {
+	client->pending_tail->next = job;
+    } else {
+	client->pending_head = job;
+    }
+    client->pending_tail = job;
+
+    client_dispatch_pending(client);
+}
+
+
+void client_job_done(struct reactor *reactor
+		     __attribute__ ((unused)), void *job_uncast)
+{
+    struct client_job *job = (struct client_job *) job_uncast;
+    struct client *client = job->client;
+    struct client_job **link;
+
+    for (link = &client->running; *link != job; link = &(*link)->next);
+    *link = job->next;
+
+    if (client->closing) {
+	client_job_free(client, job);
+	client_close(client);
+	return;
+    }
+
+    client_touch(client);
+    client_dispatch_pending(client);
+    client_reply(client, job, job->error);
+}
+
+
+/* Check to see if the request we've just read is one we can service.  If it
+ * is, it gets queued for the workers (once we've read the data, for a
+ * write), and if not, the error reply is queued.
+ */
+void client_handle_request(struct client *client)
+{
+    struct nbd_request request;
+    struct client_job *job;
+    char *buffer = NULL;
+    uint32_t magic;
+
+    if (client->handshake.extended_headers) {
+	nbd_r2h_extended_request(&client->rx_request.extended, &request);
+	magic = EXTENDED_REQUEST_MAGIC;
+    } else {
+	nbd_r2h_request(&client->rx_request.simple, &request);
+	magic = REQUEST_MAGIC;
+    }
+
+    /* The client is stupid, but don't take down the whole server as a result.
+     * We send a reply before disconnecting so that at least some indication of
+     * the problem is visible, and so proxies don't retry the same (bad) request
+     * forever.
+     */
+    if (request.magic != magic) {
+	warn("Bad magic 0x%08X from client", request.magic);
+	client->rx_state = CLIENT_RX_STOPPED;
+	client_reply_now(client, &request, EBADMSG);
+	return;
+    }
+
+    debug("request type=%" PRIu16 ", flags=%" PRIu16 ", from=%" PRIu64
+	  ", len=%" PRIu64 ", handle=0x%08X", request.type, request.flags,
+	  request.from, request.len, request.handle);
+
+    /* check it's not out of range. NBD protocol requires ENOSPC to be
+     * returned in this instance.  With extended headers, the end of the
+     * request could be past 2^64, so don't work it out.
+     */
+    if (request.len > client->serve->size ||
+	request.from > client->serve->size - request.len) {
+	warn("write request %" PRIu64 "+%" PRIu64 " out of range",
+	     request.from, request.len);
+	if (request.type == REQUEST_WRITE && request.len > 0) {
+	    client->rx_state = CLIENT_RX_DISCARD;
+	    client->rx_discard = request.len;
+	}
+	client_reply_now(client, &request, ENOSPC);
+	return;
+    }
+
+    /* We have to hold the data for a read or write in memory */
+    if ((request.type == REQUEST_READ || request.type == REQUEST_WRITE) &&
+	request.len > CLIENT_MAX_PAYLOAD) {
+	warn("request %" PRIu64 "+%" PRIu64 " is too long", request.from,
+	     request.len);
+	if (request.type == REQUEST_WRITE) {
+	    client->rx_state = CLIENT_RX_DISCARD;
+	    client->rx_discard = request.len;
+	}
+	client_reply_now(client, &request, EOVERFLOW);
+	return;
+    }
+
+    switch (request.type) {
+    case REQUEST_READ:
+    case REQUEST_WRITE:
+    case REQUEST_FLUSH:
+    case REQUEST_TRIM:
+    case REQUEST_WRITE_ZEROES:
+    case REQUEST_CACHE:
+	break;
+    case REQUEST_BLOCK_STATUS:
+	if (!client->handshake.allocation_context || request.len == 0) {
+	    warn("Bad block status request");
+	    client_reply_now(client, &request, EINVAL);
+	    return;
+	}
+	break;
+    case REQUEST_DISCONNECT:
+	debug("request disconnect");
+	client->disconnect = 1;
+	client->rx_state = CLIENT_RX_STOPPED;
+	client_check_finished(client);
+	return;
+    default:
+	/* NBD prototcol says servers SHOULD return EINVAL to unknown
+	 * commands */
+	warn("Unknown request 0x%08X", request.type);
+	client_reply_now(client, &request, EINVAL);
+	return;
+    }
+
+    /* Once the server socket has closed, we don't touch the disc again on
+     * anyone's behalf.
+     */
+    if (server_is_closed(client->serve)) {
+	debug("Server closed, dropping client");
+	client_close(client);
+	return;
+    }
+
+    if (request.type == REQUEST_WRITE && request.len > 0) {
+	/* No need to zero it, we're about to fill it */
+	buffer = malloc(request.len);
+	if (NULL == buffer) {
+	    warn("couldn't allocate %" PRIu64 " bytes for a write",
+		 request.len);
+	    client->rx_state = CLIENT_RX_DISCARD;
+	    client->rx_discard = request.len;
+	    client_reply_now(client, &request, ENOMEM);
+	    return;
+	}
+    }
+
+    job = client_job_create(client, &request);
+
+    if (request.type == REQUEST_READ) {
+	client_stream_read(client, job);
+    }
+
+    if (request.type == REQUEST_WRITE && request.len > 0) {
+	job->buffer = buffer;
+	client->rx_job = job;
+	client->rx_state = CLIENT_RX_DATA;
+	return;
+    }
+
+    client_dispatch(client, job);
+}
+
+
+/* How long the header of each request is */
+static size_t client_request_size(struct client *client)
+{
+    return client->handshake.extended_headers ?
+	sizeof(client->rx_request.extended) :
+	sizeof(client->rx_request.simple);
+}
+
+
+/* Read as much as we can off the socket, acting on each request as it
+ * arrives.
+ */
+void client_receive(struct client *client)
+{
+    char discard[4096];
+    ssize_t count;
+
+    while (client_can_receive(client)) {
+	switch (client->rx_state) {
+	case CLIENT_RX_HEADER:
+	    count = read(client->socket,
+			 (char *) &client->rx_request + client->rx_done,
+			 client_request_size(client) - client->rx_done);
+	    break;
+	case CLIENT_RX_DATA:
+	    count = read(client->socket,
+			 client->rx_job->buffer + client->rx_done,
+			 client->rx_job->request.len - client->rx_done);
+	    break;
+	case CLIENT_RX_DISCARD:
+	    count = read(client->socket, discard,
+			 client->rx_discard < sizeof(discard) ?
+			 client->rx_discard : sizeof(discard));
+	    break;
+	default:
+	    fatal("Bad client rx state %d", client->rx_state);
+	}
+
+	if (count == 0) {
+	    if (client->rx_state == CLIENT_RX_HEADER && client->rx_done == 0) {
+		warn("EOF while reading request");
+	    } else {
+		warn("EOF part-way through a request");
+	    }
+	    client_close(client);
+	    return;
+	}
+
+	if (count == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	    }
+	    warn(SHOW_ERRNO("Error reading request"));
+	    client_close(client);
+	    return;
+	}
+
+	client_touch(client);
+
+	switch (client->rx_state) {
+	case CLIENT_RX_HEADER:
+	    client->rx_done += count;
+	    if (client->rx_done == client_request_size(client)) {
+		client->rx_done = 0;
+		client_handle_request(client);
+	    }
+	    break;
+	case CLIENT_RX_DATA:
+	    client->rx_done += count;
+	    if (client->rx_done == client->rx_job->request.len) {
+		struct client_job *job = client->rx_job;
+
+		client->rx_job = NULL;
+		client->rx_done = 0;
+		client->rx_state = CLIENT_RX_HEADER;
+		client_dispatch(client, job);
+	    }
+	    break;
+	case CLIENT_RX_DISCARD:
+	    client->rx_discard -= count;
+	    if (client->rx_discard == 0) {
+		client->rx_state = CLIENT_RX_HEADER;
+	    }
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    client_check_finished(client);
+    client_update_watchers(client);
+}
+
+
+static void client_read_cb(struct ev_loop *loop
+			   __attribute__ ((unused)), ev_io * w,
+			   int revents __attribute__ ((unused)))
+{
+    client_receive((struct client *) w->data);
+}
+
+static void client_write_cb(struct ev_loop *loop
+			    __attribute__ ((unused)), ev_io * w,
+			    int revents __attribute__ ((unused)))
+{
+    client_send((struct client *) w->data);
+}
+
+static void client_stop_cb(struct ev_loop *loop
+			   __attribute__ ((unused)), ev_io * w,
+			   int revents __attribute__ ((unused)))
+{
+    struct client *client = (struct client *) w->data;
+
+    debug("Client received stop signal.");
+    self_pipe_signal_clear(client->stop_signal);
+    client_close(client);
+}
+
+static void client_timeout_cb(struct watchdog_entry *entry)
+{
+    struct client *client = (struct client *) entry->data;
+
+    warn("Client made no progress for %d seconds, disconnecting",
+	 CLIENT_HANDLER_TIMEOUT);
+    client_close(client);
+}
+
+
+/* Close everything down, and let whoever is waiting for the client know
+ * that we're done with it.  The client can be destroyed as soon as we set
+ * stopped, so this runs as a call of its own, once whatever closed the
+ * client has finished with it.
+ */
+void client_finish(struct reactor *reactor
+		   __attribute__ ((unused)), void *client_uncast)
+{
+    struct client *client = (struct client *) client_uncast;
+
+    info("client cleanup for client %p", client);
+
+    if (client->socket) {
+	FATAL_IF_NEGATIVE(close(client->socket),
+			  "Error closing client socket %d",
+			  client->socket);
+	debug("Closed client socket fd %d", client->socket);
+	client->socket = -1;
+    }
+    if (client->fileno > 0) {
+	if (client->disconnect && !client->serve->always_sync &&
+	    !server_is_in_control(client->serve)) {
+	    /* We're about to hand control over, and whoever sent us the
+	     * data will throw their copy away, so it had better be on disc.
+	     */
+	    debug("client: syncing before control arrives");
+	    FATAL_IF_NEGATIVE(client_sync(client),
+			      "Couldn't sync before handing over");
+	}
+	/* The file and its mapping belong to the export */
+	client->mapped = NULL;
+	client->fileno = -1;
+    }
 
     if (client->disconnect) {
 	debug("client: control arrived");
 	server_control_arrived(client->serve);
     }
 
-    debug("Cleaning client %p up normally in thread %p", client,
-	  pthread_self());
-    client_cleanup(client, 0);
-    debug("Client thread done");
+    if (client->stream.sequential) {
+	__sync_sub_and_fetch(&client->serve->sequential_clients, 1);
+    }
+    __sync_sub_and_fetch(&client->serve->clients_running, 1);
+
+    /* Whoever takes us off the finished list waits for stop_lock before
+     * destroying us, so we can be put on it before we let go.
+     */
+    pthread_mutex_lock(&client->stop_lock);
+    {
+	client->stopped = 1;
+	server_client_finished(client->serve, client);
+	pthread_cond_broadcast(&client->stopped_cond);
+    }
+    pthread_mutex_unlock(&client->stop_lock);
+}
+
+
+/* Stop talking to the client.  Anything the workers are doing for it has
+ * to finish before we can close the file, so we may have to wait for that.
+ */
+void client_close(struct client *client)
+{
+    struct ev_loop *loop = client->reactor->loop;
+
+    if (!client->closing) {
+	debug("client: closing");
+	client->closing = 1;
+	client->rx_state = CLIENT_RX_STOPPED;
+
+	ev_io_stop(loop, &client->read_watcher);
+	ev_io_stop(loop, &client->write_watcher);
+	ev_io_stop(loop, &client->stop_watcher);
+	watchdog_disarm(client->serve->watchdog, &client->watchdog_entry);
+
+	if (client->rx_job) {
+	    client_job_free(client, client->rx_job);
+	    client->rx_job = NULL;
+	}
+	client_jobs_free(client, client->pending_head);
+	client->pending_head = client->pending_tail = NULL;
+	client_jobs_free(client, client->tx_head);
+	client->tx_head = client->tx_tail = NULL;
+
+	if (client->negotiating) {
+	    /* Get the worker's attention */
+	    shutdown(client->socket, SHUT_RDWR);
+	}
+    }
+
+    if (NULL == client->running && !client->negotiating &&
+	!client->finishing) {
+	client->finishing = 1;
+	reactor_call(client->reactor, &client->finish, client_finish, client);
+    }
+}
+
+
+/* Start reading requests, once the handshake is over. */
+void client_serve(struct client *client)
+{
+    if (sock_set_nonblock(client->socket, 1) == -1) {
+	warn(SHOW_ERRNO("Couldn't make client socket non-blocking"));
+	client_close(client);
+	return;
+    }
+
+    debug("client: serving requests");
+    client_update_watchers(client);
+}
+
+
+/* Pick up the export's file, and its mapping if it has one, which all of
+ * its clients share.  Clients which negotiate can't do this until they've
+ * chosen an export.
+ */
+int client_open(struct client *client)
+{
+    struct server *serve = client->serve;
+
+    if (serve->fd <= 0) {
+	warn("File %s isn't open", serve->filename);
+	return -1;
+    }
+
+    client->fileno = serve->fd;
+    client->mapped = serve->mapped;
+    client->mapped_size = serve->size;
+
+    debug("Using file fd %d", client->fileno);
+    return 0;
+}
+
+
+/* Move the client from the listener to the export it chose.  Once it's
+ * one of the export's clients, a mirror of the export will wait for it, so
+ * it only has to check that it isn't too late for that; see
+ * server_forbid_new_clients.
+ */
+int client_choose_export(struct client *client, struct server *serve)
+{
+    struct server *listener = client->serve;
+
+    if (serve != listener) {
+	__sync_add_and_fetch(&serve->clients_running, 1);
+	client->serve = serve;
+	__sync_sub_and_fetch(&listener->clients_running, 1);
+	__sync_synchronize();
+    }
+
+    if (!serve->allow_new_clients || server_is_closed(serve)) {
+	info("Export '%s' stopped taking clients during negotiation",
+	     serve->name);
+	return -1;
+    }
+
+    return 0;
+}
+
+
+void client_negotiated(struct reactor *reactor
+		       __attribute__ ((unused)), void *client_uncast)
+{
+    struct client *client = (struct client *) client_uncast;
+
+    client->negotiating = 0;
+
+    if (client->closing || client->handshake_result == -1) {
+	client_close(client);
+	return;
+    }
+
+    if (client_choose_export(client, client->handshake.serve) == -1 ||
+	client_open(client) == -1) {
+	client_close(client);
+	return;
+    }
+
+    client_serve(client);
+}
+
+
+/* The newstyle handshake is a conversation, which would hold up every
+ * other client if the reactor had it, so a negotiator has it instead.
+ */
+void client_negotiate(void *client_uncast)
+{
+    struct client *client = (struct client *) client_uncast;
+
+    client->handshake_result =
+	handshake_negotiate(client->socket, client->serve, &client->address,
+			    CLIENT_TRANSMISSION_FLAGS, &client->handshake);
+
+    reactor_call(client->reactor, &client->negotiated, client_negotiated,
+		 client);
+}
+
+
+void client_start_cb(struct reactor *reactor, void *client_uncast)
+{
+    struct client *client = (struct client *) client_uncast;
+
+    client->reactor = reactor;
+    client->workers = client->serve->workers;
+
+    ev_io_init(&client->read_watcher, client_read_cb, client->socket,
+	       EV_READ);
+    client->read_watcher.data = client;
+    ev_io_init(&client->write_watcher, client_write_cb, client->socket,
+	       EV_WRITE);
+    client->write_watcher.data = client;
+    ev_io_init(&client->stop_watcher, client_stop_cb,
+	       client->stop_signal->read_fd, EV_READ);
+    client->stop_watcher.data = client;
+    watchdog_entry_init(&client->watchdog_entry, client_timeout_cb, client);
+
+    ev_io_start(reactor->loop, &client->stop_watcher);
+
+    if (client->serve->newstyle) {
+	debug("client: negotiating");
+	client->negotiating = 1;
+	worker_pool_submit(client->serve->negotiators, &client->negotiate,
+			   client_negotiate, client);
+	return;
+    }
+
+    if (client_open(client) == -1) {
+	client_close(client);
+	return;
+    }
+
+    debug("client: sending hello");
+    if (client_write_init(client, client->serve->size) == -1) {
+	warn(SHOW_ERRNO("Couldn't send hello"));
+	client_close(client);
+	return;
+    }
+
+    client_serve(client);
+}
+
+
+/* Hand the client over to the reactor, which serves it from then on. */
+void client_start(struct client *client)
+{
+    NULLCHECK(client);
+    NULLCHECK(client->serve->reactor);
 
-    return NULL;
+    reactor_call(client->serve->reactor, &client->start, client_start_cb,
+		 client);
 }
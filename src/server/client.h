@@ -1,34 +1,242 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-#include <signal.h>
-#include <time.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <ev.h>
+
+#include "nbdtypes.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "uring.h"
+#include "handshake.h"
+#include "watchdog.h"
 
 /** CLIENT_HANDLER_TIMEOUT
- * This is the length of time (in seconds) any request can be outstanding for.
- * If we spend longer than this in a request, the whole server is killed.
+ * This is the length of time (in seconds) a client can go without any
+ * progress being made while it has a request outstanding. If use_killswitch
+ * is set in the server, we disconnect clients that take longer than this.
  */
 #define CLIENT_HANDLER_TIMEOUT 120
 
-/** CLIENT_KILLSWITCH_SIGNAL
- * The signal number we use to kill the server when *any* killswitch timer
- * fires. The handler gets the fd of the client socket to work with.
+/** CLIENT_MAX_REQUESTS_IN_FLIGHT
+ * The default limit on the number of requests a client can have outstanding
+ * at once.  Requests are serviced concurrently and replied to as they
+ * complete, so replies can come back in a different order to the requests.
+ */
+#define CLIENT_MAX_REQUESTS_IN_FLIGHT 16
+
+/** CLIENT_MAX_SEND_IOVECS
+ * Replies are gathered up and sent with one sendmsg() call where possible;
+ * this is the most iovecs we'll pass it at once.
+ */
+#define CLIENT_MAX_SEND_IOVECS 64
+
+/** CLIENT_TRANSMISSION_FLAGS
+ * What we tell clients we can do, in whichever handshake they get.  As
+ * more features are implemented, this is the place to advertise them.
+ */
+#define CLIENT_TRANSMISSION_FLAGS ( FLAG_HAS_FLAGS | FLAG_SEND_FLUSH | \
+	FLAG_SEND_FUA | FLAG_SEND_TRIM | FLAG_SEND_WRITE_ZEROES | \
+	FLAG_CAN_MULTI_CONN | FLAG_SEND_CACHE )
+
+/** CLIENT_MAX_EXTENTS
+ * The most extents we'll describe in reply to one BLOCK_STATUS.  The
+ * client can ask again, starting from where the reply left off.
+ */
+#define CLIENT_MAX_EXTENTS 1024
+
+/** CLIENT_MAX_PAYLOAD
+ * The most data we'll read or write for one request, as we hold all of it
+ * in memory at once.  Newstyle clients are told this in the handshake, and
+ * anything longer gets EOVERFLOW.  Requests which don't carry data, like
+ * WRITE_ZEROES or BLOCK_STATUS, can be longer.
+ */
+#define CLIENT_MAX_PAYLOAD NBD_MAX_SIZE
+
+/** CLIENT_MAX_READ_RUNS
+ * The most runs of allocated and unallocated blocks we'll split a read
+ * into.  Past this, the rest of the read is read from the file, holes and
+ * all, so a very fragmented file can't make us keep a huge list.
+ */
+#define CLIENT_MAX_READ_RUNS 1024
+
+/** CLIENT_STREAM_TRIGGER
+ * How many reads in a row have to start where the last one ended before we
+ * decide the client is reading sequentially, and start reading ahead of it.
+ */
+#define CLIENT_STREAM_TRIGGER 2
+
+/** CLIENT_READAHEAD_MIN, CLIENT_READAHEAD_MAX
+ * How far ahead of a sequential reader we read to begin with, and how far
+ * that's allowed to grow.  It doubles each time the client catches up with
+ * half of it, and goes back to the start when the client stops reading
+ * sequentially.
+ */
+#define CLIENT_READAHEAD_MIN (128 * 1024)
+#define CLIENT_READAHEAD_MAX (8 * 1024 * 1024)
+
+
+enum client_rx_state {
+    /* Waiting for, or part-way through, a request header */
+    CLIENT_RX_HEADER,
+    /* Reading the data that follows a write request */
+    CLIENT_RX_DATA,
+    /* Throwing away the data for a write we've refused */
+    CLIENT_RX_DISCARD,
+    /* Not reading any more requests */
+    CLIENT_RX_STOPPED
+};
+
+
+/* The header of one structured reply chunk, along with the fixed part of
+ * its payload.  Any data follows separately.  Which header gets sent
+ * depends on whether the client negotiated extended headers, so the type
+ * and length are kept here as well.
  */
-#define CLIENT_KILLSWITCH_SIGNAL ( SIGRTMIN + 1 )
+struct client_chunk {
+    union {
+	struct nbd_structured_reply_raw structured;
+	struct nbd_extended_reply_raw extended;
+    } header;
+    uint16_t type;
+    uint64_t length;
+    union {
+	/* REPLY_TYPE_OFFSET_DATA */
+	__be64 offset;
+	/* REPLY_TYPE_OFFSET_HOLE */
+	struct {
+	    __be64 offset;
+	    __be32 length;
+	} __attribute__ ((packed)) hole;
+	/* REPLY_TYPE_ERROR, with no message */
+	struct {
+	    __be32 error;
+	    __be16 message_length;
+	} __attribute__ ((packed)) error;
+	/* REPLY_TYPE_BLOCK_STATUS, followed by the extents */
+	__be32 context;
+	/* REPLY_TYPE_BLOCK_STATUS_EXT, followed by the extents */
+	struct {
+	    __be32 context;
+	    __be32 count;
+	} __attribute__ ((packed)) context_ext;
+    } __attribute__ ((packed)) payload;
+} __attribute__ ((packed));
+
+/* One extent in a BLOCK_STATUS reply */
+struct client_extent {
+    __be32 length;
+    __be32 flags;
+};
+
+/* One extent in a BLOCK_STATUS_EXT reply, sent with extended headers */
+struct client_extent_ext {
+    __be64 length;
+    __be64 flags;
+};
+
+
+/* A run of a read that's either all allocated, or all unallocated */
+struct client_run {
+    uint64_t len;
+    int allocated;
+};
+
+
+/* What we know about the order a client reads the file in.  Only touched
+ * from the reactor thread, which sees the requests in the order they were
+ * sent, unlike the workers servicing them.
+ */
+struct client_stream {
+    /* Where the next read would start if the client is reading
+     * sequentially, and how many reads in a row have done so.
+     */
+    uint64_t next;
+    uint32_t run;
+    /* Set once run has reached CLIENT_STREAM_TRIGGER */
+    int sequential;
+    /* How far we've read ahead, and how much we read ahead each time */
+    uint64_t ahead;
+    uint64_t window;
+};
+
+
+/* A request that has been read off the socket, but not yet replied to. */
+struct client_job {
+    struct client *client;
+    struct nbd_request request;
+
+    /* The data received for a write, or to be sent for a read.  For a
+     * BLOCK_STATUS, this holds the extents instead.
+     */
+    char *buffer;
+    uint32_t extents_count;
+
+    /* Which parts of a read are allocated, worked out when it's
+     * dispatched.  Only those are read from the file, and the rest of the
+     * buffer is never filled in; they're sent as zeroes, or as holes.
+     */
+    struct client_run *runs;
+    int runs_count;
+
+    /* For a read by a sequential client, more of the file to ask the
+     * kernel to start reading in.  Zero length if there's none.
+     */
+    uint64_t readahead_from;
+    uint64_t readahead_len;
+
+    /* Sent back to the client in the reply */
+    int error;
+
+    /* The reply is either a simple one, or a list of structured reply
+     * chunks, and goes out as reply_iov.  That points at the header and
+     * the data in buffer.
+     */
+    struct nbd_reply_raw reply_raw;
+    struct client_chunk *chunks;
+    struct iovec reply_iov_simple[2];
+    struct iovec *reply_iov;
+    int reply_iovcnt;
+    size_t reply_len;
+    /* How much of the reply has been sent */
+    size_t sent;
+
+    /* Used to hand the job to the workers, and back again */
+    struct worker_job work;
+    struct reactor_call done;
+
+    /* Used instead of the workers if the server has an io_uring */
+    struct uring_op transfer_op;
+    struct uring_op sync_op;
+    struct uring_op readahead_op;
+    struct iovec iov;
+    /* Bytes read or written so far */
+    uint32_t transferred;
+    /* Operations submitted but not yet completed */
+    int uring_pending;
+
+    /* Links the job into whichever of the client's queues it's on */
+    struct client_job *next;
+};
 
 
 struct client {
-    /* When we call pthread_join, if the thread is already dead
-     * we can get an ESRCH.  Since we have no other way to tell
-     * if that ESRCH is from a dead thread or a thread that never
-     * existed, we use a `stopped` flag to indicate a thread which
-     * did exist, but went away.  Only check this after a
-     * pthread_join call.
+    /* Set once the reactor has finished with the client completely, at
+     * which point it is safe to destroy.  Guarded by stop_lock.
      */
     int stopped;
     int socket;
 
+    /* Our slot in the listener's client table, and the next client on its
+     * list of finished ones once we've stopped.
+     */
+    int slot;
+    struct client *next_finished;
+
+    /* The export's file and mapping, once we know which export the
+     * client wants.  They're the export's to close.
+     */
     int fileno;
     char *mapped;
 
@@ -36,23 +244,88 @@ struct client {
 
     struct self_pipe *stop_signal;
 
+    /* The export we're serving.  Clients which negotiate start out with
+     * the listener, and move to the export they ask for.
+     */
     struct server *serve;	/* FIXME: remove above duplication */
+    union mysockaddr address;
 
     /* Have we seen a REQUEST_DISCONNECT message? */
     int disconnect;
 
-    /* kill the whole server if a request has been outstanding too long,
-     * assuming use_killswitch is set in serve
+    /* What the client asked for, if it used the newstyle handshake.  This
+     * is filled in by a worker, before the reactor starts reading requests.
      */
-    timer_t killswitch;
+    struct handshake handshake;
+    int handshake_result;
+    struct worker_job negotiate;
+    struct reactor_call negotiated;
 
-};
+    pthread_mutex_t stop_lock;
+    pthread_cond_t stopped_cond;
+
+    struct reactor *reactor;
+    struct worker_pool *workers;
+
+    struct reactor_call start;
+    struct reactor_call finish;
+
+    /* Everything below is only touched from the reactor thread. */
+    ev_io read_watcher;
+    ev_io write_watcher;
+    ev_io stop_watcher;
+
+    /* Disconnects the client if it stops making progress, assuming
+     * use_killswitch is set in serve
+     */
+    struct watchdog_entry watchdog_entry;
+
+    enum client_rx_state rx_state;
+    /* Whichever the client negotiated */
+    union {
+	struct nbd_request_raw simple;
+	struct nbd_extended_request_raw extended;
+    } rx_request;
+    /* Bytes of the current header or write data read so far */
+    size_t rx_done;
+    /* Bytes of refused write data still to be thrown away */
+    uint64_t rx_discard;
+    /* The write whose data we're reading */
+    struct client_job *rx_job;
 
-void client_killswitch_hit(int signal, siginfo_t * info, void *ptr);
+    /* Whether the client is reading sequentially */
+    struct client_stream stream;
+
+    /* Requests waiting for an overlapping write to finish */
+    struct client_job *pending_head;
+    struct client_job *pending_tail;
+
+    /* Requests the workers are servicing */
+    struct client_job *running;
+
+    /* Replies waiting to be sent */
+    struct client_job *tx_head;
+    struct client_job *tx_tail;
+
+    /* Requests read but not yet replied to, and how many we allow */
+    int in_flight;
+    int max_in_flight;
+
+    /* Set while a worker is negotiating with the client */
+    int negotiating;
+
+    /* Set when we've stopped talking to the client, and are just waiting
+     * for the workers to finish with it.
+     */
+    int closing;
+    int finishing;
+};
 
-void *client_serve(void *client_uncast);
 struct client *client_create(struct server *serve, int socket);
+void client_start(struct client *client);
 void client_destroy(struct client *client);
 void client_signal_stop(struct client *client);
+int client_is_stopped(struct client *client);
+void client_wait_for_stop(struct client *client);
 
 #endif
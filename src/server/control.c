@@ -97,6 +97,7 @@ struct control_client *control_client_create(struct flexnbd *flexnbd,
 
     control_client->socket = client_fd;
     control_client->flexnbd = flexnbd;
+    control_client->serve = flexnbd_server(flexnbd);
     control_client->mirror_state_mbox = state_mbox;
     return control_client;
 }
@@ -319,7 +320,6 @@ int control_mirror(struct control_client *client, int linesc, char **lines)
 {
     NULLCHECK(client);
 
-    struct flexnbd *flexnbd = client->flexnbd;
     union mysockaddr *connect_to = xmalloc(sizeof(union mysockaddr));
     union mysockaddr *connect_from = NULL;
     uint64_t max_Bps = UINT64_MAX;
@@ -384,7 +384,7 @@ int control_mirror(struct control_client *client, int linesc, char **lines)
 	return -1;
     }
 
-    struct server *serve = flexnbd_server(flexnbd);
+    struct server *serve = client->serve;
 
     server_lock_start_mirror(serve);
     {
@@ -438,7 +438,7 @@ int control_mirror_max_bps(struct control_client *client, int linesc,
     NULLCHECK(client);
     NULLCHECK(client->flexnbd);
 
-    struct server *serve = flexnbd_server(client->flexnbd);
+    struct server *serve = client->serve;
     uint64_t max_Bps;
 
     if (!serve->mirror_super) {
@@ -473,10 +473,9 @@ int control_mirror_max_bps(struct control_client *client, int linesc,
 int control_acl(struct control_client *client, int linesc, char **lines)
 {
     NULLCHECK(client);
-    NULLCHECK(client->flexnbd);
-    struct flexnbd *flexnbd = client->flexnbd;
+    NULLCHECK(client->serve);
 
-    int default_deny = flexnbd_default_deny(flexnbd);
+    int default_deny = server_default_deny(client->serve);
     struct acl *new_acl = acl_create(linesc, lines, default_deny);
 
     if (new_acl->len != linesc) {
@@ -487,7 +486,7 @@ int control_acl(struct control_client *client, int linesc, char **lines)
 	write(client->socket, "\n", 1);
 	acl_destroy(new_acl);
     } else {
-	flexnbd_replace_acl(flexnbd, new_acl);
+	server_replace_acl(client->serve, new_acl);
 	info("ACL set");
 	write(client->socket, "0: updated\n", 11);
     }
@@ -505,9 +504,7 @@ int control_break(struct control_client *client,
     NULLCHECK(client->flexnbd);
 
     int result = 0;
-    struct flexnbd *flexnbd = client->flexnbd;
-
-    struct server *serve = flexnbd_server(flexnbd);
+    struct server *serve = client->serve;
 
     server_lock_start_mirror(serve);
     {
@@ -544,8 +541,8 @@ int control_status(struct control_client *client,
     )
 {
     NULLCHECK(client);
-    NULLCHECK(client->flexnbd);
-    struct status *status = flexnbd_status_create(client->flexnbd);
+    NULLCHECK(client->serve);
+    struct status *status = status_create(client->serve);
 
     write(client->socket, "0: ", 3);
     status_write(status, client->socket);
@@ -562,8 +559,8 @@ void control_client_cleanup(struct control_client *client,
     }
 
     /* This is wrongness */
-    if (server_acl_locked(client->flexnbd->serve)) {
-	server_unlock_acl(client->flexnbd->serve);
+    if (client->serve && server_acl_locked(client->serve)) {
+	server_unlock_acl(client->serve);
     }
 
     control_client_destroy(client);
@@ -573,38 +570,52 @@ void control_client_cleanup(struct control_client *client,
 void control_respond(struct control_client *client)
 {
     char **lines = NULL;
+    char **command;
+    int commandc;
 
     error_set_handler((cleanup_handler *) control_client_cleanup, client);
 
     int i, linesc;
     linesc = read_lines_until_blankline(client->socket, 256, &lines);
+    command = lines;
+    commandc = linesc;
+
+    /* Commands for one of the named exports start with its name */
+    if (commandc >= 2 && strcmp(command[0], "export") == 0) {
+	client->serve = server_find_export(client->serve, command[1],
+					   strlen(command[1]));
+	command += 2;
+	commandc -= 2;
+    }
 
-    if (linesc < 1) {
+    if (NULL == client->serve) {
+	write(client->socket, "1: no such export\n", 18);
+    } else if (commandc < 1) {
 	write(client->socket, "9: missing command\n", 19);
 	/* ignore failure */
-    } else if (strcmp(lines[0], "acl") == 0) {
+    } else if (strcmp(command[0], "acl") == 0) {
 	info("acl command received");
-	if (control_acl(client, linesc - 1, lines + 1) < 0) {
+	if (control_acl(client, commandc - 1, command + 1) < 0) {
 	    debug("acl command failed");
 	}
-    } else if (strcmp(lines[0], "mirror") == 0) {
+    } else if (strcmp(command[0], "mirror") == 0) {
 	info("mirror command received");
-	if (control_mirror(client, linesc - 1, lines + 1) < 0) {
+	if (control_mirror(client, commandc - 1, command + 1) < 0) {
 	    debug("mirror command failed");
 	}
-    } else if (strcmp(lines[0], "break") == 0) {
+    } else if (strcmp(command[0], "break") == 0) {
 	info("break command received");
-	if (control_break(client, linesc - 1, lines + 1) < 0) {
+	if (control_break(client, commandc - 1, command + 1) < 0) {
 	    debug("break command failed");
 	}
-    } else if (strcmp(lines[0], "status") == 0) {
+    } else if (strcmp(command[0], "status") == 0) {
 	info("status command received");
-	if (control_status(client, linesc - 1, lines + 1) < 0) {
+	if (control_status(client, commandc - 1, command + 1) < 0) {
 	    debug("status command failed");
 	}
-    } else if (strcmp(lines[0], "mirror_max_bps") == 0) {
+    } else if (strcmp(command[0], "mirror_max_bps") == 0) {
 	info("mirror_max_bps command received");
-	if (control_mirror_max_bps(client, linesc - 1, lines + 1) < 0) {
+	if (control_mirror_max_bps(client, commandc - 1, command + 1) < 0) {
 	    debug("mirror_max_bps command failed");
 	}
     } else {
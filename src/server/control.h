@@ -37,6 +37,8 @@ struct control {
 struct control_client {
     int socket;
     struct flexnbd *flexnbd;
+    /* The export the command is for */
+    struct server *serve;
 
     /* Passed in on creation.  We know it's all right to do this
      * because we know there's only ever one control_client.
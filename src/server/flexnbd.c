@@ -83,9 +83,18 @@ struct flexnbd *flexnbd_create_serving(char *s_ip_address,
 				       int acl_entries,
 				       char **s_acl_entries,
 				       int max_nbd_clients,
-				       int use_killswitch)
+				       int max_requests_in_flight,
+				       uint64_t stream_size,
+				       int use_killswitch,
+				       int always_sync,
+				       int backend, int newstyle,
+				       int exports,
+				       char **export_names,
+				       char **export_files)
 {
     struct flexnbd *flexnbd = xmalloc(sizeof(struct flexnbd));
+    int i;
+
     flexnbd->serve = server_create(flexnbd,
 				   s_ip_address,
 				   s_port,
@@ -93,19 +102,15 @@ struct flexnbd *flexnbd_create_serving(char *s_ip_address,
 				   default_deny,
 				   acl_entries,
 				   s_acl_entries,
-				   max_nbd_clients, use_killswitch, 1);
-    flexnbd_create_shared(flexnbd, s_ctrl_sock);
-
-    // Beats installing one handler per client instance
-    if (use_killswitch) {
-	struct sigaction act = {
-	    .sa_sigaction = client_killswitch_hit,
-	    .sa_flags = SA_RESTART | SA_SIGINFO
-	};
-
-	FATAL_UNLESS(0 == sigaction(CLIENT_KILLSWITCH_SIGNAL, &act, NULL),
-		     "Installing client killswitch signal failed");
+				   max_nbd_clients,
+				   max_requests_in_flight, stream_size,
+				   use_killswitch,
+				   always_sync, backend, newstyle, 1);
+    for (i = 0; i < exports; i++) {
+	server_add_export(flexnbd->serve, export_names[i], export_files[i],
+			  default_deny, acl_entries, s_acl_entries);
     }
+    flexnbd_create_shared(flexnbd, s_ctrl_sock);
 
     return flexnbd;
 }
@@ -124,7 +129,10 @@ struct flexnbd *flexnbd_create_listening(char *s_ip_address,
 				   s_port,
 				   s_file,
 				   default_deny,
-				   acl_entries, s_acl_entries, 1, 0, 0);
+				   acl_entries, s_acl_entries, 1,
+				   CLIENT_MAX_REQUESTS_IN_FLIGHT,
+				   BITSET_STREAM_SIZE, 0, 0,
+				   SERVER_BACKEND_MMAP, 0, 0);
     flexnbd_create_shared(flexnbd, s_ctrl_sock);
 
     // listen can't use killswitch, as mirror may pause on sending things
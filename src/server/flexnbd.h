@@ -37,7 +37,14 @@ struct flexnbd *flexnbd_create_serving(char *s_ip_address,
 				       int acl_entries,
 				       char **s_acl_entries,
 				       int max_nbd_clients,
-				       int use_killswitch);
+				       int max_requests_in_flight,
+				       uint64_t stream_size,
+				       int use_killswitch,
+				       int always_sync,
+				       int backend, int newstyle,
+				       int exports,
+				       char **export_names,
+				       char **export_files);
 
 struct flexnbd *flexnbd_create_listening(char *s_ip_address,
 					 char *s_port,
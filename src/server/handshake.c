@@ -0,0 +1,600 @@
+#include "handshake.h"
+#include "serve.h"
+#include "nbdtypes.h"
+#include "util.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+
+/* The client we're negotiating with, and when we give up on it */
+struct handshake_conn {
+    int fd;
+    struct timespec deadline;
+};
+
+
+static int handshake_set_timeout(int fd, struct timeval tv)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1) {
+	warn(SHOW_ERRNO("Couldn't set socket timeouts"));
+	return -1;
+    }
+
+    return 0;
+}
+
+
+/* Before each read or write, make the socket's timeouts whatever's left
+ * of the time the client has to negotiate in, so that it can't keep us
+ * waiting by sending a byte at a time.  Returns -1 if it's run out.
+ */
+static int handshake_time_left(struct handshake_conn *conn)
+{
+    struct timespec now;
+    struct timeval tv;
+    int64_t left;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (int64_t) (conn->deadline.tv_sec - now.tv_sec) * 1000000 +
+	(conn->deadline.tv_nsec - now.tv_nsec) / 1000;
+    if (left <= 0) {
+	warn("Client took too long to negotiate");
+	return -1;
+    }
+
+    tv.tv_sec = left / 1000000;
+    tv.tv_usec = left % 1000000;
+    return handshake_set_timeout(conn->fd, tv);
+}
+
+
+/* Read or write exactly len bytes.  A timeout shows up as EAGAIN, and
+ * counts as a failure.
+ */
+static int handshake_read(struct handshake_conn *conn, void *buffer,
+			  size_t len)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < len) {
+	if (handshake_time_left(conn) == -1) {
+	    return -1;
+	}
+	result = read(conn->fd, (char *) buffer + done, len - done);
+	if (result == 0) {
+	    debug("Client went away while negotiating");
+	    return -1;
+	}
+	if (result == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    warn(SHOW_ERRNO("Couldn't read from client while negotiating"));
+	    return -1;
+	}
+	done += result;
+    }
+
+    return 0;
+}
+
+static int handshake_write(struct handshake_conn *conn, const void *buffer,
+			   size_t len)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < len) {
+	if (handshake_time_left(conn) == -1) {
+	    return -1;
+	}
+	result = send(conn->fd, (const char *) buffer + done, len - done,
+		      MSG_NOSIGNAL);
+	if (result == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    warn(SHOW_ERRNO("Couldn't write to client while negotiating"));
+	    return -1;
+	}
+	done += result;
+    }
+
+    return 0;
+}
+
+
+static int handshake_reply(struct handshake_conn *conn, uint32_t option,
+			   uint32_t type, const void *data, uint32_t len)
+{
+    struct nbd_option_reply reply;
+    struct nbd_option_reply_raw reply_raw;
+
+    reply.magic = OPTION_REPLY_MAGIC;
+    reply.option = option;
+    reply.type = type;
+    reply.length = len;
+    nbd_h2r_option_reply(&reply, &reply_raw);
+
+    if (handshake_write(conn, &reply_raw, sizeof(reply_raw)) == -1) {
+	return -1;
+    }
+
+    return len > 0 ? handshake_write(conn, data, len) : 0;
+}
+
+
+/* The data that came with an option, and how far through it we've read */
+struct handshake_option {
+    uint32_t option;
+    uint32_t length;
+    char *data;
+    uint32_t offset;
+};
+
+static int option_get(struct handshake_option *opt, void *out, uint32_t len)
+{
+    if (opt->length - opt->offset < len) {
+	return -1;
+    }
+    memcpy(out, opt->data + opt->offset, len);
+    opt->offset += len;
+    return 0;
+}
+
+static int option_get_u16(struct handshake_option *opt, uint16_t * out)
+{
+    uint16_t raw;
+
+    if (option_get(opt, &raw, sizeof(raw)) == -1) {
+	return -1;
+    }
+    *out = be16toh(raw);
+    return 0;
+}
+
+static int option_get_u32(struct handshake_option *opt, uint32_t * out)
+{
+    uint32_t raw;
+
+    if (option_get(opt, &raw, sizeof(raw)) == -1) {
+	return -1;
+    }
+    *out = be32toh(raw);
+    return 0;
+}
+
+/* Point ''out'' at a string of ''len'' bytes, which isn't terminated */
+static int option_get_string(struct handshake_option *opt, uint32_t len,
+			     char **out)
+{
+    if (opt->length - opt->offset < len) {
+	return -1;
+    }
+    *out = opt->data + opt->offset;
+    opt->offset += len;
+    return 0;
+}
+
+
+/* Find the export the client named.  Returns NULL, with ''error'' set to
+ * the reply the client should get, if there's no such export, or it isn't
+ * allowed to have it.
+ */
+static struct server *handshake_find_export(struct server *listener,
+					    union mysockaddr *address,
+					    const char *name,
+					    uint32_t name_len,
+					    uint32_t * error)
+{
+    struct server *serve = server_find_export(listener, name, name_len);
+
+    if (NULL == serve) {
+	debug("Client asked for an export we don't have");
+	*error = OPTION_REPLY_ERR_UNKNOWN;
+	return NULL;
+    }
+    if (!server_acl_accepts(serve, address)) {
+	warn("Client isn't allowed export '%s'", serve->name);
+	*error = OPTION_REPLY_ERR_POLICY;
+	return NULL;
+    }
+    if (!serve->allow_new_clients) {
+	debug("Export '%s' isn't taking new clients", serve->name);
+	*error = OPTION_REPLY_ERR_SHUTDOWN;
+	return NULL;
+    }
+
+    return serve;
+}
+
+
+/* LIST.  The client only hears about the exports it could choose. */
+static int handshake_list(struct handshake_conn *conn,
+			  struct handshake_option *opt,
+			  struct server *listener,
+			  union mysockaddr *address)
+{
+    struct server *serve;
+    char reply[sizeof(uint32_t) + HANDSHAKE_MAX_EXPORT_NAME];
+    uint32_t name_len;
+    uint32_t name_len_raw;
+
+    if (opt->length != 0) {
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_INVALID,
+			       NULL, 0);
+    }
+
+    for (serve = listener; serve; serve = serve->next_export) {
+	if (serve->closed || !server_acl_accepts(serve, address)) {
+	    continue;
+	}
+	name_len = strlen(serve->name);
+	name_len_raw = htobe32(name_len);
+	memcpy(reply, &name_len_raw, sizeof(name_len_raw));
+	memcpy(reply + sizeof(name_len_raw), serve->name, name_len);
+	if (handshake_reply(conn, opt->option, OPTION_REPLY_SERVER, reply,
+			    sizeof(name_len_raw) + name_len) == -1) {
+	    return -1;
+	}
+    }
+
+    return handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0);
+}
+
+
+/* Sent in reply to EXPORT_NAME, which has no way to report errors */
+static int handshake_send_export(struct handshake_conn *conn, uint64_t size,
+				 uint16_t flags, int no_zeroes)
+{
+    struct {
+	uint64_t size;
+	uint16_t flags;
+	char reserved[124];
+    } __attribute__ ((packed)) export = {0};
+
+    export.size = htobe64(size);
+    export.flags = htobe16(flags);
+
+    return handshake_write(conn, &export,
+			   no_zeroes ? sizeof(export) -
+			   sizeof(export.reserved) : sizeof(export));
+}
+
+
+/* INFO and GO.  We tell the client the basics, which we're obliged to send
+ * whether it asks or not, and how long its requests may be, which it needs
+ * to know whether it asks or not.  Returns 1 if the client
+ * was told about the export, and ''export'' set to it, 0 if it got an error
+ * instead, or -1 if we couldn't tell it anything.
+ */
+static int handshake_info(struct handshake_conn *conn,
+			  struct handshake_option *opt,
+			  struct server *listener,
+			  union mysockaddr *address, uint16_t flags,
+			  struct server **export)
+{
+    struct {
+	uint16_t type;
+	uint64_t size;
+	uint16_t flags;
+    } __attribute__ ((packed)) info;
+    struct {
+	uint16_t type;
+	uint32_t minimum;
+	uint32_t preferred;
+	uint32_t maximum;
+    } __attribute__ ((packed)) block_size;
+    uint32_t name_len;
+    char *name;
+    uint16_t requests;
+    uint16_t request;
+    uint32_t error;
+    struct server *serve;
+    int valid;
+    int i;
+
+    valid = option_get_u32(opt, &name_len) == 0 &&
+	option_get_string(opt, name_len, &name) == 0 &&
+	option_get_u16(opt, &requests) == 0;
+    for (i = 0; valid && i < requests; i++) {
+	valid = option_get_u16(opt, &request) == 0;
+    }
+
+    if (!valid || opt->offset != opt->length) {
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_INVALID,
+			       NULL, 0);
+    }
+
+    serve = handshake_find_export(listener, address, name, name_len,
+				  &error);
+    if (NULL == serve) {
+	return handshake_reply(conn, opt->option, error, NULL, 0);
+    }
+
+    info.type = htobe16(INFO_EXPORT);
+    info.size = htobe64(serve->size);
+    info.flags = htobe16(flags);
+
+    block_size.type = htobe16(INFO_BLOCK_SIZE);
+    block_size.minimum = htobe32(1);
+    block_size.preferred = htobe32(block_allocation_resolution);
+    block_size.maximum = htobe32(CLIENT_MAX_PAYLOAD);
+
+    if (handshake_reply(conn, opt->option, OPTION_REPLY_INFO, &info,
+			sizeof(info)) == -1 ||
+	handshake_reply(conn, opt->option, OPTION_REPLY_INFO, &block_size,
+			sizeof(block_size)) == -1 ||
+	handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0) == -1) {
+	return -1;
+    }
+
+    *export = serve;
+    return 1;
+}
+
+
+/* Sent for each metadata context we match */
+static int handshake_send_context(struct handshake_conn *conn,
+				  struct handshake_option *opt,
+				  uint32_t id, const char *name)
+{
+    char reply[sizeof(id) + sizeof(META_CONTEXT_BASE_ALLOCATION)];
+    uint32_t id_raw = htobe32(id);
+    size_t name_len = strlen(name);
+
+    memcpy(reply, &id_raw, sizeof(id_raw));
+    memcpy(reply + sizeof(id_raw), name, name_len);
+
+    return handshake_reply(conn, opt->option, OPTION_REPLY_META_CONTEXT,
+			   reply, sizeof(id_raw) + name_len);
+}
+
+
+/* LIST_META_CONTEXT and SET_META_CONTEXT.  base:allocation is the only
+ * context we have, so the queries either name it, or its namespace when
+ * listing, or don't match anything.
+ */
+static int handshake_meta_context(struct handshake_conn *conn,
+				  struct handshake_option *opt,
+				  struct server *listener,
+				  union mysockaddr *address,
+				  struct handshake *out)
+{
+    static const char *context = META_CONTEXT_BASE_ALLOCATION;
+    int set = opt->option == OPTION_SET_META_CONTEXT;
+    uint32_t name_len;
+    char *name;
+    uint32_t queries;
+    uint32_t query_len;
+    char *query;
+    int matched = 0;
+    uint32_t error;
+    uint32_t i;
+
+    if (set && !out->structured_replies) {
+	/* The contexts are only any use in structured replies */
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_INVALID,
+			       NULL, 0);
+    }
+
+    if (option_get_u32(opt, &name_len) == -1 ||
+	option_get_string(opt, name_len, &name) == -1 ||
+	option_get_u32(opt, &queries) == -1) {
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_INVALID,
+			       NULL, 0);
+    }
+    if (NULL == handshake_find_export(listener, address, name, name_len,
+				      &error)) {
+	return handshake_reply(conn, opt->option, error, NULL, 0);
+    }
+
+    for (i = 0; i < queries; i++) {
+	if (option_get_u32(opt, &query_len) == -1 ||
+	    option_get_string(opt, query_len, &query) == -1) {
+	    return handshake_reply(conn, opt->option,
+				   OPTION_REPLY_ERR_INVALID, NULL, 0);
+	}
+	if (query_len == strlen(context) &&
+	    memcmp(query, context, query_len) == 0) {
+	    matched = 1;
+	} else if (!set && query_len == strlen("base:") &&
+		   memcmp(query, "base:", query_len) == 0) {
+	    matched = 1;
+	}
+    }
+    if (opt->offset != opt->length) {
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_INVALID,
+			       NULL, 0);
+    }
+
+    if (!set && queries == 0) {
+	/* Listing with no queries lists everything */
+	matched = 1;
+    }
+
+    if (set) {
+	/* Each SET replaces whatever was selected before */
+	out->allocation_context =
+	    matched ? HANDSHAKE_ALLOCATION_CONTEXT : 0;
+    }
+
+    if (matched && handshake_send_context(conn, opt,
+					  set ?
+					  HANDSHAKE_ALLOCATION_CONTEXT : 0,
+					  context) == -1) {
+	return -1;
+    }
+
+    return handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0);
+}
+
+
+/* Deal with one option.  Returns 1 if the client has moved on to making
+ * requests, 0 to carry on negotiating, or -1 if we're done with the
+ * client.
+ */
+static int handshake_option(struct handshake_conn *conn,
+			    struct handshake_option *opt,
+			    struct server *listener,
+			    union mysockaddr *address, uint16_t flags,
+			    int no_zeroes, struct handshake *out)
+{
+    struct server *serve;
+    uint32_t error;
+
+    switch (opt->option) {
+    case OPTION_EXPORT_NAME:
+	/* There's no way to refuse, other than hanging up */
+	serve = handshake_find_export(listener, address, opt->data,
+				      opt->length, &error);
+	if (NULL == serve) {
+	    return -1;
+	}
+	debug("Client chose export '%s' by name", serve->name);
+	out->serve = serve;
+	return handshake_send_export(conn, serve->size, flags, no_zeroes) ==
+	    -1 ? -1 : 1;
+    case OPTION_ABORT:
+	debug("Client aborted negotiation");
+	handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0);
+	return -1;
+    case OPTION_LIST:
+	return handshake_list(conn, opt, listener, address);
+    case OPTION_INFO:
+	return handshake_info(conn, opt, listener, address, flags,
+			      &serve) == -1 ? -1 : 0;
+    case OPTION_GO:
+	/* If the option was bad, the client gets to try again */
+	return handshake_info(conn, opt, listener, address, flags,
+			      &out->serve);
+    case OPTION_STRUCTURED_REPLY:
+	if (opt->length != 0) {
+	    return handshake_reply(conn, opt->option,
+				   OPTION_REPLY_ERR_INVALID, NULL, 0);
+	}
+	if (out->extended_headers) {
+	    /* We can't go back to the compact replies */
+	    return handshake_reply(conn, opt->option,
+				   OPTION_REPLY_ERR_EXT_HEADER_REQD, NULL,
+				   0);
+	}
+	debug("Client asked for structured replies");
+	out->structured_replies = 1;
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0);
+    case OPTION_EXTENDED_HEADERS:
+	if (opt->length != 0 || out->extended_headers) {
+	    return handshake_reply(conn, opt->option,
+				   OPTION_REPLY_ERR_INVALID, NULL, 0);
+	}
+	debug("Client asked for extended headers");
+	out->extended_headers = 1;
+	out->structured_replies = 1;
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ACK, NULL, 0);
+    case OPTION_LIST_META_CONTEXT:
+    case OPTION_SET_META_CONTEXT:
+	return handshake_meta_context(conn, opt, listener, address, out);
+    default:
+	debug("Client sent unknown option %" PRIu32, opt->option);
+	return handshake_reply(conn, opt->option, OPTION_REPLY_ERR_UNSUP,
+			       NULL, 0);
+    }
+}
+
+
+int handshake_negotiate(int fd, struct server *listener,
+			union mysockaddr *address, uint16_t flags,
+			struct handshake *out)
+{
+    struct nbd_handshake hello;
+    struct nbd_handshake_raw hello_raw;
+    struct nbd_option option;
+    struct nbd_option_raw option_raw;
+    struct handshake_option opt = { 0 };
+    struct handshake_conn handshake_conn = {.fd = fd };
+    struct handshake_conn *conn = &handshake_conn;
+    struct timeval no_timeout = { 0 };
+    uint32_t client_flags;
+    int no_zeroes;
+    int options = 0;
+    int result = 0;
+
+    memset(out, 0, sizeof(*out));
+
+    clock_gettime(CLOCK_MONOTONIC, &conn->deadline);
+    conn->deadline.tv_sec += HANDSHAKE_TIMEOUT;
+
+    memcpy(hello.passwd, INIT_PASSWD, sizeof(hello.passwd));
+    hello.magic = OPTS_MAGIC;
+    hello.flags = HANDSHAKE_FLAG_FIXED_NEWSTYLE | HANDSHAKE_FLAG_NO_ZEROES;
+    nbd_h2r_handshake(&hello, &hello_raw);
+
+    if (handshake_write(conn, &hello_raw, sizeof(hello_raw)) == -1 ||
+	handshake_read(conn, &client_flags, sizeof(client_flags)) == -1) {
+	return -1;
+    }
+
+    client_flags = be32toh(client_flags);
+    if (!(client_flags & HANDSHAKE_FLAG_FIXED_NEWSTYLE) ||
+	(client_flags & ~(HANDSHAKE_FLAG_FIXED_NEWSTYLE |
+			  HANDSHAKE_FLAG_NO_ZEROES))) {
+	warn("Client sent unsupported flags 0x%08" PRIx32, client_flags);
+	return -1;
+    }
+    no_zeroes = client_flags & HANDSHAKE_FLAG_NO_ZEROES;
+
+    while (result == 0) {
+	if (handshake_read(conn, &option_raw, sizeof(option_raw)) == -1) {
+	    result = -1;
+	    break;
+	}
+	nbd_r2h_option(&option_raw, &option);
+
+	if (option.magic != OPTS_MAGIC) {
+	    warn("Bad option magic 0x%016" PRIx64 " from client",
+		 option.magic);
+	    result = -1;
+	    break;
+	}
+	if (++options > HANDSHAKE_MAX_OPTIONS) {
+	    warn("Client sent more than %d options", HANDSHAKE_MAX_OPTIONS);
+	    result = -1;
+	    break;
+	}
+	if (option.length > HANDSHAKE_MAX_OPTION_LENGTH) {
+	    warn("Option %" PRIu32 " from client is too long (%" PRIu32
+		 " bytes)", option.option, option.length);
+	    result = -1;
+	    break;
+	}
+
+	opt.option = option.option;
+	opt.length = option.length;
+	opt.offset = 0;
+	opt.data = xrealloc(opt.data, option.length > 0 ?
+			    option.length : 1);
+
+	if (handshake_read(conn, opt.data, option.length) == -1) {
+	    result = -1;
+	    break;
+	}
+
+	result = handshake_option(conn, &opt, listener, address, flags,
+				  no_zeroes, out);
+    }
+    free(opt.data);
+
+    if (result == -1) {
+	return -1;
+    }
+
+    return handshake_set_timeout(fd, no_timeout);
+}
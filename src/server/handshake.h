@@ -0,0 +1,68 @@
+#ifndef HANDSHAKE_H
+#define HANDSHAKE_H
+
+/** handshake
+ * The server's side of the fixed newstyle negotiation.  This is a
+ * conversation of blocking reads and writes, which happens before the
+ * client is handed to the reactor, so it runs on one of the listener's
+ * negotiators.  Those are kept apart from the workers doing disc I/O, so
+ * clients that dawdle over negotiating can only hold up each other.
+ */
+
+#include <inttypes.h>
+
+#include "parse.h"
+
+struct server;
+
+/** HANDSHAKE_TIMEOUT
+ * How long (in seconds) a client has to finish negotiating, from the
+ * hello to choosing an export.  The client occupies a negotiator until
+ * it's done, so we don't wait long.
+ */
+#define HANDSHAKE_TIMEOUT 10
+
+/** HANDSHAKE_MAX_OPTIONS
+ * The most options a client may send.  A real one needs half a dozen or
+ * so; beyond this it gets disconnected.
+ */
+#define HANDSHAKE_MAX_OPTIONS 64
+
+/** HANDSHAKE_MAX_OPTION_LENGTH
+ * The most option data we'll accept.  Export names are limited to 4096
+ * bytes, and nothing we understand needs more than a couple of those.
+ * Anything bigger gets the client disconnected.
+ */
+#define HANDSHAKE_MAX_OPTION_LENGTH 16384
+
+/* The longest export name the protocol allows */
+#define HANDSHAKE_MAX_EXPORT_NAME 4096
+
+/* The id we give base:allocation, if the client asks for it */
+#define HANDSHAKE_ALLOCATION_CONTEXT 1
+
+
+/* What the client asked for */
+struct handshake {
+    /* The export it chose */
+    struct server *serve;
+    int structured_replies;
+    /* Requests and replies have 64-bit lengths.  Implies structured
+     * replies, which is all the client will get.
+     */
+    int extended_headers;
+    /* Zero unless the client selected base:allocation */
+    uint32_t allocation_context;
+};
+
+/* Negotiate with the client at ''address'' on ''fd'', which must be
+ * blocking, and fill in ''out''.  The client can choose any of the
+ * listener's exports that its ACL allows, and ''flags'' is what we tell it
+ * about each of them.  Returns 0 if the client has moved on to making
+ * requests, or -1 if it's gone, or we've given up on it.
+ */
+int handshake_negotiate(int fd, struct server *listener,
+			union mysockaddr *address, uint16_t flags,
+			struct handshake *out);
+
+#endif
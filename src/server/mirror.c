@@ -58,6 +58,9 @@ struct xfer {
     uint64_t len;
     uint64_t written;
 
+    /* How much data follows the header; 0 for a TRIM */
+    uint64_t data_len;
+
     /* number of bytes of response read */
     uint64_t read;
 
@@ -88,6 +91,11 @@ struct mirror_ctrl {
     /* Use this to keep track of what we're copying at any moment */
     struct xfer xfer;
 
+    /* What's left of the event we're working through, if it was too big
+     * for one transfer.  len is 0 once it's done.
+     */
+    struct bitset_stream_entry event;
+
 };
 
 struct mirror *mirror_alloc(union mysockaddr *connect_to,
@@ -203,6 +211,8 @@ void mirror_destroy(struct mirror *mirror)
 
 /** The mirror code will split NBD writes, making them this long as a maximum */
 static const int mirror_longest_write = 8 << 20;
+/* TRIM and WRITE_ZEROES have no payload, so can be much bigger */
+static const int mirror_longest_zeroing = 1 << 30;
 
 /* This must not be called if there's any chance of further I/O. Methods to
  * ensure this include:
@@ -288,6 +298,7 @@ int mirror_connect(struct mirror *mirror, uint64_t local_size)
 	    if (socket_nbd_read_hello
 		(mirror->client, &remote_size, &remote_flags)) {
 		if (remote_size == local_size) {
+		    mirror->remote_flags = remote_flags;
 		    connected = 1;
 		    mirror_set_state(mirror, MS_GO);
 		} else {
@@ -335,7 +346,7 @@ int mirror_should_wait(struct mirror_ctrl *ctrl)
 	ctrl->serve->mirror->max_bytes_per_second;
 
     int stream_full = bitset_stream_size(ctrl->serve->allocation_map) >
-	(BITSET_STREAM_SIZE / 2);
+	(bitset_stream_capacity(ctrl->serve->allocation_map) / 2);
 
     return bps_over && !stream_full;
 }
@@ -352,11 +363,14 @@ int mirror_setup_next_xfer(struct mirror_ctrl *ctrl)
 {
     struct mirror *mirror = ctrl->mirror;
     struct server *serve = ctrl->serve;
-    struct bitset_stream_entry e = {.event = BITSET_STREAM_UNSET };
+    struct bitset_stream_entry e = {.event = BITSET_STREAM_ON };
     uint64_t current = mirror->offset, run = 0, size = serve->size;
+    uint16_t type = REQUEST_WRITE;
 
-    /* Technically, we'd be interested in UNSET events too, but they are never
-     * generated. TODO if that changes.
+    /* SET events mean the data has changed, and UNSET events mean a client
+     * punched a hole there, so it now reads as zeroes; we pass those on as
+     * a WRITE_ZEROES or TRIM, or just send the zeroes if the listener can't
+     * take either.  Events too big for one request are sent in pieces.
      *
      * We use ctrl->clear_events to start emptying the stream when it's half
      * full, and stop when it's a quarter full. This stops a busy client from
@@ -364,13 +378,15 @@ int mirror_setup_next_xfer(struct mirror_ctrl *ctrl)
      */
     if (mirror->offset < serve->size
 	&& bitset_stream_size(serve->allocation_map) >
-	BITSET_STREAM_SIZE / 2) {
+	bitset_stream_capacity(serve->allocation_map) / 2) {
 	ctrl->clear_events = 1;
     }
 
 
-    while ((mirror->offset == serve->size || ctrl->clear_events)
-	   && e.event != BITSET_STREAM_SET) {
+    while (ctrl->event.len == 0
+	   && (mirror->offset == serve->size || ctrl->clear_events)
+	   && e.event != BITSET_STREAM_SET
+	   && e.event != BITSET_STREAM_UNSET) {
 	uint64_t events = bitset_stream_size(serve->allocation_map);
 
 	if (events == 0) {
@@ -381,14 +397,33 @@ int mirror_setup_next_xfer(struct mirror_ctrl *ctrl)
 	bitset_stream_dequeue(ctrl->serve->allocation_map, &e);
 	debug("Dequeued event %i, %zu, %zu", e.event, e.from, e.len);
 
-	if (events < (BITSET_STREAM_SIZE / 4)) {
+	if (events < bitset_stream_capacity(serve->allocation_map) / 4) {
 	    ctrl->clear_events = 0;
 	}
     }
 
-    if (e.event == BITSET_STREAM_SET) {
-	current = e.from;
-	run = e.len;
+    if (e.event == BITSET_STREAM_SET || e.event == BITSET_STREAM_UNSET) {
+	ctrl->event = e;
+    }
+
+    if (ctrl->event.len > 0) {
+	if (ctrl->event.event == BITSET_STREAM_UNSET) {
+	    if (mirror->remote_flags & FLAG_SEND_WRITE_ZEROES) {
+		type = REQUEST_WRITE_ZEROES;
+	    } else if (mirror->remote_flags & FLAG_SEND_TRIM) {
+		type = REQUEST_TRIM;
+	    }
+	}
+
+	current = ctrl->event.from;
+	run = ctrl->event.len;
+	if (type == REQUEST_WRITE && run > (uint64_t) mirror_longest_write) {
+	    run = mirror_longest_write;
+	} else if (run > (uint64_t) mirror_longest_zeroing) {
+	    run = mirror_longest_zeroing;
+	}
+	ctrl->event.from += run;
+	ctrl->event.len -= run;
     } else if (current < serve->size) {
 	current = mirror->offset;
 	run = mirror_longest_write;
@@ -402,11 +437,11 @@ int mirror_setup_next_xfer(struct mirror_ctrl *ctrl)
 	return 0;
     }
 
-    debug("Next transfer: current=%" PRIu64 ", run=%" PRIu64, current,
-	  run);
+    debug("Next transfer: type=%" PRIu16 ", current=%" PRIu64 ", run=%"
+	  PRIu64, type, current, run);
     struct nbd_request req = {
 	.magic = REQUEST_MAGIC,
-	.type = REQUEST_WRITE,
+	.type = type,
 	.handle.b = ".MIRROR.",
 	.from = current,
 	.len = run
@@ -415,6 +450,7 @@ int mirror_setup_next_xfer(struct mirror_ctrl *ctrl)
 
     ctrl->xfer.from = current;
     ctrl->xfer.len = run;
+    ctrl->xfer.data_len = type == REQUEST_WRITE ? run : 0;
 
     ctrl->xfer.written = 0;
     ctrl->xfer.read = 0;
@@ -470,7 +506,7 @@ static void mirror_write_cb(struct ev_loop *loop, ev_io * w, int revents)
     } else {
 	data_loc =
 	    ctrl->mirror->mapped + xfer->from + (xfer->written - hdr_size);
-	to_write = xfer->len - (ctrl->xfer.written - hdr_size);
+	to_write = xfer->data_len - (ctrl->xfer.written - hdr_size);
     }
 
     // Actually write some bytes
@@ -491,7 +527,7 @@ static void mirror_write_cb(struct ev_loop *loop, ev_io * w, int revents)
 	ev_timer_again(ctrl->ev_loop, &ctrl->timeout_watcher);
     }
     // All bytes written, so now we need to read the NBD reply back.
-    if (ctrl->xfer.written == ctrl->xfer.len + hdr_size) {
+    if (ctrl->xfer.written == ctrl->xfer.data_len + hdr_size) {
 	sock_set_tcp_cork(ctrl->mirror->client, 0);
 	ev_io_start(loop, &ctrl->read_watcher);
 	ev_io_stop(loop, &ctrl->write_watcher);
@@ -584,7 +620,7 @@ static void mirror_read_cb(struct ev_loop *loop, ev_io * w, int revents)
      * discs getting stuck in "drain the event queue!" mode forever
      */
     if (!ctrl->clear_events) {
-	m->all_dirty += xfer->len;
+	m->all_dirty += xfer->data_len;
     }
 
 
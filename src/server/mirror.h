@@ -86,6 +86,9 @@ struct mirror {
     int client;
     const char *filename;
 
+    /* What the listener told us it supports in its hello */
+    uint32_t remote_flags;
+
     /* Limiter, used to restrict migration speed Only dirty bytes (those going
      * over the network) are considered */
     uint64_t max_bytes_per_second;
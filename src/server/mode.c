@@ -16,11 +16,19 @@ static struct option serve_options[] = {
     GETOPT_DENY,
     GETOPT_QUIET,
     GETOPT_KILLSWITCH,
+    GETOPT_QUEUE_DEPTH,
+    GETOPT_MAX_CLIENTS,
+    GETOPT_STREAM_SIZE,
+    GETOPT_ALWAYS_SYNC,
+    GETOPT_BACKEND,
+    GETOPT_NEWSTYLE,
+    GETOPT_EXPORT,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char serve_short_options[] = "hl:p:f:s:dk" SOPT_QUIET SOPT_VERBOSE;
+static char serve_short_options[] =
+    "hl:p:f:s:dkQ:M:z:yB:ne:" SOPT_QUIET SOPT_VERBOSE;
 static char serve_help_text[] =
     "Usage: flexnbd " CMD_SERVE " <options> [<acl address>*]\n\n"
     "Serve FILE from ADDR:PORT, with an optional control socket at SOCK.\n\n"
@@ -30,8 +38,22 @@ static char serve_help_text[] =
     "\t--" OPT_FILE ",-f <FILE>\tThe file to serve.\n"
     "\t--" OPT_DENY ",-d\tDeny connections by default unless in ACL.\n"
     "\t--" OPT_KILLSWITCH
-    ",-k  \tKill the server if a request takes 120 seconds.\n" SOCK_LINE
-    VERBOSE_LINE QUIET_LINE;
+    ",-k  \tDisconnect clients if a request takes 120 seconds.\n"
+    "\t--" OPT_QUEUE_DEPTH
+    ",-Q <N>\tAllow each client N requests in flight (default 16).\n"
+    "\t--" OPT_MAX_CLIENTS
+    ",-M <N>\tAllow N clients at once (default 1024).\n"
+    "\t--" OPT_STREAM_SIZE
+    ",-z <N>\tQueue up to N changes for a mirror before overflowing.\n"
+    "\t--" OPT_ALWAYS_SYNC
+    ",-y\tSync every write to disc, not just FUA writes.\n"
+    "\t--" OPT_BACKEND
+    ",-B <B>\tDo disc I/O with 'mmap' (default), 'io_uring' or 'direct'.\n"
+    "\t--" OPT_NEWSTYLE
+    ",-n\tUse the fixed newstyle handshake, for structured replies.\n"
+    "\t--" OPT_EXPORT
+    ",-e <NAME=FILE>\tAlso serve FILE as NAME.  Implies --newstyle.\n"
+    SOCK_LINE VERBOSE_LINE QUIET_LINE;
 
 
 static struct option listen_options[] = {
@@ -96,31 +118,33 @@ static char write_help_text[] =
 static struct option acl_options[] = {
     GETOPT_HELP,
     GETOPT_SOCK,
+    GETOPT_EXPORT,
     GETOPT_QUIET,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char acl_short_options[] = "hs:" SOPT_QUIET SOPT_VERBOSE;
+static char acl_short_options[] = "hs:e:" SOPT_QUIET SOPT_VERBOSE;
 static char acl_help_text[] =
     "Usage: flexnbd " CMD_ACL " <options> [<acl address>+]\n\n"
     "Set the access control list for a server with control socket SOCK.\n\n"
-    HELP_LINE SOCK_LINE VERBOSE_LINE QUIET_LINE;
+    HELP_LINE SOCK_LINE EXPORT_LINE VERBOSE_LINE QUIET_LINE;
 
 static struct option mirror_speed_options[] = {
     GETOPT_HELP,
     GETOPT_SOCK,
     GETOPT_MAX_SPEED,
+    GETOPT_EXPORT,
     GETOPT_QUIET,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char mirror_speed_short_options[] = "hs:m:" SOPT_QUIET SOPT_VERBOSE;
+static char mirror_speed_short_options[] = "hs:m:e:" SOPT_QUIET SOPT_VERBOSE;
 static char mirror_speed_help_text[] =
     "Usage: flexnbd " CMD_MIRROR_SPEED " <options>\n\n"
     "Set the maximum speed of a migration from a mirring server listening on SOCK.\n\n"
-    HELP_LINE SOCK_LINE MAX_SPEED_LINE VERBOSE_LINE QUIET_LINE;
+    HELP_LINE SOCK_LINE MAX_SPEED_LINE EXPORT_LINE VERBOSE_LINE QUIET_LINE;
 
 static struct option mirror_options[] = {
     GETOPT_HELP,
@@ -129,12 +153,13 @@ static struct option mirror_options[] = {
     GETOPT_PORT,
     GETOPT_UNLINK,
     GETOPT_BIND,
+    GETOPT_EXPORT,
     GETOPT_QUIET,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char mirror_short_options[] = "hs:l:p:ub:" SOPT_QUIET SOPT_VERBOSE;
+static char mirror_short_options[] = "hs:l:p:ub:e:" SOPT_QUIET SOPT_VERBOSE;
 static char mirror_help_text[] =
     "Usage: flexnbd " CMD_MIRROR " <options>\n\n"
     "Start mirroring from the server with control socket SOCK to one at ADDR:PORT.\n\n"
@@ -143,36 +168,38 @@ static char mirror_help_text[] =
     "\t--" OPT_PORT ",-p <PORT>\tThe port to mirror to.\n"
     SOCK_LINE
     "\t--" OPT_UNLINK ",-u\tUnlink the local file when done.\n"
-    BIND_LINE VERBOSE_LINE QUIET_LINE;
+    BIND_LINE EXPORT_LINE VERBOSE_LINE QUIET_LINE;
 
 static struct option break_options[] = {
     GETOPT_HELP,
     GETOPT_SOCK,
+    GETOPT_EXPORT,
     GETOPT_QUIET,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char break_short_options[] = "hs:" SOPT_QUIET SOPT_VERBOSE;
+static char break_short_options[] = "hs:e:" SOPT_QUIET SOPT_VERBOSE;
 static char break_help_text[] =
     "Usage: flexnbd " CMD_BREAK " <options>\n\n"
     "Stop mirroring from the server with control socket SOCK.\n\n"
-    HELP_LINE SOCK_LINE VERBOSE_LINE QUIET_LINE;
+    HELP_LINE SOCK_LINE EXPORT_LINE VERBOSE_LINE QUIET_LINE;
 
 
 static struct option status_options[] = {
     GETOPT_HELP,
     GETOPT_SOCK,
+    GETOPT_EXPORT,
     GETOPT_QUIET,
     GETOPT_VERBOSE,
     {0}
 };
 
-static char status_short_options[] = "hs:" SOPT_QUIET SOPT_VERBOSE;
+static char status_short_options[] = "hs:e:" SOPT_QUIET SOPT_VERBOSE;
 static char status_help_text[] =
     "Usage: flexnbd " CMD_STATUS " <options>\n\n"
     "Get the status for a server with control socket SOCK.\n\n"
-    HELP_LINE SOCK_LINE VERBOSE_LINE QUIET_LINE;
+    HELP_LINE SOCK_LINE EXPORT_LINE VERBOSE_LINE QUIET_LINE;
 
 char help_help_text_arr[] =
     "Usage: flexnbd <cmd> [cmd options]\n\n"
@@ -196,11 +223,16 @@ char *help_help_text = help_help_text_arr;
 
 void do_read(struct mode_readwrite_params *params);
 void do_write(struct mode_readwrite_params *params);
-void do_remote_command(char *command, char *mode, int argc, char **argv);
+void do_remote_command(char *command, char *export, char *mode, int argc,
+		       char **argv);
 
 
 void read_serve_param(int c, char **ip_addr, char **ip_port, char **file,
-		      char **sock, int *default_deny, int *use_killswitch)
+		      char **sock, int *default_deny, int *use_killswitch,
+		      int *queue_depth, int *max_clients,
+		      long long *stream_size, int *always_sync,
+		      enum server_backend *backend, int *newstyle,
+		      int *exports, char ***export_names)
 {
     switch (c) {
     case 'h':
@@ -230,6 +262,39 @@ void read_serve_param(int c, char **ip_addr, char **ip_port, char **file,
     case 'k':
 	*use_killswitch = 1;
 	break;
+    case 'Q':
+	*queue_depth = atoi(optarg);
+	break;
+    case 'M':
+	*max_clients = atoi(optarg);
+	break;
+    case 'z':
+	*stream_size = atoll(optarg);
+	break;
+    case 'y':
+	*always_sync = 1;
+	break;
+    case 'B':
+	if (strcmp(optarg, "mmap") == 0) {
+	    *backend = SERVER_BACKEND_MMAP;
+	} else if (strcmp(optarg, "io_uring") == 0) {
+	    *backend = SERVER_BACKEND_IO_URING;
+	} else if (strcmp(optarg, "direct") == 0) {
+	    *backend = SERVER_BACKEND_DIRECT;
+	} else {
+	    fprintf(stderr, "Unknown backend '%s'\n", optarg);
+	    exit_err(serve_help_text);
+	}
+	break;
+    case 'n':
+	*newstyle = 1;
+	break;
+    case 'e':
+	/* Split into name and file once we've seen them all */
+	*export_names = xrealloc(*export_names,
+				 (*exports + 1) * sizeof(char *));
+	(*export_names)[(*exports)++] = optarg;
+	break;
     default:
 	exit_err(serve_help_text);
 	break;
@@ -308,7 +373,7 @@ void read_readwrite_param(int c, char **ip_addr, char **ip_port,
     }
 }
 
-void read_sock_param(int c, char **sock, char *help_text)
+void read_sock_param(int c, char **sock, char **export, char *help_text)
 {
     switch (c) {
     case 'h':
@@ -317,6 +382,9 @@ void read_sock_param(int c, char **sock, char *help_text)
     case 's':
 	*sock = optarg;
 	break;
+    case 'e':
+	*export = optarg;
+	break;
     case 'q':
 	log_level = QUIET_LOG_LEVEL;
 	break;
@@ -329,12 +397,13 @@ void read_sock_param(int c, char **sock, char *help_text)
     }
 }
 
-void read_acl_param(int c, char **sock)
+void read_acl_param(int c, char **sock, char **export)
 {
-    read_sock_param(c, sock, acl_help_text);
+    read_sock_param(c, sock, export, acl_help_text);
 }
 
-void read_mirror_speed_param(int c, char **sock, char **max_speed)
+void read_mirror_speed_param(int c, char **sock, char **max_speed,
+			     char **export)
 {
     switch (c) {
     case 'h':
@@ -346,6 +415,9 @@ void read_mirror_speed_param(int c, char **sock, char **max_speed)
     case 'm':
 	*max_speed = optarg;
 	break;
+    case 'e':
+	*export = optarg;
+	break;
     case 'q':
 	log_level = QUIET_LOG_LEVEL;
 	break;
@@ -362,7 +434,8 @@ void read_mirror_speed_param(int c, char **sock, char **max_speed)
 void read_mirror_param(int c,
 		       char **sock,
 		       char **ip_addr,
-		       char **ip_port, int *unlink, char **bind_addr)
+		       char **ip_port, int *unlink, char **bind_addr,
+		       char **export)
 {
     switch (c) {
     case 'h':
@@ -383,6 +456,9 @@ void read_mirror_param(int c,
     case 'b':
 	*bind_addr = optarg;
 	break;
+    case 'e':
+	*export = optarg;
+	break;
     case 'q':
 	log_level = QUIET_LOG_LEVEL;
 	break;
@@ -395,7 +471,7 @@ void read_mirror_param(int c,
     }
 }
 
-void read_break_param(int c, char **sock)
+void read_break_param(int c, char **sock, char **export)
 {
     switch (c) {
     case 'h':
@@ -404,6 +480,9 @@ void read_break_param(int c, char **sock)
     case 's':
 	*sock = optarg;
 	break;
+    case 'e':
+	*export = optarg;
+	break;
     case 'q':
 	log_level = QUIET_LOG_LEVEL;
 	break;
@@ -417,9 +496,9 @@ void read_break_param(int c, char **sock)
 }
 
 
-void read_status_param(int c, char **sock)
+void read_status_param(int c, char **sock, char **export)
 {
-    read_sock_param(c, sock, status_help_text);
+    read_sock_param(c, sock, export, status_help_text);
 }
 
 int mode_serve(int argc, char *argv[])
@@ -431,7 +510,18 @@ int mode_serve(int argc, char *argv[])
     char *sock = NULL;
     int default_deny = 0;	// not on by default
     int use_killswitch = 0;
+    int queue_depth = CLIENT_MAX_REQUESTS_IN_FLIGHT;
+    int max_clients = MAX_NBD_CLIENTS;
+    long long stream_size = BITSET_STREAM_SIZE;
+    int always_sync = 0;
+    enum server_backend backend = SERVER_BACKEND_MMAP;
+    int newstyle = 0;
+    int exports = 0;
+    char **export_names = NULL;
+    char **export_files;
+    char *equals;
     int err = 0;
+    int i;
 
     int success;
 
@@ -445,7 +535,9 @@ int mode_serve(int argc, char *argv[])
 	}
 
 	read_serve_param(c, &ip_addr, &ip_port, &file, &sock,
-			 &default_deny, &use_killswitch);
+			 &default_deny, &use_killswitch, &queue_depth,
+			 &max_clients, &stream_size, &always_sync, &backend, &newstyle, &exports,
+			 &export_names);
     }
 
     if (NULL == ip_addr || NULL == ip_port) {
@@ -456,17 +548,55 @@ int mode_serve(int argc, char *argv[])
 	err = 1;
 	fprintf(stderr, "--file is required\n");
     }
+    if (queue_depth < 1) {
+	err = 1;
+	fprintf(stderr, "--queue-depth must be at least 1\n");
+    }
+    if (max_clients < 1) {
+	err = 1;
+	fprintf(stderr, "--max-clients must be at least 1\n");
+    }
+    if (stream_size < 1) {
+	err = 1;
+	fprintf(stderr, "--stream-size must be at least 1\n");
+    }
+    export_files = xmalloc((exports + 1) * sizeof(char *));
+    for (i = 0; i < exports; i++) {
+	equals = strchr(export_names[i], '=');
+	if (NULL == equals || equals == export_names[i] ||
+	    equals[1] == '\0' ||
+	    equals - export_names[i] > HANDSHAKE_MAX_EXPORT_NAME) {
+	    err = 1;
+	    fprintf(stderr, "--export must be NAME=FILE, not '%s'\n",
+		    export_names[i]);
+	    continue;
+	}
+	*equals = '\0';
+	export_files[i] = equals + 1;
+    }
     if (err) {
 	exit_err(serve_help_text);
     }
+    if (exports > 0) {
+	/* Oldstyle clients can't choose */
+	newstyle = 1;
+    }
 
     flexnbd =
 	flexnbd_create_serving(ip_addr, ip_port, file, sock, default_deny,
 			       argc - optind, argv + optind,
-			       MAX_NBD_CLIENTS, use_killswitch);
+			       max_clients, queue_depth, stream_size,
+			       use_killswitch, always_sync, backend,
+			       newstyle, exports, export_names,
+			       export_files);
     info("Serving file %s", file);
+    for (i = 0; i < exports; i++) {
+	info("Serving file %s as '%s'", export_files[i], export_names[i]);
+    }
     success = flexnbd_serve(flexnbd);
     flexnbd_destroy(flexnbd);
+    free(export_files);
+    free(export_names);
 
     return success ? 0 : 1;
 }
@@ -678,13 +808,14 @@ int mode_acl(int argc, char *argv[])
 {
     int c;
     char *sock = NULL;
+    char *export = NULL;
 
     while (1) {
 	c = getopt_long(argc, argv, acl_short_options, acl_options, NULL);
 	if (c == -1) {
 	    break;
 	}
-	read_acl_param(c, &sock);
+	read_acl_param(c, &sock, &export);
     }
 
     if (NULL == sock) {
@@ -695,7 +826,7 @@ int mode_acl(int argc, char *argv[])
     /* Don't use the CMD_ACL macro here, "acl" is the remote command
      * name, not the cli option
      */
-    do_remote_command("acl", sock, argc - optind, argv + optind);
+    do_remote_command("acl", export, sock, argc - optind, argv + optind);
 
     return 0;
 }
@@ -706,6 +837,7 @@ int mode_mirror_speed(int argc, char *argv[])
     int c;
     char *sock = NULL;
     char *speed = NULL;
+    char *export = NULL;
 
     while (1) {
 	c = getopt_long(argc, argv, mirror_speed_short_options,
@@ -713,7 +845,7 @@ int mode_mirror_speed(int argc, char *argv[])
 	if (-1 == c) {
 	    break;
 	}
-	read_mirror_speed_param(c, &sock, &speed);
+	read_mirror_speed_param(c, &sock, &speed, &export);
     }
 
     if (NULL == sock) {
@@ -726,7 +858,7 @@ int mode_mirror_speed(int argc, char *argv[])
 	exit_err(mirror_speed_help_text);
     }
 
-    do_remote_command("mirror_max_bps", sock, 1, &speed);
+    do_remote_command("mirror_max_bps", export, sock, 1, &speed);
     return 0;
 }
 
@@ -736,6 +868,7 @@ int mode_mirror(int argc, char *argv[])
     int c;
     char *sock = NULL;
     char *remote_argv[4] = { 0 };
+    char *export = NULL;
     int err = 0;
     int unlink = 0;
 
@@ -750,7 +883,7 @@ int mode_mirror(int argc, char *argv[])
 	read_mirror_param(c,
 			  &sock,
 			  &remote_argv[0],
-			  &remote_argv[1], &unlink, &remote_argv[3]);
+			  &remote_argv[1], &unlink, &remote_argv[3], &export);
     }
 
     if (NULL == sock) {
@@ -769,9 +902,9 @@ int mode_mirror(int argc, char *argv[])
     }
 
     if (remote_argv[3] == NULL) {
-	do_remote_command("mirror", sock, 3, remote_argv);
+	do_remote_command("mirror", export, sock, 3, remote_argv);
     } else {
-	do_remote_command("mirror", sock, 4, remote_argv);
+	do_remote_command("mirror", export, sock, 4, remote_argv);
     }
 
     return 0;
@@ -782,6 +915,7 @@ int mode_break(int argc, char *argv[])
 {
     int c;
     char *sock = NULL;
+    char *export = NULL;
 
     while (1) {
 	c = getopt_long(argc, argv, break_short_options, break_options,
@@ -789,7 +923,7 @@ int mode_break(int argc, char *argv[])
 	if (-1 == c) {
 	    break;
 	}
-	read_break_param(c, &sock);
+	read_break_param(c, &sock, &export);
     }
 
     if (NULL == sock) {
@@ -797,7 +931,7 @@ int mode_break(int argc, char *argv[])
 	exit_err(break_help_text);
     }
 
-    do_remote_command("break", sock, argc - optind, argv + optind);
+    do_remote_command("break", export, sock, argc - optind, argv + optind);
 
     return 0;
 }
@@ -806,6 +940,7 @@ int mode_status(int argc, char *argv[])
 {
     int c;
     char *sock = NULL;
+    char *export = NULL;
 
     while (1) {
 	c = getopt_long(argc, argv, status_short_options, status_options,
@@ -813,7 +948,7 @@ int mode_status(int argc, char *argv[])
 	if (-1 == c) {
 	    break;
 	}
-	read_status_param(c, &sock);
+	read_status_param(c, &sock, &export);
     }
 
     if (NULL == sock) {
@@ -821,7 +956,8 @@ int mode_status(int argc, char *argv[])
 	exit_err(status_help_text);
     }
 
-    do_remote_command("status", sock, argc - optind, argv + optind);
+    do_remote_command("status", export, sock, argc - optind,
+		      argv + optind);
 
     return 0;
 }
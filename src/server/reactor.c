@@ -0,0 +1,136 @@
+#include "reactor.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+
+#include <ev.h>
+
+
+static void reactor_wakeup_cb(struct ev_loop *loop, ev_async * w,
+			      int revents __attribute__ ((unused)))
+{
+    struct reactor *reactor = (struct reactor *) w->data;
+    struct reactor_call *calls;
+    struct reactor_call *next;
+    int stop;
+
+    pthread_mutex_lock(&reactor->lock);
+    {
+	calls = reactor->calls_head;
+	reactor->calls_head = NULL;
+	reactor->calls_tail = NULL;
+	stop = reactor->stop;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    while (calls) {
+	next = calls->next;
+	calls->next = NULL;
+	calls->run(reactor, calls->data);
+	calls = next;
+    }
+
+    if (stop) {
+	ev_break(loop, EVBREAK_ALL);
+    }
+}
+
+
+/* Nothing that runs on the reactor may use error(), since we can't unwind
+ * the loop.  If it happens anyway, there's no way to carry on.
+ */
+void reactor_cleanup(struct reactor *reactor
+		     __attribute__ ((unused)), int fatal
+		     __attribute__ ((unused)))
+{
+    fatal("Error in the client reactor thread");
+}
+
+
+void *reactor_run(void *reactor_uncast)
+{
+    struct reactor *reactor = (struct reactor *) reactor_uncast;
+    sigset_t mask;
+
+    /* Signals are for the main thread to deal with. */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    error_set_handler((cleanup_handler *) reactor_cleanup, reactor);
+
+    debug("reactor %p: running", reactor);
+    ev_run(reactor->loop, 0);
+    debug("reactor %p: stopped", reactor);
+
+    return NULL;
+}
+
+
+struct reactor *reactor_create(void)
+{
+    struct reactor *reactor = xmalloc(sizeof(struct reactor));
+
+    reactor->loop = ev_loop_new(EVFLAG_AUTO);
+    FATAL_IF_NULL(reactor->loop, "Couldn't create an event loop");
+
+    FATAL_UNLESS(0 == pthread_mutex_init(&reactor->lock, NULL),
+		 "Failed to initialise a mutex");
+
+    ev_async_init(&reactor->wakeup, reactor_wakeup_cb);
+    reactor->wakeup.data = reactor;
+    ev_async_start(reactor->loop, &reactor->wakeup);
+
+    FATAL_UNLESS_ZERO(pthread_create(&reactor->thread, NULL,
+				     reactor_run, reactor),
+		      "Couldn't create reactor thread");
+
+    return reactor;
+}
+
+
+void reactor_call(struct reactor *reactor, struct reactor_call *call,
+		  reactor_call_fn * run, void *data)
+{
+    NULLCHECK(reactor);
+    NULLCHECK(call);
+
+    call->run = run;
+    call->data = data;
+    call->next = NULL;
+
+    pthread_mutex_lock(&reactor->lock);
+    {
+	if (reactor->calls_tail) {
+	    reactor->calls_tail->next = call;
+	} else {
+	    reactor->calls_head = call;
+	}
+	reactor->calls_tail = call;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+
+    ev_async_send(reactor->loop, &reactor->wakeup);
+}
+
+
+void reactor_destroy(struct reactor *reactor)
+{
+    if (NULL == reactor) {
+	return;
+    }
+
+    pthread_mutex_lock(&reactor->lock);
+    {
+	reactor->stop = 1;
+    }
+    pthread_mutex_unlock(&reactor->lock);
+    ev_async_send(reactor->loop, &reactor->wakeup);
+
+    FATAL_UNLESS_ZERO(pthread_join(reactor->thread, NULL),
+		      "Couldn't join reactor thread");
+
+    ev_loop_destroy(reactor->loop);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor);
+}
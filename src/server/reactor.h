@@ -0,0 +1,64 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+/** reactor
+ * A thread running a libev loop, which owns every watcher started on it.
+ * Other threads mustn't touch the loop directly; instead they hand the
+ * reactor a call, which it runs on its own thread at the next opportunity.
+ * Calls are run in the order they were made.
+ */
+
+#include <pthread.h>
+#include <ev.h>
+
+/* compat with older libev */
+#ifndef EVBREAK_ONE
+
+#define ev_run( loop, flags ) ev_loop( loop, flags )
+
+#define ev_break(loop, how) ev_unloop( loop, how )
+
+#define EVBREAK_ONE EVUNLOOP_ONE
+#define EVBREAK_ALL EVUNLOOP_ALL
+
+#endif
+
+struct reactor;
+typedef void (reactor_call_fn) (struct reactor *, void *data);
+
+struct reactor_call {
+    reactor_call_fn *run;
+    void *data;
+    struct reactor_call *next;
+};
+
+struct reactor {
+    struct ev_loop *loop;
+    pthread_t thread;
+
+    /* Wakes the loop up when there are calls waiting */
+    ev_async wakeup;
+
+    /* Covers the call queue and the stop flag */
+    pthread_mutex_t lock;
+    struct reactor_call *calls_head;
+    struct reactor_call *calls_tail;
+    int stop;
+};
+
+/* Create a loop, and start a thread running it. */
+struct reactor *reactor_create(void);
+
+/* Have ''run'' called with ''data'' on the reactor thread.  This is safe to
+ * call from any thread, including the reactor's own.  ''call'' is used to
+ * queue it, and must stay valid until ''run'' is called.
+ */
+void reactor_call(struct reactor *reactor, struct reactor_call *call,
+		  reactor_call_fn * run, void *data);
+
+/* Run any outstanding calls, stop the loop, and free the reactor.  Any
+ * watchers still started on the loop are abandoned.
+ */
+void reactor_destroy(struct reactor *reactor);
+
+#endif
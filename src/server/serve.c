@@ -7,6 +7,11 @@
 #include "bitset.h"
 #include "control.h"
 #include "self_pipe.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "uring.h"
+#include "block_cache.h"
+#include "watchdog.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -21,6 +26,11 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 
+static void server_grow_client_table(struct server *serve);
+static void server_reap_clients(struct server *listener);
+static void server_lock_clients(struct server *serve);
+static void server_unlock_clients(struct server *serve);
+
 struct server *server_create(struct flexnbd *flexnbd,
 			     char *s_ip_address,
 			     char *s_port,
@@ -29,20 +39,31 @@ struct server *server_create(struct flexnbd *flexnbd,
 			     int acl_entries,
 			     char **s_acl_entries,
 			     int max_nbd_clients,
-			     int use_killswitch, int success)
+			     int max_requests_in_flight,
+			     uint64_t stream_size,
+			     int use_killswitch,
+			     int always_sync,
+			     enum server_backend backend, int newstyle,
+			     int success)
 {
     NULLCHECK(flexnbd);
     struct server *out;
     out = xmalloc(sizeof(struct server));
     out->flexnbd = flexnbd;
+    out->name = "";
     out->success = success;
     out->max_nbd_clients = max_nbd_clients;
+    out->max_requests_in_flight = max_requests_in_flight;
+    out->stream_size = stream_size;
     out->use_killswitch = use_killswitch;
+    out->always_sync = always_sync;
+    out->backend = backend;
+    out->newstyle = newstyle;
 
     server_allow_new_clients(out);
 
-    out->nbd_client =
-	xmalloc(max_nbd_clients * sizeof(struct client_tbl_entry));
+    out->nbd_client_free = -1;
+    server_grow_client_table(out);
     out->tcp_backlog = 10;	/* does this need to be settable? */
 
     FATAL_IF_NULL(s_ip_address, "No IP address supplied");
@@ -66,6 +87,11 @@ struct server *server_create(struct flexnbd *flexnbd,
 
     out->l_acl = flexthread_mutex_create();
     out->l_start_mirror = flexthread_mutex_create();
+    out->l_clients = flexthread_mutex_create();
+    FATAL_UNLESS(0 == pthread_mutex_init(&out->dirty.lock, NULL),
+		 "Failed to initialise a mutex");
+    FATAL_UNLESS(0 == pthread_mutex_init(&out->readahead.lock, NULL),
+		 "Failed to initialise a mutex");
 
     out->mirror_can_start = 1;
 
@@ -75,20 +101,182 @@ struct server *server_create(struct flexnbd *flexnbd,
     NULLCHECK(out->close_signal);
     NULLCHECK(out->acl_updated_signal);
 
+    out->reactor = reactor_create();
+    out->workers = worker_pool_create(SERVER_WORKER_THREADS,
+				       SERVER_WORKER_STACK_SIZE);
+    if (newstyle) {
+	out->negotiators = worker_pool_create(SERVER_NEGOTIATOR_THREADS,
+					      SERVER_WORKER_STACK_SIZE);
+    }
+    if (use_killswitch) {
+	out->watchdog = watchdog_create(CLIENT_HANDLER_TIMEOUT);
+	watchdog_start(out->watchdog, out->reactor);
+    }
+
+    if (backend == SERVER_BACKEND_IO_URING) {
+	out->uring = uring_create(SERVER_URING_ENTRIES);
+	if (out->uring) {
+	    uring_attach(out->uring, out->reactor);
+	    info("Using io_uring");
+	} else {
+	    warn("Falling back to mmap");
+	}
+    }
+
     log_context = s_file;
 
     return out;
 }
 
+
+/** Add another export to the listener.  Its clients come in through the
+ * listener's socket, and are served by its reactor and workers, but it
+ * has a file, ACL and mirror all of its own.
+ */
+struct server *server_add_export(struct server *listener,
+				  char *name,
+				  char *s_file,
+				  int default_deny,
+				  int acl_entries, char **s_acl_entries)
+{
+    NULLCHECK(listener);
+    NULLCHECK(name);
+    FATAL_IF_NULL(s_file, "No filename supplied");
+    FATAL_IF(server_find_export(listener, name, strlen(name)) != NULL,
+	     "Export '%s' given twice", name);
+
+    struct server *out;
+    struct server *last;
+
+    out = xmalloc(sizeof(struct server));
+    out->flexnbd = listener->flexnbd;
+    out->name = name;
+    out->listener = listener;
+    out->filename = s_file;
+    out->success = 1;
+    out->max_nbd_clients = listener->max_nbd_clients;
+    out->max_requests_in_flight = listener->max_requests_in_flight;
+    out->stream_size = listener->stream_size;
+    out->use_killswitch = listener->use_killswitch;
+    out->always_sync = listener->always_sync;
+    out->backend = listener->backend;
+    out->newstyle = listener->newstyle;
+
+    out->reactor = listener->reactor;
+    out->workers = listener->workers;
+    out->negotiators = listener->negotiators;
+    out->watchdog = listener->watchdog;
+    out->uring = listener->uring;
+
+    server_allow_new_clients(out);
+
+    out->acl = acl_create(acl_entries, s_acl_entries, default_deny);
+    if (out->acl && out->acl->len != acl_entries) {
+	fatal("Bad ACL entry '%s'", s_acl_entries[out->acl->len]);
+    }
+
+    out->l_acl = flexthread_mutex_create();
+    out->l_start_mirror = flexthread_mutex_create();
+    FATAL_UNLESS(0 == pthread_mutex_init(&out->dirty.lock, NULL),
+		 "Failed to initialise a mutex");
+    FATAL_UNLESS(0 == pthread_mutex_init(&out->readahead.lock, NULL),
+		 "Failed to initialise a mutex");
+
+    out->mirror_can_start = 1;
+
+    for (last = listener; last->next_export; last = last->next_export);
+    last->next_export = out;
+
+    return out;
+}
+
+
+/** Find the export with the given name, which needn't be terminated.
+ * Exports which have been closed can't be found.
+ */
+struct server *server_find_export(struct server *listener,
+				  const char *name, size_t name_len)
+{
+    NULLCHECK(listener);
+
+    struct server *serve;
+
+    for (serve = listener; serve; serve = serve->next_export) {
+	if (strlen(serve->name) == name_len &&
+	    memcmp(serve->name, name, name_len) == 0 && !serve->closed) {
+	    return serve;
+	}
+    }
+
+    return NULL;
+}
+
+
+static struct server *server_listener(struct server *serve)
+{
+    return serve->listener ? serve->listener : serve;
+}
+
+
+void serve_close_file(struct server *params);
+
+static void server_destroy_export(struct server *serve)
+{
+    serve_close_file(serve);
+    flexthread_mutex_destroy(serve->l_start_mirror);
+    flexthread_mutex_destroy(serve->l_acl);
+    pthread_mutex_destroy(&serve->dirty.lock);
+    pthread_mutex_destroy(&serve->readahead.lock);
+
+    if (serve->acl) {
+	acl_destroy(serve->acl);
+	serve->acl = NULL;
+    }
+
+    free(serve);
+}
+
 void server_destroy(struct server *serve)
 {
+    /* The clients need the reactor and the workers to shut down, so
+     * they have to go first.
+     */
+    server_close_clients(serve);
+    server_join_clients(serve);
+    server_lock_clients(serve);
+    {
+	server_reap_clients(serve);
+    }
+    server_unlock_clients(serve);
+
+    while (serve->next_export) {
+	struct server *export = serve->next_export;
+	serve->next_export = export->next_export;
+	server_destroy_export(export);
+    }
+
+    serve_close_file(serve);
+    reactor_destroy(serve->reactor);
+    serve->reactor = NULL;
+    watchdog_destroy(serve->watchdog);
+    serve->watchdog = NULL;
+    uring_destroy(serve->uring);
+    serve->uring = NULL;
+    worker_pool_destroy(serve->negotiators);
+    serve->negotiators = NULL;
+    worker_pool_destroy(serve->workers);
+    serve->workers = NULL;
+
     self_pipe_destroy(serve->acl_updated_signal);
     serve->acl_updated_signal = NULL;
     self_pipe_destroy(serve->close_signal);
     serve->close_signal = NULL;
 
+    flexthread_mutex_destroy(serve->l_clients);
     flexthread_mutex_destroy(serve->l_start_mirror);
     flexthread_mutex_destroy(serve->l_acl);
+    pthread_mutex_destroy(&serve->dirty.lock);
+    pthread_mutex_destroy(&serve->readahead.lock);
 
     if (serve->acl) {
 	acl_destroy(serve->acl);
@@ -155,6 +343,18 @@ void server_unlock_start_mirror(struct server *serve)
 		  "Problem with start mirror unlock");
 }
 
+/* Only the listener has a client table, so only it has this lock */
+static void server_lock_clients(struct server *serve)
+{
+    SERVER_LOCK(serve, l_clients, "Problem with clients lock");
+}
+
+static void server_unlock_clients(struct server *serve)
+{
+    SERVER_UNLOCK(serve, l_clients, "Problem with clients unlock");
+}
+
+
 int server_start_mirror_locked(struct server *serve)
 {
     NULLCHECK(serve);
@@ -221,104 +421,109 @@ void serve_open_server_socket(struct server *params)
 
 
 
-int tryjoin_client_thread(struct client_tbl_entry *entry,
-			  int (*joinfunc) (pthread_t, void **))
+/* Make room in the client table for more clients, up to max_nbd_clients.
+ * The new slots go on the free list.  Call it with l_clients held, or
+ * before anyone else can see the server.
+ */
+static void server_grow_client_table(struct server *serve)
 {
+    int slots, i;
 
-    NULLCHECK(entry);
-    NULLCHECK(joinfunc);
+    slots = serve->nbd_client_slots ?
+	serve->nbd_client_slots * 2 : SERVER_CLIENTS_INITIAL;
+    if (slots > serve->max_nbd_clients) {
+	slots = serve->max_nbd_clients;
+    }
+    if (slots <= serve->nbd_client_slots) {
+	return;
+    }
 
-    int was_closed = 0;
-    void *status = NULL;
+    serve->nbd_client = xrealloc(serve->nbd_client,
+				 slots * sizeof(struct client_tbl_entry));
+    for (i = slots - 1; i >= serve->nbd_client_slots; i--) {
+	serve->nbd_client[i].client = NULL;
+	serve->nbd_client[i].next_free = serve->nbd_client_free;
+	serve->nbd_client_free = i;
+    }
+    debug("client table grown from %d to %d slots",
+	  serve->nbd_client_slots, slots);
+    serve->nbd_client_slots = slots;
+}
 
-    if (entry->thread != 0) {
-	char s_client_address[128];
 
-	sockaddr_address_string(&entry->address.generic,
-				&s_client_address[0], 128);
+/* Put a stopped client on the listener's finished list.  This is called
+ * by the reactor, with the client's stop_lock held.
+ */
+void server_client_finished(struct server *serve, struct client *client)
+{
+    NULLCHECK(serve);
+    NULLCHECK(client);
 
-	debug("%s(%p,...)",
-	      joinfunc == pthread_join ? "joining" : "tryjoining",
-	      entry->thread);
-	int join_errno = joinfunc(entry->thread, &status);
-
-	/* join_errno can legitimately be ESRCH if the thread is
-	 * already dead, but the client still needs tidying up. */
-	if (join_errno != 0 && !entry->client->stopped) {
-	    debug("join_errno was %s, stopped was %d",
-		  strerror(join_errno), entry->client->stopped);
-	    FATAL_UNLESS(join_errno == EBUSY,
-			 "Problem with joining thread %p: %s",
-			 entry->thread, strerror(join_errno));
-	} else if (join_errno == 0) {
-	    debug("nbd thread %016x exited (%s) with status %ld",
-		  entry->thread, s_client_address, (uintptr_t) status);
-	    client_destroy(entry->client);
-	    entry->client = NULL;
-	    entry->thread = 0;
-	    was_closed = 1;
-	}
-    }
+    struct server *listener = server_listener(serve);
+    struct client *head;
 
-    return was_closed;
+    do {
+	head = listener->finished_clients;
+	client->next_finished = head;
+    } while (!__sync_bool_compare_and_swap(&listener->finished_clients,
+					   head, client));
 }
 
 
 /**
- * Check to see if a client thread has finished, and if so, tidy up
- * after it.
- * Returns 1 if the thread was cleaned up and the slot freed, 0
- * otherwise.
+ * Destroy every client which has finished since we last looked, and free
+ * their slots.  Call it with l_clients held.
  *
  * It's important that client_destroy gets called in the same thread
- * which signals the client threads to stop.  This avoids the
- * possibility of sending a stop signal via a signal which has already
- * been destroyed.  However, it means that stopped client threads,
- * including their signal pipes, won't be cleaned up until the next new
- * client connection attempt.
+ * which signals the clients to stop.  This avoids the possibility of
+ * sending a stop signal via a signal which has already been destroyed.
+ * However, it means that stopped clients, including their signal pipes,
+ * won't be cleaned up until the next new client connection attempt.
  */
-int cleanup_client_thread(struct client_tbl_entry *entry)
+static void server_reap_clients(struct server *listener)
 {
-    return tryjoin_client_thread(entry, pthread_tryjoin_np);
-}
+    struct client *client, *next;
+    struct client_tbl_entry *entry;
+    char s_client_address[128];
 
-void cleanup_client_threads(struct client_tbl_entry *entries,
-			    size_t entries_len)
-{
-    size_t i;
-    for (i = 0; i < entries_len; i++) {
-	cleanup_client_thread(&entries[i]);
-    }
-}
+    client = __sync_lock_test_and_set(&listener->finished_clients, NULL);
+    for (; client; client = next) {
+	next = client->next_finished;
+	/* The reactor may still be on its way out of client_finish */
+	client_wait_for_stop(client);
 
+	entry = &listener->nbd_client[client->slot];
+	sockaddr_address_string(&entry->address.generic,
+				&s_client_address[0], 128);
+	debug("nbd client %p exited (%s)", client, s_client_address);
 
-/**
- * Join a client thread after having sent a stop signal to it.
- * This function will not return until pthread_join has returned, so
- * ensures that the client thread is dead.
- */
-int join_client_thread(struct client_tbl_entry *entry)
-{
-    return tryjoin_client_thread(entry, pthread_join);
+	client_destroy(client);
+	entry->client = NULL;
+	entry->next_free = listener->nbd_client_free;
+	listener->nbd_client_free = entry - listener->nbd_client;
+    }
 }
 
-/** We can only accommodate MAX_NBD_CLIENTS connections at once.  This function
- *  goes through the current list, waits for any threads that have finished
- *  and returns the next slot free (or -1 if there are none).
+
+/** We can accommodate max_nbd_clients connections at once.  This function
+ *  tidies up any clients that have finished and returns a free slot,
+ *  growing the table if need be (or -1 if it's full).  Call it with
+ *  l_clients held.
  */
 int cleanup_and_find_client_slot(struct server *params)
 {
     NULLCHECK(params);
 
-    int slot = -1, i;
+    int slot;
 
-    cleanup_client_threads(params->nbd_client, params->max_nbd_clients);
+    server_reap_clients(params);
+    if (params->nbd_client_free < 0) {
+	server_grow_client_table(params);
+    }
 
-    for (i = 0; i < params->max_nbd_clients; i++) {
-	if (params->nbd_client[i].thread == 0 && slot == -1) {
-	    slot = i;
-	    break;
-	}
+    slot = params->nbd_client_free;
+    if (slot >= 0) {
+	params->nbd_client_free = params->nbd_client[slot].next_free;
     }
 
     return slot;
@@ -327,17 +532,11 @@ int cleanup_and_find_client_slot(struct server *params)
 int server_count_clients(struct server *params)
 {
     NULLCHECK(params);
-    int i, count = 0;
-
-    cleanup_client_threads(params->nbd_client, params->max_nbd_clients);
 
-    for (i = 0; i < params->max_nbd_clients; i++) {
-	if (params->nbd_client[i].thread != 0) {
-	    count++;
-	}
-    }
-
-    return count;
+    /* This is called from the control thread, which mustn't touch the
+     * client table, so the clients keep count for us.
+     */
+    return __sync_add_and_fetch(&params->clients_running, 0);
 }
 
 
@@ -397,18 +596,8 @@ int server_should_accept_client(struct server *params,
 
 
 
-int spawn_client_thread(struct client *client_params,
-			pthread_t * out_thread)
-{
-    int result =
-	pthread_create(out_thread, NULL, client_serve, client_params);
-
-    return result;
-}
-
-
-/** Dispatch function for accepting an NBD connection and starting a thread
-  * to handle it.  Rejects the connection if there is an ACL, and the far end's
+/** Dispatch function for accepting an NBD connection and handing it to the
+  * reactor to serve.  Rejects the connection if there is an ACL, and the far end's
   * address doesn't match, or if there are too many clients already connected.
   */
 void accept_nbd_client(struct server *params,
@@ -436,35 +625,36 @@ void accept_nbd_client(struct server *params,
 	return;
     }
 
-    slot = cleanup_and_find_client_slot(params);
-    if (slot < 0) {
-	warn("too many clients to accept connection");
-	FATAL_IF_NEGATIVE(close(client_fd),
-			  "Error closing client socket fd %d", client_fd);
-	debug("Closed client socket fd %d", client_fd);
-	return;
+    server_lock_clients(params);
+    {
+	slot = cleanup_and_find_client_slot(params);
+	if (slot >= 0) {
+	    info("Client %s accepted on fd %d.", s_client_address,
+		 client_fd);
+	    client_params = client_create(params, client_fd);
+	    memcpy(&client_params->address, client_address,
+		   sizeof(union mysockaddr));
+
+	    client_params->slot = slot;
+	    params->nbd_client[slot].client = client_params;
+	    memcpy(&params->nbd_client[slot].address, client_address,
+		   sizeof(union mysockaddr));
+
+	    __sync_add_and_fetch(&params->clients_running, 1);
+	    client_start(client_params);
+	}
     }
+    server_unlock_clients(params);
 
-    info("Client %s accepted on fd %d.", s_client_address, client_fd);
-    client_params = client_create(params, client_fd);
-
-    params->nbd_client[slot].client = client_params;
-    memcpy(&params->nbd_client[slot].address, client_address,
-	   sizeof(union mysockaddr));
-
-    pthread_t *thread = &params->nbd_client[slot].thread;
-
-    if (0 != spawn_client_thread(client_params, thread)) {
-	debug("Thread creation problem.");
-	client_destroy(client_params);
+    if (slot < 0) {
+	warn("too many clients to accept connection");
 	FATAL_IF_NEGATIVE(close(client_fd),
 			  "Error closing client socket fd %d", client_fd);
 	debug("Closed client socket fd %d", client_fd);
 	return;
     }
 
-    debug("nbd thread %p started (%s)", params->nbd_client[slot].thread,
-	  s_client_address);
+    debug("nbd client %p started (%s)", client_params, s_client_address);
 }
 
 
@@ -474,6 +664,7 @@ void server_audit_clients(struct server *serve)
 
     int i;
     struct client_tbl_entry *entry;
+    struct server *export;
 
     /* There's an apparent race here.  If the acl updates while
      * we're traversing the nbd_clients array, the earlier entries
@@ -482,27 +673,49 @@ void server_audit_clients(struct server *serve)
      * server_replace_acl must have been called, so the
      * server_accept loop will see a second acl_updated signal as
      * soon as it hits select, and a second audit will be run.
+     *
+     * Clients of the other exports have to be allowed by both ACLs,
+     * since they connected through us.
      */
-    for (i = 0; i < serve->max_nbd_clients; i++) {
-	entry = &serve->nbd_client[i];
-	if (0 == entry->thread) {
-	    continue;
-	}
-	if (server_acl_accepts(serve, &entry->address)) {
-	    continue;
+    server_lock_clients(serve);
+    {
+	for (i = 0; i < serve->nbd_client_slots; i++) {
+	    entry = &serve->nbd_client[i];
+	    if (NULL == entry->client) {
+		continue;
+	    }
+	    export = entry->client->serve;
+	    if (server_acl_accepts(serve, &entry->address) &&
+		(export == serve ||
+		 server_acl_accepts(export, &entry->address))) {
+		continue;
+	    }
+	    client_signal_stop(entry->client);
 	}
-	client_signal_stop(entry->client);
     }
+    server_unlock_clients(serve);
 }
 
 
 int server_is_closed(struct server *serve)
 {
     NULLCHECK(serve);
+
+    if (serve->listener) {
+	return serve->closed || server_is_closed(serve->listener);
+    }
     return fd_is_closed(serve->server_fd);
 }
 
 
+/* Is this one of serve's clients?  The listener counts all of them. */
+static int server_has_client(struct server *serve, struct client *client)
+{
+    return client != NULL && (serve->listener == NULL ||
+			      client->serve == serve);
+}
+
+
 void server_close_clients(struct server *params)
 {
     NULLCHECK(params);
@@ -510,26 +723,24 @@ void server_close_clients(struct server *params)
     info("closing all clients");
 
     int i;			/* , j; */
+    struct server *listener = server_listener(params);
     struct client_tbl_entry *entry;
 
-    for (i = 0; i < params->max_nbd_clients; i++) {
-	entry = &params->nbd_client[i];
+    server_lock_clients(listener);
+    {
+	for (i = 0; i < listener->nbd_client_slots; i++) {
+	    entry = &listener->nbd_client[i];
 
-	if (entry->thread != 0) {
-	    debug("Stop signaling client %p", entry->client);
-	    client_signal_stop(entry->client);
+	    if (server_has_client(params, entry->client)) {
+		debug("Stop signaling client %p", entry->client);
+		client_signal_stop(entry->client);
+	    }
 	}
     }
-    /* We don't join the clients here.  When we enter the final
-     * mirror pass, we get the IO lock, then wait for the server_fd
-     * to close before sending the data, to be sure that no new
-     * clients can be accepted which might think they've written
-     * to the disc.  However, an existing client thread can be
-     * waiting for the IO lock already, so if we try to join it
-     * here, we deadlock.
-     *
-     * The client threads will be joined in serve_cleanup.
-     *
+    server_unlock_clients(listener);
+    /* We don't wait for the clients here; that's up to
+     * server_join_clients, which the final mirror pass and
+     * serve_cleanup both call.
      */
 }
 
@@ -556,7 +767,8 @@ void server_replace_acl(struct server *serve, struct acl *new_acl)
     }
     server_unlock_acl(serve);
 
-    self_pipe_signal(serve->acl_updated_signal);
+    /* The listener audits every export's clients */
+    self_pipe_signal(server_listener(serve)->acl_updated_signal);
 }
 
 
@@ -591,15 +803,20 @@ int server_mirror_can_start(struct server *serve)
 int serve_shutdown_is_graceful(struct server *params)
 {
     int is_mirroring = 0;
-    server_lock_start_mirror(params);
-    {
-	if (server_is_mirroring(params)) {
-	    is_mirroring = 1;
-	    warn("Stop signal received while mirroring.");
-	    server_prevent_mirror_start(params);
+    struct server *export;
+
+    for (export = params; export; export = export->next_export) {
+	server_lock_start_mirror(export);
+	{
+	    /* An export is closed once its mirror has finished with it */
+	    if (server_is_mirroring(export) && !export->closed) {
+		is_mirroring = 1;
+		warn("Stop signal received while mirroring.");
+		server_prevent_mirror_start(export);
+	    }
 	}
+	server_unlock_start_mirror(export);
     }
-    server_unlock_start_mirror(params);
 
     return !is_mirroring;
 }
@@ -733,7 +950,8 @@ void serve_init_allocation_map(struct server *params)
     FATAL_IF_NEGATIVE(size, "Couldn't find size of %s", params->filename);
 
     params->allocation_map =
-	bitset_alloc(params->size, block_allocation_resolution);
+	bitset_alloc_with_stream(params->size, block_allocation_resolution,
+				 params->stream_size);
 
     int ok = pthread_create(&params->allocation_map_builder_thread,
 			    NULL,
@@ -744,9 +962,78 @@ void serve_init_allocation_map(struct server *params)
 }
 
 
+/** Open and map the file, which the export's clients share for as long as
+  * the server runs.  This has to wait until we know how big it is, and
+  * whether the direct backend has its block cache.  If it does, that does
+  * all the I/O with O_DIRECT, so there's no call to map the file.
+  */
+void serve_init_file(struct server *params)
+{
+    NULLCHECK(params);
+    uint64_t size;
+
+    if (params->cache) {
+	FATAL_IF_NEGATIVE(open_and_mmap(params->filename, &params->fd,
+					&size, NULL),
+			  "Couldn't open file %s", params->filename);
+	return;
+    }
+
+    FATAL_IF_NEGATIVE(open_and_mmap(params->filename, &params->fd, &size,
+				    (void **) &params->mapped),
+		      "Couldn't open/mmap file %s", params->filename);
+
+    if (madvise(params->mapped, params->size, MADV_RANDOM) == -1) {
+	warn(SHOW_ERRNO("Failed to madvise() %s", params->filename));
+    }
+}
+
+
+/** Undo serve_init_file, once the export's clients have all finished */
+void serve_close_file(struct server *params)
+{
+    NULLCHECK(params);
+
+    if (params->mapped) {
+	munmap(params->mapped, params->size);
+	params->mapped = NULL;
+    }
+    if (params->fd > 0) {
+	close(params->fd);
+	params->fd = -1;
+    }
+}
+
+
+/** Set up the block cache for the direct backend.  This has to wait until
+  * we know how big the file is.
+  */
+void serve_init_cache(struct server *params)
+{
+    NULLCHECK(params);
+
+    if (params->backend != SERVER_BACKEND_DIRECT) {
+	return;
+    }
+
+    params->cache = block_cache_create(params->filename, params->size,
+				       SERVER_BLOCK_CACHE_SIZE);
+    if (params->cache) {
+	info("Using direct I/O");
+    } else {
+	warn("Falling back to mmap");
+    }
+}
+
+
 void server_forbid_new_clients(struct server *serve)
 {
     serve->allow_new_clients = 0;
+    /* A client can choose one of the other exports at any time, so it
+     * checks allow_new_clients after it's been added to that export's
+     * clients.  If it's in time to see this, we're in time to see it.
+     */
+    __sync_synchronize();
     return;
 }
 
@@ -759,30 +1046,37 @@ void server_allow_new_clients(struct server *serve)
 void server_join_clients(struct server *serve)
 {
     int i;
-    void *status;
+    struct server *listener = server_listener(serve);
+
+    server_lock_clients(listener);
+    {
+	for (i = 0; i < listener->nbd_client_slots; i++) {
+	    struct client *client = listener->nbd_client[i].client;
 
-    for (i = 0; i < serve->max_nbd_clients; i++) {
-	pthread_t thread_id = serve->nbd_client[i].thread;
-
-	if (thread_id != 0) {
-	    debug("joining thread %p", thread_id);
-	    int err = pthread_join(thread_id, &status);
-	    if (0 == err) {
-		serve->nbd_client[i].thread = 0;
-	    } else {
-		warn("Error %s (%i) joining thread %p", strerror(err), err,
-		     thread_id);
+	    if (server_has_client(serve, client)) {
+		debug("waiting for client %p", client);
+		client_wait_for_stop(client);
 	    }
 	}
     }
+    server_unlock_clients(listener);
 
     return;
 }
 
-/* Tell the server to close all the things. */
+/* Tell the server to close all the things.  The other exports don't have
+ * things of their own to close; they just stop being found.
+ */
 void serve_signal_close(struct server *serve)
 {
     NULLCHECK(serve);
+
+    if (serve->listener) {
+	info("closing export '%s'", serve->name);
+	serve->closed = 1;
+	return;
+    }
+
     info("signalling close");
     self_pipe_signal(serve->close_signal);
 }
@@ -792,6 +1086,10 @@ void serve_signal_close(struct server *serve)
  */
 void serve_wait_for_close(struct server *serve)
 {
+    if (serve->listener) {
+	return;
+    }
+
     while (!fd_is_closed(serve->server_fd)) {
 	usleep(10000);
     }
@@ -812,14 +1110,19 @@ void server_control_arrived(struct server *serve)
 }
 
 
-/** Closes sockets, frees memory and waits for all client threads to finish */
+/** Closes sockets, frees memory and waits for all clients to finish */
 void serve_cleanup(struct server *params,
 		   int fatal __attribute__ ((unused)))
 {
     NULLCHECK(params);
     void *status;
+    struct server *export;
 
     info("cleaning up");
+
+    if (flexthread_mutex_held(params->l_clients)) {
+	server_unlock_clients(params);
+    }
     
     /* Close the control socket, and wait for it to close before proceeding.
      * If we do not wait, we risk a race condition with the tail supervisor
@@ -837,38 +1140,51 @@ void serve_cleanup(struct server *params,
 	close(params->server_fd);
     }
 
-    /* need to stop background build if we're killed very early on */
-    pthread_cancel(params->allocation_map_builder_thread);
-    pthread_join(params->allocation_map_builder_thread, &status);
+    for (export = params; export; export = export->next_export) {
+	/* need to stop background build if we're killed very early on */
+	if (export->allocation_map) {
+	    pthread_cancel(export->allocation_map_builder_thread);
+	    pthread_join(export->allocation_map_builder_thread, &status);
+	}
 
-    int need_mirror_lock;
-    need_mirror_lock = !server_start_mirror_locked(params);
+	int need_mirror_lock;
+	need_mirror_lock = !server_start_mirror_locked(export);
 
-    if (need_mirror_lock) {
-	server_lock_start_mirror(params);
-    }
-    {
-	if (server_is_mirroring(params)) {
-	    server_abandon_mirror(params);
+	if (need_mirror_lock) {
+	    server_lock_start_mirror(export);
+	}
+	{
+	    if (server_is_mirroring(export)) {
+		server_abandon_mirror(export);
+	    }
+	    server_prevent_mirror_start(export);
+	}
+	if (need_mirror_lock) {
+	    server_unlock_start_mirror(export);
 	}
-	server_prevent_mirror_start(params);
-    }
-    if (need_mirror_lock) {
-	server_unlock_start_mirror(params);
     }
 
+    server_close_clients(params);
     server_join_clients(params);
 
-    if (params->allocation_map) {
-	bitset_free(params->allocation_map);
-    }
+    for (export = params; export; export = export->next_export) {
+	if (export->allocation_map) {
+	    bitset_free(export->allocation_map);
+	    export->allocation_map = NULL;
+	}
 
-    if (server_start_mirror_locked(params)) {
-	server_unlock_start_mirror(params);
-    }
+	block_cache_destroy(export->cache);
+	export->cache = NULL;
+
+	serve_close_file(export);
+
+	if (server_start_mirror_locked(export)) {
+	    server_unlock_start_mirror(export);
+	}
 
-    if (server_acl_locked(params)) {
-	server_unlock_acl(params);
+	if (server_acl_locked(export)) {
+	    server_unlock_acl(export);
+	}
     }
 
     debug("Cleanup done");
@@ -970,6 +1286,7 @@ int do_serve(struct server *params, struct self_pipe *open_signal)
     NULLCHECK(params);
 
     int success;
+    struct server *export;
 
     error_set_handler((cleanup_handler *) serve_cleanup, params);
     serve_open_server_socket(params);
@@ -980,7 +1297,11 @@ int do_serve(struct server *params, struct self_pipe *open_signal)
 	self_pipe_signal(open_signal);
     }
 
-    serve_init_allocation_map(params);
+    for (export = params; export; export = export->next_export) {
+	serve_init_allocation_map(export);
+	serve_init_cache(export);
+	serve_init_file(export);
+    }
     serve_accept_loop(params);
     success = params->success;
     serve_cleanup(params, 0);
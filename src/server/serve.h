@@ -13,14 +13,105 @@
 static const int block_allocation_resolution = 4096;	//128<<10;
 
 
+/* How clients get at the file */
+enum server_backend {
+    /* Worker threads using pread() and pwrite(), and syncing through a
+     * mapping of the file
+     */
+    SERVER_BACKEND_MMAP,
+    /* Reads, writes and syncs submitted to io_uring by the reactor, with
+     * the workers filling in for anything it can't do
+     */
+    SERVER_BACKEND_IO_URING,
+    /* Worker threads doing O_DIRECT I/O through our own block cache, so
+     * the file stays out of the page cache
+     */
+    SERVER_BACKEND_DIRECT
+};
+
+
+/** SERVER_MAX_DIRTY_RANGES
+ * Each export remembers which parts of the file have been written to since
+ * the last flush, so that a flush only has to sync those.  If there are
+ * more separate ranges than this, we give up keeping track and sync the
+ * whole file with fdatasync() instead.
+ */
+#define SERVER_MAX_DIRTY_RANGES 64
+
+/* A page-aligned range of the file, [from, to) */
+struct server_dirty_range {
+    uint64_t from;
+    uint64_t to;
+};
+
+/* What's been written but not yet synced, by any of the export's clients.
+ * A flush from any one of them syncs the lot, which is what lets us tell
+ * clients they can use several connections at once.
+ */
+struct server_dirty {
+    pthread_mutex_t lock;
+    /* Set if there were too many ranges to keep track of */
+    int overflowed;
+    int ranges_count;
+    struct server_dirty_range ranges[SERVER_MAX_DIRTY_RANGES];
+    /* Flushes which have taken their ranges, but not finished syncing */
+    int syncing;
+};
+
+
+/** SERVER_READAHEAD_BYTES_PER_SECOND
+ * How much an export will read ahead each second, whether for clients which
+ * send CACHE or for those we've noticed reading sequentially.  Beyond this,
+ * CACHE requests are acknowledged but ignored, and streams go without, so
+ * neither can crowd out the reads and writes the clients are waiting on.
+ */
+#define SERVER_READAHEAD_BYTES_PER_SECOND (128 * 1024 * 1024)
+
+/* How much of this second's readahead has been used, and how much has
+ * been used altogether.
+ */
+struct server_readahead {
+    pthread_mutex_t lock;
+    uint64_t second;
+    uint64_t bytes;
+    uint64_t total;
+};
+
+
+/* A slot in the listener's client table.  Free slots are chained
+ * together through next_free, so finding one doesn't mean a search.
+ */
 struct client_tbl_entry {
-    pthread_t thread;
     union mysockaddr address;
     struct client *client;
+    int next_free;
 };
 
 
-#define MAX_NBD_CLIENTS 16
+/* The most clients we'll have connected at once, unless told otherwise */
+#define MAX_NBD_CLIENTS 1024
+/* How many slots the client table starts with.  It doubles in size
+ * whenever it fills up, up to max_nbd_clients.
+ */
+#define SERVER_CLIENTS_INITIAL 16
+/* The number of threads doing disc I/O on behalf of clients */
+#define SERVER_WORKER_THREADS 8
+/** SERVER_WORKER_STACK_SIZE
+ * The stack each worker gets.  Workers only call down into the I/O
+ * functions and the handshake, none of which keep much on the stack, so
+ * they don't need the several megabytes a thread gets by default.
+ */
+#define SERVER_WORKER_STACK_SIZE (256 * 1024)
+/** SERVER_NEGOTIATOR_THREADS
+ * The number of threads negotiating with newstyle clients.  Negotiating is
+ * a blocking conversation, which can take up to HANDSHAKE_TIMEOUT, so it
+ * gets threads of its own rather than tying up the workers.
+ */
+#define SERVER_NEGOTIATOR_THREADS 4
+/* How many operations we can have queued up for io_uring at once */
+#define SERVER_URING_ENTRIES 256
+/* How much memory the direct backend uses to cache the file */
+#define SERVER_BLOCK_CACHE_SIZE (64 * 1024 * 1024)
 #define CLIENT_KEEPALIVE_TIME 30
 #define CLIENT_KEEPALIVE_INTVL 10
 #define CLIENT_KEEPALIVE_PROBES 3
@@ -28,6 +119,22 @@ struct server {
     /* The flexnbd wrapper this server is attached to */
     struct flexnbd *flexnbd;
 
+	/** The name newstyle clients ask for this export by.  The file given
+	 * with --file is the export with the empty name, and its server is
+	 * the one that accepts clients for all the others.
+	 */
+    char *name;
+	/** For the other exports, the server that accepts their clients and
+	 * lends them its reactor and workers.  NULL for that server.
+	 */
+    struct server *listener;
+	/** The next export.  The list starts with the listener. */
+    struct server *next_export;
+	/** Set on an export other than the listener once a mirror has
+	 * finished with it, since it has no socket of its own to close.
+	 */
+    int closed;
+
 	/** address/port to bind to */
     union mysockaddr bind_to;
 	/** (static) file name to serve */
@@ -38,6 +145,12 @@ struct server {
     char *control_socket_name;
 	/** size of file */
     uint64_t size;
+	/** The file, opened and mapped once for all of the export's clients.
+	 * They write to it with pwrite(), and sync it through the mapping.
+	 * With the direct backend's block cache, it isn't mapped at all.
+	 */
+    int fd;
+    char *mapped;
 
 	/** to interrupt accept loop and clients, write() to close_signal[1] */
     struct self_pipe *close_signal;
@@ -72,9 +185,8 @@ struct server {
      * incoming writes, and avoid writing zeroes to unallocated sections
      * of the file which would needlessly increase disc usage.  This
      * bitmap will start at all-zeroes for an empty file, and tend towards
-     * all-ones as the file is written to (i.e. we assume that allocated
-     * blocks can never become unallocated again, as is the case with ext3
-     * at least).
+     * all-ones as the file is written to.  Blocks only become unallocated
+     * again when a client trims them, and we punch a hole where they were.
      */
     struct bitset *allocation_map;
     /* when starting up, this thread builds the allocation_map */
@@ -84,12 +196,70 @@ struct server {
     volatile sig_atomic_t allocation_map_built;
     volatile sig_atomic_t allocation_map_not_built;
 
+    /* Written but not yet synced.  Updated by the workers. */
+    struct server_dirty dirty;
+    /* Read ahead for CACHE requests and sequential readers.  Updated by
+     * the workers and the reactor.
+     */
+    struct server_readahead readahead;
+
     int max_nbd_clients;
+    /* The clients of every export go in the listener's table, so the
+     * other exports have to claim its l_clients around looking at it.
+     */
     struct client_tbl_entry *nbd_client;
+    /* How many slots nbd_client has, and the first free one, or -1 */
+    int nbd_client_slots;
+    int nbd_client_free;
+    struct flexthread_mutex *l_clients;
+    /* Clients which have stopped, waiting for the next accept to destroy
+     * them and free their slots.  Pushed by the reactor, which can't
+     * claim l_clients, so it's updated atomically.
+     */
+    struct client *finished_clients;
+    /* Clients which haven't yet finished.  Updated atomically. */
+    int clients_running;
+    /* Clients currently reading sequentially.  Updated atomically. */
+    int sequential_clients;
+
+	/** How many requests each client may have outstanding at once */
+    int max_requests_in_flight;
+	/** How many events the allocation map's stream holds before changes
+	 * have to go into its overflow map for the mirror to find later
+	 */
+    uint64_t stream_size;
+
+	/** Does all of the socket I/O for our clients */
+    struct reactor *reactor;
+	/** Does all of the disc I/O for our clients */
+    struct worker_pool *workers;
+	/** Negotiates with newstyle clients, before the reactor takes them */
+    struct worker_pool *negotiators;
+	/** If use_killswitch is set, notices clients that stop making
+	 * progress.  It ticks on the reactor.
+	 */
+    struct watchdog *watchdog;
+	/** If we're using io_uring, this does most of it instead */
+    struct uring *uring;
+	/** If we're using direct I/O, the workers go through this */
+    struct block_cache *cache;
+    enum server_backend backend;
+
+	/** If set, clients get the fixed newstyle handshake, and can negotiate
+	 * structured replies.  Otherwise they get the oldstyle one, which is
+	 * all the proxy understands.
+	 */
+    int newstyle;
 
 	/** Should clients use the killswitch? */
     int use_killswitch;
 
+	/** If set, every write is synced to disc before we reply to it.
+	 * Otherwise, only FUA writes are, and the client has to ask for a
+	 * flush to be sure of the rest.
+	 */
+    int always_sync;
+
 	/** If this isn't set, newly accepted clients will be closed immediately */
     int allow_new_clients;
 
@@ -111,7 +281,19 @@ struct server *server_create(struct flexnbd *flexnbd,
 			     int acl_entries,
 			     char **s_acl_entries,
 			     int max_nbd_clients,
-			     int use_killswitch, int success);
+			     int max_requests_in_flight,
+			     uint64_t stream_size,
+			     int use_killswitch,
+			     int always_sync,
+			     enum server_backend backend, int newstyle,
+			     int success);
+struct server *server_add_export(struct server *listener,
+				  char *name,
+				  char *s_file,
+				  int default_deny,
+				  int acl_entries, char **s_acl_entries);
+struct server *server_find_export(struct server *listener,
+				  const char *name, size_t name_len);
 void server_destroy(struct server *);
 int server_is_closed(struct server *serve);
 void serve_signal_close(struct server *serve);
@@ -119,6 +301,8 @@ void serve_wait_for_close(struct server *serve);
 void server_replace_acl(struct server *serve, struct acl *acl);
 void server_control_arrived(struct server *serve);
 int server_is_in_control(struct server *serve);
+int server_acl_accepts(struct server *serve,
+		       union mysockaddr *client_address);
 int server_default_deny(struct server *serve);
 int server_acl_locked(struct server *serve);
 void server_lock_acl(struct server *serve);
@@ -137,7 +321,9 @@ void server_allow_mirror_start(struct server *serve);
 int server_mirror_can_start(struct server *serve);
 
 /* These three functions are used by mirror around the final pass, to close
- * existing clients and prevent new ones from being around
+ * existing clients and prevent new ones from being around.  Closing and
+ * joining the listener's clients takes in every export's, since none of
+ * them can have new clients while it's forbidding them.
  */
 
 void server_forbid_new_clients(struct server *serve);
@@ -145,7 +331,10 @@ void server_close_clients(struct server *serve);
 void server_join_clients(struct server *serve);
 void server_allow_new_clients(struct server *serve);
 
-/* Returns a count (ish) of the number of currently-running client threads */
+/* Called by a client as it stops, so its slot can be reused */
+void server_client_finished(struct server *serve, struct client *client);
+
+/* Returns a count (ish) of the number of currently-connected clients */
 int server_count_clients(struct server *params);
 
 void server_unlink(struct server *serve);
@@ -1,6 +1,7 @@
 #include "status.h"
 #include "serve.h"
 #include "util.h"
+#include "block_cache.h"
 
 struct status *status_create(struct server *serve)
 {
@@ -14,6 +15,14 @@ struct status *status_create(struct server *serve)
 
     status->clients_allowed = serve->allow_new_clients;
     status->num_clients = server_count_clients(serve);
+    status->sequential_clients =
+	__sync_add_and_fetch(&serve->sequential_clients, 0);
+
+    pthread_mutex_lock(&serve->readahead.lock);
+    {
+	status->readahead_bytes = serve->readahead.total;
+    }
+    pthread_mutex_unlock(&serve->readahead.lock);
 
     server_lock_start_mirror(serve);
 
@@ -39,6 +48,12 @@ struct status *status_create(struct server *serve)
 
     server_unlock_start_mirror(serve);
 
+    status->has_cache = NULL != serve->cache;
+    if (status->has_cache) {
+	block_cache_stats(serve->cache, &status->cache_hits,
+			  &status->cache_misses);
+    }
+
     return status;
 
 }
@@ -59,6 +74,8 @@ int status_write(struct status *status, int fd)
     PRINT_BOOL(clients_allowed);
     PRINT_INT(num_clients);
     PRINT_BOOL(has_control);
+    PRINT_INT(sequential_clients);
+    PRINT_UINT64(readahead_bytes);
 
     if (status->is_mirroring) {
 	PRINT_UINT64(migration_speed);
@@ -70,6 +87,11 @@ int status_write(struct status *status, int fd)
 	};
     }
 
+    if (status->has_cache) {
+	PRINT_UINT64(cache_hits);
+	PRINT_UINT64(cache_misses);
+    }
+
     dprintf(fd, "\n");
     return 1;
 }
@@ -46,6 +46,14 @@
  *	If the server is currently in "listen" mode, this will never be
  *	true.
  *
+ * sequential_clients:
+ *   How many clients are currently reading the file sequentially, and so
+ *   having it read ahead for them.
+ *
+ * readahead_bytes:
+ *   How much of the file has been read ahead, for sequential clients and
+ *   CACHE requests, since the server started.
+ *
  *
  * If is_migrating is true, then a number of other attributes may appear,
  * relating to the progress of the migration.
@@ -66,6 +74,17 @@
  *
  * migration_bytes_left:
  *   The number of bytes remaining to migrate.
+ *
+ *
+ * If the server is using the direct backend, the block cache's counters
+ * appear too.
+ *
+ * cache_hits:
+ *   The number of block lookups which found the block already cached.
+ *
+ * cache_misses:
+ *   The number of block lookups which had to go to disc, or evict a
+ *   block to make room for one being written.
  */
 
 
@@ -81,12 +100,18 @@ struct status {
     int clients_allowed;
     int num_clients;
     int is_mirroring;
+    int sequential_clients;
+    uint64_t readahead_bytes;
 
     uint64_t migration_duration;
     uint64_t migration_speed;
     uint64_t migration_speed_limit;
     uint64_t migration_seconds_left;
     uint64_t migration_bytes_left;
+
+    int has_cache;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
 };
 
 /** Create a status object for the given server. */
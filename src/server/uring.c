@@ -0,0 +1,396 @@
+#include "uring.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include <ev.h>
+
+struct uring {
+    int fd;
+    int event_fd;
+
+    unsigned sq_entries;
+    unsigned cq_entries;
+
+    /* Shared with the kernel */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Queued, but not yet handed to the kernel */
+    unsigned to_submit;
+    /* Queued or submitted, but not yet reaped.  We never let this go past
+     * the size of the completion ring, so it can't overflow.
+     */
+    unsigned in_flight;
+
+    struct reactor_call attach;
+    struct ev_loop *loop;
+    ev_io completion_watcher;
+    ev_prepare submit_watcher;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+			  unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/* Hand everything we've queued to the kernel.  This runs just before the
+ * loop blocks, so everything queued in one iteration goes in one syscall.
+ */
+static void uring_submit_cb(struct ev_loop *loop
+			    __attribute__ ((unused)), ev_prepare * w,
+			    int revents __attribute__ ((unused)))
+{
+    struct uring *ring = (struct uring *) w->data;
+    int submitted;
+
+    while (ring->to_submit > 0) {
+	submitted = uring_enter(ring->fd, ring->to_submit);
+	if (submitted == -1) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    /* EAGAIN or EBUSY; we'll try again next time round */
+	    warn(SHOW_ERRNO("io_uring_enter failed"));
+	    break;
+	}
+	ring->to_submit -= submitted;
+    }
+}
+
+
+static void uring_completion_cb(struct ev_loop *loop
+				__attribute__ ((unused)), ev_io * w,
+				int revents __attribute__ ((unused)))
+{
+    struct uring *ring = (struct uring *) w->data;
+    struct io_uring_cqe *cqe;
+    struct uring_op *op;
+    uint64_t events;
+    unsigned head;
+    int result;
+
+    /* We only need this to wake us up, the ring tells us the rest */
+    if (read(ring->event_fd, &events, sizeof(events)) == -1 &&
+	errno != EAGAIN) {
+	warn(SHOW_ERRNO("Couldn't read io_uring eventfd"));
+    }
+
+    head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	op = (struct uring_op *) (uintptr_t) cqe->user_data;
+	result = cqe->res;
+
+	head++;
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	ring->in_flight--;
+
+	op->done(op, result);
+    }
+}
+
+
+struct uring *uring_create(unsigned entries)
+{
+    struct io_uring_params params;
+    struct uring *ring = xmalloc(sizeof(struct uring));
+
+    memset(&params, 0, sizeof(params));
+    ring->event_fd = -1;
+
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1) {
+	warn(SHOW_ERRNO("io_uring isn't available"));
+	free(ring);
+	return NULL;
+    }
+
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+
+    ring->sq_ring_size =
+	params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+	params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	ring->sqes == MAP_FAILED) {
+	warn(SHOW_ERRNO("Couldn't map io_uring"));
+	goto fail;
+    }
+
+    ring->sq_head = ring->sq_ring + params.sq_off.head;
+    ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ring + params.sq_off.array;
+    ring->cq_head = ring->cq_ring + params.cq_off.head;
+    ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ring + params.cq_off.cqes;
+
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd == -1 ||
+	uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+		       &ring->event_fd, 1) == -1) {
+	warn(SHOW_ERRNO("Couldn't set up io_uring eventfd"));
+	goto fail;
+    }
+
+    debug("io_uring %d: %u submission, %u completion entries", ring->fd,
+	  ring->sq_entries, ring->cq_entries);
+    return ring;
+
+  fail:
+    uring_destroy(ring);
+    return NULL;
+}
+
+
+static void uring_attach_cb(struct reactor *reactor, void *ring_uncast)
+{
+    struct uring *ring = (struct uring *) ring_uncast;
+
+    ring->loop = reactor->loop;
+
+    ev_io_init(&ring->completion_watcher, uring_completion_cb,
+	       ring->event_fd, EV_READ);
+    ring->completion_watcher.data = ring;
+    ev_io_start(ring->loop, &ring->completion_watcher);
+
+    ev_prepare_init(&ring->submit_watcher, uring_submit_cb);
+    ring->submit_watcher.data = ring;
+    ev_prepare_start(ring->loop, &ring->submit_watcher);
+}
+
+
+void uring_attach(struct uring *ring, struct reactor *reactor)
+{
+    NULLCHECK(ring);
+    NULLCHECK(reactor);
+
+    reactor_call(reactor, &ring->attach, uring_attach_cb, ring);
+}
+
+
+int uring_has_room(struct uring *ring, unsigned count)
+{
+    unsigned queued = *ring->sq_tail -
+	__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return queued + count <= ring->sq_entries &&
+	ring->in_flight + count <= ring->cq_entries;
+}
+
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring,
+					  struct uring_op *op)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uintptr_t) op;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ring->to_submit++;
+    ring->in_flight++;
+
+    return sqe;
+}
+
+
+void uring_readv(struct uring *ring, struct uring_op *op, int fd,
+		 const struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+}
+
+
+void uring_writev(struct uring *ring, struct uring_op *op, int fd,
+		  const struct iovec *iov, int iovcnt, uint64_t offset,
+		  int link)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    if (link) {
+	sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+
+void uring_fdatasync(struct uring *ring, struct uring_op *op, int fd,
+		     uint64_t offset, uint32_t len)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = len;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+}
+
+
+void uring_fadvise(struct uring *ring, struct uring_op *op, int fd,
+		   uint64_t offset, uint32_t len, int advice)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->len = len;
+    sqe->fadvise_advice = advice;
+}
+
+
+void uring_destroy(struct uring *ring)
+{
+    if (NULL == ring) {
+	return;
+    }
+
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+	munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+	munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+	munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->event_fd != -1) {
+	close(ring->event_fd);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+#else
+
+/* Built without io_uring headers, so the server always uses mmap. */
+
+struct uring *uring_create(unsigned entries __attribute__ ((unused)))
+{
+    warn("io_uring isn't available in this build");
+    return NULL;
+}
+
+void uring_attach(struct uring *ring __attribute__ ((unused)),
+		  struct reactor *reactor __attribute__ ((unused)))
+{
+}
+
+int uring_has_room(struct uring *ring __attribute__ ((unused)),
+		   unsigned count __attribute__ ((unused)))
+{
+    return 0;
+}
+
+void uring_readv(struct uring *ring __attribute__ ((unused)),
+		 struct uring_op *op __attribute__ ((unused)),
+		 int fd __attribute__ ((unused)),
+		 const struct iovec *iov __attribute__ ((unused)),
+		 int iovcnt __attribute__ ((unused)),
+		 uint64_t offset __attribute__ ((unused)))
+{
+}
+
+void uring_writev(struct uring *ring __attribute__ ((unused)),
+		  struct uring_op *op __attribute__ ((unused)),
+		  int fd __attribute__ ((unused)),
+		  const struct iovec *iov __attribute__ ((unused)),
+		  int iovcnt __attribute__ ((unused)),
+		  uint64_t offset __attribute__ ((unused)),
+		  int link __attribute__ ((unused)))
+{
+}
+
+void uring_fdatasync(struct uring *ring __attribute__ ((unused)),
+		     struct uring_op *op __attribute__ ((unused)),
+		     int fd __attribute__ ((unused)),
+		     uint64_t offset __attribute__ ((unused)),
+		     uint32_t len __attribute__ ((unused)))
+{
+}
+
+void uring_fadvise(struct uring *ring __attribute__ ((unused)),
+		   struct uring_op *op __attribute__ ((unused)),
+		   int fd __attribute__ ((unused)),
+		   uint64_t offset __attribute__ ((unused)),
+		   uint32_t len __attribute__ ((unused)),
+		   int advice __attribute__ ((unused)))
+{
+}
+
+void uring_destroy(struct uring *ring __attribute__ ((unused)))
+{
+}
+
+#endif
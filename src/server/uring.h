@@ -0,0 +1,75 @@
+#ifndef URING_H
+#define URING_H
+
+/** uring
+ * An io_uring instance driven from the reactor.  Operations are queued up
+ * while the loop is running callbacks, and submitted to the kernel in one
+ * go just before it goes back to sleep; completions wake the loop up via an
+ * eventfd, and are handed back to whoever queued the operation.
+ *
+ * Everything here other than uring_create and uring_destroy must be called
+ * on the reactor thread.  We talk to the kernel directly, so there's no
+ * dependency on liburing, and if the kernel doesn't support io_uring then
+ * uring_create just returns NULL.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "reactor.h"
+
+struct uring;
+struct uring_op;
+
+/* ''result'' is what the equivalent syscall would have returned, or
+ * -errno on failure.
+ */
+typedef void (uring_op_fn) (struct uring_op * op, int result);
+
+struct uring_op {
+    uring_op_fn *done;
+    void *data;
+};
+
+/* Set up a ring with room for ''entries'' submissions at once.  Returns
+ * NULL (with a warning) if io_uring isn't available.
+ */
+struct uring *uring_create(unsigned entries);
+
+/* Start servicing the ring from ''reactor''. */
+void uring_attach(struct uring *ring, struct reactor *reactor);
+
+/* Returns 1 if ''count'' more operations can be queued right now, 0 if
+ * the caller should wait for some to complete or do the work itself.
+ */
+int uring_has_room(struct uring *ring, unsigned count);
+
+/* Queue an operation.  Each of these must only be called after
+ * uring_has_room has said there's space for it.  ''op'' must stay valid
+ * until its done function has been called.  If ''link'' is set, the next
+ * operation queued won't start until this one has completed successfully.
+ */
+void uring_readv(struct uring *ring, struct uring_op *op, int fd,
+		 const struct iovec *iov, int iovcnt, uint64_t offset);
+void uring_writev(struct uring *ring, struct uring_op *op, int fd,
+		  const struct iovec *iov, int iovcnt, uint64_t offset,
+		  int link);
+/* Like fdatasync, restricted to [offset, offset+len).  A ''len'' of 0
+ * means the rest of the file.  The kernel only takes 32 bits of length, so
+ * anything longer has to be synced some other way.
+ */
+void uring_fdatasync(struct uring *ring, struct uring_op *op, int fd,
+		     uint64_t offset, uint32_t len);
+
+/* Like posix_fadvise.  Kernels which can't do this from io_uring fail it
+ * with -EINVAL.
+ */
+void uring_fadvise(struct uring *ring, struct uring_op *op, int fd,
+		   uint64_t offset, uint32_t len, int advice);
+
+/* The reactor the ring was attached to must have been destroyed first,
+ * and every operation must have completed.
+ */
+void uring_destroy(struct uring *ring);
+
+#endif
@@ -0,0 +1,154 @@
+#include "watchdog.h"
+#include "util.h"
+
+#include <ev.h>
+
+
+struct watchdog *watchdog_create(uint64_t timeout)
+{
+    struct watchdog *watchdog;
+
+    FATAL_UNLESS(timeout > 0 && timeout < WATCHDOG_SLOTS,
+		 "Watchdog timeout must be between 1 and %d seconds",
+		 WATCHDOG_SLOTS - 1);
+
+    watchdog = xmalloc(sizeof(struct watchdog));
+    watchdog->timeout = timeout;
+
+    return watchdog;
+}
+
+
+static void watchdog_tick_cb(struct ev_loop *loop
+			     __attribute__ ((unused)), ev_timer * w,
+			     int revents __attribute__ ((unused)))
+{
+    watchdog_tick((struct watchdog *) w->data);
+}
+
+
+static void watchdog_start_cb(struct reactor *reactor, void *watchdog_uncast)
+{
+    struct watchdog *watchdog = (struct watchdog *) watchdog_uncast;
+
+    ev_timer_init(&watchdog->tick_watcher, watchdog_tick_cb, 1.0, 1.0);
+    watchdog->tick_watcher.data = watchdog;
+    ev_timer_start(reactor->loop, &watchdog->tick_watcher);
+}
+
+
+void watchdog_start(struct watchdog *watchdog, struct reactor *reactor)
+{
+    NULLCHECK(watchdog);
+    NULLCHECK(reactor);
+
+    reactor_call(reactor, &watchdog->start, watchdog_start_cb, watchdog);
+}
+
+
+void watchdog_entry_init(struct watchdog_entry *entry,
+			 watchdog_expired_fn * expired, void *data)
+{
+    entry->expired = expired;
+    entry->data = data;
+    entry->progress = 0;
+    entry->armed = 0;
+    entry->next = entry->prev = NULL;
+}
+
+
+/* Put the entry in the slot for the second its deadline falls in.  Since
+ * its deadline is less than a turn of the wheel away, that's never the
+ * slot we're emptying.
+ */
+static void watchdog_insert(struct watchdog *watchdog,
+			    struct watchdog_entry *entry)
+{
+    struct watchdog_entry **slot;
+
+    entry->slot = (entry->progress + watchdog->timeout) % WATCHDOG_SLOTS;
+    slot = &watchdog->wheel[entry->slot];
+
+    entry->prev = NULL;
+    entry->next = *slot;
+    if (*slot) {
+	(*slot)->prev = entry;
+    }
+    *slot = entry;
+}
+
+
+static void watchdog_remove(struct watchdog *watchdog,
+			    struct watchdog_entry *entry)
+{
+    if (entry->prev) {
+	entry->prev->next = entry->next;
+    } else {
+	watchdog->wheel[entry->slot] = entry->next;
+    }
+    if (entry->next) {
+	entry->next->prev = entry->prev;
+    }
+    entry->next = entry->prev = NULL;
+}
+
+
+void watchdog_arm(struct watchdog *watchdog, struct watchdog_entry *entry)
+{
+    if (entry->armed) {
+	return;
+    }
+
+    entry->progress = watchdog->now;
+    entry->armed = 1;
+    watchdog->armed_count++;
+    watchdog_insert(watchdog, entry);
+}
+
+
+void watchdog_disarm(struct watchdog *watchdog,
+		     struct watchdog_entry *entry)
+{
+    if (!entry->armed) {
+	return;
+    }
+
+    watchdog_remove(watchdog, entry);
+    entry->armed = 0;
+    watchdog->armed_count--;
+}
+
+
+void watchdog_tick(struct watchdog *watchdog)
+{
+    struct watchdog_entry **slot;
+    struct watchdog_entry *entry;
+
+    watchdog->now++;
+    slot = &watchdog->wheel[watchdog->now % WATCHDOG_SLOTS];
+
+    /* Expiring an entry may disarm any of the others, so we take them
+     * off one at a time rather than walking the list.
+     */
+    while ((entry = *slot) != NULL) {
+	watchdog_remove(watchdog, entry);
+
+	if (entry->progress + watchdog->timeout > watchdog->now) {
+	    /* It's made progress since it went in, so it's due later */
+	    watchdog_insert(watchdog, entry);
+	    continue;
+	}
+
+	entry->armed = 0;
+	watchdog->armed_count--;
+	entry->expired(entry);
+    }
+}
+
+
+void watchdog_destroy(struct watchdog *watchdog)
+{
+    if (watchdog) {
+	free(watchdog);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+/** watchdog
+ * Notices connections which have stopped making progress, without each of
+ * them needing a timer of its own.  The watchdog keeps a coarse clock,
+ * which ticks once a second on the reactor, and a timing wheel with a slot
+ * for each second.  Making progress is just a matter of copying the clock
+ * into the entry.  An entry only moves between slots when the wheel comes
+ * round to it, at which point it's either expired or put in the slot its
+ * deadline now falls in.
+ *
+ * All of these must be called from the reactor thread, apart from
+ * watchdog_create and watchdog_destroy.  None of them call error().
+ */
+
+#include <stdint.h>
+
+#include "reactor.h"
+
+/* Slots in the wheel, one a second.  Timeouts have to be shorter. */
+#define WATCHDOG_SLOTS 256
+
+struct watchdog_entry;
+typedef void (watchdog_expired_fn) (struct watchdog_entry *entry);
+
+struct watchdog_entry {
+    /* Called on the reactor, once the entry has been disarmed */
+    watchdog_expired_fn *expired;
+    void *data;
+
+    /* The watchdog's clock when we last made progress */
+    uint64_t progress;
+    int armed;
+
+    /* Our slot of the wheel, and the other entries in it */
+    int slot;
+    struct watchdog_entry *next;
+    struct watchdog_entry *prev;
+};
+
+struct watchdog {
+    /* Seconds without progress before an entry expires */
+    uint64_t timeout;
+    /* Seconds since we started */
+    uint64_t now;
+
+    struct watchdog_entry *wheel[WATCHDOG_SLOTS];
+    /* How many entries there are in the wheel */
+    int armed_count;
+
+    ev_timer tick_watcher;
+    struct reactor_call start;
+};
+
+/* Create a watchdog which expires entries after ''timeout'' seconds. */
+struct watchdog *watchdog_create(uint64_t timeout);
+
+/* Have ''reactor'' tick the watchdog's clock once a second.  Until this
+ * is called, nothing will ever expire.
+ */
+void watchdog_start(struct watchdog *watchdog, struct reactor *reactor);
+
+/* Prepare ''entry'' to be armed, calling ''expired'' if it ever expires. */
+void watchdog_entry_init(struct watchdog_entry *entry,
+			 watchdog_expired_fn * expired, void *data);
+
+/* Start timing ''entry'' from now.  Does nothing if it's already armed. */
+void watchdog_arm(struct watchdog *watchdog, struct watchdog_entry *entry);
+
+/* Stop timing ''entry''.  Does nothing if it isn't armed. */
+void watchdog_disarm(struct watchdog *watchdog,
+		     struct watchdog_entry *entry);
+
+/* Put off ''entry'' expiring, since it's made some progress. */
+static inline void watchdog_touch(struct watchdog *watchdog,
+				  struct watchdog_entry *entry)
+{
+    entry->progress = watchdog->now;
+}
+
+/* Advance the clock by a second, and expire whatever's due. */
+void watchdog_tick(struct watchdog *watchdog);
+
+/* Free the watchdog.  The reactor it was started on has to have been
+ * destroyed already.
+ */
+void watchdog_destroy(struct watchdog *watchdog);
+
+#endif
@@ -0,0 +1,132 @@
+#include "worker_pool.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+
+
+void *worker_pool_run(void *pool_uncast)
+{
+    struct worker_pool *pool = (struct worker_pool *) pool_uncast;
+    struct worker_job *job;
+    sigset_t mask;
+
+    /* Signals are for the main thread to deal with. */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while (1) {
+	pthread_mutex_lock(&pool->lock);
+	{
+	    while (NULL == pool->jobs_head && !pool->stop) {
+		pthread_cond_wait(&pool->job_queued, &pool->lock);
+	    }
+
+	    job = pool->jobs_head;
+	    if (job) {
+		pool->jobs_head = job->next;
+		if (NULL == pool->jobs_head) {
+		    pool->jobs_tail = NULL;
+		}
+	    }
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (NULL == job) {
+	    break;
+	}
+
+	job->next = NULL;
+	job->run(job->data);
+    }
+
+    return NULL;
+}
+
+
+struct worker_pool *worker_pool_create(int threads, size_t stack_size)
+{
+    struct worker_pool *pool = xmalloc(sizeof(struct worker_pool));
+    pthread_attr_t attr;
+    int i;
+
+    FATAL_UNLESS(0 == pthread_mutex_init(&pool->lock, NULL),
+		 "Failed to initialise a mutex");
+    FATAL_UNLESS(0 == pthread_cond_init(&pool->job_queued, NULL),
+		 "Failed to initialise a condition variable");
+
+    FATAL_UNLESS_ZERO(pthread_attr_init(&attr),
+		      "Couldn't initialise thread attributes");
+    if (stack_size) {
+	if (stack_size < (size_t) PTHREAD_STACK_MIN) {
+	    stack_size = PTHREAD_STACK_MIN;
+	}
+	FATAL_UNLESS_ZERO(pthread_attr_setstacksize(&attr, stack_size),
+			  "Couldn't set worker stack size to %zu",
+			  stack_size);
+    }
+
+    pool->threads = xmalloc(threads * sizeof(pthread_t));
+    for (i = 0; i < threads; i++) {
+	FATAL_UNLESS_ZERO(pthread_create(&pool->threads[i], &attr,
+					 worker_pool_run, pool),
+			  "Couldn't create worker thread");
+	pool->threads_count++;
+    }
+    pthread_attr_destroy(&attr);
+
+    debug("Started %d worker threads", threads);
+    return pool;
+}
+
+
+void worker_pool_submit(struct worker_pool *pool, struct worker_job *job,
+			worker_job_fn * run, void *data)
+{
+    NULLCHECK(pool);
+    NULLCHECK(job);
+
+    job->run = run;
+    job->data = data;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    {
+	if (pool->jobs_tail) {
+	    pool->jobs_tail->next = job;
+	} else {
+	    pool->jobs_head = job;
+	}
+	pool->jobs_tail = job;
+	pthread_cond_signal(&pool->job_queued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void worker_pool_destroy(struct worker_pool *pool)
+{
+    int i;
+
+    if (NULL == pool) {
+	return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    {
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->job_queued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->threads_count; i++) {
+	FATAL_UNLESS_ZERO(pthread_join(pool->threads[i], NULL),
+			  "Couldn't join worker thread");
+    }
+
+    pthread_cond_destroy(&pool->job_queued);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
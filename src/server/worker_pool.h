@@ -0,0 +1,53 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/** worker_pool
+ * A fixed set of threads which run jobs handed to them from any other
+ * thread, in the order they were submitted.  Jobs are embedded in the
+ * caller's own structures, so submitting one never allocates.
+ *
+ * Jobs run without an error handler of their own, so they must not call
+ * error(); anything that can fail needs reporting back to whoever
+ * submitted the job.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+
+typedef void (worker_job_fn) (void *data);
+
+struct worker_job {
+    worker_job_fn *run;
+    void *data;
+    struct worker_job *next;
+};
+
+struct worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t job_queued;
+
+    struct worker_job *jobs_head;
+    struct worker_job *jobs_tail;
+
+    /* Once set, the threads exit as soon as the queue is empty */
+    int stop;
+
+    int threads_count;
+    pthread_t *threads;
+};
+
+/* Start a pool of ''threads'' threads, each with a stack of ''stack_size''
+ * bytes, or the system's default if it's 0.
+ */
+struct worker_pool *worker_pool_create(int threads, size_t stack_size);
+
+/* Queue a call to ''run'' with ''data'' on one of the pool's threads.
+ * ''job'' is used to queue it, and must stay valid until ''run'' is called.
+ */
+void worker_pool_submit(struct worker_pool *pool, struct worker_job *job,
+			worker_job_fn * run, void *data);
+
+/* Run every job already queued, then stop the threads and free the pool. */
+void worker_pool_destroy(struct worker_pool *pool);
+
+#endif
@@ -186,6 +186,9 @@ module FlexNBD
 
     attr_accessor :prefetch_proxy
 
+    # Extra options to pass to serve, e.g. ['--backend', 'io_uring']
+    attr_accessor :serve_options
+
     def initialize(bin, ip, port)
       @bin = bin
       @do_debug = ENV['DEBUG']
@@ -198,6 +201,7 @@ module FlexNBD
       @pid = @wait_thread = nil
       @kill = []
       @prefetch_proxy = false
+      @serve_options = []
     end
 
     def debug?
@@ -215,6 +219,7 @@ module FlexNBD
         "--file #{file} "\
         "--sock #{ctrl} "\
         "#{@debug} "\
+        "#{serve_options.join(' ')} "\
         "#{acl.join(' ')}"
     end
 
@@ -287,15 +292,21 @@ module FlexNBD
         "#{@debug}"
     end
 
-    def status_cmd
+    def export_opt(export)
+      export ? "--export #{export} " : ''
+    end
+
+    def status_cmd(export = nil)
       "#{@bin} status "\
         "--sock #{ctrl} "\
+        "#{export_opt(export)}"\
         "#{@debug}"
     end
 
-    def acl_cmd(*acl)
+    def acl_cmd(*acl, export: nil)
       "#{@bin} acl " \
         "--sock #{ctrl} "\
+        "#{export_opt(export)}"\
         "#{@debug} "\
         "#{acl.join ' '}"
     end
@@ -481,15 +492,15 @@ module FlexNBD
       maybe_timeout(cmd, timeout)
     end
 
-    def acl(*acl)
-      cmd = acl_cmd(*acl)
+    def acl(*acl, export: nil)
+      cmd = acl_cmd(*acl, export: export)
       debug(cmd)
 
       maybe_timeout(cmd, 2)
     end
 
-    def status(timeout = nil)
-      cmd = status_cmd
+    def status(timeout = nil, export: nil)
+      cmd = status_cmd(export)
       debug(cmd)
 
       o, e = maybe_timeout(cmd, timeout)
@@ -40,6 +40,151 @@ module FlexNBD
       end
     end
 
+    def read_newstyle_hello
+      timing_out(::FlexNBD::MS_HELLO_TIME_SECS,
+                 'Timed out waiting for hello.') do
+        raise 'No hello.' unless (hello = @sock.read(18)) &&
+                                 hello.length == 18
+
+        return {
+          passwd: hello[0..7],
+          magic: hello[8..15].unpack('Q>').first,
+          flags: hello[16..17].unpack('n').first
+        }
+      end
+    end
+
+    def write_client_flags(flags)
+      @sock.write([flags].pack('N'))
+    end
+
+    def write_option(option, data = '')
+      @sock.write('IHAVEOPT')
+      @sock.write([option, data.length].pack('NN'))
+      @sock.write(data)
+    end
+
+    def read_option_reply
+      magic, option, type, len = @sock.read(20).unpack('Q>NNN')
+      {
+        magic: magic,
+        option: option,
+        type: type,
+        data: len > 0 ? @sock.read(len) : ''
+      }
+    end
+
+    # Read the size and transmission flags sent in reply to EXPORT_NAME,
+    # having asked for no zeroes.
+    def read_export
+      size, flags = @sock.read(10).unpack('Q>n')
+      { size: size, flags: flags }
+    end
+
+    # Go through the fixed newstyle handshake, optionally asking for
+    # structured replies and base:allocation, and pick the export with GO.
+    # Returns the option replies we got along the way.
+    def negotiate(structured = true, contexts = ['base:allocation'], export = '', extended: false)
+      replies = []
+      name = [export.length].pack('N') + export
+      read_newstyle_hello
+      write_client_flags(3)
+
+      if extended
+        write_option(OPTION_EXTENDED_HEADERS)
+        replies << read_option_reply
+      end
+
+      if structured
+        write_option(OPTION_STRUCTURED_REPLY)
+        replies << read_option_reply
+      end
+
+      unless contexts.empty?
+        data = name + [contexts.length].pack('N')
+        contexts.each { |c| data += [c.length].pack('N') + c }
+        write_option(OPTION_SET_META_CONTEXT, data)
+        loop do
+          replies << read_option_reply
+          break if replies.last[:type] != OPTION_REPLY_META_CONTEXT
+        end
+      end
+
+      write_option(OPTION_GO, name + [0].pack('n'))
+      loop do
+        replies << read_option_reply
+        break if replies.last[:type] != OPTION_REPLY_INFO
+      end
+      replies
+    end
+
+    # Ask for the list of exports, and return their names
+    def list_exports
+      write_option(OPTION_LIST)
+      names = []
+      loop do
+        reply = read_option_reply
+        break if reply[:type] != OPTION_REPLY_SERVER
+        len = reply[:data].unpack('N').first
+        names << reply[:data][4, len]
+      end
+      names
+    end
+
+    def read_structured_reply
+      magic, flags, type = @sock.read(8).unpack('Nnn')
+      handle = @sock.read(8)
+      len = @sock.read(4).unpack('N').first
+      {
+        magic: magic,
+        flags: flags,
+        type: type,
+        handle: handle,
+        data: len > 0 ? @sock.read(len) : ''
+      }
+    end
+
+    # Read structured reply chunks until the one flagged as the last, with
+    # REPLY_FLAG_DONE (1)
+    def read_structured_replies
+      chunks = [read_structured_reply]
+      chunks << read_structured_reply while (chunks.last[:flags] & 1).zero?
+      chunks
+    end
+
+    # Once extended headers are negotiated, every reply looks like this
+    def read_extended_reply
+      magic, flags, type = @sock.read(8).unpack('Nnn')
+      handle = @sock.read(8)
+      offset, len = @sock.read(16).unpack('Q>Q>')
+      {
+        magic: magic,
+        flags: flags,
+        type: type,
+        handle: handle,
+        offset: offset,
+        data: len > 0 ? @sock.read(len) : ''
+      }
+    end
+
+    def read_extended_replies
+      chunks = [read_extended_reply]
+      chunks << read_extended_reply while (chunks.last[:flags] & 1).zero?
+      chunks
+    end
+
+    def send_extended_request(type, handle = 'myhandle', from = 0, len = 0, flags = 0)
+      raise 'Bad handle' unless handle.length == 8
+
+      @sock.write([0x21e41c71, flags, type].pack('Nnn'))
+      @sock.write(handle)
+      @sock.write([from, len].pack('Q>Q>'))
+    end
+
+    def write_block_status_request(from, len, flags = 0, handle = 'myhandle')
+      send_request(7, handle, from, len, REQUEST_MAGIC, flags)
+    end
+
     def send_request(type, handle = 'myhandle', from = 0, len = 0, magic = REQUEST_MAGIC, flags = 0)
       raise 'Bad handle' unless handle.length == 8
 
@@ -63,6 +208,18 @@ module FlexNBD
       send_request(3, handle, 0, 0)
     end
 
+    def write_trim_request(from, len, handle = 'myhandle')
+      send_request(4, handle, from, len)
+    end
+
+    def write_cache_request(from, len, handle = 'myhandle')
+      send_request(5, handle, from, len)
+    end
+
+    def write_write_zeroes_request(from, len, flags = 0, handle = 'myhandle')
+      send_request(6, handle, from, len, REQUEST_MAGIC, flags)
+    end
+
     def write_entrust_request(handle = 'myhandle')
       send_request(65_536, handle)
     end
@@ -113,6 +270,18 @@ module FlexNBD
       write_flush_request
     end
 
+    def trim(from, len)
+      write_trim_request(from, len)
+    end
+
+    def cache(from, len)
+      write_cache_request(from, len)
+    end
+
+    def write_zeroes(from, len, flags = 0)
+      write_write_zeroes_request(from, len, flags)
+    end
+
     def read_response
       magic = @sock.read(4)
       error_s = @sock.read(4)
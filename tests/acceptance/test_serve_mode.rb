@@ -27,8 +27,9 @@ class TestServeMode < Test::Unit::TestCase
       assert_equal 0x00420281861253, result[:magic]
       assert_equal @env.file1.size, result[:size]
       # See src/common/nbdtypes.h for the various flags. At the moment we
-      # support HAS_FLAGS (1), SEND_FLUSH (4), SEND_FUA (8)
-      assert_equal (1 | 4 | 8), result[:flags]
+      # support HAS_FLAGS (1), SEND_FLUSH (4), SEND_FUA (8), SEND_TRIM (32),
+      # SEND_WRITE_ZEROES (64), CAN_MULTI_CONN (256), SEND_CACHE (1024)
+      assert_equal (1 | 4 | 8 | 32 | 64 | 256 | 1024), result[:flags]
       assert_equal "\x0" * 124, result[:reserved]
       yield client
     ensure
@@ -140,8 +141,31 @@ class TestServeMode < Test::Unit::TestCase
         assert_equal 0, rsp[:error]
       end
       op = parse_ld_preload_logs('msync_logger')
+      assert_equal 0, op.count, 'Nothing was written, so no msync expected'
+    end
+  end
+
+  def test_flush_only_syncs_what_was_written
+    with_ld_preload('msync_logger') do
+      page_size = Integer(`getconf PAGESIZE`)
+
+      @env.blocksize = page_size * 10
+      connect_to_server do |client|
+        # Write somewhere in the third page, then flush it
+        pos = page_size * 3 + 100
+        client.write(pos, "\x00" * 33)
+        rsp = client.read_response
+        assert_equal 0, rsp[:error]
+
+        client.flush
+        rsp = client.read_response
+        assert_equal FlexNBD::REPLY_MAGIC, rsp[:magic]
+        assert_equal 0, rsp[:error]
+      end
+      op = parse_ld_preload_logs('msync_logger')
+
       assert_equal 1, op.count, 'Only one msync expected'
-      assert_equal @env.blocksize, op.first[2], 'msync length wrong'
+      assert_equal 133, op.first[2], 'msync length wrong'
       assert_equal 6, op.first[3], 'msync called with incorrect flags'
     end
   end
@@ -170,6 +194,615 @@ class TestServeMode < Test::Unit::TestCase
     end
   end
 
+  def test_write_without_fua_is_not_synced
+    with_ld_preload('msync_logger') do
+      connect_to_server do |client|
+        client.write(0, "\x00" * 33)
+        rsp = client.read_response
+        assert_equal FlexNBD::REPLY_MAGIC, rsp[:magic]
+        assert_equal 0, rsp[:error]
+      end
+      op = parse_ld_preload_logs('msync_logger')
+      assert_equal 0, op.count, 'No msync expected'
+    end
+  end
+
+  def test_io_uring_backend_reads_back_what_was_written
+    @env.blocksize = 4096 * 4
+    @env.nbd1.serve_options = ['--backend', 'io_uring']
+    connect_to_server do |client|
+      client.write(0, @b * 4096)
+      assert_equal 0, client.read_response[:error]
+
+      client.write_with_fua(4096, @b * 4096)
+      assert_equal 0, client.read_response[:error]
+
+      client.flush
+      assert_equal 0, client.read_response[:error]
+
+      client.send_request(0, 'readback', 0, 4096 * 3)
+      rsp = client.read_response
+      assert_equal 'readback', rsp[:handle]
+      assert_equal 0, rsp[:error]
+      assert_equal @b * 4096 * 2 + "\x00" * 4096, client.read_raw(4096 * 3)
+    end
+  end
+
+  def test_direct_backend_reads_back_what_was_written
+    @env.blocksize = 4096 * 4
+    @env.nbd1.serve_options = ['--backend', 'direct']
+    connect_to_server do |client|
+      client.write(4096, @b * 4096)
+      assert_equal 0, client.read_response[:error]
+
+      client.write_with_fua(8192, @b * 100)
+      assert_equal 0, client.read_response[:error]
+
+      client.send_request(0, 'readback', 0, 4096 * 3)
+      rsp = client.read_response
+      assert_equal 'readback', rsp[:handle]
+      assert_equal 0, rsp[:error]
+      assert_equal "\x00" * 4096 + @b * 4096 + @b * 100 + "\x00" * 3996,
+                   client.read_raw(4096 * 3)
+    end
+  end
+
+  def test_direct_backend_doesnt_map_the_file
+    with_ld_preload('msync_logger') do
+      @env.blocksize = 4096 * 4
+      @env.nbd1.serve_options = ['--backend', 'direct']
+      connect_to_server do |client|
+        client.write(4096, @b * 4096)
+        assert_equal 0, client.read_response[:error]
+
+        client.write_with_fua(8192, @b * 100)
+        assert_equal 0, client.read_response[:error]
+
+        client.flush
+        assert_equal 0, client.read_response[:error]
+
+        maps = File.read("/proc/#{@env.nbd1.pid}/maps")
+        assert !maps.include?(File.basename(@env.filename1)), 'File was mapped'
+      end
+      op = parse_ld_preload_logs('msync_logger')
+      assert_equal 0, op.count, 'No msync expected'
+    end
+  end
+
+  def test_cache_is_accepted
+    connect_to_server do |client|
+      client.cache(0, 512)
+      rsp = client.read_response
+      assert_equal 'myhandle', rsp[:handle]
+      assert_equal 0, rsp[:error]
+
+      client.cache(@env.file1.size, 512)
+      assert_equal 28, client.read_response[:error] # ENOSPC
+    end
+  end
+
+  def test_cache_fills_the_direct_backends_cache
+    @env.blocksize = 4096 * 4
+    @env.nbd1.serve_options = ['--backend', 'direct']
+    connect_to_server do |client|
+      client.cache(0, 4096 * 3)
+      assert_equal 0, client.read_response[:error]
+
+      client.write_read_request(0, 4096 * 3)
+      assert_equal 0, client.read_response[:error]
+      client.read_raw(4096 * 3)
+    end
+    assert_equal '3', @env.status1['cache_misses']
+    assert_equal '3', @env.status1['cache_hits']
+  end
+
+  def test_sequential_reads_are_read_ahead
+    @env.blocksize = 4096 * 4
+    connect_to_server do |client|
+      3.times do |i|
+        client.write_read_request(4096 * i, 4096)
+        assert_equal 0, client.read_response[:error]
+        client.read_raw(4096)
+      end
+      status = @env.status1
+      assert_equal '1', status['sequential_clients']
+      assert_equal '4096', status['readahead_bytes']
+
+      client.write_read_request(0, 4096)
+      assert_equal 0, client.read_response[:error]
+      client.read_raw(4096)
+      assert_equal '0', @env.status1['sequential_clients']
+    end
+  end
+
+  def test_reads_of_holes_are_zeroes
+    # Holes longer than the server's buffer of zeroes
+    @env.blocksize = 1024 * 1024
+    @env.writefile1('__f__f')
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.read_hello
+      client.write_read_request(4096, 5 * 1024 * 1024)
+      assert_equal 0, client.read_response[:error]
+      data = client.read_raw(5 * 1024 * 1024)
+      assert data == @env.file1.read(4096, 5 * 1024 * 1024), 'Bad data'
+    ensure
+      client.close
+    end
+  end
+
+  def test_reads_of_holes_dont_touch_the_file
+    @env.blocksize = 4096
+    @env.writefile1('f__f')
+    @env.nbd1.serve_options = ['--backend', 'direct']
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.read_hello
+      client.write_read_request(4096, 8192)
+      assert_equal 0, client.read_response[:error]
+      assert_equal "\x00" * 8192, client.read_raw(8192)
+    ensure
+      client.close
+    end
+    assert_equal '0', @env.status1['cache_misses']
+    assert_equal '0', @env.status1['cache_hits']
+  end
+
+  def test_zero_blocks_written_into_holes_stay_unallocated
+    @env.blocksize = 4096
+    @env.writefile1('_______0')
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.read_hello
+      zero = "\x00" * 4096
+      data = @b * 4096
+      client.write(0, data + zero + zero + data + data + zero)
+      assert_equal 0, client.read_response[:error]
+      client.flush
+      assert_equal 0, client.read_response[:error]
+    ensure
+      client.close
+    end
+
+    # Three blocks written, plus the one the file started with
+    assert_equal 4 * 4096, File.stat(@env.filename1).blocks * 512
+    assert_equal data, @env.file1.read(3 * 4096, 4096)
+  end
+
+  def test_trim_punches_holes_in_whole_blocks
+    @env.blocksize = 4096
+    @env.writefile1('ffff')
+    original = File.binread(@env.filename1)
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.read_hello
+      # Only the second block is covered entirely
+      client.trim(2048, 4096 * 2)
+      assert_equal 0, client.read_response[:error]
+
+      client.send_request(0, 'readback', 0, 4096 * 3)
+      rsp = client.read_response
+      assert_equal 0, rsp[:error]
+      data = client.read_raw(4096 * 3)
+      assert data[0, 4096] == original[0, 4096], 'First block changed'
+      assert data[4096, 4096] == "\x00" * 4096, 'Second block not zeroed'
+      assert data[8192, 4096] == original[8192, 4096], 'Third block changed'
+    ensure
+      client.close
+    end
+
+    assert_equal 3 * 4096, File.stat(@env.filename1).blocks * 512
+  end
+
+  def write_zeroes_and_read_back(flags)
+    @env.blocksize = 4096
+    @env.writefile1('ffff')
+    original = File.binread(@env.filename1)
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.read_hello
+      client.write_zeroes(2048, 4096 * 2, flags)
+      assert_equal 0, client.read_response[:error]
+
+      client.send_request(0, 'readback', 0, 4096 * 4)
+      rsp = client.read_response
+      assert_equal 0, rsp[:error]
+      data = client.read_raw(4096 * 4)
+      assert data[0, 2048] == original[0, 2048], 'Zeroed too early'
+      assert data[2048, 8192] == "\x00" * 8192, 'Range not zeroed'
+      assert data[10_240, 6144] == original[10_240, 6144], 'Zeroed too late'
+    ensure
+      client.close
+    end
+  end
+
+  def test_write_zeroes_punches_holes_in_whole_blocks
+    write_zeroes_and_read_back(0)
+    assert_equal 3 * 4096, File.stat(@env.filename1).blocks * 512
+  end
+
+  def test_write_zeroes_with_no_hole_keeps_blocks_allocated
+    write_zeroes_and_read_back(2)
+    assert_equal 4 * 4096, File.stat(@env.filename1).blocks * 512
+  end
+
+  def connect_newstyle(pattern, options = ['--newstyle'], pattern2 = nil)
+    @env.blocksize = 4096
+    @env.writefile1(pattern)
+    @env.writefile2(pattern2) if pattern2
+    @env.nbd1.serve_options = options
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      yield client
+    ensure
+      client.close
+    end
+  end
+
+  def test_newstyle_export_name_serves_requests
+    connect_newstyle('f') do |client|
+      hello = client.read_newstyle_hello
+      assert_equal 'NBDMAGIC', hello[:passwd]
+      assert_equal 0x49484156454F5054, hello[:magic]
+      # FIXED_NEWSTYLE (1), NO_ZEROES (2)
+      assert_equal 3, hello[:flags]
+
+      client.write_client_flags(3)
+      client.write_option(FlexNBD::OPTION_EXPORT_NAME, '')
+      export = client.read_export
+      assert_equal 4096, export[:size]
+      assert_equal (1 | 4 | 8 | 32 | 64 | 256 | 1024), export[:flags]
+
+      # Without structured replies, reads get a simple reply
+      client.write(0, @b * 10)
+      assert_equal 0, client.read_response[:error]
+      client.write_read_request(0, 10)
+      rsp = client.read_response
+      assert_equal FlexNBD::REPLY_MAGIC, rsp[:magic]
+      assert_equal 0, rsp[:error]
+      assert_equal @b * 10, client.read_raw(10)
+    end
+  end
+
+  def test_newstyle_rejects_unknown_options
+    connect_newstyle('f') do |client|
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      client.write_option(12_345, 'what?')
+      rsp = client.read_option_reply
+      assert_equal 0x3e889045565a9, rsp[:magic]
+      assert_equal 12_345, rsp[:option]
+      assert_equal 0x80000001, rsp[:type] # ERR_UNSUP
+
+      # We can still carry on
+      client.write_option(FlexNBD::OPTION_ABORT)
+      assert_equal FlexNBD::OPTION_REPLY_ACK, client.read_option_reply[:type]
+      assert client.disconnected?, 'Server not disconnected'
+    end
+  end
+
+  def test_negotiation_has_a_deadline
+    connect_newstyle('f') do |client|
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+
+      # Each byte comes well within the time any one read may take, but the
+      # whole handshake has to be done in HANDSHAKE_TIMEOUT (10s).
+      started = Time.now
+      option = 'IHAVEOPT' + [FlexNBD::OPTION_EXPORT_NAME, 0].pack('NN')
+      begin
+        option.each_char do |byte|
+          client.write_data(byte)
+          sleep 1
+        end
+      rescue Errno::EPIPE, Errno::ECONNRESET
+        nil
+      end
+      assert client.disconnected?, 'Server not disconnected'
+      assert Time.now - started < 14, 'Negotiation went on too long'
+    end
+  end
+
+  def test_negotiation_has_a_limited_number_of_options
+    connect_newstyle('f') do |client|
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      64.times do
+        client.write_option(12_345)
+        assert_equal 0x80000001, client.read_option_reply[:type] # ERR_UNSUP
+      end
+      client.write_option(12_345)
+      assert client.disconnected?, 'Server not disconnected'
+    end
+  end
+
+  def test_stalled_negotiations_dont_hold_up_other_clients
+    connect_newstyle('f') do |client|
+      client.negotiate(false, [])
+
+      # More than there are workers, so if they were negotiating on the
+      # workers, there'd be none left to do our write.
+      stalled = (1..10).map do
+        FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting failed')
+      end
+      sleep 0.5
+
+      Timeout.timeout(3) do
+        client.write(0, @b * 4096)
+        assert_equal 0, client.read_response[:error]
+      end
+      stalled.each(&:close)
+    end
+  end
+
+  def test_go_negotiates_structured_replies_and_base_allocation
+    connect_newstyle('f') do |client|
+      replies = client.negotiate
+      assert_equal [FlexNBD::OPTION_REPLY_ACK,
+                    FlexNBD::OPTION_REPLY_META_CONTEXT,
+                    FlexNBD::OPTION_REPLY_ACK,
+                    FlexNBD::OPTION_REPLY_INFO,
+                    FlexNBD::OPTION_REPLY_INFO,
+                    FlexNBD::OPTION_REPLY_ACK], replies.map { |r| r[:type] }
+
+      context_id, name = replies[1][:data].unpack('Na*')
+      assert context_id != 0, 'No context id'
+      assert_equal 'base:allocation', name
+
+      info_type, size, flags = replies[3][:data].unpack('nQ>n')
+      assert_equal FlexNBD::INFO_EXPORT, info_type
+      assert_equal 4096, size
+      assert_equal (1 | 4 | 8 | 32 | 64 | 256 | 1024), flags
+
+      assert_equal [FlexNBD::INFO_BLOCK_SIZE, 1, 4096, 32 << 20],
+                   replies[4][:data].unpack('nNNN')
+    end
+  end
+
+  def test_requests_longer_than_the_block_size_are_refused
+    @env.blocksize = 4096
+    @env.writefile1('f')
+    @env.truncate1(64 << 20)
+    @env.nbd1.serve_options = ['--newstyle']
+    @env.serve1
+    client = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    begin
+      client.negotiate(false, [])
+
+      client.send_request(0, 'bigread!', 0, (32 << 20) + 1)
+      assert_equal 75, client.read_response[:error] # EOVERFLOW
+
+      # The data's thrown away, and we carry on with the next request
+      client.write(0, "\0" * ((32 << 20) + 1))
+      assert_equal 75, client.read_response[:error]
+
+      client.write(0, @b * 4096)
+      assert_equal 0, client.read_response[:error]
+      assert_equal @b * 4096, @env.file1.read(0, 4096)
+    ensure
+      client.close
+    end
+  end
+
+  def test_structured_reads_send_holes_as_hole_chunks
+    connect_newstyle('f__f') do |client|
+      client.negotiate
+      client.send_request(0, 'readback', 2048, 4096 * 3)
+      chunks = client.read_structured_replies
+
+      assert_equal [FlexNBD::REPLY_TYPE_OFFSET_DATA,
+                    FlexNBD::REPLY_TYPE_OFFSET_HOLE,
+                    FlexNBD::REPLY_TYPE_OFFSET_DATA], chunks.map { |c| c[:type] }
+      chunks.each do |chunk|
+        assert_equal 0x668e33ef, chunk[:magic]
+        assert_equal 'readback', chunk[:handle]
+      end
+
+      assert_equal 2048, chunks[0][:data].unpack('Q>').first
+      assert chunks[0][:data][8..-1] == @env.file1.read(2048, 2048), 'Bad data'
+      assert_equal [4096, 8192], chunks[1][:data].unpack('Q>N')
+      assert_equal 12_288, chunks[2][:data].unpack('Q>').first
+      assert chunks[2][:data][8..-1] == @env.file1.read(12_288, 2048), 'Bad data'
+    end
+  end
+
+  def test_block_status_describes_the_allocation_map
+    connect_newstyle('f__f') do |client|
+      context_id = client.negotiate[1][:data].unpack('N').first
+
+      client.write_block_status_request(0, 4096 * 4)
+      chunks = client.read_structured_replies
+      assert_equal 1, chunks.length
+      assert_equal FlexNBD::REPLY_TYPE_BLOCK_STATUS, chunks[0][:type]
+      extents = chunks[0][:data].unpack('N*')
+      assert_equal context_id, extents.shift
+      # HOLE (1) | ZERO (2) for the unallocated blocks
+      assert_equal [4096, 0, 8192, 3, 4096, 0], extents
+
+      # REQ_ONE (8) only gets the first extent
+      client.write_block_status_request(4096, 4096 * 3, 8)
+      extents = client.read_structured_replies[0][:data].unpack('N*')
+      assert_equal [context_id, 8192, 3], extents
+
+      # Trimming a block makes it a hole
+      client.trim(12_288, 4096)
+      assert_equal 0, client.read_response[:error]
+      client.write_block_status_request(4096, 4096 * 3)
+      extents = client.read_structured_replies[0][:data].unpack('N*')
+      assert_equal [context_id, 4096 * 3, 3], extents
+    end
+  end
+
+  def test_extended_headers_carry_64_bit_lengths
+    connect_newstyle('f__f') do |client|
+      replies = client.negotiate(false, ['base:allocation'], '', extended: true)
+      assert_equal FlexNBD::OPTION_REPLY_ACK, replies[0][:type]
+      context_id = replies[1][:data].unpack('N').first
+
+      # Every reply is structured, and echoes the request's offset
+      client.send_extended_request(0, 'readback', 2048, 2048)
+      chunks = client.read_extended_replies
+      assert_equal 1, chunks.length
+      assert_equal 0x6e8a278c, chunks[0][:magic]
+      assert_equal FlexNBD::REPLY_TYPE_OFFSET_DATA, chunks[0][:type]
+      assert_equal 'readback', chunks[0][:handle]
+      assert_equal 2048, chunks[0][:offset]
+      assert chunks[0][:data][8..-1] == @env.file1.read(2048, 2048), 'Bad data'
+
+      # Extents have 64-bit lengths and flags, and are counted
+      client.send_extended_request(7, 'blockst8', 0, 4096 * 4)
+      chunks = client.read_extended_replies
+      assert_equal FlexNBD::REPLY_TYPE_BLOCK_STATUS_EXT, chunks[0][:type]
+      assert_equal [context_id, 3, 4096, 0, 8192, 3, 4096, 0],
+                   chunks[0][:data].unpack('NNQ>*')
+
+      # The end of this would be past 2^64, so it mustn't wrap round
+      client.send_extended_request(6, 'zeroes!!', 4096, 2**64 - 2048)
+      chunks = client.read_extended_replies
+      assert_equal FlexNBD::REPLY_TYPE_ERROR, chunks[0][:type]
+      assert_equal [28, 0], chunks[0][:data].unpack('Nn') # ENOSPC
+
+      # Zero the whole disc in one go
+      client.send_extended_request(6, 'zeroes!!', 0, 4096 * 4)
+      chunks = client.read_extended_replies
+      assert_equal [FlexNBD::REPLY_TYPE_NONE], chunks.map { |c| c[:type] }
+      assert_equal 1, chunks[0][:flags]
+
+      client.send_extended_request(7, 'blockst8', 0, 4096 * 4)
+      assert_equal [context_id, 1, 4096 * 4, 3],
+                   client.read_extended_replies[0][:data].unpack('NNQ>*')
+    end
+  end
+
+  def test_structured_replies_cannot_follow_extended_headers
+    connect_newstyle('f') do |client|
+      replies = client.negotiate(true, [], '', extended: true)
+      assert_equal FlexNBD::OPTION_REPLY_ACK, replies[0][:type]
+      assert_equal 0x8000000a, replies[1][:type] # ERR_EXT_HEADER_REQD
+    end
+  end
+
+  def connect_with_exports(&block)
+    connect_newstyle('f', ["--export other=#{@env.filename2}"], 'f__f', &block)
+  end
+
+  def test_list_shows_every_export
+    connect_with_exports do |client|
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      assert_equal ['', 'other'], client.list_exports
+    end
+  end
+
+  def test_go_chooses_an_export_by_name
+    connect_with_exports do |client|
+      replies = client.negotiate(true, ['base:allocation'], 'other')
+      context_id = replies[1][:data].unpack('N').first
+      _, size, = replies[3][:data].unpack('nQ>n')
+      assert_equal 4096 * 4, size
+
+      client.write_block_status_request(0, 4096 * 4)
+      extents = client.read_structured_replies[0][:data].unpack('N*')
+      assert_equal [context_id, 4096, 0, 8192, 3, 4096, 0], extents
+
+      client.write(4096, @b * 4096)
+      assert_equal 0, client.read_response[:error]
+    end
+
+    assert_equal @b * 4096, @env.file2.read(4096, 4096)
+    assert @env.file1.untouched?(0, 4096), 'Default export was written to'
+  end
+
+  def test_unknown_exports_are_refused
+    connect_with_exports do |client|
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      client.write_option(FlexNBD::OPTION_GO,
+                          [4].pack('N') + 'nope' + [0].pack('n'))
+      assert_equal 0x80000006, client.read_option_reply[:type] # ERR_UNKNOWN
+
+      # EXPORT_NAME can't refuse, so we get hung up on
+      client.write_option(FlexNBD::OPTION_EXPORT_NAME, 'nope')
+      assert client.disconnected?, 'Server not disconnected'
+    end
+  end
+
+  def test_exports_have_their_own_acls
+    connect_with_exports do |client|
+      @env.nbd1.acl('127.0.0.2', export: 'other')
+
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      assert_equal [''], client.list_exports
+      client.write_option(FlexNBD::OPTION_GO,
+                          [5].pack('N') + 'other' + [0].pack('n'))
+      assert_equal 0x80000002, client.read_option_reply[:type] # ERR_POLICY
+    end
+  end
+
+  def test_control_commands_can_name_an_export
+    connect_with_exports do |client|
+      # Once we've been served, the exports have all been sized
+      client.read_newstyle_hello
+      client.write_client_flags(3)
+      client.list_exports
+
+      status, = @env.nbd1.status(export: 'other')
+      assert_equal '16384', status['size']
+      assert_equal '4096', @env.nbd1.status.first['size']
+
+      _, stderr = @env.nbd1.status(export: 'nope')
+      assert_match(/no such export/, stderr)
+    end
+  end
+
+  def test_block_status_without_a_context_is_refused
+    connect_newstyle('f') do |client|
+      client.negotiate(true, [])
+      client.write_block_status_request(0, 4096)
+      chunks = client.read_structured_replies
+      assert_equal 1, chunks.length
+      assert_equal FlexNBD::REPLY_TYPE_ERROR, chunks[0][:type]
+      assert_equal [22, 0], chunks[0][:data].unpack('Nn') # EINVAL
+    end
+  end
+
+  def test_pipelined_requests_all_receive_replies
+    @env.blocksize = 4096 * 4
+    connect_to_server do |client|
+      # Send a write and several reads before reading any replies. The replies
+      # may come back in any order, so match them up by handle.
+      client.write_write_request(0, 4096, 'write001')
+      client.write_data(@b * 4096)
+      reads = {}
+      4.times do |i|
+        handle = format('read%04d', i)
+        client.send_request(0, handle, 4096 * i, 4096)
+        reads[handle] = i.zero? ? @b * 4096 : "\x00" * 4096
+      end
+
+      handles = []
+      5.times do
+        rsp = client.read_response
+        assert_equal FlexNBD::REPLY_MAGIC, rsp[:magic]
+        assert_equal 0, rsp[:error]
+        handles << rsp[:handle]
+        next unless reads.key?(rsp[:handle])
+
+        # A read that was pipelined behind the write must still see its data
+        assert_equal reads[rsp[:handle]], client.read_raw(4096)
+      end
+
+      assert_equal (['write001'] + reads.keys).sort, handles.sort
+    end
+  end
+
   def test_odd_size_discs_are_truncated_to_nearest_512
     # This should get rounded down to 1024
     @env.blocksize = 1024 + 511
@@ -208,6 +841,57 @@ class TestServeMode < Test::Unit::TestCase
     end
   end
 
+  def test_clients_share_one_mapping_of_the_file
+    @env.writefile1('f')
+    @env.serve1
+    clients = Array.new(2) do
+      FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    end
+    begin
+      clients.each(&:read_hello)
+      assert_equal('2', @env.status1['num_clients'])
+      maps = File.readlines("/proc/#{@env.status1['pid']}/maps")
+      path = File.realpath(@env.filename1)
+      assert_equal 1, maps.count { |line| line.chomp.end_with?(" #{path}") }
+    ensure
+      clients.each(&:close)
+    end
+  end
+
+  def test_serves_more_than_sixteen_clients_at_once
+    @env.writefile1('f')
+    @env.serve1
+    clients = Array.new(40) do
+      FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    end
+    begin
+      clients.each do |client|
+        assert_equal 'NBDMAGIC', client.read_hello[:passwd]
+      end
+      assert_equal('40', @env.status1['num_clients'])
+    ensure
+      clients.each(&:close)
+    end
+  end
+
+  def test_max_clients_limits_the_clients_at_once
+    @env.writefile1('f')
+    @env.nbd1.serve_options = ['--max-clients', '2']
+    @env.serve1
+    clients = Array.new(2) do
+      FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+    end
+    begin
+      clients.each(&:read_hello)
+      extra = FlexNBD::FakeSource.new(@env.ip, @env.port1, 'Connecting to server failed')
+      assert extra.disconnected?, 'Server not disconnected'
+      extra.close
+      assert_equal('2', @env.status1['num_clients'])
+    ensure
+      clients.each(&:close)
+    end
+  end
+
   def test_status_returns_correct_client_count
     @env.writefile1('0')
     @env.serve1
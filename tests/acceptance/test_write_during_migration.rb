@@ -22,6 +22,7 @@ class TestWriteDuringMigration < Test::Unit::TestCase
     @dest_sock = 'dst.sock'
     @source_file = 'src.file'
     @dest_file = 'dst.file'
+    @serve_options = ''
   end
 
   def teardown
@@ -46,7 +47,7 @@ class TestWriteDuringMigration < Test::Unit::TestCase
     end
 
     @src_proc = fork do
-      cmd = "#{@flexnbd} serve -l 127.0.0.1 -p #{@source_port} -f #{@source_file} -s #{@source_sock} #{debug_arg}"
+      cmd = "#{@flexnbd} serve -l 127.0.0.1 -p #{@source_port} -f #{@source_file} -s #{@source_sock} #{@serve_options} #{debug_arg}"
       exec cmd
     end
     begin
@@ -78,9 +79,11 @@ class TestWriteDuringMigration < Test::Unit::TestCase
     File.open(@source_file, 'wb') { |f| f.write 'a' * @size }
   end
 
-  def start_mirror
+  def start_mirror(max_bps = nil)
+    args = ['mirror', '127.0.0.1', @dest_port.to_s, 'exit']
+    args += ['127.0.0.1', max_bps.to_s] if max_bps
     UNIXSocket.open(@source_sock) do |sock|
-      sock.write(['mirror', '127.0.0.1', @dest_port.to_s, 'exit'].join("\x0A") + "\x0A\x0A")
+      sock.write(args.join("\x0A") + "\x0A\x0A")
       sock.flush
       sock.readline
     end
@@ -114,6 +117,30 @@ class TestWriteDuringMigration < Test::Unit::TestCase
     end
   end
 
+  def source_zeroer
+    client = FlexNBD::FakeSource.new('127.0.0.1', @source_port, 'Timed out connecting')
+    offsets = Range.new(0, (@size - @write_data.size) / 4096).to_a
+    loop do
+      begin
+        offset = offsets[rand(offsets.size)] * 4096
+        case rand(4)
+        when 0
+          client.write(offset, @write_data)
+        when 1
+          client.trim(offset, @write_data.size)
+        when 2
+          # Deliberately not block-aligned
+          client.write_zeroes(offset + 100, @write_data.size)
+        else
+          client.write_zeroes(offset, @write_data.size, 2) # NO_HOLE
+        end
+      rescue StandardError
+        # We expect a broken write at some point, so ignore it
+        break
+      end
+    end
+  end
+
   def bombard_with_status
     loop do
       begin
@@ -165,6 +192,44 @@ class TestWriteDuringMigration < Test::Unit::TestCase
     end
   end
 
+  def test_write_during_migration_with_io_uring
+    # Once the allocation map is built, writes to allocated blocks go
+    # through io_uring rather than write_not_zeroes, and the mirror has to
+    # hear about them all the same.
+    @serve_options = '--backend io_uring'
+    Dir.mktmpdir do |tmpdir|
+      Dir.chdir(tmpdir) do
+        make_files
+
+        launch_servers
+
+        src_writers = (1..3).collect { Thread.new { source_writer } }
+
+        start_mirror
+        wait_for_quit
+        src_writers.each(&:join)
+        assert_both_sides_identical
+      end
+    end
+  end
+
+  def test_trim_and_write_zeroes_during_migration
+    Dir.mktmpdir do |tmpdir|
+      Dir.chdir(tmpdir) do
+        make_files
+
+        launch_servers
+
+        src_zeroer = Thread.new { source_zeroer }
+
+        start_mirror
+        wait_for_quit
+        src_zeroer.join
+        assert_both_sides_identical
+      end
+    end
+  end
+
   def test_many_clients_during_migration
     Dir.mktmpdir do |tmpdir|
       Dir.chdir(tmpdir) do
@@ -211,11 +276,10 @@ class TestWriteDuringMigration < Test::Unit::TestCase
 
         launch_servers
 
-        # This is a bit racy.  It needs to be slow enough that the migration
-        # isn't finished before the stop runs, and slow enough so that we can
-        # stop/start a few times.
+        # The mirrors we stop are limited to 10MB/s, so they can't finish
+        # before the stop runs, however fast the disc is.
         3.times do
-          start_mirror
+          start_mirror(10 * 1024 * 1024)
           sleep 0.1
           stop_mirror
           sleep 0.1
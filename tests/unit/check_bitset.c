@@ -82,6 +82,38 @@ START_TEST(test_bit_ranges)
 }
 END_TEST
 
+START_TEST(test_bit_ranges_atomic)
+{
+    bitfield_word_t buffer[4];
+    uint64_t i;
+
+    memset(buffer, 0, sizeof(buffer));
+
+    /* Ranges which start part-way through one word and end part-way
+     * through the next
+     */
+    for (i = 0; i < 28; i++) {
+	bit_set_range_atomic(buffer, 64 + i, 100);
+	fail_unless(buffer[0] == 0, "bit_set_range_atomic undershot");
+	fail_unless(buffer[1] == ~0ULL << i,
+		    "buffer[1] = %lx SHOULD BE %lx", buffer[1], ~0ULL << i);
+	fail_unless(buffer[2] == (1ULL << (36 + i)) - 1,
+		    "buffer[2] = %lx SHOULD BE %lx", buffer[2],
+		    (1ULL << (36 + i)) - 1);
+	fail_unless(buffer[3] == 0, "bit_set_range_atomic overshot");
+
+	bit_clear_range_atomic(buffer, 64 + i, 100);
+	fail_unless(buffer[1] == 0 && buffer[2] == 0,
+		    "bit_clear_range_atomic didn't work at i=%d", i);
+    }
+
+    bit_set_range_atomic(buffer, 0, 256);
+    bit_clear_range_atomic(buffer, 1, 254);
+    fail_unless(buffer[0] == 1 && buffer[1] == 0 && buffer[2] == 0 &&
+		buffer[3] == 1ULL << 63, "Whole words weren't cleared");
+}
+END_TEST
+
 START_TEST(test_bit_runs)
 {
     bitfield_word_t buffer[BIT_WORDS_FOR_SIZE(256)];
@@ -385,6 +417,35 @@ START_TEST(test_bitset_stream_with_set_range)
 }
 END_TEST
 
+START_TEST(test_bitset_stream_with_set_ranges)
+{
+    struct bitset *map = bitset_alloc(64, 1);
+    struct bitset_stream_entry result;
+    struct bitset_range ranges[] = { {0, 8}, {16, 4}, {60, 4} };
+    memset(&result, 0, sizeof(result));
+
+    bitset_enable_stream(map);
+    bitset_set_ranges(map, ranges, 3);
+
+    ck_assert_int_eq(4, bitset_stream_size(map));
+    ck_assert_int_eq(8, bitset_run_count(map, 0, 64));
+    ck_assert_int_eq(1, bitset_is_set_at(map, 16));
+    ck_assert_int_eq(1, bitset_is_set_at(map, 19));
+    ck_assert_int_eq(0, bitset_is_set_at(map, 20));
+    ck_assert_int_eq(1, bitset_is_set_at(map, 63));
+
+    bitset_stream_dequeue(map, NULL);	// ON
+    bitset_stream_dequeue(map, NULL);	// SET 0
+    bitset_stream_dequeue(map, &result);	// SET 16
+
+    ck_assert_int_eq(BITSET_STREAM_SET, result.event);
+    ck_assert_int_eq(16, result.from);
+    ck_assert_int_eq(4, result.len);
+
+    bitset_free(map);
+}
+END_TEST
+
 START_TEST(test_bitset_stream_with_clear_range)
 {
     struct bitset *map = bitset_alloc(64, 1);
@@ -419,7 +480,8 @@ START_TEST(test_bitset_stream_size)
     bitset_clear_range(map, 48, 16);
     bitset_disable_stream(map);
 
-    ck_assert_int_eq(8, bitset_stream_size(map));
+    /* The third SET only covers blocks the first two already have */
+    ck_assert_int_eq(7, bitset_stream_size(map));
 
     bitset_free(map);
 }
@@ -441,7 +503,7 @@ START_TEST(test_bitset_stream_queued_bytes)
 
     ck_assert_int_eq(64,
 		     bitset_stream_queued_bytes(map, BITSET_STREAM_ON));
-    ck_assert_int_eq(80,
+    ck_assert_int_eq(64,
 		     bitset_stream_queued_bytes(map, BITSET_STREAM_SET));
     ck_assert_int_eq(82,
 		     bitset_stream_queued_bytes(map, BITSET_STREAM_UNSET));
@@ -451,6 +513,453 @@ START_TEST(test_bitset_stream_queued_bytes)
 }
 END_TEST
 
+/* Check every summary bit against the word under it */
+static void assert_summaries_match(struct bitset *map)
+{
+    int level;
+    uint64_t w;
+    bitfield_word_t any, all;
+
+    for (level = 1; level < map->levels; level++) {
+	for (w = 0; w < map->words[level - 1]; w++) {
+	    any = map->any[level - 1][w];
+	    all = map->all[level - 1][w];
+	    fail_unless(bit_get(map->any[level], w) == (any != 0),
+			"any summary wrong at level %d, word %lu", level, w);
+	    fail_unless(bit_get(map->all[level], w) ==
+			(all == ~(bitfield_word_t) 0),
+			"all summary wrong at level %d, word %lu", level, w);
+	}
+    }
+}
+
+START_TEST(test_bitset_summaries)
+{
+    /* 2^22 blocks, which takes four levels */
+    uint64_t size = 1ULL << 34, block = 4096;
+    struct bitset *map = bitset_alloc(size, block);
+    int is_set;
+
+    ck_assert_int_eq(4, map->levels);
+    ck_assert_int_eq(1, map->words[3]);
+
+    bitset_set_range(map, size - block * 3, block);
+    bitset_set_range(map, block * 100, block * 200);
+    assert_summaries_match(map);
+
+    ck_assert_int_eq(100, bitset_find_bit(map, 1, 0));
+    ck_assert_int_eq(300, bitset_find_bit(map, 0, 100));
+    ck_assert_int_eq((size / block) - 3, bitset_find_bit(map, 1, 300));
+    ck_assert_int_eq(UINT64_MAX, bitset_find_bit(map, 1, (size / block) - 2));
+
+    ck_assert_int_eq(block * 100, bitset_run_count(map, 0, size));
+    ck_assert_int_eq(size - block * 303,
+		     bitset_run_count_ex(map, block * 300, size, &is_set));
+    ck_assert_int_eq(0, is_set);
+    ck_assert_int_eq(block, bitset_run_count(map, size - block * 3, size));
+
+    /* A single clear block in a set bitset */
+    bitset_set(map);
+    bitset_clear_range(map, block * 123456, 1);
+    assert_summaries_match(map);
+    ck_assert_int_eq(block * 123456, bitset_run_count(map, 0, size));
+    ck_assert_int_eq(size - block * 123457,
+		     bitset_run_count_ex(map, block * 123457, size,
+					 &is_set));
+    ck_assert_int_eq(1, is_set);
+
+    bitset_clear(map);
+    assert_summaries_match(map);
+    ck_assert_int_eq(size, bitset_run_count(map, 0, size));
+
+    bitset_free(map);
+}
+END_TEST
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_BITS 4096
+
+struct concurrent_setter {
+    struct bitset *map;
+    int offset;
+};
+
+void *set_every_fourth_bit(void *setter_uncast)
+{
+    struct concurrent_setter *setter =
+	(struct concurrent_setter *) setter_uncast;
+    uint64_t i;
+
+    for (i = setter->offset; i < CONCURRENT_BITS; i += CONCURRENT_THREADS) {
+	bitset_set_range(setter->map, i, 1);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_bitset_concurrent_set_range)
+{
+    struct bitset *map = bitset_alloc(CONCURRENT_BITS, 1);
+    struct concurrent_setter setters[CONCURRENT_THREADS];
+    pthread_t threads[CONCURRENT_THREADS];
+    int i;
+
+    /* Every thread is setting bits in every word, so any of them that
+     * isn't atomic will lose some of the others' bits.
+     */
+    for (i = 0; i < CONCURRENT_THREADS; i++) {
+	setters[i].map = map;
+	setters[i].offset = i;
+	pthread_create(&threads[i], NULL, set_every_fourth_bit,
+		       &setters[i]);
+    }
+    for (i = 0; i < CONCURRENT_THREADS; i++) {
+	pthread_join(threads[i], NULL);
+    }
+
+    ck_assert_int_eq(CONCURRENT_BITS,
+		     bitset_run_count(map, 0, CONCURRENT_BITS));
+    assert_summaries_match(map);
+    bitset_free(map);
+}
+END_TEST
+
+START_TEST(test_bitset_stream_wraps_around)
+{
+    struct bitset *map = bitset_alloc(BITSET_STREAM_SIZE * 6, 1);
+    struct bitset_stream_entry e;
+    uint64_t i;
+
+    /* Keep it half full as we go round the ring a few times.  The events
+     * are spaced out so they don't get merged.
+     */
+    for (i = 0; i < BITSET_STREAM_SIZE / 2; i++) {
+	bitset_stream_enqueue(map, BITSET_STREAM_SET, i * 2, 1);
+    }
+    for (; i < BITSET_STREAM_SIZE * 3; i++) {
+	bitset_stream_enqueue(map, BITSET_STREAM_SET, i * 2, 1);
+	bitset_stream_dequeue(map, &e);
+	fail_unless(e.from == (i - BITSET_STREAM_SIZE / 2) * 2,
+		    "Got event %lu, expected %lu", e.from,
+		    (i - BITSET_STREAM_SIZE / 2) * 2);
+    }
+    ck_assert_int_eq(BITSET_STREAM_SIZE / 2, bitset_stream_size(map));
+    ck_assert_int_eq(BITSET_STREAM_SIZE / 2,
+		     bitset_stream_queued_bytes(map, BITSET_STREAM_SET));
+
+    bitset_free(map);
+}
+END_TEST
+
+START_TEST(test_bitset_stream_coalesces)
+{
+    struct bitset *map = bitset_alloc(64, 1);
+    struct bitset_stream_entry e;
+
+    bitset_enable_stream(map);
+    bitset_set_range(map, 0, 4);
+    /* These two are already covered by the first */
+    bitset_set_range(map, 0, 4);
+    bitset_set_range(map, 2, 2);
+    bitset_set_range(map, 4, 4);
+    bitset_set_range(map, 12, 4);
+    /* but a SET after an UNSET can't be dropped, and the UNSET comes out
+     * as a SET, since the blocks are set again by the time it's taken.
+     */
+    bitset_clear_range(map, 12, 4);
+    bitset_set_range(map, 12, 4);
+
+    ck_assert_int_eq(6, bitset_stream_size(map));
+
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_ON, e.event);
+
+    /* The first two SETs touch, so they come out as one */
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(0, e.from);
+    ck_assert_int_eq(8, e.len);
+
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(12, e.from);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(12, e.from);
+    ck_assert_int_eq(4, e.len);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(12, e.from);
+    ck_assert_int_eq(0, bitset_stream_size(map));
+
+    /* Once the mirror has taken it, the next write needs a new one */
+    bitset_set_range(map, 0, 4);
+    ck_assert_int_eq(1, bitset_stream_size(map));
+
+    bitset_free(map);
+}
+END_TEST
+
+START_TEST(test_bitset_stream_rechecks_unsets)
+{
+    struct bitset *map = bitset_alloc(64, 1);
+    struct bitset_stream_entry e;
+
+    /* A clear that changed the bits just before the stream was enabled,
+     * but only adds its UNSET after the SET for a write made since.
+     */
+    bitset_set_range(map, 0, 8);
+    bitset_clear_range(map, 0, 8);
+    bitset_enable_stream(map);
+    bitset_set_range(map, 0, 4);
+    bitset_stream_enqueue(map, BITSET_STREAM_UNSET, 0, 8);
+
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_ON, e.event);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(0, e.from);
+    ck_assert_int_eq(4, e.len);
+
+    /* The write mustn't be zeroed, so only the rest comes out as UNSET */
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(0, e.from);
+    ck_assert_int_eq(4, e.len);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_UNSET, e.event);
+    ck_assert_int_eq(4, e.from);
+    ck_assert_int_eq(4, e.len);
+    ck_assert_int_eq(0, bitset_stream_size(map));
+
+    bitset_free(map);
+}
+END_TEST
+
+START_TEST(test_bitset_stream_overflows)
+{
+    struct bitset *map = bitset_alloc_with_stream(64, 1, 4);
+    struct bitset_stream_entry e;
+
+    ck_assert_int_eq(4, bitset_stream_capacity(map));
+    bitset_enable_stream(map);
+    bitset_set_range(map, 0, 2);
+    bitset_set_range(map, 10, 2);
+    bitset_set_range(map, 20, 1);
+
+    /* The ring is full now, so these go in the overflow map, without
+     * waiting for anyone to empty it.
+     */
+    bitset_set_range(map, 30, 4);
+    bitset_clear_range(map, 40, 2);
+    bitset_set_range(map, 50, 2);
+    bitset_clear_range(map, 51, 1);
+    bitset_stream_enqueue(map, BITSET_STREAM_OFF, 0, 64);
+
+    ck_assert_int_eq(4 + 8, bitset_stream_size(map));
+    ck_assert_int_eq(5 + 8,
+		     bitset_stream_queued_bytes(map, BITSET_STREAM_SET));
+
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_ON, e.event);
+    bitset_stream_dequeue(map, NULL);
+    bitset_stream_dequeue(map, NULL);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(20, e.from);
+
+    /* Then the overflow comes out as it is now, split where the bits are
+     * set or clear.
+     */
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(30, e.from);
+    ck_assert_int_eq(4, e.len);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_UNSET, e.event);
+    ck_assert_int_eq(40, e.from);
+    ck_assert_int_eq(2, e.len);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_SET, e.event);
+    ck_assert_int_eq(50, e.from);
+    ck_assert_int_eq(1, e.len);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(BITSET_STREAM_UNSET, e.event);
+    ck_assert_int_eq(51, e.from);
+    ck_assert_int_eq(1, e.len);
+
+    ck_assert_int_eq(0, bitset_stream_size(map));
+    ck_assert_int_eq(0, bitset_stream_queued_bytes(map, BITSET_STREAM_SET));
+
+    /* And the ring carries on as before */
+    bitset_set_range(map, 60, 1);
+    bitset_stream_dequeue(map, &e);
+    ck_assert_int_eq(60, e.from);
+
+    bitset_free(map);
+}
+END_TEST
+
+#define STREAM_PRODUCERS 4
+#define STREAM_CAPACITY 256
+#define STREAM_EVENTS_EACH (STREAM_CAPACITY * 4)
+
+struct stream_producer {
+    struct bitset *map;
+    int id;
+};
+
+static int producers_finished;
+
+void *produce_events(void *producer_uncast)
+{
+    struct stream_producer *producer =
+	(struct stream_producer *) producer_uncast;
+    uint64_t i;
+
+    for (i = 0; i < STREAM_EVENTS_EACH; i++) {
+	bitset_set_range(producer->map,
+			 producer->id * STREAM_EVENTS_EACH + i, 1);
+    }
+    __sync_add_and_fetch(&producers_finished, 1);
+
+    return NULL;
+}
+
+START_TEST(test_bitset_stream_concurrent_producers)
+{
+    uint64_t size = STREAM_PRODUCERS * STREAM_EVENTS_EACH;
+    struct bitset *map = bitset_alloc_with_stream(size, 1, STREAM_CAPACITY);
+    struct stream_producer producers[STREAM_PRODUCERS];
+    pthread_t threads[STREAM_PRODUCERS];
+    char *seen = xmalloc(size);
+    struct bitset_stream_entry e;
+    uint64_t i;
+    int j, done;
+
+    /* Far more changes than there's room for in the ring, so most of them
+     * overflow.  Whether they come through the ring or the overflow map,
+     * every one of them has to come out as a SET.
+     */
+    producers_finished = 0;
+    bitset_enable_stream(map);
+    for (j = 0; j < STREAM_PRODUCERS; j++) {
+	producers[j].map = map;
+	producers[j].id = j;
+	pthread_create(&threads[j], NULL, produce_events, &producers[j]);
+    }
+    while (1) {
+	done = __sync_add_and_fetch(&producers_finished, 0) ==
+	    STREAM_PRODUCERS;
+	if (bitset_stream_size(map) == 0) {
+	    if (done) {
+		break;
+	    }
+	    continue;
+	}
+	bitset_stream_dequeue(map, &e);
+	if (e.event == BITSET_STREAM_SET) {
+	    fail_unless(e.from + e.len <= size, "Bad event");
+	    memset(seen + e.from, 1, e.len);
+	}
+    }
+    for (j = 0; j < STREAM_PRODUCERS; j++) {
+	pthread_join(threads[j], NULL);
+    }
+
+    for (i = 0; i < size; i++) {
+	fail_unless(seen[i], "Change at %lu was lost", i);
+    }
+    ck_assert_int_eq(0, bitset_stream_size(map));
+    ck_assert_int_eq(0, bitset_stream_queued_bytes(map, BITSET_STREAM_SET));
+
+    free(seen);
+    bitset_free(map);
+}
+END_TEST
+
+#define CHURN_BLOCKS 64
+#define CHURN_EVENTS_EACH (1 << 16)
+
+void *churn_events(void *producer_uncast)
+{
+    struct stream_producer *producer =
+	(struct stream_producer *) producer_uncast;
+    unsigned int seed = producer->id;
+    uint64_t i, from, len;
+
+    for (i = 0; i < CHURN_EVENTS_EACH; i++) {
+	from = rand_r(&seed) % CHURN_BLOCKS;
+	len = 1 + rand_r(&seed) % 4;
+	if (from + len > CHURN_BLOCKS) {
+	    len = CHURN_BLOCKS - from;
+	}
+	if (rand_r(&seed) % 2) {
+	    bitset_set_range(producer->map, from, len);
+	} else {
+	    bitset_clear_range(producer->map, from, len);
+	}
+    }
+    __sync_add_and_fetch(&producers_finished, 1);
+
+    return NULL;
+}
+
+START_TEST(test_bitset_stream_concurrent_sets_and_clears)
+{
+    struct bitset *map =
+	bitset_alloc_with_stream(CHURN_BLOCKS, 1, STREAM_CAPACITY);
+    struct stream_producer producers[STREAM_PRODUCERS];
+    pthread_t threads[STREAM_PRODUCERS];
+    char mirrored[CHURN_BLOCKS];
+    struct bitset_stream_entry e;
+    uint64_t i;
+    int j, done;
+
+    /* Threads setting and clearing the same few blocks, so their events
+     * often come out the other way round from their changes.  A mirror
+     * which copies what's there for a SET, and zeroes for an UNSET, has to
+     * end up with what the bitset says.
+     */
+    memset(mirrored, 0, sizeof(mirrored));
+    producers_finished = 0;
+    bitset_enable_stream(map);
+    for (j = 0; j < STREAM_PRODUCERS; j++) {
+	producers[j].map = map;
+	producers[j].id = j;
+	pthread_create(&threads[j], NULL, churn_events, &producers[j]);
+    }
+    while (1) {
+	done = __sync_add_and_fetch(&producers_finished, 0) ==
+	    STREAM_PRODUCERS;
+	if (bitset_stream_size(map) == 0) {
+	    if (done) {
+		break;
+	    }
+	    continue;
+	}
+	bitset_stream_dequeue(map, &e);
+	for (i = e.from; i < e.from + e.len && i < CHURN_BLOCKS; i++) {
+	    if (e.event == BITSET_STREAM_SET) {
+		mirrored[i] = bit_get(map->bits, i);
+	    } else if (e.event == BITSET_STREAM_UNSET) {
+		mirrored[i] = 0;
+	    }
+	}
+    }
+    for (j = 0; j < STREAM_PRODUCERS; j++) {
+	pthread_join(threads[j], NULL);
+    }
+
+    for (i = 0; i < CHURN_BLOCKS; i++) {
+	fail_unless(mirrored[i] == bit_get(map->bits, i),
+		    "Block %lu mirrored wrongly", i);
+    }
+    ck_assert_int_eq(0, bitset_stream_size(map));
+
+    bitset_free(map);
+}
+END_TEST
+
 Suite * bitset_suite(void)
 {
     Suite *s = suite_create("bitset");
@@ -460,6 +969,7 @@ Suite * bitset_suite(void)
     tcase_add_test(tc_bit, test_bit_clear);
     tcase_add_test(tc_bit, test_bit_tests);
     tcase_add_test(tc_bit, test_bit_ranges);
+    tcase_add_test(tc_bit, test_bit_ranges_atomic);
     tcase_add_test(tc_bit, test_bit_runs);
     suite_add_tcase(s, tc_bit);
 
@@ -473,6 +983,8 @@ Suite * bitset_suite(void)
     tcase_add_test(tc_bitset, test_bitset_set_range_doesnt_push_to_stream);
     tcase_add_test(tc_bitset,
 		   test_bitset_clear_range_doesnt_push_to_stream);
+    tcase_add_test(tc_bitset, test_bitset_summaries);
+    tcase_add_test(tc_bitset, test_bitset_concurrent_set_range);
     suite_add_tcase(s, tc_bitset);
 
 
@@ -480,9 +992,18 @@ Suite * bitset_suite(void)
     tcase_add_test(tc_bitset_stream, test_bitset_enable_stream);
     tcase_add_test(tc_bitset_stream, test_bitset_disable_stream);
     tcase_add_test(tc_bitset_stream, test_bitset_stream_with_set_range);
+    tcase_add_test(tc_bitset_stream, test_bitset_stream_with_set_ranges);
     tcase_add_test(tc_bitset_stream, test_bitset_stream_with_clear_range);
     tcase_add_test(tc_bitset_stream, test_bitset_stream_size);
     tcase_add_test(tc_bitset_stream, test_bitset_stream_queued_bytes);
+    tcase_add_test(tc_bitset_stream, test_bitset_stream_wraps_around);
+    tcase_add_test(tc_bitset_stream, test_bitset_stream_coalesces);
+    tcase_add_test(tc_bitset_stream, test_bitset_stream_rechecks_unsets);
+    tcase_add_test(tc_bitset_stream, test_bitset_stream_overflows);
+    tcase_add_test(tc_bitset_stream,
+		   test_bitset_stream_concurrent_producers);
+    tcase_add_test(tc_bitset_stream,
+		   test_bitset_stream_concurrent_sets_and_clears);
     suite_add_tcase(s, tc_bitset_stream);
 
     return s;
@@ -0,0 +1,260 @@
+#include "block_cache.h"
+#include "util.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* A file of ''size'' bytes, where each byte is its offset modulo 251 */
+int make_file(char *filename, uint64_t size)
+{
+    int fd = mkstemp(filename);
+    char *data = xmalloc(size);
+    uint64_t i;
+
+    for (i = 0; i < size; i++) {
+	data[i] = i % 251;
+    }
+    fail_if(fd < 0, "Couldn't create a file");
+    fail_if(pwrite(fd, data, size, 0) != (ssize_t) size,
+	    "Couldn't fill the file");
+    free(data);
+
+    return fd;
+}
+
+
+START_TEST(test_reads_file_contents)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    int fd = make_file(filename, 65536);
+    struct block_cache *cache = block_cache_create(filename, 65536, 65536);
+    char buf[10000];
+    int i;
+
+    fail_if(NULL == cache, "Couldn't create the cache");
+
+    /* Unaligned, and crossing several blocks */
+    fail_unless(0 == block_cache_read(cache, 1000, 10000, buf),
+		"Read failed");
+    for (i = 0; i < 10000; i++) {
+	fail_unless((char) ((1000 + i) % 251) == buf[i],
+		    "Read the wrong data");
+    }
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_writes_go_through_to_the_file)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    int fd = make_file(filename, 65536);
+    struct block_cache *cache = block_cache_create(filename, 65536, 65536);
+    char data[5000];
+    char buf[5000];
+
+    memset(data, 'x', sizeof(data));
+
+    fail_unless(0 == block_cache_write(cache, 3000, 5000, data),
+		"Write failed");
+
+    fail_unless(0 == block_cache_read(cache, 3000, 5000, buf),
+		"Read failed");
+    fail_unless(0 == memcmp(data, buf, 5000), "Cache had the wrong data");
+
+    fail_unless(5000 == pread(fd, buf, 5000, 3000), "pread failed");
+    fail_unless(0 == memcmp(data, buf, 5000), "File had the wrong data");
+
+    /* Either side of the write should be untouched */
+    fail_unless(1 == pread(fd, buf, 1, 2999), "pread failed");
+    fail_unless((char) (2999 % 251) == buf[0], "Write overran its start");
+    fail_unless(1 == pread(fd, buf, 1, 8000), "pread failed");
+    fail_unless((char) (8000 % 251) == buf[0], "Write overran its end");
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_counts_hits_and_misses)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    int fd = make_file(filename, 65536);
+    struct block_cache *cache = block_cache_create(filename, 65536, 65536);
+    uint64_t hits, misses;
+    char buf[BLOCK_CACHE_BLOCK_SIZE];
+
+    block_cache_read(cache, 0, BLOCK_CACHE_BLOCK_SIZE, buf);
+    block_cache_read(cache, 0, BLOCK_CACHE_BLOCK_SIZE, buf);
+    block_cache_read(cache, 0, BLOCK_CACHE_BLOCK_SIZE, buf);
+
+    block_cache_stats(cache, &hits, &misses);
+    fail_unless(2 == hits, "Wrong number of hits");
+    fail_unless(1 == misses, "Wrong number of misses");
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_prefetched_blocks_are_hits)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    int fd = make_file(filename, 65536);
+    struct block_cache *cache = block_cache_create(filename, 65536, 65536);
+    uint64_t hits, misses;
+    char buf[BLOCK_CACHE_BLOCK_SIZE * 2];
+    int i;
+
+    /* Unaligned, so it touches three blocks */
+    fail_unless(0 == block_cache_prefetch(cache, 1000,
+					  BLOCK_CACHE_BLOCK_SIZE * 2),
+		"Prefetch failed");
+    fail_unless(0 == block_cache_read(cache, 0, sizeof(buf), buf),
+		"Read failed");
+    block_cache_read(cache, BLOCK_CACHE_BLOCK_SIZE * 2, 1, buf);
+
+    block_cache_stats(cache, &hits, &misses);
+    fail_unless(3 == hits, "Wrong number of hits");
+    fail_unless(3 == misses, "Wrong number of misses");
+    block_cache_read(cache, 0, sizeof(buf), buf);
+    for (i = 0; i < (int) sizeof(buf); i++) {
+	fail_unless((char) (i % 251) == buf[i], "Read the wrong data");
+    }
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_evicts_when_full)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    uint64_t size = BLOCK_CACHE_BLOCK_SIZE * BLOCK_CACHE_SHARDS * 8;
+    int fd = make_file(filename, size);
+    /* Room for one block per shard, so we'll be evicting constantly */
+    struct block_cache *cache = block_cache_create(filename, size, 0);
+    char buf[BLOCK_CACHE_BLOCK_SIZE];
+    uint64_t offset;
+    int i;
+
+    for (offset = 0; offset < size; offset += BLOCK_CACHE_BLOCK_SIZE) {
+	fail_unless(0 == block_cache_read(cache, offset,
+					  BLOCK_CACHE_BLOCK_SIZE, buf),
+		    "Read failed");
+	for (i = 0; i < BLOCK_CACHE_BLOCK_SIZE; i++) {
+	    fail_unless((char) ((offset + i) % 251) == buf[i],
+			"Read the wrong data");
+	}
+    }
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_handles_a_short_last_block)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    uint64_t size = BLOCK_CACHE_BLOCK_SIZE * 2 + 512;
+    int fd = make_file(filename, size);
+    struct block_cache *cache = block_cache_create(filename, size, size);
+    char data[512];
+    char buf[512];
+
+    memset(data, 'y', sizeof(data));
+    fail_unless(0 == block_cache_write(cache, size - 512, 512, data),
+		"Write failed");
+
+    fail_unless(512 == pread(fd, buf, 512, size - 512), "pread failed");
+    fail_unless(0 == memcmp(data, buf, 512), "File had the wrong data");
+
+    fail_unless((off_t) size == lseek(fd, 0, SEEK_END),
+		"File changed size");
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+START_TEST(test_forgotten_blocks_are_read_again)
+{
+    char filename[] = "/tmp/check_block_cache_XXXXXX";
+    int fd = make_file(filename, 65536);
+    struct block_cache *cache = block_cache_create(filename, 65536, 65536);
+    char data[BLOCK_CACHE_BLOCK_SIZE];
+    char buf[BLOCK_CACHE_BLOCK_SIZE];
+    uint64_t hits, misses;
+
+    block_cache_read(cache, 8192, BLOCK_CACHE_BLOCK_SIZE, buf);
+
+    /* Change the file behind the cache's back */
+    memset(data, 'z', sizeof(data));
+    fail_unless(BLOCK_CACHE_BLOCK_SIZE ==
+		pwrite(fd, data, BLOCK_CACHE_BLOCK_SIZE, 8192),
+		"pwrite failed");
+    block_cache_forget(cache, 8192, BLOCK_CACHE_BLOCK_SIZE);
+
+    fail_unless(0 == block_cache_read(cache, 8192, BLOCK_CACHE_BLOCK_SIZE,
+				      buf), "Read failed");
+    fail_unless(0 == memcmp(data, buf, BLOCK_CACHE_BLOCK_SIZE),
+		"Read stale data");
+
+    block_cache_stats(cache, &hits, &misses);
+    fail_unless(0 == hits, "Forgotten block was still cached");
+
+    block_cache_destroy(cache);
+    close(fd);
+    unlink(filename);
+}
+END_TEST
+
+
+Suite * block_cache_suite(void)
+{
+    Suite *s = suite_create("block_cache");
+
+    TCase *tc_io = tcase_create("io");
+    TCase *tc_stats = tcase_create("stats");
+
+    tcase_add_test(tc_io, test_reads_file_contents);
+    tcase_add_test(tc_io, test_writes_go_through_to_the_file);
+    tcase_add_test(tc_io, test_evicts_when_full);
+    tcase_add_test(tc_io, test_handles_a_short_last_block);
+    tcase_add_test(tc_io, test_forgotten_blocks_are_read_again);
+
+    tcase_add_test(tc_stats, test_counts_hits_and_misses);
+    tcase_add_test(tc_stats, test_prefetched_blocks_are_hits);
+
+    suite_add_tcase(s, tc_io);
+    suite_add_tcase(s, tc_stats);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+
+    Suite *s = block_cache_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? 0 : 1;
+}
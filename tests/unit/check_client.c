@@ -2,12 +2,17 @@
 #include <stdio.h>
 
 #include "self_pipe.h"
+#include "util.h"
 #include "nbdtypes.h"
 
 #include "serve.h"
 #include "client.h"
+#include "bitset.h"
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 
 struct server fake_server = { 0 };
 
@@ -64,20 +69,275 @@ START_TEST(test_closes_stop_signal)
 }
 END_TEST
 
-START_TEST(test_read_request_quits_on_stop_signal)
+void client_dirty_add(struct client *, uint64_t, uint64_t);
+
+START_TEST(test_dirty_ranges_are_merged)
+{
+    struct client *c = client_create(FAKE_SERVER, FAKE_SOCKET);
+
+    client_dirty_add(c, 0, 4096);
+    client_dirty_add(c, 8192, 12288);
+    fail_unless(2 == c->serve->dirty.ranges_count, "Ranges were merged.");
+
+    /* Fills the gap, so all three should become one */
+    client_dirty_add(c, 4096, 8192);
+    fail_unless(1 == c->serve->dirty.ranges_count, "Ranges weren't merged.");
+    fail_unless(0 == c->serve->dirty.ranges[0].from, "Range start was wrong.");
+    fail_unless(12288 == c->serve->dirty.ranges[0].to, "Range end was wrong.");
+
+    client_destroy(c);
+}
+END_TEST
+
+START_TEST(test_too_many_dirty_ranges_overflow)
+{
+    struct client *c = client_create(FAKE_SERVER, FAKE_SOCKET);
+    uint64_t i;
+
+    for (i = 0; i < SERVER_MAX_DIRTY_RANGES; i++) {
+	client_dirty_add(c, i * 8192, i * 8192 + 4096);
+    }
+    fail_if(c->serve->dirty.overflowed, "Overflowed too soon.");
+
+    client_dirty_add(c, i * 8192, i * 8192 + 4096);
+    fail_unless(c->serve->dirty.overflowed, "Didn't overflow.");
+
+    client_destroy(c);
+}
+END_TEST
+
+START_TEST(test_dirty_ranges_are_shared_by_clients)
+{
+    struct client *c1 = client_create(FAKE_SERVER, FAKE_SOCKET);
+    struct client *c2 = client_create(FAKE_SERVER, FAKE_SOCKET);
+
+    client_dirty_add(c1, 0, 4096);
+    client_dirty_add(c2, 4096, 8192);
+    fail_unless(1 == c1->serve->dirty.ranges_count,
+		"Clients didn't share the ranges.");
+    fail_unless(8192 == c1->serve->dirty.ranges[0].to,
+		"Range end was wrong.");
+
+    client_destroy(c2);
+    client_destroy(c1);
+}
+END_TEST
+
+int client_zero_blocks(struct client *, uint64_t, uint64_t, int);
+
+/* Zero the middle two blocks of a four block file, as a TRIM (if
+ * ''punch'') or a WRITE_ZEROES would, and check the next flush will sync
+ * them.
+ */
+static void check_zeroed_blocks_are_dirty(int punch)
+{
+    char filename[] = "/tmp/check_client_XXXXXX";
+    char data[4 * 4096];
+    struct server serve = { 0 };
+    struct client *c;
+    int fd;
+
+    fd = mkstemp(filename);
+    fail_if(fd == -1, "Couldn't make a file");
+    memset(data, 0xff, sizeof(data));
+    fail_unless(write(fd, data, sizeof(data)) == sizeof(data),
+		"Couldn't fill the file");
+
+    c = client_create(&serve, FAKE_SOCKET);
+    c->fileno = fd;
+
+    fail_if(client_zero_blocks(c, 4096, 8192, punch) == -1,
+	    "Couldn't zero the blocks");
+    fail_unless(1 == serve.dirty.ranges_count, "Blocks weren't dirty.");
+    fail_unless(4096 == serve.dirty.ranges[0].from,
+		"Range start was wrong.");
+    fail_unless(12288 == serve.dirty.ranges[0].to, "Range end was wrong.");
+
+    client_destroy(c);
+    close(fd);
+    unlink(filename);
+}
+
+START_TEST(test_trimmed_blocks_are_dirty)
+{
+    check_zeroed_blocks_are_dirty(1);
+}
+END_TEST
+
+START_TEST(test_zeroed_blocks_are_dirty)
+{
+    check_zeroed_blocks_are_dirty(0);
+}
+END_TEST
+
+int client_uring_flush(struct client *, struct client_job *);
+
+START_TEST(test_long_dirty_ranges_sync_the_whole_file)
 {
+    struct server serve = { 0 };
+    struct client *c = client_create(&serve, FAKE_SOCKET);
+    struct client_job job = { 0 };
+
+    serve.uring = uring_create(8);
+    if (NULL == serve.uring) {
+	/* Nothing to test without io_uring */
+	client_destroy(c);
+	return;
+    }
+
+    /* Too long for one of io_uring's syncs, so rather than one for each
+     * range, there's one for the whole file.
+     */
+    job.client = c;
+    client_dirty_add(c, 0, 5ULL << 30);
+    client_dirty_add(c, 6ULL << 30, (6ULL << 30) + 4096);
+    fail_unless(1 == client_uring_flush(c, &job),
+		"Didn't sync the whole file.");
+    fail_unless(1 == job.uring_pending, "Wrong number of syncs pending.");
+    fail_unless(0 == serve.dirty.ranges_count, "Ranges weren't taken.");
+
+    uring_destroy(serve.uring);
+    client_destroy(c);
+}
+END_TEST
+
+void client_stream_read(struct client *, struct client_job *);
+
+/* Pretend the client sent a read, and return how much would be read ahead */
+static uint64_t stream_read(struct client *c, uint64_t from, uint64_t len)
+{
+    struct client_job job = { 0 };
+
+    job.client = c;
+    job.request.type = REQUEST_READ;
+    job.request.from = from;
+    job.request.len = len;
+    client_stream_read(c, &job);
+
+    return job.readahead_len;
+}
+
+START_TEST(test_sequential_reads_are_read_ahead)
+{
+    struct server serve = { 0 };
+    serve.size = 64 * 1024 * 1024;
+    struct client *c = client_create(&serve, FAKE_SOCKET);
+
+    fail_unless(0 == stream_read(c, 0, 4096), "Read ahead too soon.");
+    fail_unless(0 == stream_read(c, 4096, 4096), "Read ahead too soon.");
+    fail_unless(CLIENT_READAHEAD_MIN == stream_read(c, 8192, 4096),
+		"Didn't read ahead of a sequential client.");
+    fail_unless(c->stream.sequential, "Client wasn't sequential.");
+    fail_unless(1 == serve.sequential_clients, "Client wasn't counted.");
+
+    /* Still more than half the window ahead of it */
+    fail_unless(0 == stream_read(c, 12288, 4096), "Read ahead again.");
+
+    /* Now it's caught up with half of it */
+    fail_unless(2 * CLIENT_READAHEAD_MIN ==
+		stream_read(c, 16384, CLIENT_READAHEAD_MIN / 2),
+		"Readahead didn't grow.");
+
+    fail_unless(0 == stream_read(c, 1 << 20, 4096),
+		"Read ahead of a random read.");
+    fail_if(c->stream.sequential, "Client was still sequential.");
+    fail_unless(0 == serve.sequential_clients, "Client was still counted.");
+
+    client_destroy(c);
+}
+END_TEST
+
+START_TEST(test_readahead_stops_at_the_end)
+{
+    struct server serve = { 0 };
+    serve.size = 16384;
+    struct client *c = client_create(&serve, FAKE_SOCKET);
+
+    stream_read(c, 0, 4096);
+    stream_read(c, 4096, 4096);
+    fail_unless(4096 == stream_read(c, 8192, 4096),
+		"Read ahead past the end.");
+    fail_unless(0 == stream_read(c, 12288, 4096),
+		"Read ahead past the end.");
+
+    client_destroy(c);
+}
+END_TEST
+
+int client_read_runs(struct client *, struct client_job *);
+
+START_TEST(test_reads_are_split_at_holes)
+{
+    struct server serve = { 0 };
+    serve.size = 4 * 4096;
+    serve.allocation_map = bitset_alloc(serve.size, 4096);
+    serve.allocation_map_built = 1;
+    bitset_set_range(serve.allocation_map, 4096, 4096);
+
+    struct client *c = client_create(&serve, FAKE_SOCKET);
+    struct client_job job = { 0 };
+    job.client = c;
+    job.request.type = REQUEST_READ;
+    job.request.from = 2048;
+    job.request.len = 4 * 4096 - 2048;
+
+    fail_unless(client_read_runs(c, &job), "Read wasn't allocated.");
+    fail_unless(3 == job.runs_count, "Read wasn't split in three.");
+    fail_unless(2048 == job.runs[0].len && !job.runs[0].allocated,
+		"First run was wrong.");
+    fail_unless(4096 == job.runs[1].len && job.runs[1].allocated,
+		"Second run was wrong.");
+    fail_unless(8192 == job.runs[2].len && !job.runs[2].allocated,
+		"Third run was wrong.");
+    free(job.runs);
+
+    job.request.from = 8192;
+    job.request.len = 8192;
+    fail_if(client_read_runs(c, &job), "Hole was allocated.");
+    free(job.runs);
+
+    client_destroy(c);
+    bitset_free(serve.allocation_map);
+}
+END_TEST
+
+void serve_init_file(struct server *);
+void serve_close_file(struct server *);
+
+START_TEST(test_serve_quits_on_stop_signal)
+{
+    char filename[] = "/tmp/check_client_XXXXXX";
+    int file_fd = mkstemp(filename);
     int fds[2];
-    struct nbd_request nbdr;
-    pipe(fds);
-    struct client *c = client_create(FAKE_SERVER, fds[0]);
+    struct server serve = { 0 };
+
+    fail_if(file_fd < 0, "Couldn't create a temporary file.");
+    fail_if(ftruncate(file_fd, 4096) < 0, "Couldn't size the file.");
+    fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0,
+	    "Couldn't create a socket pair.");
+
+    serve.filename = filename;
+    serve.size = 4096;
+    serve_init_file(&serve);
+    serve.reactor = reactor_create();
+    serve.workers = worker_pool_create(1, 0);
 
+    struct client *c = client_create(&serve, fds[0]);
+    client_start(c);
     client_signal_stop(c);
+    client_wait_for_stop(c);
 
-    int client_serve_request(struct client *);
-    fail_unless(1 == client_serve_request(c), "Didn't quit on stop.");
+    fail_unless(client_is_stopped(c), "Didn't quit on stop.");
+    fail_unless(fd_is_closed(fds[0]), "Client socket wasn't closed.");
+    fail_if(fd_is_closed(serve.fd), "The export's file was closed.");
 
-    close(fds[0]);
+    client_destroy(c);
+    serve_close_file(&serve);
+    reactor_destroy(serve.reactor);
+    worker_pool_destroy(serve.workers);
     close(fds[1]);
+    close(file_fd);
+    unlink(filename);
 }
 END_TEST
 
@@ -87,18 +347,36 @@ Suite * client_suite(void)
 
     TCase *tc_create = tcase_create("create");
     TCase *tc_signal = tcase_create("signal");
+    TCase *tc_dirty = tcase_create("dirty");
+    TCase *tc_stream = tcase_create("stream");
+    TCase *tc_read = tcase_create("read");
     TCase *tc_destroy = tcase_create("destroy");
 
     tcase_add_test(tc_create, test_assigns_socket);
     tcase_add_test(tc_create, test_assigns_server);
 
     tcase_add_test(tc_signal, test_opens_stop_signal);
-    tcase_add_test(tc_signal, test_read_request_quits_on_stop_signal);
+    tcase_add_test(tc_signal, test_serve_quits_on_stop_signal);
+
+    tcase_add_test(tc_dirty, test_dirty_ranges_are_merged);
+    tcase_add_test(tc_dirty, test_too_many_dirty_ranges_overflow);
+    tcase_add_test(tc_dirty, test_dirty_ranges_are_shared_by_clients);
+    tcase_add_test(tc_dirty, test_trimmed_blocks_are_dirty);
+    tcase_add_test(tc_dirty, test_zeroed_blocks_are_dirty);
+    tcase_add_test(tc_dirty, test_long_dirty_ranges_sync_the_whole_file);
+
+    tcase_add_test(tc_stream, test_sequential_reads_are_read_ahead);
+    tcase_add_test(tc_stream, test_readahead_stops_at_the_end);
+
+    tcase_add_test(tc_read, test_reads_are_split_at_holes);
 
     tcase_add_test(tc_destroy, test_closes_stop_signal);
 
     suite_add_tcase(s, tc_create);
     suite_add_tcase(s, tc_signal);
+    suite_add_tcase(s, tc_dirty);
+    suite_add_tcase(s, tc_stream);
+    suite_add_tcase(s, tc_read);
     suite_add_tcase(s, tc_destroy);
 
     return s;
@@ -108,6 +386,8 @@ int main(void)
 {
     int number_failed;
 
+    error_init();
+
     Suite *s = client_suite();
     SRunner *sr = srunner_create(s);
     srunner_run_all(sr, CK_NORMAL);
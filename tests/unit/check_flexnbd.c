@@ -1,4 +1,5 @@
 #include "flexnbd.h"
+#include "util.h"
 
 #include <check.h>
 
@@ -32,6 +33,8 @@ int main(void)
 {
     int number_failed;
 
+    error_init();
+
     Suite *s = flexnbd_suite();
     SRunner *sr = srunner_create(s);
     srunner_run_all(sr, CK_NORMAL);
@@ -221,12 +221,148 @@ START_TEST(test_convert_from)
 }
 END_TEST
 
+START_TEST(test_option_fields)
+{
+    struct nbd_option_raw option_raw;
+    struct nbd_option option;
+
+    option_raw.magic = htobe64(OPTS_MAGIC);
+    option_raw.option = htobe32(OPTION_GO);
+    option_raw.length = htobe32(12345);
+    nbd_r2h_option(&option_raw, &option);
+
+    fail_unless(OPTS_MAGIC == option.magic, "Magic was not converted.");
+    fail_unless(OPTION_GO == option.option, "Option was not converted.");
+    fail_unless(12345 == option.length, "Length was not converted.");
+}
+END_TEST
+
+START_TEST(test_option_reply_fields)
+{
+    struct nbd_option_reply_raw reply_raw;
+    struct nbd_option_reply reply;
+
+    reply.magic = OPTION_REPLY_MAGIC;
+    reply.option = OPTION_GO;
+    reply.type = OPTION_REPLY_ERR_UNSUP;
+    reply.length = 67890;
+    nbd_h2r_option_reply(&reply, &reply_raw);
+
+    fail_unless(htobe64(OPTION_REPLY_MAGIC) == reply_raw.magic,
+		"Magic was not converted.");
+    fail_unless(htobe32(OPTION_GO) == reply_raw.option,
+		"Option was not converted.");
+    fail_unless(htobe32(OPTION_REPLY_ERR_UNSUP) == reply_raw.type,
+		"Type was not converted.");
+    fail_unless(htobe32(67890) == reply_raw.length,
+		"Length was not converted.");
+}
+END_TEST
+
+START_TEST(test_structured_reply_fields)
+{
+    struct nbd_structured_reply_raw reply_raw;
+    struct nbd_structured_reply reply;
+
+    fail_unless(20 == sizeof(reply_raw), "Raw reply is the wrong size.");
+
+    reply.magic = STRUCTURED_REPLY_MAGIC;
+    reply.flags = REPLY_FLAG_DONE;
+    reply.type = REPLY_TYPE_OFFSET_HOLE;
+    memcpy(reply.handle.b, "MYHANDLE", 8);
+    reply.length = 12;
+    nbd_h2r_structured_reply(&reply, &reply_raw);
+    memset(&reply, 0, sizeof(reply));
+    nbd_r2h_structured_reply(&reply_raw, &reply);
+
+    fail_unless(htobe32(STRUCTURED_REPLY_MAGIC) == reply_raw.magic,
+		"Magic was not converted.");
+    fail_unless(htobe16(REPLY_TYPE_OFFSET_HOLE) == reply_raw.type,
+		"Type was not converted.");
+    fail_unless(REPLY_FLAG_DONE == reply.flags,
+		"Flags were not converted back.");
+    fail_unless(12 == reply.length, "Length was not converted back.");
+    fail_unless(memcmp(reply.handle.b, "MYHANDLE", 8) == 0,
+		"The handle was not copied back.");
+}
+END_TEST
+
+START_TEST(test_extended_request_fields)
+{
+    struct nbd_extended_request_raw request_raw;
+    struct nbd_request request;
+
+    fail_unless(32 == sizeof(request_raw),
+		"Raw request is the wrong size.");
+
+    request.magic = EXTENDED_REQUEST_MAGIC;
+    request.flags = CMD_FLAG_FUA;
+    request.type = REQUEST_WRITE_ZEROES;
+    memcpy(request.handle.b, "MYHANDLE", 8);
+    request.from = 0x100000000ULL;
+    request.len = 0x8000000000000000ULL;
+    nbd_h2r_extended_request(&request, &request_raw);
+    memset(&request, 0, sizeof(request));
+    nbd_r2h_extended_request(&request_raw, &request);
+
+    fail_unless(htobe32(EXTENDED_REQUEST_MAGIC) == request_raw.magic,
+		"Magic was not converted.");
+    fail_unless(htobe64(0x8000000000000000ULL) == request_raw.len,
+		"Length was not converted.");
+    fail_unless(REQUEST_WRITE_ZEROES == request.type,
+		"Type was not converted back.");
+    fail_unless(CMD_FLAG_FUA == request.flags,
+		"Flags were not converted back.");
+    fail_unless(0x100000000ULL == request.from,
+		"From was not converted back.");
+    fail_unless(0x8000000000000000ULL == request.len,
+		"Length was not converted back.");
+    fail_unless(memcmp(request.handle.b, "MYHANDLE", 8) == 0,
+		"The handle was not copied back.");
+}
+END_TEST
+
+START_TEST(test_extended_reply_fields)
+{
+    struct nbd_extended_reply_raw reply_raw;
+    struct nbd_extended_reply reply;
+
+    fail_unless(32 == sizeof(reply_raw), "Raw reply is the wrong size.");
+
+    reply.magic = EXTENDED_REPLY_MAGIC;
+    reply.flags = REPLY_FLAG_DONE;
+    reply.type = REPLY_TYPE_BLOCK_STATUS_EXT;
+    memcpy(reply.handle.b, "MYHANDLE", 8);
+    reply.offset = 0x100000000ULL;
+    reply.length = 0x200000000ULL;
+    nbd_h2r_extended_reply(&reply, &reply_raw);
+    memset(&reply, 0, sizeof(reply));
+    nbd_r2h_extended_reply(&reply_raw, &reply);
+
+    fail_unless(htobe32(EXTENDED_REPLY_MAGIC) == reply_raw.magic,
+		"Magic was not converted.");
+    fail_unless(htobe64(0x200000000ULL) == reply_raw.length,
+		"Length was not converted.");
+    fail_unless(REPLY_TYPE_BLOCK_STATUS_EXT == reply.type,
+		"Type was not converted back.");
+    fail_unless(REPLY_FLAG_DONE == reply.flags,
+		"Flags were not converted back.");
+    fail_unless(0x100000000ULL == reply.offset,
+		"Offset was not converted back.");
+    fail_unless(0x200000000ULL == reply.length,
+		"Length was not converted back.");
+    fail_unless(memcmp(reply.handle.b, "MYHANDLE", 8) == 0,
+		"The handle was not copied back.");
+}
+END_TEST
+
 Suite * nbdtypes_suite(void)
 {
     Suite *s = suite_create("nbdtypes");
     TCase *tc_init = tcase_create("nbd_init");
     TCase *tc_request = tcase_create("nbd_request");
     TCase *tc_reply = tcase_create("nbd_reply");
+    TCase *tc_newstyle = tcase_create("newstyle");
 
     tcase_add_test(tc_init, test_init_passwd);
     tcase_add_test(tc_init, test_init_magic);
@@ -241,10 +377,16 @@ Suite * nbdtypes_suite(void)
     tcase_add_test(tc_reply, test_reply_magic);
     tcase_add_test(tc_reply, test_reply_error);
     tcase_add_test(tc_reply, test_reply_handle);
+    tcase_add_test(tc_newstyle, test_option_fields);
+    tcase_add_test(tc_newstyle, test_option_reply_fields);
+    tcase_add_test(tc_newstyle, test_structured_reply_fields);
+    tcase_add_test(tc_newstyle, test_extended_request_fields);
+    tcase_add_test(tc_newstyle, test_extended_reply_fields);
 
     suite_add_tcase(s, tc_init);
     suite_add_tcase(s, tc_request);
     suite_add_tcase(s, tc_reply);
+    suite_add_tcase(s, tc_newstyle);
 
 
     return s;
@@ -68,7 +68,9 @@ START_TEST(test_replaces_acl)
     flexnbd.signal_fd = -1;
     struct server *s =
 	server_create(&flexnbd, "127.0.0.1", "0", dummy_file, 0, 0, NULL,
-		      1, 0, 1);
+		      1, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
     struct acl *new_acl = acl_create(0, NULL, 0);
 
     server_replace_acl(s, new_acl);
@@ -84,7 +86,9 @@ START_TEST(test_signals_acl_updated)
     flexnbd.signal_fd = -1;
     struct server *s =
 	server_create(&flexnbd, "127.0.0.1", "0", dummy_file, 0, 0, NULL,
-		      1, 0, 1);
+		      1, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
     struct acl *new_acl = acl_create(0, NULL, 0);
 
     server_replace_acl(s, new_acl);
@@ -144,6 +148,7 @@ int connect_client(char *addr, int actual_port, char *source_addr)
 /* These are "internal" functions we need for the following test.  We
  * shouldn't need them but there's no other way at the moment. */
 void serve_open_server_socket(struct server *);
+void serve_init_file(struct server *);
 int server_port(struct server *);
 void server_accept(struct server *);
 int fd_is_closed(int);
@@ -151,7 +156,7 @@ void server_close_clients(struct server *);
 
 START_TEST(test_acl_update_closes_bad_client)
 {
-    /* This is the wrong way round.  Rather than pulling the thread
+    /* This is the wrong way round.  Rather than pulling the client
      * and socket out of the server structure, we should be testing
      * a client socket.
      */
@@ -159,7 +164,9 @@ START_TEST(test_acl_update_closes_bad_client)
     flexnbd.signal_fd = -1;
     struct server *s =
 	server_create(&flexnbd, "127.0.0.7", "0", dummy_file, 0, 0, NULL,
-		      1, 0, 1);
+		      1, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
     struct acl *new_acl = acl_create(0, NULL, 1);
     struct client *c;
     struct client_tbl_entry *entry;
@@ -170,6 +177,7 @@ START_TEST(test_acl_update_closes_bad_client)
 
 
     serve_open_server_socket(s);
+    serve_init_file(s);
     actual_port = server_port(s);
 
     client_fd = connect_client("127.0.0.7", actual_port, "127.0.0.1");
@@ -177,9 +185,9 @@ START_TEST(test_acl_update_closes_bad_client)
     entry = &s->nbd_client[0];
     c = entry->client;
     /* At this point there should be an entry in the nbd_clients
-     * table and a background thread to run the client loop
+     * table, and the reactor should be running the client
      */
-    myfail_if(entry->thread == 0, "No client thread was started.");
+    myfail_if(c == NULL, "No client was accepted.");
     server_fd = c->socket;
     myfail_if(fd_is_closed(server_fd),
 	      "Sanity check failed - client socket wasn't open.");
@@ -205,7 +213,9 @@ START_TEST(test_acl_update_leaves_good_client)
 
     struct server *s =
 	server_create(&flexnbd, "127.0.0.7", "0", dummy_file, 0, 0, NULL,
-		      1, 0, 1);
+		      1, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
 
     char *lines[] = { "127.0.0.1" };
     struct acl *new_acl = acl_create(1, lines, 1);
@@ -217,15 +227,16 @@ START_TEST(test_acl_update_leaves_good_client)
     int server_fd;
 
     serve_open_server_socket(s);
+    serve_init_file(s);
     actual_port = server_port(s);
     client_fd = connect_client("127.0.0.7", actual_port, "127.0.0.1");
     server_accept(s);
     entry = &s->nbd_client[0];
     c = entry->client;
     /* At this point there should be an entry in the nbd_clients
-     * table and a background thread to run the client loop
+     * table, and the reactor should be running the client
      */
-    myfail_if(entry->thread == 0, "No client thread was started.");
+    myfail_if(c == NULL, "No client was accepted.");
     server_fd = c->socket;
     myfail_if(fd_is_closed(server_fd),
 	      "Sanity check failed - client socket wasn't open.");
@@ -242,10 +253,77 @@ START_TEST(test_acl_update_leaves_good_client)
 }
 END_TEST
 
+int cleanup_and_find_client_slot(struct server *);
+
+START_TEST(test_client_table_grows_to_max_clients)
+{
+    struct flexnbd flexnbd;
+    flexnbd.signal_fd = -1;
+    struct server *s =
+	server_create(&flexnbd, "127.0.0.7", "0", dummy_file, 0, 0, NULL,
+		      40, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
+    int seen[40] = { 0 };
+    int i, slot;
+
+    myfail_unless(SERVER_CLIENTS_INITIAL == s->nbd_client_slots,
+		  "Client table didn't start small.");
+
+    for (i = 0; i < 40; i++) {
+	slot = cleanup_and_find_client_slot(s);
+	myfail_if(slot < 0 || slot >= 40, "Didn't get a slot.");
+	myfail_if(seen[slot], "Got the same slot twice.");
+	seen[slot] = 1;
+    }
+    myfail_unless(40 == s->nbd_client_slots,
+		  "Client table didn't grow to the limit.");
+    myfail_unless(-1 == cleanup_and_find_client_slot(s),
+		  "Got a slot beyond the limit.");
+
+    server_destroy(s);
+}
+END_TEST
+
+START_TEST(test_finished_clients_free_their_slots)
+{
+    struct flexnbd flexnbd;
+    flexnbd.signal_fd = -1;
+    struct server *s =
+	server_create(&flexnbd, "127.0.0.7", "0", dummy_file, 0, 0, NULL,
+		      1, CLIENT_MAX_REQUESTS_IN_FLIGHT,
+		      BITSET_STREAM_SIZE, 0, 0,
+		      SERVER_BACKEND_MMAP, 0, 1);
+    struct client *c;
+    int slot;
+
+    slot = cleanup_and_find_client_slot(s);
+    myfail_unless(0 == slot, "Didn't get the only slot.");
+    myfail_unless(-1 == cleanup_and_find_client_slot(s),
+		  "Got a second slot.");
+
+    c = client_create(s, -1);
+    c->slot = slot;
+    s->nbd_client[slot].client = c;
+
+    /* What client_finish does, once the reactor is done with it */
+    c->stopped = 1;
+    server_client_finished(s, c);
+
+    myfail_unless(slot == cleanup_and_find_client_slot(s),
+		  "Finished client's slot wasn't freed.");
+    myfail_unless(NULL == s->nbd_client[slot].client,
+		  "Finished client is still in the table.");
+
+    server_destroy(s);
+}
+END_TEST
+
 Suite * serve_suite(void)
 {
     Suite *s = suite_create("serve");
     TCase *tc_acl_update = tcase_create("acl_update");
+    TCase *tc_clients = tcase_create("clients");
 
     tcase_add_checked_fixture(tc_acl_update, setup, NULL);
 
@@ -257,7 +335,13 @@ Suite * serve_suite(void)
     tcase_add_exit_test(tc_acl_update, test_acl_update_leaves_good_client,
 			0);
 
+    tcase_add_checked_fixture(tc_clients, setup, NULL);
+
+    tcase_add_test(tc_clients, test_client_table_grows_to_max_clients);
+    tcase_add_test(tc_clients, test_finished_clients_free_their_slots);
+
     suite_add_tcase(s, tc_acl_update);
+    suite_add_tcase(s, tc_clients);
 
     return s;
 }
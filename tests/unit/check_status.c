@@ -130,6 +130,24 @@ START_TEST(test_gets_size)
 }
 END_TEST
 
+START_TEST(test_gets_readahead_statistics)
+{
+    struct server *server = mock_server();
+    server->sequential_clients = 2;
+    server->readahead.total = 1 << 20;
+
+    struct status *status = status_create(server);
+
+    fail_unless(2 == status->sequential_clients,
+		"sequential_clients wasn't gathered");
+    fail_unless(1 << 20 == status->readahead_bytes,
+		"readahead_bytes wasn't gathered");
+
+    status_destroy(status);
+    destroy_mock_server(server);
+}
+END_TEST
+
 START_TEST(test_gets_migration_statistics)
 {
     struct server *server = mock_mirroring_server();
@@ -307,6 +325,38 @@ START_TEST(test_renders_migration_statistics)
 }
 END_TEST
 
+START_TEST(test_renders_cache_statistics)
+{
+    RENDER_TEST_SETUP status.has_cache = 0;
+    status.cache_hits = 12;
+    status.cache_misses = 34;
+
+    status_write(&status, fds[1]);
+    fail_if_rendered(fds[0], "cache_hits");
+
+    status.has_cache = 1;
+
+    status_write(&status, fds[1]);
+    fail_unless_rendered(fds[0], "cache_hits=12");
+
+    status_write(&status, fds[1]);
+    fail_unless_rendered(fds[0], "cache_misses=34");
+}
+END_TEST
+
+START_TEST(test_renders_readahead_statistics)
+{
+    RENDER_TEST_SETUP status.sequential_clients = 3;
+    status.readahead_bytes = 4096;
+
+    status_write(&status, fds[1]);
+    fail_unless_rendered(fds[0], "sequential_clients=3");
+
+    status_write(&status, fds[1]);
+    fail_unless_rendered(fds[0], "readahead_bytes=4096");
+}
+END_TEST
+
 Suite * status_suite(void)
 {
     Suite *s = suite_create("status");
@@ -319,6 +369,7 @@ Suite * status_suite(void)
     tcase_add_test(tc_create, test_gets_clients_allowed);
     tcase_add_test(tc_create, test_gets_pid);
     tcase_add_test(tc_create, test_gets_size);
+    tcase_add_test(tc_create, test_gets_readahead_statistics);
     tcase_add_test(tc_create, test_gets_migration_statistics);
 
 
@@ -329,6 +380,8 @@ Suite * status_suite(void)
     tcase_add_test(tc_render, test_renders_pid);
     tcase_add_test(tc_render, test_renders_size);
     tcase_add_test(tc_render, test_renders_migration_statistics);
+    tcase_add_test(tc_render, test_renders_cache_statistics);
+    tcase_add_test(tc_render, test_renders_readahead_statistics);
 
     suite_add_tcase(s, tc_create);
     suite_add_tcase(s, tc_render);
@@ -0,0 +1,163 @@
+#include "watchdog.h"
+#include "util.h"
+
+#include <check.h>
+
+
+static int expired_count;
+
+static void count_expired(struct watchdog_entry *entry)
+{
+    expired_count++;
+    fail_if(entry->armed, "Entry was still armed when it expired.");
+}
+
+static void tick(struct watchdog *watchdog, int seconds)
+{
+    int i;
+
+    for (i = 0; i < seconds; i++) {
+	watchdog_tick(watchdog);
+    }
+}
+
+
+START_TEST(test_expires_after_timeout)
+{
+    struct watchdog *watchdog = watchdog_create(10);
+    struct watchdog_entry entry;
+
+    expired_count = 0;
+    watchdog_entry_init(&entry, count_expired, NULL);
+    watchdog_arm(watchdog, &entry);
+
+    tick(watchdog, 9);
+    fail_unless(0 == expired_count, "Expired early.");
+    tick(watchdog, 1);
+    fail_unless(1 == expired_count, "Didn't expire.");
+    fail_unless(0 == watchdog->armed_count, "Still counted as armed.");
+
+    tick(watchdog, WATCHDOG_SLOTS);
+    fail_unless(1 == expired_count, "Expired twice.");
+
+    watchdog_destroy(watchdog);
+}
+END_TEST
+
+
+START_TEST(test_touching_puts_off_expiry)
+{
+    struct watchdog *watchdog = watchdog_create(10);
+    struct watchdog_entry entry;
+    int i;
+
+    expired_count = 0;
+    watchdog_entry_init(&entry, count_expired, NULL);
+    watchdog_arm(watchdog, &entry);
+
+    /* Long enough to go round the wheel more than once */
+    for (i = 0; i < WATCHDOG_SLOTS * 2; i++) {
+	tick(watchdog, 5);
+	watchdog_touch(watchdog, &entry);
+    }
+    fail_unless(0 == expired_count, "Expired despite progress.");
+
+    tick(watchdog, 10);
+    fail_unless(1 == expired_count, "Didn't expire once progress stopped.");
+
+    watchdog_destroy(watchdog);
+}
+END_TEST
+
+
+START_TEST(test_disarmed_entries_dont_expire)
+{
+    struct watchdog *watchdog = watchdog_create(10);
+    struct watchdog_entry entries[3];
+    int i;
+
+    expired_count = 0;
+    for (i = 0; i < 3; i++) {
+	watchdog_entry_init(&entries[i], count_expired, NULL);
+	watchdog_arm(watchdog, &entries[i]);
+    }
+    fail_unless(3 == watchdog->armed_count, "Not all armed.");
+
+    /* Take one out of the middle of the slot, and arming twice is fine */
+    watchdog_disarm(watchdog, &entries[1]);
+    watchdog_disarm(watchdog, &entries[1]);
+    watchdog_arm(watchdog, &entries[0]);
+
+    tick(watchdog, 10);
+    fail_unless(2 == expired_count, "Wrong entries expired.");
+    fail_if(entries[1].armed, "Disarmed entry was rearmed.");
+
+    watchdog_destroy(watchdog);
+}
+END_TEST
+
+
+static struct watchdog_entry *victim;
+static struct watchdog *victim_watchdog;
+
+static void disarm_victim(struct watchdog_entry *entry)
+{
+    count_expired(entry);
+    watchdog_disarm(victim_watchdog, victim);
+}
+
+START_TEST(test_expiry_can_disarm_others)
+{
+    struct watchdog *watchdog = watchdog_create(10);
+    struct watchdog_entry first, second;
+
+    expired_count = 0;
+    victim_watchdog = watchdog;
+    watchdog_entry_init(&first, count_expired, NULL);
+    watchdog_entry_init(&second, disarm_victim, NULL);
+    watchdog_arm(watchdog, &first);
+    /* second goes at the head of the slot, so it expires first */
+    watchdog_arm(watchdog, &second);
+    victim = &first;
+
+    tick(watchdog, 10);
+    fail_unless(1 == expired_count, "Disarmed entry expired anyway.");
+    fail_unless(0 == watchdog->armed_count, "Still counted as armed.");
+
+    watchdog_destroy(watchdog);
+}
+END_TEST
+
+
+Suite * watchdog_suite(void)
+{
+    Suite *s = suite_create("watchdog");
+    TCase *tc_expiry = tcase_create("expiry");
+
+    tcase_add_test(tc_expiry, test_expires_after_timeout);
+    tcase_add_test(tc_expiry, test_touching_puts_off_expiry);
+    tcase_add_test(tc_expiry, test_disarmed_entries_dont_expire);
+    tcase_add_test(tc_expiry, test_expiry_can_disarm_others);
+
+    suite_add_tcase(s, tc_expiry);
+
+    return s;
+}
+
+
+int main(void)
+{
+#ifdef DEBUG
+    log_level = 0;
+#else
+    log_level = 2;
+#endif
+    int number_failed;
+    Suite *s = watchdog_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    log_level = 0;
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#include "zeroes.h"
+
+#include <check.h>
+#include <string.h>
+
+typedef int (zeroes_fn) (const char *buf, size_t len);
+
+#define ZEROES_BUF_SIZE 1024
+
+/* Try every length up to ZEROES_BUF_SIZE, at every alignment within a
+ * vector, with a single non-zero byte in each possible position.
+ */
+static void check_implementation(zeroes_fn * fn)
+{
+    static char buf[ZEROES_BUF_SIZE + 32];
+    size_t offset, len, i;
+
+    memset(buf, 0, sizeof(buf));
+
+    for (offset = 0; offset < 32; offset += 7) {
+	for (len = 0; len <= ZEROES_BUF_SIZE; len += (len < 300 ? 1 : 61)) {
+	    fail_unless(fn(buf + offset, len),
+			"Zeroes weren't recognised (len=%zu)", len);
+
+	    for (i = 0; i < len; i++) {
+		buf[offset + i] = 0x10;
+		fail_if(fn(buf + offset, len),
+			"Missed a byte at %zu of %zu", i, len);
+		buf[offset + i] = 0;
+	    }
+	}
+    }
+
+    /* Bytes just outside the buffer mustn't count */
+    buf[0] = 1;
+    buf[65] = 1;
+    fail_unless(fn(buf + 1, 64), "Looked outside the buffer");
+}
+
+
+START_TEST(test_generic_finds_non_zeroes)
+{
+    check_implementation(is_all_zeroes_generic);
+}
+END_TEST
+
+
+START_TEST(test_sse2_finds_non_zeroes)
+{
+    if (zeroes_have_sse2()) {
+	check_implementation(is_all_zeroes_sse2);
+    }
+}
+END_TEST
+
+
+START_TEST(test_avx2_finds_non_zeroes)
+{
+    if (zeroes_have_avx2()) {
+	check_implementation(is_all_zeroes_avx2);
+    }
+}
+END_TEST
+
+
+START_TEST(test_dispatched_finds_non_zeroes)
+{
+    check_implementation(is_all_zeroes);
+}
+END_TEST
+
+
+START_TEST(test_zeroes_buffer_is_zeroes)
+{
+    fail_unless(is_all_zeroes(zeroes_buffer(), ZEROES_BUFFER_SIZE),
+		"The zeroes buffer wasn't all zeroes");
+}
+END_TEST
+
+
+Suite * zeroes_suite(void)
+{
+    Suite *s = suite_create("zeroes");
+
+    TCase *tc_zeroes = tcase_create("zeroes");
+
+    tcase_add_test(tc_zeroes, test_generic_finds_non_zeroes);
+    tcase_add_test(tc_zeroes, test_sse2_finds_non_zeroes);
+    tcase_add_test(tc_zeroes, test_avx2_finds_non_zeroes);
+    tcase_add_test(tc_zeroes, test_dispatched_finds_non_zeroes);
+    tcase_add_test(tc_zeroes, test_zeroes_buffer_is_zeroes);
+
+    suite_add_tcase(s, tc_zeroes);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+
+    Suite *s = zeroes_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? 0 : 1;
+}